@@ -0,0 +1,92 @@
+#!/bin/sh
+#
+# Benchmark of the capture of command output
+#
+# Copyright (c) 2016, Lans Zhang
+# All rights reserved.
+#
+# See "LICENSE" for license terms.
+#
+# Author:
+#      Lans Zhang <lans.zhang2008@gmail.com>
+#
+# Start the daemon serving the local host, capture the stdout of
+# head -c <size> /dev/zero with icmpc and report the wall-clock time of
+# each capture. The sizes are given in MB.
+#
+# Usage: capture.sh [size ...]
+
+topdir=${TOPDIR:-$(cd "$(dirname "$0")/.." && pwd)}
+icmpd=$topdir/src/icmpd/icmpd
+icmpc=$topdir/src/icmpc/icmpc
+sizes=${*:-1 4 16 100}
+
+work=$(mktemp -d /tmp/icmpd-capture-XXXXXX) || exit 1
+
+cat > "$work/icmpd.conf" <<CONF
+container_name: host
+host:
+  monitor: local
+  commands: 'head'
+CONF
+
+cat > "$work/icmpc.conf" <<CONF
+transport:
+  timeout_max: 60000
+CONF
+
+"$icmpd" -q start -c "$work/icmpd.conf" > "$work/icmpd.log" 2>&1 &
+daemon=$!
+
+# The zygote and the worker are left behind by the daemon killed
+stop() {
+	kill $(pgrep -P $daemon) $daemon
+	wait $daemon 2> /dev/null
+	rm -rf "$work"
+}
+
+# Capture into $work/out and print the length of stdout captured
+capture() {
+	"$icmpc" -q commandline -c "$work/icmpc.conf" "head -c $1 /dev/zero" \
+		> "$work/out" 2> /dev/null
+}
+
+# The debug build dumps the cmdline of icmpc ahead of the stdout. The
+# older icmpc prints the stdout as a string, which ends at the first zero.
+captured() {
+	echo $(($(wc -c < "$work/out") - \
+		$(grep -a '^  \[[0-9]*\]' "$work/out" | wc -c)))
+}
+
+# Wait for the daemon to serve
+i=0
+while ! capture 1; do
+	i=$((i + 1))
+	if [ $i -ge 50 ]; then
+		echo "The daemon is not serving:" >&2
+		tail "$work/icmpd.log" >&2
+		stop
+		exit 1
+	fi
+	sleep 0.1
+done
+
+echo "Capturing the output of head -c <size> /dev/zero:"
+echo
+echo "  size      time      captured"
+
+rc=0
+for size in $sizes; do
+	bytes=$((size * 1024 * 1024))
+	start=$(date +%s%N)
+	capture $bytes || rc=1
+	end=$(date +%s%N)
+	len=$(captured)
+
+	printf "  %4s MB  %6s ms  %s\n" $size $(((end - start) / 1000000)) \
+		"$([ $len = $bytes ] && echo all || echo "$len bytes")"
+done
+
+stop
+
+exit $rc
@@ -0,0 +1,288 @@
+/*
+ * Benchmark of the policy of commands
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * Compile .host.commands of 10k commands, each of them granted to 10 out
+ * of 1k containers by .commands.<command>.acl, and measure the decisions
+ * made by icmpd_policy_check() against the linear checks it replaces.
+ * Every decision is compared with the one of the linear checks.
+ *
+ * Usage: policy [iterations of the linear checks]
+ */
+
+#include "icmpd.h"
+
+#define NR_COMMAND		10000
+#define NR_CONTAINER		1000
+#define NR_ACL			10
+#define NR_PAIR			1000
+/* The policy is so much faster that it runs more iterations */
+#define POLICY_SPEEDUP		2000
+
+typedef struct {
+	char command[32];
+	char container[16];
+} pair_t;
+
+static unsigned int acl[NR_COMMAND][NR_ACL];
+static pair_t granted_pairs[NR_PAIR];
+static pair_t mixed_pairs[NR_PAIR];
+
+/* The checks done before the policy, for the reference */
+static int
+check_limited_commands(const char *cmd)
+{
+	char *local_container_name = ic_container_name();
+	int rc = -1;
+
+	if (!local_container_name)
+		return -1;
+
+	char *limited_commands = ic_conf_file_query(".%s.commands",
+						    local_container_name);
+	if (!limited_commands) {
+		info("%s.commands is not configured\n", local_container_name);
+		eee_mfree(local_container_name);
+		return 0;
+	}
+
+	if (!strcmp(limited_commands, "*")) {
+		eee_mfree(limited_commands);
+		eee_mfree(local_container_name);
+		return 0;
+	}
+
+	unsigned int nr_cmd = 0;
+	char **splitted_cmds = ic_util_split_string(limited_commands, ":",
+						    &nr_cmd);
+	eee_mfree(limited_commands);
+	if (!splitted_cmds)
+		goto err_splitted_cmds;
+
+	unsigned int i;
+	for (i = 0; i < nr_cmd; ++i) {
+		if (!strncmp(splitted_cmds[i], cmd, strlen(splitted_cmds[i]))) {
+			info("%s is limited by %s.commands\n", cmd,
+			     local_container_name);
+			rc = 0;
+			break;
+		}
+	}
+
+	eee_mfree(splitted_cmds);
+
+	if (i == nr_cmd)
+		warn("%s is prohibited by %s.commands\n", cmd,
+		     local_container_name);
+
+err_splitted_cmds:
+	eee_mfree(local_container_name);
+
+	return rc;
+}
+
+static int
+check_command_acl(const char *cmd, const char *target_container_name)
+{
+	char *acl_list = ic_conf_file_query(".commands.%s.acl", cmd);
+	if (!acl_list) {
+		info("commands.%s.acl is not configured\n", cmd);
+		return 0;
+	}
+
+	if (!strcmp(acl_list, "*")) {
+		eee_mfree(acl_list);
+		return 0;
+	}
+
+	unsigned int nr_acl_list = 0;
+	char **splitted_acl_list = ic_util_split_string(acl_list, ":",
+							&nr_acl_list);
+	eee_mfree(acl_list);
+	if (!splitted_acl_list)
+		return -1;
+
+	unsigned int i;
+	for (i = 0; i < nr_acl_list; ++i) {
+		if (!strcmp(splitted_acl_list[i], target_container_name)) {
+			info("%s is granted by commands.%s.acl for %s\n", cmd,
+			     cmd, target_container_name);
+			break;
+		}
+	}
+
+	eee_mfree(splitted_acl_list);
+
+	if (i == nr_acl_list) {
+		warn("%s is not granted by commands.%s.acl for %s\n", cmd,
+		     cmd, target_container_name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+check_linear(const char *cmd, const char *target_container_name)
+{
+	int rc = check_limited_commands(cmd);
+	if (rc)
+		return rc;
+
+	return check_command_acl(cmd, target_container_name);
+}
+
+static double
+now(void)
+{
+	return ic_util_time_us() / 1e6;
+}
+
+static bool
+in_acl(unsigned int cmd, unsigned int container)
+{
+	for (unsigned int i = 0; i < NR_ACL; ++i) {
+		if (acl[cmd][i] == container)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int
+write_conf(char *path)
+{
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		err("Unable to create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	FILE *fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		return -1;
+	}
+
+	fprintf(fp, "container_name: host\nhost:\n  monitor: local\n"
+		"  commands: '");
+	for (unsigned int i = 0; i < NR_COMMAND; ++i)
+		fprintf(fp, "%scmd%05u-tool", i ? ":" : "", i);
+	fprintf(fp, "'\ncommands:\n");
+
+	for (unsigned int i = 0; i < NR_COMMAND; ++i) {
+		fprintf(fp, "  cmd%05u-tool:\n    acl: '", i);
+		for (unsigned int j = 0; j < NR_ACL; ++j) {
+			unsigned int c;
+
+			do
+				c = random() % NR_CONTAINER;
+			while (in_acl(i, c));
+
+			acl[i][j] = c;
+			fprintf(fp, "%sc%u", j ? ":" : "", c);
+		}
+		fprintf(fp, "'\n");
+	}
+
+	return fclose(fp);
+}
+
+/* All pairs are granted, or half of them are denied */
+static void
+fill_pairs(pair_t *pairs, bool mixed)
+{
+	for (unsigned int i = 0; i < NR_PAIR; ++i) {
+		unsigned int cmd = random() % NR_COMMAND;
+		unsigned int container = acl[cmd][random() % NR_ACL];
+
+		if (mixed && i % 2) {
+			do
+				container = random() % NR_CONTAINER;
+			while (in_acl(cmd, container));
+		}
+
+		snprintf(pairs[i].command, sizeof(pairs[i].command),
+			 "cmd%05u-tool", cmd);
+		snprintf(pairs[i].container, sizeof(pairs[i].container),
+			 "c%u", container);
+	}
+}
+
+static int
+run(const char *name, pair_t *pairs, unsigned long iterations)
+{
+	unsigned int nr_granted = 0;
+	unsigned int nr_mismatch = 0;
+
+	for (unsigned int i = 0; i < NR_PAIR; ++i) {
+		bool granted = !icmpd_policy_check(pairs[i].command,
+						   pairs[i].container);
+
+		nr_granted += granted;
+		nr_mismatch += granted != !check_linear(pairs[i].command,
+							pairs[i].container);
+	}
+
+	double start = now();
+	for (unsigned long i = 0; i < iterations; ++i)
+		check_linear(pairs[i % NR_PAIR].command,
+			     pairs[i % NR_PAIR].container);
+	double linear = iterations / (now() - start);
+
+	start = now();
+	for (unsigned long i = 0; i < iterations * POLICY_SPEEDUP; ++i)
+		icmpd_policy_check(pairs[i % NR_PAIR].command,
+				   pairs[i % NR_PAIR].container);
+	double policy = iterations * POLICY_SPEEDUP / (now() - start);
+
+	printf("%s: %u/%u granted, %u mismatched, linear %.0f decisions/s, "
+	       "policy %.0f decisions/s\n", name, nr_granted, NR_PAIR,
+	       nr_mismatch, linear, policy);
+
+	return nr_mismatch ? -1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 200;
+	char conf[] = "/tmp/icmpd-policy-XXXXXX";
+
+	srandom(1);
+
+	if (write_conf(conf))
+		return EXIT_FAILURE;
+
+	/* Logging each decision is not what is measured */
+	if (!freopen("/dev/null", "w", stderr))
+		return EXIT_FAILURE;
+
+	int rc = ic_conf_file_parse(conf);
+	unlink(conf);
+	if (rc)
+		return EXIT_FAILURE;
+
+	fill_pairs(granted_pairs, 0);
+	fill_pairs(mixed_pairs, 1);
+
+	double start = now();
+	if (icmpd_policy_load())
+		return EXIT_FAILURE;
+	printf("compile %u commands: %.1f ms\n", NR_COMMAND,
+	       (now() - start) * 1e3);
+
+	rc = run("all granted", granted_pairs, iterations);
+	rc |= run("half denied", mixed_pairs, iterations);
+
+	return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
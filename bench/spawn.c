@@ -0,0 +1,220 @@
+/*
+ * Benchmark of the command launch
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * Measure the launch of true, as the daemon does it, in two parts:
+ *
+ * - fork+execvp() against posix_spawnp() while the RSS of the launcher
+ *   grows, because fork() copies the page tables of the launcher.
+ * - posix_spawnp() searching PATH against posix_spawn() of the path
+ *   resolved already, with the default PATH and with 10 empty
+ *   directories ahead of it.
+ *
+ * Usage: spawn [RSS in MB ...]
+ */
+
+#include "icmpd.h"
+
+#define NR_LAUNCH		200
+/* The difference of PATH search is small, so launch more */
+#define NR_RESOLVE_LAUNCH	2000
+#define NR_EMPTY_DIR		10
+
+extern char **environ;
+
+static char *true_argv[] = { "true", NULL };
+
+static void
+launch_fork(void)
+{
+	pid_t pid = fork();
+	if (!pid) {
+		execvp(true_argv[0], true_argv);
+		_exit(127);
+	}
+
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+static void
+launch_spawnp(void)
+{
+	pid_t pid;
+
+	if (!posix_spawnp(&pid, true_argv[0], NULL, NULL, true_argv,
+			  environ))
+		waitpid(pid, NULL, 0);
+}
+
+static char true_path[PATH_MAX];
+
+static void
+launch_spawn(void)
+{
+	pid_t pid;
+
+	if (!posix_spawn(&pid, true_path, NULL, NULL, true_argv, environ))
+		waitpid(pid, NULL, 0);
+}
+
+/* Return the latency of launch in microseconds */
+static unsigned long
+measure(void (*launch)(void), unsigned int nr_launch)
+{
+	unsigned long start = ic_util_time_us();
+
+	for (unsigned int i = 0; i < nr_launch; ++i)
+		launch();
+
+	return (ic_util_time_us() - start) / nr_launch;
+}
+
+static int
+resolve_true(void)
+{
+	char *path = getenv("PATH");
+	if (!path)
+		return -1;
+
+	char *dirs = strdup(path);
+	if (!dirs)
+		return -1;
+
+	char *save;
+	for (char *dir = strtok_r(dirs, ":", &save); dir;
+	     dir = strtok_r(NULL, ":", &save)) {
+		snprintf(true_path, sizeof(true_path), "%s/%s", dir,
+			 true_argv[0]);
+		if (!access(true_path, X_OK)) {
+			eee_mfree(dirs);
+			return 0;
+		}
+	}
+
+	eee_mfree(dirs);
+
+	return -1;
+}
+
+static int
+bench_rss(int argc, char **argv)
+{
+	static const char *default_rss[] = { "8", "128", "1024" };
+	unsigned int nr_rss = argc > 1 ? argc - 1 :
+			      sizeof(default_rss) / sizeof(default_rss[0]);
+	char *ballast = NULL;
+	unsigned long ballast_size = 0;
+
+	printf("Launch latency of true against RSS (%u launches each):\n\n"
+	       "  RSS        fork+exec    posix_spawn\n", NR_LAUNCH);
+
+	for (unsigned int i = 0; i < nr_rss; ++i) {
+		unsigned long mb = strtoul(argc > 1 ? argv[i + 1] :
+					   default_rss[i], NULL, 0);
+
+		/* Touch the pages so that they are mapped */
+		free(ballast);
+		ballast_size = mb << 20;
+		ballast = malloc(ballast_size);
+		if (!ballast) {
+			err("Unable to allocate %lu MB\n", mb);
+			return -1;
+		}
+		memset(ballast, 1, ballast_size);
+
+		unsigned long fork_us = measure(launch_fork, NR_LAUNCH);
+		unsigned long spawn_us = measure(launch_spawnp, NR_LAUNCH);
+
+		printf("  %5lu MB  %6lu us    %6lu us\n", mb, fork_us,
+		       spawn_us);
+	}
+
+	free(ballast);
+
+	return 0;
+}
+
+static int
+bench_resolve(void)
+{
+	char *path = getenv("PATH");
+	if (!path || resolve_true()) {
+		err("Unable to find true in PATH\n");
+		return -1;
+	}
+
+	printf("\nLaunch latency of true resolved in PATH (%u launches "
+	       "each):\n\n  PATH                  posix_spawnp    "
+	       "posix_spawn\n", NR_RESOLVE_LAUNCH);
+
+	unsigned long search_us = measure(launch_spawnp, NR_RESOLVE_LAUNCH);
+	unsigned long resolved_us = measure(launch_spawn, NR_RESOLVE_LAUNCH);
+	printf("  %-20s  %6lu us       %6lu us\n", "default", search_us,
+	       resolved_us);
+
+	char root[] = "/tmp/icmpd-spawn-XXXXXX";
+	if (!mkdtemp(root)) {
+		err("Unable to create %s: %s\n", root, strerror(errno));
+		return -1;
+	}
+
+	unsigned long len = strlen(path) + NR_EMPTY_DIR * (sizeof(root) + 8);
+	char *new_path = eee_malloc(len);
+	char *old_path = strdup(path);
+	if (!new_path || !old_path) {
+		eee_mfree(new_path);
+		eee_mfree(old_path);
+		rmdir(root);
+		return -1;
+	}
+
+	char *p = new_path;
+	for (unsigned int i = 0; i < NR_EMPTY_DIR; ++i) {
+		char dir[sizeof(root) + 8];
+
+		snprintf(dir, sizeof(dir), "%s/%u", root, i);
+		mkdir(dir, 0755);
+		p += sprintf(p, "%s:", dir);
+	}
+	strcpy(p, old_path);
+
+	setenv("PATH", new_path, 1);
+	search_us = measure(launch_spawnp, NR_RESOLVE_LAUNCH);
+	resolved_us = measure(launch_spawn, NR_RESOLVE_LAUNCH);
+	setenv("PATH", old_path, 1);
+
+	printf("  %2u empty dirs ahead   %6lu us       %6lu us\n",
+	       NR_EMPTY_DIR, search_us, resolved_us);
+
+	for (unsigned int i = 0; i < NR_EMPTY_DIR; ++i) {
+		char dir[sizeof(root) + 8];
+
+		snprintf(dir, sizeof(dir), "%s/%u", root, i);
+		rmdir(dir);
+	}
+	rmdir(root);
+
+	eee_mfree(new_path);
+	eee_mfree(old_path);
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (bench_rss(argc, argv) || bench_resolve())
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}
@@ -47,6 +47,18 @@ show_usage(const char *prog)
 	info_cont("  echo: echo the data over ICMP\n");
 	info_cont("  commandline: Run the commandline on the monitoring "
 		  "or essential\n");
+	info_cont("  heartbeat: Probe the liveness of the monitoring "
+		  "or essential\n");
+	info_cont("  builtin: Run the operation built in the monitoring "
+		  "or essential\n");
+	info_cont("  session: Run the commandlines in a shell kept on the "
+		  "monitoring or essential\n");
+	info_cont("  batch: Run the commandlines in parallel on the "
+		  "monitoring or essential\n");
+	info_cont("  prepare: Validate the commandline once and show the "
+		  "handle to run it\n");
+	info_cont("  fetch: Read the stdout kept by the monitoring or "
+		  "essential\n");
 	info_cont("\nargs:\n");
 	info_cont("  Run `%s help <subcommand>` for the details\n", prog);
 }
@@ -104,6 +116,12 @@ parse_options(int argc, char *argv[])
 extern subcommand_t subcommand_help;
 extern subcommand_t subcommand_commandline;
 extern subcommand_t subcommand_echo;
+extern subcommand_t subcommand_heartbeat;
+extern subcommand_t subcommand_builtin;
+extern subcommand_t subcommand_session;
+extern subcommand_t subcommand_batch;
+extern subcommand_t subcommand_prepare;
+extern subcommand_t subcommand_fetch;
 
 static void
 exit_notify(void)
@@ -124,6 +142,12 @@ main(int argc, char *argv[], char *envp[])
 	subcommand_add(&subcommand_help);
 	subcommand_add(&subcommand_commandline);
 	subcommand_add(&subcommand_echo);
+	subcommand_add(&subcommand_heartbeat);
+	subcommand_add(&subcommand_builtin);
+	subcommand_add(&subcommand_session);
+	subcommand_add(&subcommand_batch);
+	subcommand_add(&subcommand_prepare);
+	subcommand_add(&subcommand_fetch);
 
 	int rc = parse_options(argc, argv);
 	if (rc)
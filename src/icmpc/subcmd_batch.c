@@ -0,0 +1,342 @@
+/*
+ * ICMPC batch sub-command
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#include <ic.h>
+
+#define ICMPC_DEFAULT_CONF_FILE		"/etc/icmpc.conf"
+#define ICMPC_BATCH_MAX_COMMANDS	1024
+
+static char *opt_conf_file;
+static char *opt_requestor;
+static char *opt_file;
+static unsigned int opt_parallel;
+static char *opt_cmdlines[ICMPC_BATCH_MAX_COMMANDS];
+static unsigned int opt_nr_cmdline;
+
+/* The commandlines read from the file */
+static char *file_cmdlines;
+
+static void
+show_usage(char *prog)
+{
+	info_cont("\nUsage: %s batch <commandline>... <args>\n", prog);
+	info_cont("Run the commandlines in parallel on the monitoring "
+		  "container or essential with a single request.\n");
+	info_cont("\nargs:\n");
+	info_cont("  --config-file, -c: (optional) Configuration file. "
+		  "The default is " ICMPC_DEFAULT_CONF_FILE ".\n");
+	info_cont("  --requestor, -r: (optional) Set the command "
+		  "requestor. The default is local.\n");
+	info_cont("  --file, -f: (optional) Read the commandlines, one per "
+		  "line, from the file, or stdin if it is -.\n");
+	info_cont("  --parallel, -p: (optional) The maximum number of "
+		  "commandlines running in parallel. The default is the "
+		  "limit of daemon.\n");
+	info_cont("\nThe exit code is the one of the first commandline "
+		  "failing.\n");
+}
+
+static int
+parse_arg(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'c':
+		opt_conf_file = optarg;
+		break;
+	case 'r':
+		opt_requestor = optarg;
+		break;
+	case 'f':
+		opt_file = optarg;
+		break;
+	case 'p':
+		opt_parallel = strtoul(optarg, NULL, 0);
+		break;
+	case 1:
+		if (opt_nr_cmdline >= ICMPC_BATCH_MAX_COMMANDS) {
+			err("Too many commandlines\n");
+			return -1;
+		}
+
+		opt_cmdlines[opt_nr_cmdline++] = optarg;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Add the commandlines read from the file, one per line */
+static int
+read_file(const char *path)
+{
+	FILE *fp = stdin;
+
+	if (strcmp(path, "-")) {
+		fp = fopen(path, "r");
+		if (!fp) {
+			err("Unable to open %s: %s\n", path, strerror(errno));
+			return -1;
+		}
+	}
+
+	/* Read the whole file at once */
+	size_t size = 0;
+	ssize_t len = getdelim(&file_cmdlines, &size, 0, fp);
+	bool failed = len < 0 && ferror(fp);
+	if (fp != stdin)
+		fclose(fp);
+	if (failed) {
+		err("Unable to read %s\n", path);
+		return -1;
+	}
+
+	if (len < 0)
+		return 0;
+
+	char *saveptr;
+	for (char *line = strtok_r(file_cmdlines, "\n", &saveptr); line;
+	     line = strtok_r(NULL, "\n", &saveptr)) {
+		/* Skip the blank lines */
+		if (!line[strspn(line, " \t")])
+			continue;
+
+		if (opt_nr_cmdline >= ICMPC_BATCH_MAX_COMMANDS) {
+			err("Too many commandlines\n");
+			return -1;
+		}
+
+		opt_cmdlines[opt_nr_cmdline++] = line;
+	}
+
+	return 0;
+}
+
+/* Return the exit code of record */
+static int
+show_record(const icmp_batch_record_t *record, const uint8_t *data)
+{
+	const char *cmdline = opt_cmdlines[record->index];
+
+	if (opt_nr_cmdline > 1) {
+		info_cont("==> %s <==\n", cmdline);
+		fflush(stdout);
+	}
+
+	if (record->error) {
+		err("Unable to run %s: %s\n", cmdline,
+		    strerror(record->error));
+		return EXIT_FAILURE;
+	}
+
+	icmp_exec_result_t result;
+	if (icmp_find_exec_result(data, record->length, &result)) {
+		err("Malformed output of %s\n", cmdline);
+		return EXIT_FAILURE;
+	}
+
+	fwrite(data, 1, result.stdout_length, stdout);
+	fflush(stdout);
+	fwrite(data + result.stdout_length, 1, result.stderr_length,
+	       stderr);
+	fflush(stderr);
+
+	if (result.flags & ICMP_EXEC_TIMED_OUT)
+		return 124;
+
+	if (result.exit_code >= 0)
+		return result.exit_code;
+
+	return 128 + result.signal;
+}
+
+static int
+handle_result(void *context, uint16_t cc, const void *data,
+	      unsigned long data_len)
+{
+	int *exit_code = context;
+	icmp_batch_result_t result;
+
+	if (cc != ICMP_CC_BATCH || data_len < sizeof(result)) {
+		err("Unexpected response (cc 0x%x)\n", cc);
+		return -1;
+	}
+
+	eee_memcpy(&result, data, sizeof(result));
+	if (result.error) {
+		err("Unable to run the batch: %s\n", strerror(result.error));
+		*exit_code = EXIT_FAILURE;
+		return 0;
+	}
+
+	if (result.nr_command != opt_nr_cmdline) {
+		err("Unexpected number of results (%u)\n", result.nr_command);
+		return -1;
+	}
+
+	/* The records are in the order of completion, so index them to
+	 * show the results in the order of commandlines.
+	 */
+	const uint8_t **records = calloc(opt_nr_cmdline, sizeof(*records));
+	if (!records)
+		return -1;
+
+	const uint8_t *p = (const uint8_t *)data + sizeof(result);
+	unsigned long len = data_len - sizeof(result);
+
+	while (len >= sizeof(icmp_batch_record_t)) {
+		icmp_batch_record_t record;
+
+		eee_memcpy(&record, p, sizeof(record));
+		if (record.index >= opt_nr_cmdline ||
+		    record.length > len - sizeof(record))
+			break;
+
+		records[record.index] = p;
+		p += sizeof(record) + record.length;
+		len -= sizeof(record) + record.length;
+	}
+
+	*exit_code = 0;
+
+	for (unsigned int i = 0; i < opt_nr_cmdline; ++i) {
+		int rc = EXIT_FAILURE;
+
+		if (records[i]) {
+			icmp_batch_record_t record;
+
+			eee_memcpy(&record, records[i], sizeof(record));
+			rc = show_record(&record, records[i] + sizeof(record));
+		} else
+			err("No result of %s\n", opt_cmdlines[i]);
+
+		if (rc && !*exit_code)
+			*exit_code = rc;
+	}
+
+	free(records);
+
+	return 0;
+}
+
+static int
+handle_protocol(const char *requestor)
+{
+	/* The commandlines are separated by NUL */
+	unsigned long payload_len = sizeof(icmp_batch_t);
+	for (unsigned int i = 0; i < opt_nr_cmdline; ++i)
+		payload_len += strlen(opt_cmdlines[i]) + 1;
+
+	icmp_batch_t *req = eee_malloc(payload_len);
+	if (!req)
+		return -1;
+
+	req->parallel = opt_parallel;
+
+	char *cmdline = req->commandlines;
+	for (unsigned int i = 0; i < opt_nr_cmdline; ++i) {
+		unsigned long len = strlen(opt_cmdlines[i]) + 1;
+
+		eee_memcpy(cmdline, opt_cmdlines[i], len);
+		cmdline += len;
+	}
+
+	void *msg;
+	unsigned long msg_len;
+	int rc = icmp_marshal(req, payload_len, ICMP_CC_BATCH, &msg,
+			      &msg_len);
+	eee_mfree(req);
+	if (rc) {
+		err("Failed to marshal ICMP request message\n");
+		return rc;
+	}
+
+	ic_transport_t tr = ic_transport_create_slave(requestor);
+	if (!tr) {
+		eee_mfree(msg);
+		return -1;
+	}
+
+	rc = ic_transport_send_data(tr, msg, msg_len);
+	eee_mfree(msg);
+	if (rc) {
+		err("Failed to send ICMP request message\n");
+		goto out;
+	}
+
+	msg = NULL;
+	msg_len = 0;
+	rc = ic_transport_receive_data(tr, &msg, &msg_len);
+	if (rc) {
+		err("Failed to receive ICMP response message\n");
+		goto out;
+	}
+
+	int exit_code = 0;
+
+	rc = icmp_unmarshal(msg, msg_len, ICMP_CC_BATCH, handle_result,
+			    &exit_code);
+	ic_transport_free_data(tr, msg);
+	if (rc)
+		err("Failed to unmarshal ICMP response message\n");
+	else
+		rc = exit_code;
+
+out:
+	ic_transport_destroy(tr);
+
+	return rc;
+}
+
+static int
+run_batch(char *prog)
+{
+	int rc;
+
+	if (opt_file && read_file(opt_file))
+		return -1;
+
+	if (!opt_nr_cmdline) {
+		err("No commandline specified\n");
+		show_usage(prog);
+		return -1;
+	}
+
+	if (opt_conf_file) {
+		rc = ic_conf_file_parse(opt_conf_file);
+		if (rc < 0)
+			return rc;
+	}
+
+	rc = handle_protocol(opt_requestor ? opt_requestor : "local");
+	free(file_cmdlines);
+
+	return rc;
+}
+
+static struct option long_opts[] = {
+	{ "config-file", required_argument, NULL, 'c' },
+	{ "requestor", required_argument, NULL, 'r' },
+	{ "file", required_argument, NULL, 'f' },
+	{ "parallel", required_argument, NULL, 'p' },
+	{ 0 },	/* NULL terminated */
+};
+
+subcommand_t subcommand_batch = {
+	.name = "batch",
+	.optstring = "-c:r:f:p:",
+	.long_opts = long_opts,
+	.parse_arg = parse_arg,
+	.show_usage = show_usage,
+	.run = run_batch,
+};
@@ -0,0 +1,426 @@
+/*
+ * ICMPC builtin sub-command
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#include <ic.h>
+
+#define ICMPC_DEFAULT_CONF_FILE		"/etc/icmpc.conf"
+#define ICMPC_BUILTIN_MAX_ARGS		64
+
+typedef struct {
+	const char *name;
+	uint16_t op;
+	/* The minimum and maximum number of arguments */
+	unsigned int min_args;
+	unsigned int max_args;
+} icmpc_builtin_t;
+
+static icmpc_builtin_t builtins[] = {
+	{ "read", ICMP_BUILTIN_READ, 1, 1 },
+	{ "stat", ICMP_BUILTIN_STAT, 1, ICMPC_BUILTIN_MAX_ARGS },
+	{ "ls", ICMP_BUILTIN_LIST, 1, 1 },
+	{ "proc", ICMP_BUILTIN_PROC, 1, ICMPC_BUILTIN_MAX_ARGS },
+	{ "df", ICMP_BUILTIN_STATFS, 1, ICMPC_BUILTIN_MAX_ARGS },
+	{ "sysinfo", ICMP_BUILTIN_SYSINFO, 0, 0 },
+	{ "cache", ICMP_BUILTIN_CACHE, 0, 0 },
+};
+
+static char *opt_conf_file;
+static char *opt_requestor;
+static char *opt_args[ICMPC_BUILTIN_MAX_ARGS + 1];
+static unsigned int opt_nr_arg;
+
+/* The request being answered */
+typedef struct {
+	icmpc_builtin_t *builtin;
+	int rc;
+} icmpc_result_t;
+
+static void
+show_usage(char *prog)
+{
+	info_cont("\nUsage: %s builtin <operation> <args>\n", prog);
+	info_cont("Run the operation built in the monitoring container or "
+		  "essential without spawning a process.\n");
+	info_cont("\noperation:\n");
+	info_cont("  read <file>: Read a regular file (granted as cat).\n");
+	info_cont("  stat <path>...: Stat the paths (granted as stat).\n");
+	info_cont("  ls <directory>: List a directory (granted as ls).\n");
+	info_cont("  proc <file>...: Read the files relative to /proc "
+		  "(granted as cat).\n");
+	info_cont("  df <path>...: Show the usage of file systems (granted "
+		  "as df).\n");
+	info_cont("  sysinfo: Show the uptime, load and memory (granted as "
+		  "sysinfo).\n");
+	info_cont("  cache: Show the statistics of result cache (granted as "
+		  "cache).\n");
+	info_cont("\nargs:\n");
+	info_cont("  --config-file, -c: (optional) Configuration file. "
+		  "The default is " ICMPC_DEFAULT_CONF_FILE ".\n");
+	info_cont("  --requestor, -r: (optional) Set the command "
+		  "requestor. The default is local.\n");
+}
+
+static int
+parse_arg(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'c':
+		opt_conf_file = optarg;
+		break;
+	case 'r':
+		opt_requestor = optarg;
+		break;
+	case 1:
+		if (opt_nr_arg > ICMPC_BUILTIN_MAX_ARGS) {
+			err("Too many arguments\n");
+			return -1;
+		}
+
+		opt_args[opt_nr_arg++] = optarg;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+show_records(const uint8_t *data, unsigned long len)
+{
+	for (unsigned int i = 1; i < opt_nr_arg; ++i) {
+		icmp_builtin_record_t record;
+
+		if (len < sizeof(record))
+			break;
+
+		eee_memcpy(&record, data, sizeof(record));
+		data += sizeof(record);
+		len -= sizeof(record);
+		if (record.length > len)
+			break;
+
+		if (record.error)
+			err("/proc/%s: %s\n", opt_args[i],
+			    strerror(record.error));
+		else {
+			if (opt_nr_arg > 2)
+				info_cont("==> /proc/%s <==\n", opt_args[i]);
+			fwrite(data, 1, record.length, stdout);
+		}
+
+		data += record.length;
+		len -= record.length;
+	}
+}
+
+static void
+show_stats(const uint8_t *data, unsigned long len)
+{
+	for (unsigned int i = 1; i < opt_nr_arg; ++i) {
+		icmp_builtin_stat_t st;
+
+		if (len < sizeof(st))
+			break;
+
+		eee_memcpy(&st, data, sizeof(st));
+		data += sizeof(st);
+		len -= sizeof(st);
+
+		if (st.error) {
+			err("%s: %s\n", opt_args[i], strerror(st.error));
+			continue;
+		}
+
+		info_cont("%s: mode 0%o, uid %u, gid %u, size %llu, inode %llu, "
+			  "links %llu, mtime %llu.%09llu\n", opt_args[i],
+			  st.mode, st.uid, st.gid, (unsigned long long)st.size,
+			  (unsigned long long)st.ino,
+			  (unsigned long long)st.nlink,
+			  (unsigned long long)st.mtime / 1000000000,
+			  (unsigned long long)st.mtime % 1000000000);
+	}
+}
+
+static void
+show_entries(const uint8_t *data, unsigned long len)
+{
+	while (len > 1) {
+		unsigned long name_len = strnlen((const char *)data + 1,
+						 len - 1);
+		if (name_len == len - 1)
+			break;
+
+		info_cont("%s%s\n", data + 1, *data == DT_DIR ? "/" : "");
+		data += 1 + name_len + 1;
+		len -= 1 + name_len + 1;
+	}
+}
+
+static void
+show_statfs(const uint8_t *data, unsigned long len)
+{
+	info_cont("%-24s %16s %16s %16s\n", "Path", "1K-blocks", "Used",
+		  "Available");
+
+	for (unsigned int i = 1; i < opt_nr_arg; ++i) {
+		icmp_builtin_statfs_t st;
+
+		if (len < sizeof(st))
+			break;
+
+		eee_memcpy(&st, data, sizeof(st));
+		data += sizeof(st);
+		len -= sizeof(st);
+
+		if (st.error) {
+			err("%s: %s\n", opt_args[i], strerror(st.error));
+			continue;
+		}
+
+		unsigned long long kb = st.block_size / 1024 ?
+					st.block_size / 1024 : 1;
+
+		info_cont("%-24s %16llu %16llu %16llu\n", opt_args[i],
+			  (unsigned long long)st.blocks * kb,
+			  (unsigned long long)(st.blocks - st.blocks_free) * kb,
+			  (unsigned long long)st.blocks_avail * kb);
+	}
+}
+
+static void
+show_sysinfo(const uint8_t *data, unsigned long len)
+{
+	icmp_builtin_sysinfo_t si;
+
+	if (len < sizeof(si))
+		return;
+
+	eee_memcpy(&si, data, sizeof(si));
+
+	info_cont("uptime: %llu s\n", (unsigned long long)si.uptime);
+	info_cont("load average: %.2f, %.2f, %.2f\n", si.loads[0] / 65536.0,
+		  si.loads[1] / 65536.0, si.loads[2] / 65536.0);
+	info_cont("cpus: %u\n", si.nr_cpu);
+	info_cont("processes: %u\n", si.procs);
+	info_cont("memory: %llu KB total, %llu KB free, %llu KB shared, "
+		  "%llu KB buffer\n", (unsigned long long)si.total_ram / 1024,
+		  (unsigned long long)si.free_ram / 1024,
+		  (unsigned long long)si.shared_ram / 1024,
+		  (unsigned long long)si.buffer_ram / 1024);
+	info_cont("swap: %llu KB total, %llu KB free\n",
+		  (unsigned long long)si.total_swap / 1024,
+		  (unsigned long long)si.free_swap / 1024);
+}
+
+static void
+show_cache(const uint8_t *data, unsigned long len)
+{
+	icmp_builtin_cache_t cache;
+
+	if (len < sizeof(cache))
+		return;
+
+	eee_memcpy(&cache, data, sizeof(cache));
+
+	uint64_t lookups = cache.hits + cache.misses;
+
+	info_cont("hits: %llu, misses: %llu, hit ratio: %.1f%%\n",
+		  (unsigned long long)cache.hits,
+		  (unsigned long long)cache.misses,
+		  lookups ? cache.hits * 100.0 / lookups : 0.0);
+	info_cont("stores: %llu, evictions: %llu, expirations: %llu\n",
+		  (unsigned long long)cache.stores,
+		  (unsigned long long)cache.evictions,
+		  (unsigned long long)cache.expirations);
+	info_cont("entries: %u, %llu KB used of %llu KB\n", cache.entries,
+		  (unsigned long long)cache.used / 1024,
+		  (unsigned long long)cache.budget / 1024);
+}
+
+static int
+handle_result(void *context, uint16_t cc, const void *data,
+	      unsigned long data_len)
+{
+	icmpc_result_t *res = context;
+	icmp_builtin_result_t result;
+
+	if (cc != ICMP_CC_BUILTIN || data_len < sizeof(result)) {
+		err("Unexpected response (cc 0x%x)\n", cc);
+		return -1;
+	}
+
+	eee_memcpy(&result, data, sizeof(result));
+	if (result.error) {
+		err("%s: %s\n", res->builtin->name, strerror(result.error));
+		res->rc = EXIT_FAILURE;
+		return 0;
+	}
+
+	data = (const uint8_t *)data + sizeof(result);
+	data_len -= sizeof(result);
+
+	switch (res->builtin->op) {
+	case ICMP_BUILTIN_READ:
+		fwrite(data, 1, data_len, stdout);
+		break;
+	case ICMP_BUILTIN_STAT:
+		show_stats(data, data_len);
+		break;
+	case ICMP_BUILTIN_LIST:
+		show_entries(data, data_len);
+		break;
+	case ICMP_BUILTIN_PROC:
+		show_records(data, data_len);
+		break;
+	case ICMP_BUILTIN_STATFS:
+		show_statfs(data, data_len);
+		break;
+	case ICMP_BUILTIN_SYSINFO:
+		show_sysinfo(data, data_len);
+		break;
+	case ICMP_BUILTIN_CACHE:
+		show_cache(data, data_len);
+		break;
+	}
+
+	fflush(stdout);
+
+	return 0;
+}
+
+static int
+handle_protocol(const char *requestor, icmpc_builtin_t *builtin)
+{
+	/* The arguments are separated by NUL */
+	unsigned long payload_len = sizeof(icmp_builtin_t);
+	for (unsigned int i = 1; i < opt_nr_arg; ++i)
+		payload_len += strlen(opt_args[i]) + 1;
+
+	icmp_builtin_t *req = eee_malloc(payload_len);
+	if (!req)
+		return -1;
+
+	req->op = builtin->op;
+
+	char *arg = req->arguments;
+	for (unsigned int i = 1; i < opt_nr_arg; ++i) {
+		unsigned long len = strlen(opt_args[i]) + 1;
+
+		eee_memcpy(arg, opt_args[i], len);
+		arg += len;
+	}
+
+	void *msg;
+	unsigned long msg_len;
+	int rc = icmp_marshal(req, payload_len, ICMP_CC_BUILTIN, &msg,
+			      &msg_len);
+	eee_mfree(req);
+	if (rc) {
+		err("Failed to marshal ICMP request message\n");
+		return rc;
+	}
+
+	ic_transport_t tr = ic_transport_create_slave(requestor);
+	if (!tr) {
+		eee_mfree(msg);
+		return -1;
+	}
+
+	rc = ic_transport_send_data(tr, msg, msg_len);
+	eee_mfree(msg);
+	if (rc) {
+		err("Failed to send ICMP request message\n");
+		goto out;
+	}
+
+	msg = NULL;
+	msg_len = 0;
+	rc = ic_transport_receive_data(tr, &msg, &msg_len);
+	if (rc) {
+		err("Failed to receive ICMP response message\n");
+		goto out;
+	}
+
+	icmpc_result_t res = {
+		.builtin = builtin,
+		.rc = 0,
+	};
+
+	rc = icmp_unmarshal(msg, msg_len, ICMP_CC_BUILTIN, handle_result,
+			    &res);
+	ic_transport_free_data(tr, msg);
+	if (rc)
+		err("Failed to unmarshal ICMP response message\n");
+	else
+		rc = res.rc;
+
+out:
+	ic_transport_destroy(tr);
+
+	return rc;
+}
+
+static int
+run_builtin(char *prog)
+{
+	int rc;
+
+	if (!opt_nr_arg)
+		return -1;
+
+	icmpc_builtin_t *builtin = NULL;
+	for (unsigned int i = 0; i < sizeof(builtins) / sizeof(*builtins);
+	     ++i) {
+		if (!strcmp(opt_args[0], builtins[i].name)) {
+			builtin = builtins + i;
+			break;
+		}
+	}
+
+	if (!builtin) {
+		err("Unrecognized operation: %s\n", opt_args[0]);
+		show_usage(prog);
+		return -1;
+	}
+
+	unsigned int nr_arg = opt_nr_arg - 1;
+	if (nr_arg < builtin->min_args || nr_arg > builtin->max_args) {
+		err("Invalid number of arguments for %s\n", builtin->name);
+		show_usage(prog);
+		return -1;
+	}
+
+	if (opt_conf_file) {
+		rc = ic_conf_file_parse(opt_conf_file);
+		if (rc < 0)
+			return rc;
+	}
+
+	return handle_protocol(opt_requestor ? opt_requestor : "local",
+			       builtin);
+}
+
+static struct option long_opts[] = {
+	{ "config-file", required_argument, NULL, 'c' },
+	{ "requestor", required_argument, NULL, 'r' },
+	{ 0 },	/* NULL terminated */
+};
+
+subcommand_t subcommand_builtin = {
+	.name = "builtin",
+	.optstring = "-c:r:",
+	.long_opts = long_opts,
+	.parse_arg = parse_arg,
+	.show_usage = show_usage,
+	.run = run_builtin,
+};
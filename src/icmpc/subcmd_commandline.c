@@ -18,10 +18,150 @@ typedef struct {
 } icmpc_context_t;
 
 #define ICMPC_DEFAULT_CONF_FILE		"/etc/icmpc.conf"
+/* The chunk of stdin streamed at once */
+#define ICMPC_STDIN_CHUNK		(64 * 1024)
+
+/* The exit code if the command doesn't complete within the timeout */
+#define ICMPC_EXIT_TIMEOUT		124
+
+/* The maximum number of arguments sent with --argv */
+#define ICMPC_MAX_ARGS			1024
+
+/* The length of stdout previewed if spilled unless specified */
+#define ICMPC_SPILL_PREVIEW		4096
+
+/* The response of the exchange */
+typedef struct {
+	uint16_t cc;
+	/* The command doesn't read stdin anymore */
+	bool stdin_closed;
+	/* The request is cancelled */
+	bool cancelled;
+	/* The exit code of command, or 0 if not reported by the daemon */
+	int exit_code;
+} icmpc_response_t;
+
+/* The request cancelled if the client gives up */
+typedef struct {
+	const char *requestor;
+	uint64_t request_id;
+} icmpc_request_t;
 
 static char *opt_conf_file;
 static char *opt_cmdline;
 static char *opt_requestor;
+static bool opt_stdin;
+static unsigned int opt_timeout;
+static bool opt_stats;
+static bool opt_argv;
+static bool opt_pipeline;
+static uint64_t opt_handle;
+static icmp_filter_t opt_filter;
+static char *opt_pattern;
+static bool opt_spill;
+static char *opt_delta_file;
+static icmp_spill_t opt_spill_value = {
+	.preview_length = ICMPC_SPILL_PREVIEW,
+};
+static char *opt_args[ICMPC_MAX_ARGS + 1];
+static unsigned int opt_nr_arg;
+
+/* The stdout kept with --delta and its tag */
+static char *delta_stdout;
+static unsigned long delta_stdout_len;
+static uint64_t delta_tag;
+
+/* Load the tag and the stdout kept. The stdout is requested entirely if
+ * the file isn't usable.
+ */
+static void
+load_delta_file(void)
+{
+	FILE *fp = fopen(opt_delta_file, "r");
+	if (!fp)
+		return;
+
+	/* The stdout may carry any byte, so it is read by the size */
+	struct stat st;
+	uint64_t tag;
+	if (fstat(fileno(fp), &st) || !S_ISREG(st.st_mode) ||
+	    st.st_size < (off_t)sizeof(tag) ||
+	    fread(&tag, sizeof(tag), 1, fp) != 1) {
+		fclose(fp);
+		return;
+	}
+
+	unsigned long len = st.st_size - sizeof(tag);
+	char *data = malloc(len ? len : 1);
+	if (data && fread(data, 1, len, fp) == len && fgetc(fp) == EOF) {
+		delta_tag = tag;
+		delta_stdout = data;
+		delta_stdout_len = len;
+	} else
+		free(data);
+
+	fclose(fp);
+}
+
+/* Replace the file with the tag and the stdout */
+static void
+save_delta_file(uint64_t tag, const char *data, unsigned long len)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s.tmp", opt_delta_file);
+
+	FILE *fp = fopen(path, "w");
+	if (!fp) {
+		err("Unable to create %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	bool failed = fwrite(&tag, sizeof(tag), 1, fp) != 1 ||
+		      fwrite(data, 1, len, fp) != len;
+	if (fclose(fp) || failed || rename(path, opt_delta_file)) {
+		err("Unable to save %s\n", opt_delta_file);
+		unlink(path);
+	}
+}
+
+/* Rebuild the stdout answered with the delta result. Return the stdout
+ * to free, or NULL if it is unable to rebuild.
+ */
+static char *
+apply_delta(const icmp_delta_result_t *delta, const void *data,
+	    unsigned long len)
+{
+	char *out = malloc(delta->length ? delta->length : 1);
+	if (!out)
+		return NULL;
+
+	switch (delta->encoding) {
+	case ICMP_DELTA_FULL:
+		if (len != delta->length)
+			break;
+
+		eee_memcpy(out, data, len);
+		return out;
+	case ICMP_DELTA_NOT_MODIFIED:
+		if (!delta_stdout || delta_stdout_len != delta->length)
+			break;
+
+		eee_memcpy(out, delta_stdout, delta_stdout_len);
+		return out;
+	case ICMP_DELTA_PATCH:
+		if (!delta_stdout ||
+		    icmp_apply_delta(delta_stdout, delta_stdout_len, data, len,
+				     out, delta->length))
+			break;
+
+		return out;
+	}
+
+	free(out);
+
+	return NULL;
+}
 
 static int
 init_context(icmpc_context_t *ctx)
@@ -52,45 +192,182 @@ destroy_context(icmpc_context_t *ctx)
 }
 
 static int
-print_result(void *context, uint16_t cc, const void *data,
-	     unsigned long data_len)
+handle_result(void *context, uint16_t cc, const void *data,
+	      unsigned long data_len)
 {
-	fprintf(stdout, "%s", (char *)data);
-	fflush(stdout);
+	icmpc_response_t *resp = context;
+
+	resp->cc = cc;
+
+	switch (cc) {
+	case ICMP_CC_COMMMANDLINE: {
+		icmp_exec_result_t result;
+
+		if (icmp_find_exec_result(data, data_len, &result)) {
+			fprintf(stdout, "%s", (char *)data);
+			fflush(stdout);
+			break;
+		}
+
+		/* The results of delta and spill precede the trailer */
+		const char *trailer = (const char *)data + data_len -
+				      sizeof(result);
+		const char *out = data;
+		unsigned long out_len = result.stdout_length;
+		char *rebuilt = NULL;
+
+		if (result.flags & ICMP_EXEC_DELTA) {
+			icmp_delta_result_t delta;
+
+			eee_memcpy(&delta, trailer - sizeof(delta),
+				   sizeof(delta));
+			rebuilt = apply_delta(&delta, data,
+					      result.stdout_length);
+			if (!rebuilt) {
+				err("Unable to rebuild the stdout\n");
+				unlink(opt_delta_file);
+				resp->exit_code = EXIT_FAILURE;
+				break;
+			}
+
+			out = rebuilt;
+			out_len = delta.length;
+
+			if (delta.tag != delta_tag)
+				save_delta_file(delta.tag, out, out_len);
+
+			if (opt_stats)
+				fprintf(stderr, "%s, %llu bytes answered for "
+					"%lu-byte stdout\n",
+					delta.encoding == ICMP_DELTA_PATCH ?
+					"delta" : delta.encoding ==
+					ICMP_DELTA_NOT_MODIFIED ?
+					"not modified" : "full",
+					(unsigned long long)result.stdout_length,
+					out_len);
+		}
+
+		fwrite(out, 1, out_len, stdout);
+		fflush(stdout);
+		free(rebuilt);
+		fwrite((const char *)data + result.stdout_length, 1,
+		       result.stderr_length, stderr);
+		fflush(stderr);
+
+		/* Exit like the shell does for the command */
+		if (result.exit_code >= 0)
+			resp->exit_code = result.exit_code;
+		else
+			resp->exit_code = 128 + result.signal;
+
+		if (result.flags & ICMP_EXEC_TIMED_OUT)
+			resp->exit_code = ICMPC_EXIT_TIMEOUT;
+
+		if (result.flags & ICMP_EXEC_SPILLED) {
+			icmp_spill_result_t spill;
+
+			eee_memcpy(&spill, trailer - sizeof(spill),
+				   sizeof(spill));
+			fprintf(stderr, "The stdout of %llu bytes%s is kept "
+				"as 0x%llx for %u ms after the last fetch\n",
+				(unsigned long long)spill.total_length,
+				spill.flags & ICMP_SPILL_TRUNCATED ?
+				" (truncated)" : "",
+				(unsigned long long)spill.handle, spill.ttl);
+		}
+
+		/* Keep the stdout intact for the output of command */
+		if (opt_stats)
+			fprintf(stderr, "exit %d, signal %d, wall %llu us, "
+				"user %llu us, sys %llu us, max rss %llu "
+				"KB%s%s%s\n",
+				result.exit_code, result.signal,
+				(unsigned long long)result.wall_time,
+				(unsigned long long)result.user_time,
+				(unsigned long long)result.sys_time,
+				(unsigned long long)result.max_rss,
+				result.flags & ICMP_EXEC_TIMED_OUT ?
+				", timed out" : "",
+				result.flags & ICMP_EXEC_CACHED ?
+				", cached" : "",
+				result.flags & ICMP_EXEC_TRUNCATED ?
+				", truncated" : "");
+		break;
+	}
+	case ICMP_CC_STDIN: {
+		icmp_stdin_ack_t ack = {
+			.closed = 1,
+		};
+
+		if (data_len >= sizeof(ack))
+			eee_memcpy(&ack, data, sizeof(ack));
+
+		resp->stdin_closed = ack.closed;
+		break;
+	}
+	case ICMP_CC_EXECUTE: {
+		icmp_prepare_result_t result = {
+			.error = EINVAL,
+		};
+
+		if (data_len >= sizeof(result))
+			eee_memcpy(&result, data, sizeof(result));
+
+		if (result.error == ESTALE)
+			err("The prepared command 0x%llx is stale. Prepare it "
+			    "again\n", (unsigned long long)opt_handle);
+		else
+			err("Unable to run the prepared command 0x%llx: %s\n",
+			    (unsigned long long)opt_handle,
+			    strerror(result.error));
+
+		resp->exit_code = EXIT_FAILURE;
+		break;
+	}
+	case ICMP_CC_CANCEL: {
+		icmp_cancel_ack_t ack = {
+			.cancelled = 0,
+		};
+
+		if (data_len >= sizeof(ack))
+			eee_memcpy(&ack, data, sizeof(ack));
+
+		resp->cancelled = ack.cancelled;
+		break;
+	}
+	default:
+		err("Unexpected response (cc 0x%x)\n", cc);
+		return -1;
+	}
 
 	return 0;
 }
 
+/* Send the request and handle the response */
 static int
-handle_protocol(icmpc_context_t *ctx, char *cmdline)
+exchange(ic_transport_t tr, void *payload, unsigned long payload_len,
+	 uint16_t cc, icmpc_response_t *resp)
 {
 	void *msg;
 	unsigned long msg_len;
-	unsigned long cmdline_len = strlen(cmdline) + 1;
 
-	int rc = icmp_marshal(cmdline, cmdline_len, ICMP_CC_COMMMANDLINE,
-			      &msg, &msg_len);
+	int rc = icmp_marshal(payload, payload_len, cc, &msg, &msg_len);
 	if (rc) {
 		err("Failed to marshal ICMP request message\n");
 		return rc;
 	}
 
-	char *requestor = ctx->container_name;
-	ic_transport_t tr = ic_transport_create_slave(requestor);
-	if (!tr)
-		return -1;
-
 	dbg("Preparing to send ICMP request message ...\n");
 
 	rc = ic_transport_send_data(tr, msg, msg_len);
 	eee_mfree(msg);
 	if (rc) {
 		err("Failed to send ICMP request message\n");
-		goto err_send_data;
+		return rc;
 	}
 
 	dbg("%ld-byte ICMP request message with %ld-byte payload sent\n",
-	    msg_len, cmdline_len);
+	    msg_len, payload_len);
 
 	dbg("Preparing to receive ICMP response message ...\n");
 
@@ -99,30 +376,324 @@ handle_protocol(icmpc_context_t *ctx, char *cmdline)
 	rc = ic_transport_receive_data(tr, &msg, &msg_len);
 	if (rc) {
 		err("Failed to receive ICMP response message\n");
-		goto err_send_data;
+		return rc;
 	}
 
 	dbg("%ld-byte ICMP response message received\n", msg_len);
 
-	rc = icmp_unmarshal(msg, msg_len, ICMP_CC_COMMMANDLINE,
-			    print_result, ctx);
+	resp->cc = ICMP_CC_NOT_SPECIFIED;
+	rc = icmp_unmarshal(msg, msg_len, ICMP_CC_NOT_SPECIFIED,
+			    handle_result, resp);
 	ic_transport_free_data(tr, msg);
-	ic_transport_destroy(tr);
 	if (rc)
 		err("Failed to unmarshal ICMP response message\n");
 
 	return rc;
+}
 
-err_send_data:
-	ic_transport_destroy(tr);
+/* Stream the stdin to the command chunk by chunk. The next chunk is
+ * sent once the daemon acknowledges the previous one. The last chunk
+ * without data is answered with the output of command.
+ */
+static int
+stream_stdin(ic_transport_t tr, uint64_t stream_id, icmpc_response_t *resp)
+{
+	icmp_stdin_t *chunk = eee_malloc(sizeof(*chunk) + ICMPC_STDIN_CHUNK);
+	if (!chunk)
+		return -1;
+
+	chunk->stream_id = stream_id;
+	resp->stdin_closed = 0;
+
+	int rc = 0;
+
+	while (!resp->stdin_closed) {
+		ssize_t sz = read(STDIN_FILENO, chunk->data,
+				  ICMPC_STDIN_CHUNK);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+
+			err("Unable to read stdin: %s\n", strerror(errno));
+			break;
+		}
+
+		if (!sz)
+			break;
+
+		rc = exchange(tr, chunk, sizeof(*chunk) + sz, ICMP_CC_STDIN,
+			      resp);
+		if (rc)
+			goto out;
+
+		if (resp->cc != ICMP_CC_STDIN) {
+			rc = -1;
+			goto out;
+		}
+	}
+
+	rc = exchange(tr, chunk, sizeof(*chunk), ICMP_CC_STDIN, resp);
+	if (!rc && resp->cc != ICMP_CC_COMMMANDLINE) {
+		err("The command is gone before the end of stdin\n");
+		rc = -1;
+	}
+
+out:
+	eee_mfree(chunk);
 
 	return rc;
 }
 
+/* Cancel the request with a transport of its own, because the request
+ * is outstanding on the transport of main thread.
+ */
+static void
+cancel_request(icmpc_request_t *req)
+{
+	ic_transport_t tr = ic_transport_create_slave(req->requestor);
+	if (!tr)
+		return;
+
+	icmp_cancel_t cancel = {
+		.request_id = req->request_id,
+	};
+	icmpc_response_t resp = {
+		.cancelled = 0,
+	};
+
+	if (!exchange(tr, &cancel, sizeof(cancel), ICMP_CC_CANCEL, &resp))
+		dbg("Request 0x%llx %s\n", (unsigned long long)req->request_id,
+		    resp.cancelled ? "cancelled" : "already completed");
+
+	ic_transport_destroy(tr);
+}
+
+/* Wait for the interruption or the timeout, and cancel the request
+ * before exiting.
+ */
+static void *
+watch_request(void *data)
+{
+	icmpc_request_t *req = data;
+	unsigned long deadline = ic_util_time_ms() + opt_timeout;
+	sigset_t mask;
+	int sig;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+
+	while (1) {
+		if (!opt_timeout) {
+			if (!sigwait(&mask, &sig))
+				break;
+
+			continue;
+		}
+
+		unsigned long now = ic_util_time_ms();
+		if (now >= deadline) {
+			sig = 0;
+			break;
+		}
+
+		struct timespec ts = {
+			.tv_sec = (deadline - now) / 1000,
+			.tv_nsec = ((deadline - now) % 1000) * 1000000,
+		};
+
+		sig = sigtimedwait(&mask, NULL, &ts);
+		if (sig > 0)
+			break;
+	}
+
+	if (sig)
+		dbg("Cancelling the command on signal %d\n", sig);
+	else
+		err("The command doesn't complete within %u ms\n",
+		    opt_timeout);
+
+	cancel_request(req);
+
+	exit(sig ? 128 + sig : ICMPC_EXIT_TIMEOUT);
+
+	return NULL;
+}
+
+static int
+start_watcher(icmpc_request_t *req)
+{
+	sigset_t mask;
+
+	/* Only the watcher receives the signals */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+	pthread_t thread;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	int rc = pthread_create(&thread, &attr, watch_request, req);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		err("Failed to create the thread watching the request\n");
+		pthread_sigmask(SIG_UNBLOCK, &mask, NULL);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The request carries the commandline, the arguments tokenized here,
+ * or the handle of prepared command with the arguments appended to it,
+ * followed by the options.
+ */
+static int
+handle_protocol(icmpc_context_t *ctx)
+{
+	char *requestor = ctx->container_name;
+	ic_transport_t tr = ic_transport_create_slave(requestor);
+	if (!tr)
+		return -1;
+
+	uint16_t cc = ICMP_CC_COMMMANDLINE;
+	unsigned long cmdline_len;
+	if (opt_handle) {
+		cc = ICMP_CC_EXECUTE;
+		cmdline_len = sizeof(icmp_execute_t) + icmp_argv_size(opt_args);
+	} else if (opt_argv) {
+		cc = ICMP_CC_ARGV;
+		cmdline_len = icmp_argv_size(opt_args);
+	} else
+		cmdline_len = strlen(opt_cmdline) + 1;
+
+	/* The stages of argv payload are laid out already */
+	bool pipeline = opt_pipeline && !opt_handle && !opt_argv;
+
+	unsigned long payload_len = cmdline_len;
+	uint64_t stream_id = 0;
+
+	payload_len += icmp_option_size(sizeof(uint64_t)) +
+		       icmp_option_size(sizeof(uint32_t));
+	if (opt_stdin)
+		payload_len += icmp_option_size(sizeof(stream_id));
+	if (pipeline)
+		payload_len += icmp_option_size(0);
+
+	/* The stdout is filtered by the daemon */
+	bool filter = opt_pattern || opt_filter.head || opt_filter.tail ||
+		      opt_filter.byte_offset || opt_filter.byte_length;
+	if (opt_pattern)
+		opt_filter.pattern_length = strlen(opt_pattern);
+	if (filter)
+		payload_len += icmp_option_size(sizeof(opt_filter) +
+						opt_filter.pattern_length);
+	if (opt_spill)
+		payload_len += icmp_option_size(sizeof(opt_spill_value));
+	if (opt_delta_file)
+		payload_len += icmp_option_size(sizeof(icmp_delta_t));
+
+	char *payload = eee_malloc(payload_len);
+	if (!payload) {
+		ic_transport_destroy(tr);
+		return -1;
+	}
+
+	if (opt_handle) {
+		icmp_execute_t exe = {
+			.handle = opt_handle,
+		};
+
+		eee_memcpy(payload, &exe, sizeof(exe));
+		icmp_put_argv(payload + sizeof(exe), opt_args);
+	} else if (opt_argv)
+		icmp_put_argv(payload, opt_args);
+	else
+		eee_memcpy(payload, opt_cmdline, cmdline_len);
+
+	/* The command is cancelled if the client gives up or is gone */
+	icmpc_request_t req = {
+		.requestor = requestor,
+		.request_id = ic_util_random(),
+	};
+	uint32_t lease = ic_transport_set_lease(tr, req.request_id);
+
+	char *opt = payload + cmdline_len;
+	opt += icmp_put_option(opt, ICMP_OPT_REQUEST_ID, &req.request_id,
+			       sizeof(req.request_id));
+	opt += icmp_put_option(opt, ICMP_OPT_LEASE, &lease, sizeof(lease));
+
+	if (opt_stdin) {
+		stream_id = ic_util_random();
+		opt += icmp_put_option(opt, ICMP_OPT_STDIN_STREAM, &stream_id,
+				       sizeof(stream_id));
+	}
+
+	if (pipeline)
+		opt += icmp_put_option(opt, ICMP_OPT_PIPELINE, NULL, 0);
+
+	if (filter) {
+		unsigned long len = sizeof(opt_filter) +
+				    opt_filter.pattern_length;
+		char *value = eee_malloc(len);
+		if (!value) {
+			eee_mfree(payload);
+			ic_transport_destroy(tr);
+			return -1;
+		}
+
+		eee_memcpy(value, &opt_filter, sizeof(opt_filter));
+		if (opt_pattern)
+			eee_memcpy(value + sizeof(opt_filter), opt_pattern,
+				   opt_filter.pattern_length);
+		opt += icmp_put_option(opt, ICMP_OPT_FILTER, value, len);
+		eee_mfree(value);
+	}
+
+	if (opt_spill)
+		opt += icmp_put_option(opt, ICMP_OPT_SPILL, &opt_spill_value,
+				       sizeof(opt_spill_value));
+
+	if (opt_delta_file) {
+		icmp_delta_t delta = {
+			.tag = delta_tag,
+		};
+
+		opt += icmp_put_option(opt, ICMP_OPT_DELTA, &delta,
+				       sizeof(delta));
+	}
+
+	start_watcher(&req);
+
+	icmpc_response_t resp = {
+		.exit_code = 0,
+	};
+	int rc = exchange(tr, payload, payload_len, cc, &resp);
+	eee_mfree(payload);
+
+	/* The daemon not supporting the stdin stream returns the output
+	 * right away.
+	 */
+	if (!rc && resp.cc == ICMP_CC_STDIN)
+		rc = stream_stdin(tr, stream_id, &resp);
+
+	ic_transport_destroy(tr);
+
+	/* Exit with the status of remote command */
+	return rc ? rc : resp.exit_code;
+}
+
 static void
 show_usage(char *prog)
 {
 	info_cont("\nUsage: %s commandline <command> <args>\n", prog);
+	info_cont("       %s commandline --argv <args> [--] <program> "
+		  "<argument>...\n", prog);
 	info_cont("Run the commandline on the monitoring container or "
 		  "essential.\n");
 	info_cont("\nargs:\n");
@@ -130,6 +701,43 @@ show_usage(char *prog)
 		  "The default is " ICMPC_DEFAULT_CONF_FILE ".\n");
 	info_cont("  --requestor, -r: (optional) Set the command "
 		  "requestor. The default is local.\n");
+	info_cont("  --stdin, -i: (optional) Stream the stdin to the "
+		  "command.\n");
+	info_cont("  --timeout, -t: (optional) Cancel the command if it "
+		  "doesn't complete within the timeout in milliseconds.\n");
+	info_cont("  --stats, -s: (optional) Show the exit status and "
+		  "resource usage of the command on stderr.\n");
+	info_cont("  --argv, -a: (optional) Send the program and its "
+		  "arguments as they are, without splitting them by the "
+		  "spaces.\n");
+	info_cont("  --pipeline, -p: (optional) A standalone | separates "
+		  "the stages of pipeline run without a shell. Otherwise it "
+		  "is an argument as it is.\n");
+	info_cont("  --head, -n: (optional) Return the first lines of "
+		  "stdout only.\n");
+	info_cont("  --tail, -T: (optional) Return the last lines of stdout "
+		  "only.\n");
+	info_cont("  --grep, -g: (optional) Return the lines of stdout "
+		  "containing the pattern only.\n");
+	info_cont("  --regex, -E: (optional) The pattern is an extended "
+		  "regular expression.\n");
+	info_cont("  --invert-match, -v: (optional) Return the lines not "
+		  "matching the pattern.\n");
+	info_cont("  --bytes, -b: (optional) Return the byte range "
+		  "<offset>[:<length>] of stdout only. The range is taken "
+		  "before matching the lines.\n");
+	info_cont("  --handle, -H: (optional) Run the command prepared by "
+		  "\"%s prepare\" with the arguments appended.\n", prog);
+	info_cont("  --spill, -S: (optional) If the stdout grows beyond "
+		  "<threshold>[:<preview>] bytes, return the first %u bytes, "
+		  "or the preview given, and keep the stdout in the daemon "
+		  "to be read with \"%s fetch\".\n", ICMPC_SPILL_PREVIEW,
+		  prog);
+	info_cont("  --delta, -D: (optional) Keep the stdout in the file, and "
+		  "let the daemon answer only what is changed since the "
+		  "stdout kept when polling the same commandline.\n");
+	info_cont("\nThe exit code is the one of the command, or 128 plus "
+		  "the signal killing it.\n");
 }
 
 static int
@@ -142,7 +750,76 @@ parse_arg(int opt, char *optarg)
 	case 'r':
 		opt_requestor = optarg;
 		break;
+	case 'i':
+		opt_stdin = 1;
+		break;
+	case 't':
+		opt_timeout = strtoul(optarg, NULL, 0);
+		break;
+	case 's':
+		opt_stats = 1;
+		break;
+	case 'a':
+		opt_argv = 1;
+		break;
+	case 'p':
+		opt_pipeline = 1;
+		break;
+	case 'H':
+		opt_handle = strtoull(optarg, NULL, 0);
+		break;
+	case 'n':
+		opt_filter.head = strtoul(optarg, NULL, 0);
+		break;
+	case 'T':
+		opt_filter.tail = strtoul(optarg, NULL, 0);
+		break;
+	case 'g':
+		opt_pattern = optarg;
+		break;
+	case 'E':
+		opt_filter.flags |= ICMP_FILTER_REGEX;
+		break;
+	case 'v':
+		opt_filter.flags |= ICMP_FILTER_INVERT;
+		break;
+	case 'b': {
+		char *end;
+
+		opt_filter.byte_offset = strtoull(optarg, &end, 0);
+		if (*end == ':')
+			opt_filter.byte_length = strtoull(end + 1, &end, 0);
+		if (*end) {
+			err("Invalid byte range %s\n", optarg);
+			return -1;
+		}
+		break;
+	}
+	case 'S': {
+		char *end;
+
+		opt_spill = 1;
+		opt_spill_value.threshold = strtoull(optarg, &end, 0);
+		if (*end == ':')
+			opt_spill_value.preview_length = strtoul(end + 1, &end,
+								 0);
+		if (*end) {
+			err("Invalid spill threshold %s\n", optarg);
+			return -1;
+		}
+		break;
+	}
+	case 'D':
+		opt_delta_file = optarg;
+		break;
 	case 1:
+		if (opt_nr_arg >= ICMPC_MAX_ARGS) {
+			err("Too many arguments\n");
+			return -1;
+		}
+
+		opt_args[opt_nr_arg++] = optarg;
+		/* The last one is the commandline without --argv */
 		opt_cmdline = optarg;
 		break;
 	default:
@@ -157,7 +834,7 @@ run_commandline(char *prog)
 {
 	int rc;
 
-	if (!opt_cmdline)
+	if (!opt_cmdline && !opt_handle)
 		return -1;
 
 	if (opt_conf_file) {
@@ -166,25 +843,50 @@ run_commandline(char *prog)
 			return rc;
 	}
 
+	if (opt_delta_file)
+		load_delta_file();
+
+	/* The stages are told apart by ICMP_PIPE rather than the string */
+	for (unsigned int i = 0; opt_pipeline && i < opt_nr_arg; ++i) {
+		if (!strcmp(opt_args[i], "|"))
+			opt_args[i] = ICMP_PIPE;
+	}
+
 	icmpc_context_t ctx;
 	rc = init_context(&ctx);
 	if (!rc) {
-		rc = handle_protocol(&ctx, opt_cmdline);
+		rc = handle_protocol(&ctx);
 		destroy_context(&ctx);
 	}
 
+	free(delta_stdout);
+
 	return rc;
 }
 
 static struct option long_opts[] = {
 	{ "config-file", required_argument, NULL, 'c' },
 	{ "requestor", required_argument, NULL, 'r' },
+	{ "stdin", no_argument, NULL, 'i' },
+	{ "timeout", required_argument, NULL, 't' },
+	{ "stats", no_argument, NULL, 's' },
+	{ "argv", no_argument, NULL, 'a' },
+	{ "pipeline", no_argument, NULL, 'p' },
+	{ "handle", required_argument, NULL, 'H' },
+	{ "head", required_argument, NULL, 'n' },
+	{ "tail", required_argument, NULL, 'T' },
+	{ "grep", required_argument, NULL, 'g' },
+	{ "regex", no_argument, NULL, 'E' },
+	{ "invert-match", no_argument, NULL, 'v' },
+	{ "bytes", required_argument, NULL, 'b' },
+	{ "spill", required_argument, NULL, 'S' },
+	{ "delta", required_argument, NULL, 'D' },
 	{ 0 },	/* NULL terminated */
 };
 
 subcommand_t subcommand_commandline = {
 	.name = "commandline",
-	.optstring = "-c:r:",
+	.optstring = "-c:r:it:sapH:n:T:g:Evb:S:D:",
 	.long_opts = long_opts,
 	.parse_arg = parse_arg,
 	.show_usage = show_usage,
@@ -0,0 +1,237 @@
+/*
+ * ICMPC fetch sub-command
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#include <ic.h>
+
+#define ICMPC_DEFAULT_CONF_FILE		"/etc/icmpc.conf"
+/* The length of range fetched at once */
+#define ICMPC_FETCH_CHUNK		(4 * 1024 * 1024)
+
+static char *opt_conf_file;
+static char *opt_requestor;
+static uint64_t opt_handle;
+static uint64_t opt_offset;
+static uint64_t opt_length;
+static bool opt_release;
+
+/* The range fetched */
+typedef struct {
+	int error;
+	uint64_t total_length;
+	unsigned long length;
+} icmpc_fetch_t;
+
+static void
+show_usage(char *prog)
+{
+	info_cont("\nUsage: %s fetch <handle> <args>\n", prog);
+	info_cont("Read the stdout kept by \"%s commandline --spill\" on the "
+		  "monitoring container or essential.\n", prog);
+	info_cont("\nargs:\n");
+	info_cont("  --config-file, -c: (optional) Configuration file. "
+		  "The default is " ICMPC_DEFAULT_CONF_FILE ".\n");
+	info_cont("  --requestor, -r: (optional) Set the command "
+		  "requestor. The default is local.\n");
+	info_cont("  --offset, -o: (optional) Start reading at the offset. "
+		  "The default is 0.\n");
+	info_cont("  --length, -l: (optional) Read so many bytes only. The "
+		  "default is the rest of stdout.\n");
+	info_cont("  --release, -R: (optional) Release the stdout kept "
+		  "once read.\n");
+}
+
+static int
+parse_arg(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'c':
+		opt_conf_file = optarg;
+		break;
+	case 'r':
+		opt_requestor = optarg;
+		break;
+	case 'o':
+		opt_offset = strtoull(optarg, NULL, 0);
+		break;
+	case 'l':
+		opt_length = strtoull(optarg, NULL, 0);
+		break;
+	case 'R':
+		opt_release = 1;
+		break;
+	case 1:
+		opt_handle = strtoull(optarg, NULL, 0);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+handle_result(void *context, uint16_t cc, const void *data,
+	      unsigned long data_len)
+{
+	icmpc_fetch_t *fetch = context;
+	icmp_fetch_result_t result;
+
+	if (cc != ICMP_CC_FETCH || data_len < sizeof(result)) {
+		err("Unexpected response (cc 0x%x)\n", cc);
+		return -1;
+	}
+
+	eee_memcpy(&result, data, sizeof(result));
+	fetch->error = result.error;
+	fetch->total_length = result.total_length;
+	fetch->length = data_len - sizeof(result);
+
+	if (fetch->length) {
+		fwrite((const char *)data + sizeof(result), 1, fetch->length,
+		       stdout);
+		fflush(stdout);
+	}
+
+	return 0;
+}
+
+/* Fetch the range and write it to stdout */
+static int
+fetch_range(ic_transport_t tr, uint64_t offset, uint64_t length,
+	    uint32_t flags, icmpc_fetch_t *fetch)
+{
+	icmp_fetch_t req = {
+		.handle = opt_handle,
+		.offset = offset,
+		.length = length,
+		.flags = flags,
+	};
+	void *msg;
+	unsigned long msg_len;
+
+	int rc = icmp_marshal(&req, sizeof(req), ICMP_CC_FETCH, &msg,
+			      &msg_len);
+	if (rc) {
+		err("Failed to marshal ICMP request message\n");
+		return rc;
+	}
+
+	rc = ic_transport_send_data(tr, msg, msg_len);
+	eee_mfree(msg);
+	if (rc) {
+		err("Failed to send ICMP request message\n");
+		return rc;
+	}
+
+	msg = NULL;
+	msg_len = 0;
+	rc = ic_transport_receive_data(tr, &msg, &msg_len);
+	if (rc) {
+		err("Failed to receive ICMP response message\n");
+		return rc;
+	}
+
+	rc = icmp_unmarshal(msg, msg_len, ICMP_CC_FETCH, handle_result,
+			    fetch);
+	ic_transport_free_data(tr, msg);
+	if (rc) {
+		err("Failed to unmarshal ICMP response message\n");
+		return rc;
+	}
+
+	if (fetch->error) {
+		if (fetch->error == ESTALE)
+			err("The stdout 0x%llx is expired or released\n",
+			    (unsigned long long)opt_handle);
+		else
+			err("Unable to fetch the stdout 0x%llx: %s\n",
+			    (unsigned long long)opt_handle,
+			    strerror(fetch->error));
+		return EXIT_FAILURE;
+	}
+
+	return 0;
+}
+
+/* The daemon answers a long range partially, so fetch it chunk by
+ * chunk until the end of range or stdout.
+ */
+static int
+handle_protocol(const char *requestor)
+{
+	ic_transport_t tr = ic_transport_create_slave(requestor);
+	if (!tr)
+		return -1;
+
+	uint64_t offset = opt_offset;
+	uint64_t left = opt_length ? opt_length : UINT64_MAX;
+	icmpc_fetch_t fetch;
+	int rc;
+
+	do {
+		uint64_t len = left < ICMPC_FETCH_CHUNK ? left :
+			       ICMPC_FETCH_CHUNK;
+
+		rc = fetch_range(tr, offset, len, 0, &fetch);
+		if (rc)
+			goto out;
+
+		offset += fetch.length;
+		left -= fetch.length;
+	} while (fetch.length && left && offset < fetch.total_length);
+
+	if (opt_release)
+		rc = fetch_range(tr, 0, 0, ICMP_FETCH_RELEASE, &fetch);
+
+out:
+	ic_transport_destroy(tr);
+
+	return rc;
+}
+
+static int
+run_fetch(char *prog)
+{
+	int rc;
+
+	if (!opt_handle) {
+		err("No handle specified\n");
+		show_usage(prog);
+		return -1;
+	}
+
+	if (opt_conf_file) {
+		rc = ic_conf_file_parse(opt_conf_file);
+		if (rc < 0)
+			return rc;
+	}
+
+	return handle_protocol(opt_requestor ? opt_requestor : "local");
+}
+
+static struct option long_opts[] = {
+	{ "config-file", required_argument, NULL, 'c' },
+	{ "requestor", required_argument, NULL, 'r' },
+	{ "offset", required_argument, NULL, 'o' },
+	{ "length", required_argument, NULL, 'l' },
+	{ "release", no_argument, NULL, 'R' },
+	{ 0 },	/* NULL terminated */
+};
+
+subcommand_t subcommand_fetch = {
+	.name = "fetch",
+	.optstring = "-c:r:o:l:R",
+	.long_opts = long_opts,
+	.parse_arg = parse_arg,
+	.show_usage = show_usage,
+	.run = run_fetch,
+};
@@ -0,0 +1,102 @@
+/*
+ * ICMPC heartbeat sub-command
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#include <ic.h>
+
+#define ICMPC_DEFAULT_CONF_FILE		"/etc/icmpc.conf"
+
+static char *opt_conf_file;
+static char *opt_requestor;
+static unsigned int opt_timeout;
+
+static void
+show_usage(char *prog)
+{
+	info_cont("\nUsage: %s heartbeat <requestor> <args>\n", prog);
+	info_cont("Probe the liveness of the monitoring container or "
+		  "essential.\n");
+	info_cont("\nargs:\n");
+	info_cont("  --config-file, -c: (optional) Configuration file. "
+		  "The default is " ICMPC_DEFAULT_CONF_FILE ".\n");
+	info_cont("  --requestor, -r: (optional) Set the command "
+		  "requestor. The default is local.\n");
+	info_cont("  --timeout, -t: (optional) Timeout in milliseconds. "
+		  "The default is estimated from the round-trip time.\n");
+}
+
+static int
+parse_arg(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'c':
+		opt_conf_file = optarg;
+		break;
+	case 'r':
+	case 1:
+		opt_requestor = optarg;
+		break;
+	case 't':
+		opt_timeout = strtoul(optarg, NULL, 0);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+run_heartbeat(char *prog)
+{
+	int rc;
+
+	if (opt_conf_file) {
+		rc = ic_conf_file_parse(opt_conf_file);
+		if (rc < 0)
+			return rc;
+	}
+
+	const char *requestor = opt_requestor ? opt_requestor : "local";
+	ic_transport_t tr = ic_transport_create_slave(requestor);
+	if (!tr)
+		return -1;
+
+	rc = ic_transport_heartbeat(tr, opt_timeout);
+	if (!rc) {
+		ic_transport_stats_t stats;
+
+		ic_transport_get_stats(tr, IC_TRANSPORT_LANE_CONTROL, &stats);
+		info_cont("%s is alive (rtt %ld us, rto %ld ms)\n", requestor,
+			  stats.last_rtt, stats.rto / 1000);
+	} else
+		info_cont("%s is down\n", requestor);
+
+	ic_transport_destroy(tr);
+
+	return rc;
+}
+
+static struct option long_opts[] = {
+	{ "config-file", required_argument, NULL, 'c' },
+	{ "requestor", required_argument, NULL, 'r' },
+	{ "timeout", required_argument, NULL, 't' },
+	{ 0 },	/* NULL terminated */
+};
+
+subcommand_t subcommand_heartbeat = {
+	.name = "heartbeat",
+	.optstring = "-c:r:t:",
+	.long_opts = long_opts,
+	.parse_arg = parse_arg,
+	.show_usage = show_usage,
+	.run = run_heartbeat,
+};
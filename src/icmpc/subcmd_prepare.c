@@ -0,0 +1,185 @@
+/*
+ * ICMPC prepare sub-command
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#include <ic.h>
+
+#define ICMPC_DEFAULT_CONF_FILE		"/etc/icmpc.conf"
+
+static char *opt_conf_file;
+static char *opt_requestor;
+static char *opt_cmdline;
+static bool opt_pipeline;
+
+static void
+show_usage(char *prog)
+{
+	info_cont("\nUsage: %s prepare <commandline> <args>\n", prog);
+	info_cont("Validate the commandline once on the monitoring container "
+		  "or essential, and show the handle to run it with "
+		  "\"%s commandline --handle\".\n", prog);
+	info_cont("\nargs:\n");
+	info_cont("  --config-file, -c: (optional) Configuration file. "
+		  "The default is " ICMPC_DEFAULT_CONF_FILE ".\n");
+	info_cont("  --requestor, -r: (optional) Set the command "
+		  "requestor. The default is local.\n");
+	info_cont("  --pipeline, -p: (optional) A standalone | separates "
+		  "the stages of pipeline run without a shell. Otherwise it "
+		  "is an argument as it is.\n");
+	info_cont("\nThe handle becomes stale once the configuration of "
+		  "daemon is reloaded.\n");
+}
+
+static int
+parse_arg(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'c':
+		opt_conf_file = optarg;
+		break;
+	case 'r':
+		opt_requestor = optarg;
+		break;
+	case 'p':
+		opt_pipeline = 1;
+		break;
+	case 1:
+		opt_cmdline = optarg;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+handle_result(void *context, uint16_t cc, const void *data,
+	      unsigned long data_len)
+{
+	icmp_prepare_result_t *result = context;
+
+	if (cc != ICMP_CC_PREPARE || data_len < sizeof(*result)) {
+		err("Unexpected response (cc 0x%x)\n", cc);
+		return -1;
+	}
+
+	eee_memcpy(result, data, sizeof(*result));
+
+	return 0;
+}
+
+static int
+handle_protocol(const char *requestor)
+{
+	unsigned long cmdline_len = strlen(opt_cmdline) + 1;
+	unsigned long payload_len = cmdline_len;
+	if (opt_pipeline)
+		payload_len += icmp_option_size(0);
+
+	char *payload = eee_malloc(payload_len);
+	if (!payload)
+		return -1;
+
+	eee_memcpy(payload, opt_cmdline, cmdline_len);
+	if (opt_pipeline)
+		icmp_put_option(payload + cmdline_len, ICMP_OPT_PIPELINE, NULL,
+				0);
+
+	void *msg;
+	unsigned long msg_len;
+	int rc = icmp_marshal(payload, payload_len, ICMP_CC_PREPARE, &msg,
+			      &msg_len);
+	eee_mfree(payload);
+	if (rc) {
+		err("Failed to marshal ICMP request message\n");
+		return rc;
+	}
+
+	ic_transport_t tr = ic_transport_create_slave(requestor);
+	if (!tr) {
+		eee_mfree(msg);
+		return -1;
+	}
+
+	rc = ic_transport_send_data(tr, msg, msg_len);
+	eee_mfree(msg);
+	if (rc) {
+		err("Failed to send ICMP request message\n");
+		goto out;
+	}
+
+	msg = NULL;
+	msg_len = 0;
+	rc = ic_transport_receive_data(tr, &msg, &msg_len);
+	if (rc) {
+		err("Failed to receive ICMP response message\n");
+		goto out;
+	}
+
+	icmp_prepare_result_t result;
+
+	rc = icmp_unmarshal(msg, msg_len, ICMP_CC_PREPARE, handle_result,
+			    &result);
+	ic_transport_free_data(tr, msg);
+	if (rc) {
+		err("Failed to unmarshal ICMP response message\n");
+		goto out;
+	}
+
+	if (result.error) {
+		err("Unable to prepare %s: %s\n", opt_cmdline,
+		    strerror(result.error));
+		rc = EXIT_FAILURE;
+	} else
+		info_cont("0x%llx\n", (unsigned long long)result.handle);
+
+out:
+	ic_transport_destroy(tr);
+
+	return rc;
+}
+
+static int
+run_prepare(char *prog)
+{
+	int rc;
+
+	if (!opt_cmdline) {
+		err("No commandline specified\n");
+		show_usage(prog);
+		return -1;
+	}
+
+	if (opt_conf_file) {
+		rc = ic_conf_file_parse(opt_conf_file);
+		if (rc < 0)
+			return rc;
+	}
+
+	return handle_protocol(opt_requestor ? opt_requestor : "local");
+}
+
+static struct option long_opts[] = {
+	{ "config-file", required_argument, NULL, 'c' },
+	{ "requestor", required_argument, NULL, 'r' },
+	{ "pipeline", no_argument, NULL, 'p' },
+	{ 0 },	/* NULL terminated */
+};
+
+subcommand_t subcommand_prepare = {
+	.name = "prepare",
+	.optstring = "-c:r:p",
+	.long_opts = long_opts,
+	.parse_arg = parse_arg,
+	.show_usage = show_usage,
+	.run = run_prepare,
+};
@@ -0,0 +1,268 @@
+/*
+ * ICMPC session sub-command
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#include <ic.h>
+
+#define ICMPC_DEFAULT_CONF_FILE		"/etc/icmpc.conf"
+
+static char *opt_conf_file;
+static char *opt_requestor;
+static char *opt_script;
+static bool opt_exit_on_error;
+
+/* The response of session request */
+typedef struct {
+	int error;
+	/* The exit code of commandline */
+	int exit_code;
+} icmpc_session_response_t;
+
+static void
+show_usage(char *prog)
+{
+	info_cont("\nUsage: %s session <script> <args>\n", prog);
+	info_cont("Run the commandlines, one per line, in a shell kept on the "
+		  "monitoring container or essential.\n");
+	info_cont("\nargs:\n");
+	info_cont("  --config-file, -c: (optional) Configuration file. "
+		  "The default is " ICMPC_DEFAULT_CONF_FILE ".\n");
+	info_cont("  --requestor, -r: (optional) Set the command "
+		  "requestor. The default is local.\n");
+	info_cont("  --script, -f: Read the commandlines from the file, or "
+		  "stdin if it is -.\n");
+	info_cont("  --exit-on-error, -e: (optional) Stop at the first "
+		  "commandline failing.\n");
+	info_cont("\nThe exit code is the one of the last commandline.\n");
+}
+
+static int
+parse_arg(int opt, char *optarg)
+{
+	switch (opt) {
+	case 'c':
+		opt_conf_file = optarg;
+		break;
+	case 'r':
+		opt_requestor = optarg;
+		break;
+	case 'f':
+	case 1:
+		opt_script = optarg;
+		break;
+	case 'e':
+		opt_exit_on_error = 1;
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+handle_result(void *context, uint16_t cc, const void *data,
+	      unsigned long data_len)
+{
+	icmpc_session_response_t *resp = context;
+	icmp_session_result_t result;
+
+	if (cc != ICMP_CC_SESSION || data_len < sizeof(result)) {
+		err("Unexpected response (cc 0x%x)\n", cc);
+		return -1;
+	}
+
+	eee_memcpy(&result, data, sizeof(result));
+	resp->error = result.error;
+	if (result.error)
+		return 0;
+
+	data = (const char *)data + sizeof(result);
+	data_len -= sizeof(result);
+
+	icmp_exec_result_t exec_result;
+	if (icmp_find_exec_result(data, data_len, &exec_result))
+		return 0;
+
+	fwrite(data, 1, exec_result.stdout_length, stdout);
+	fflush(stdout);
+	fwrite((const char *)data + exec_result.stdout_length, 1,
+	       exec_result.stderr_length, stderr);
+	fflush(stderr);
+
+	if (exec_result.exit_code >= 0)
+		resp->exit_code = exec_result.exit_code;
+	else
+		resp->exit_code = 128 + exec_result.signal;
+
+	return 0;
+}
+
+static int
+request(ic_transport_t tr, uint64_t session_id, uint8_t op,
+	const char *cmdline, icmpc_session_response_t *resp)
+{
+	unsigned long cmdline_len = cmdline ? strlen(cmdline) + 1 : 0;
+	unsigned long payload_len = sizeof(icmp_session_t) + cmdline_len;
+	icmp_session_t *ses = eee_malloc(payload_len);
+	if (!ses)
+		return -1;
+
+	ses->session_id = session_id;
+	ses->op = op;
+	if (cmdline_len)
+		eee_memcpy(ses->data, cmdline, cmdline_len);
+
+	void *msg;
+	unsigned long msg_len;
+	int rc = icmp_marshal(ses, payload_len, ICMP_CC_SESSION, &msg,
+			      &msg_len);
+	eee_mfree(ses);
+	if (rc) {
+		err("Failed to marshal ICMP request message\n");
+		return rc;
+	}
+
+	rc = ic_transport_send_data(tr, msg, msg_len);
+	eee_mfree(msg);
+	if (rc) {
+		err("Failed to send ICMP request message\n");
+		return rc;
+	}
+
+	msg = NULL;
+	msg_len = 0;
+	rc = ic_transport_receive_data(tr, &msg, &msg_len);
+	if (rc) {
+		err("Failed to receive ICMP response message\n");
+		return rc;
+	}
+
+	resp->error = 0;
+	resp->exit_code = 0;
+	rc = icmp_unmarshal(msg, msg_len, ICMP_CC_SESSION, handle_result,
+			    resp);
+	ic_transport_free_data(tr, msg);
+	if (rc)
+		err("Failed to unmarshal ICMP response message\n");
+
+	return rc;
+}
+
+static int
+run_script(ic_transport_t tr, uint64_t session_id, FILE *script)
+{
+	icmpc_session_response_t resp;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	int exit_code = 0;
+
+	while ((len = getline(&line, &line_size, script)) >= 0) {
+		if (len && line[len - 1] == '\n')
+			line[--len] = 0;
+
+		/* Skip the blank lines */
+		if (!line[strspn(line, " \t")])
+			continue;
+
+		int rc = request(tr, session_id, ICMP_SESSION_EXEC, line,
+				 &resp);
+		if (rc) {
+			exit_code = rc;
+			break;
+		}
+
+		if (resp.error) {
+			err("Unable to run %s: %s\n", line,
+			    strerror(resp.error));
+			exit_code = EXIT_FAILURE;
+			break;
+		}
+
+		exit_code = resp.exit_code;
+		if (exit_code && opt_exit_on_error)
+			break;
+	}
+
+	free(line);
+
+	return exit_code;
+}
+
+static int
+run_session(char *prog)
+{
+	int rc;
+
+	if (opt_conf_file) {
+		rc = ic_conf_file_parse(opt_conf_file);
+		if (rc < 0)
+			return rc;
+	}
+
+	FILE *script = stdin;
+	if (opt_script && strcmp(opt_script, "-")) {
+		script = fopen(opt_script, "r");
+		if (!script) {
+			err("Unable to open %s: %s\n", opt_script,
+			    strerror(errno));
+			return -1;
+		}
+	}
+
+	const char *requestor = opt_requestor ? opt_requestor : "local";
+	ic_transport_t tr = ic_transport_create_slave(requestor);
+	if (!tr) {
+		if (script != stdin)
+			fclose(script);
+		return -1;
+	}
+
+	uint64_t session_id = ic_util_random();
+	icmpc_session_response_t resp;
+
+	rc = request(tr, session_id, ICMP_SESSION_OPEN, NULL, &resp);
+	if (!rc && resp.error) {
+		err("Unable to open the session: %s\n", strerror(resp.error));
+		rc = -1;
+	}
+
+	if (!rc) {
+		rc = run_script(tr, session_id, script);
+
+		/* The session is closed by the idle timeout anyway */
+		request(tr, session_id, ICMP_SESSION_CLOSE, NULL, &resp);
+	}
+
+	ic_transport_destroy(tr);
+	if (script != stdin)
+		fclose(script);
+
+	return rc;
+}
+
+static struct option long_opts[] = {
+	{ "config-file", required_argument, NULL, 'c' },
+	{ "requestor", required_argument, NULL, 'r' },
+	{ "script", required_argument, NULL, 'f' },
+	{ "exit-on-error", no_argument, NULL, 'e' },
+	{ 0 },	/* NULL terminated */
+};
+
+subcommand_t subcommand_session = {
+	.name = "session",
+	.optstring = "-c:r:f:e",
+	.long_opts = long_opts,
+	.parse_arg = parse_arg,
+	.show_usage = show_usage,
+	.run = run_session,
+};
@@ -0,0 +1,310 @@
+/*
+ * ICMPD batch
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The batch carries a list of commandlines in a single request, so the
+ * client pays for one round trip instead of one per commandline. Each
+ * commandline is authorized on its own. The commandlines granted are
+ * run as the commands of lane, at most .batch_parallel of them at the
+ * same time, and each one is still limited by its own timeout.
+ *
+ * The output of each commandline is appended to the response once it
+ * completes, as a record carrying the index of commandline, and the
+ * response is answered after the last one completes. The commandline
+ * denied or failing to run is answered by a record with the errno.
+ */
+
+#include "icmpd.h"
+
+static unsigned int
+batch_parallel(void)
+{
+	char *parallel = ic_conf_file_query(".batch_parallel");
+	if (!parallel)
+		return ICMPD_BATCH_PARALLEL;
+
+	unsigned long n = strtoul(parallel, NULL, 0);
+	eee_mfree(parallel);
+
+	if (!n)
+		return ICMPD_BATCH_PARALLEL;
+
+	return n < ICMPD_MAX_COMMANDS ? n : ICMPD_MAX_COMMANDS;
+}
+
+/* Answer the request with the error only */
+static int
+fail(icmpd_request_t *req, int error)
+{
+	icmp_batch_result_t result = {
+		.error = error,
+		.nr_command = 0,
+	};
+
+	return icmpd_send_response(req, ICMP_CC_BATCH, &result,
+				   sizeof(result));
+}
+
+/* Append the record of commandline completed to the response */
+void
+icmpd_batch_add(icmpd_batch_t *batch, unsigned int index, int error,
+		const void *out, unsigned long out_len, const void *err,
+		unsigned long err_len, const icmp_exec_result_t *result)
+{
+	if (batch->nr_running)
+		--batch->nr_running;
+	++batch->nr_done;
+
+	if (batch->error)
+		return;
+
+	icmp_batch_record_t record = {
+		.index = index,
+		.error = error,
+		.length = 0,
+	};
+
+	if (!error)
+		record.length = out_len + err_len + 1 + sizeof(*result);
+
+	char *p = icmpd_output_reserve(&batch->out,
+				       sizeof(record) + record.length);
+	if (!p) {
+		batch->error = ENOMEM;
+		return;
+	}
+
+	eee_memcpy(p, &record, sizeof(record));
+	if (error)
+		return;
+
+	p += sizeof(record);
+	if (out_len)
+		eee_memcpy(p, out, out_len);
+	p += out_len;
+	if (err_len)
+		eee_memcpy(p, err, err_len);
+	p += err_len;
+	*p++ = 0;
+	eee_memcpy(p, result, sizeof(*result));
+}
+
+static int
+send_result(icmpd_batch_t *batch)
+{
+	icmpd_output_t *out = &batch->out;
+	icmp_batch_result_t result = {
+		.error = 0,
+		.nr_command = batch->nr_command,
+	};
+
+	eee_memcpy(out->msg + out->offset, &result, sizeof(result));
+
+	/* The whole message is sent so trim the room not used */
+	unsigned long msg_len = out->offset + out->len;
+	char *msg = ic_transport_realloc_data(out->tr, out->msg, msg_len);
+	if (!msg)
+		return -1;
+	out->msg = NULL;
+
+	int rc = icmp_marshal_in_place(msg, msg_len, ICMP_CC_BATCH,
+				       msg + out->offset, out->len, &msg_len);
+	ic_assert(!rc, "Unable to marshal ICMP message");
+
+	rc = ic_transport_send_msg(batch->tr, msg, msg_len);
+	if (rc) {
+		err("Failed to send ICMP response message\n");
+		ic_transport_free_data(batch->tr, msg);
+		return rc;
+	}
+
+	dbg("%ld-byte ICMP response message sent to %s\n", msg_len,
+	    ic_transport_name(batch->tr));
+
+	return 0;
+}
+
+static void
+complete(icmpd_batch_t *batch)
+{
+	info("Batch of %u commandlines for %s completed\n",
+	     batch->nr_command, ic_transport_name(batch->tr));
+
+	ic_transport_reply_t reply = batch->reply;
+	batch->reply = 0;
+
+	if (ic_transport_restore_reply(batch->tr, reply))
+		return;
+
+	if (batch->error) {
+		icmpd_request_t req = {
+			.tr = batch->tr,
+			.msg = NULL,
+		};
+
+		fail(&req, batch->error);
+	} else
+		send_result(batch);
+}
+
+/*
+ * Accept the batch and authorize each commandline with check(). The
+ * commandlines granted are started by icmpd_batch_schedule() later.
+ */
+int
+icmpd_batch_start(icmpd_request_t *req, const void *payload,
+		  unsigned long payload_len,
+		  int (*check)(icmpd_request_t *, const char *,
+			       unsigned long))
+{
+	icmp_batch_t hdr;
+
+	if (payload_len < sizeof(hdr))
+		return fail(req, EINVAL);
+
+	eee_memcpy(&hdr, payload, sizeof(hdr));
+
+	const char *cmdlines = (const char *)payload + sizeof(hdr);
+	unsigned long len = payload_len - sizeof(hdr);
+
+	/* The commandlines must be terminated */
+	if (!len || cmdlines[len - 1])
+		return fail(req, EINVAL);
+
+	unsigned int nr_command = 0;
+	for (unsigned long i = 0; i < len; ++i) {
+		if (!cmdlines[i])
+			++nr_command;
+	}
+
+	if (nr_command > ICMPD_BATCH_MAX_COMMANDS)
+		return fail(req, E2BIG);
+
+	icmpd_batch_t *batch = eee_malloc(sizeof(*batch));
+	if (!batch)
+		return fail(req, ENOMEM);
+
+	batch->commandlines = eee_malloc(len);
+	batch->offsets = eee_malloc(nr_command * sizeof(*batch->offsets));
+	batch->pending = eee_malloc(nr_command * sizeof(*batch->pending));
+	if (!batch->commandlines || !batch->offsets || !batch->pending ||
+	    icmpd_output_init(&batch->out, req->tr,
+			      icmp_message_header_length(icmp_message_version()))) {
+		eee_mfree(batch->pending);
+		eee_mfree(batch->offsets);
+		eee_mfree(batch->commandlines);
+		eee_mfree(batch);
+		return fail(req, ENOMEM);
+	}
+
+	eee_memcpy(batch->commandlines, cmdlines, len);
+
+	batch->tr = req->tr;
+	batch->commands = req->commands;
+	batch->wake_fd = req->wake_fd;
+	batch->reply = 0;
+	batch->nr_command = nr_command;
+	batch->nr_pending = 0;
+	batch->next_pending = 0;
+	batch->nr_running = 0;
+	batch->nr_done = 0;
+	batch->parallel = batch_parallel();
+	if (hdr.parallel && hdr.parallel < batch->parallel)
+		batch->parallel = hdr.parallel;
+	batch->out.len = sizeof(icmp_batch_result_t);
+	batch->error = 0;
+
+	unsigned long offset = 0;
+	for (unsigned int i = 0; i < nr_command; ++i) {
+		const char *cmdline = batch->commandlines + offset;
+		unsigned long cmdline_len = strlen(cmdline) + 1;
+
+		batch->offsets[i] = offset;
+		offset += cmdline_len;
+
+		int error = 0;
+		if (!cmdline[strspn(cmdline, " \f\n\r\t\v")])
+			error = EINVAL;
+		else if (check(req, cmdline, cmdline_len))
+			error = ic_get_errno() == IC_ERRNO_COMMAND_DENIED ?
+				EACCES : EIO;
+
+		if (!error)
+			batch->pending[batch->nr_pending++] = i;
+		else
+			icmpd_batch_add(batch, i, error, NULL, 0, NULL, 0,
+					NULL);
+	}
+
+	dbg("Batch of %u commandlines accepted, %u granted, %u in "
+	    "parallel\n", nr_command, batch->nr_pending, batch->parallel);
+
+	batch->reply = ic_transport_save_reply(req->tr);
+	bcll_add_tail(req->batches, &batch->link);
+
+	return 0;
+}
+
+/*
+ * Start the pending commandlines as long as the batch and the lane have
+ * room for them. The number of commands in the lane is updated. Return 1
+ * if the batch is completed and answered, or 0 if it is still running.
+ */
+int
+icmpd_batch_schedule(icmpd_batch_t *batch, unsigned int *nr_command)
+{
+	icmpd_request_t req = {
+		.tr = batch->tr,
+		.msg = NULL,
+		.msg_len = 0,
+		.commands = batch->commands,
+		.sessions = NULL,
+		.batches = NULL,
+		.wake_fd = batch->wake_fd,
+	};
+
+	while (batch->next_pending < batch->nr_pending &&
+	       batch->nr_running < batch->parallel &&
+	       *nr_command < ICMPD_MAX_COMMANDS) {
+		unsigned int index = batch->pending[batch->next_pending++];
+		const char *cmdline = batch->commandlines +
+				      batch->offsets[index];
+
+		/* The command failing to spawn is answered right away */
+		++batch->nr_running;
+		if (icmpd_command_start(&req, cmdline, strlen(cmdline) + 1,
+					batch, index))
+			icmpd_batch_add(batch, index, ENOMEM, NULL, 0, NULL, 0,
+					NULL);
+		else
+			++*nr_command;
+	}
+
+	if (batch->nr_done < batch->nr_command)
+		return 0;
+
+	complete(batch);
+
+	return 1;
+}
+
+/* The commands of batch must be destroyed already */
+void
+icmpd_batch_destroy(icmpd_batch_t *batch)
+{
+	ic_transport_drop_reply(batch->tr, batch->reply);
+	icmpd_output_destroy(&batch->out);
+	eee_mfree(batch->pending);
+	eee_mfree(batch->offsets);
+	eee_mfree(batch->commandlines);
+	eee_mfree(batch);
+}
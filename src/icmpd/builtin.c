@@ -0,0 +1,498 @@
+/*
+ * ICMPD built-in operations
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The frequent queries, such as reading /proc, listing a directory or
+ * checking the disk usage, are served by the daemon itself instead of
+ * spawning cat, ls or df. The result is returned in the compact form
+ * defined in icmp.h, and it is built right behind the header of the
+ * response message like the output of command.
+ *
+ * Each operation is authorized with the name of command it replaces, so
+ * .<container>.commands and .commands.<command>.acl apply to it as well.
+ *
+ * The files read by ICMP_BUILTIN_PROC are confined to /proc. The magic
+ * links, e.g, <pid>/root or <pid>/fd/<n>, lead out of it, so the
+ * components giving them are refused, and openat2() refuses any other
+ * magic link or path escaping /proc if the kernel supports it.
+ */
+
+#include "icmpd.h"
+
+/* The largest file to read */
+#define ICMPD_BUILTIN_MAX_READ		(16 * 1024 * 1024)
+/* The size to read at once if the size of file is unknown, e.g, /proc */
+#define ICMPD_BUILTIN_READ_CHUNK	4096
+
+typedef struct {
+	/* The command replaced by the operation */
+	const char *command;
+	int (*run)(icmpd_output_t *out, const char *args,
+		   unsigned long args_len);
+} builtin_op_t;
+
+/* Return the next argument, or NULL at the end of arguments */
+static const char *
+next_argument(const char **args, unsigned long *args_len)
+{
+	if (!*args_len)
+		return NULL;
+
+	const char *arg = *args;
+	unsigned long len = strlen(arg) + 1;
+
+	*args += len;
+	*args_len -= len;
+
+	return arg;
+}
+
+static int
+read_fd(icmpd_output_t *out, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	if (!S_ISREG(st.st_mode)) {
+		errno = S_ISDIR(st.st_mode) ? EISDIR : EINVAL;
+		return -1;
+	}
+
+	if (st.st_size > ICMPD_BUILTIN_MAX_READ) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	/* Read one more byte to hit the end of file with a single read */
+	unsigned long chunk = st.st_size ? st.st_size + 1 :
+			      ICMPD_BUILTIN_READ_CHUNK;
+	unsigned long total = 0;
+
+	while (1) {
+		char *p = icmpd_output_reserve(out, chunk);
+		if (!p)
+			return -1;
+
+		ssize_t sz = read(fd, p, chunk);
+		out->len -= chunk - (sz > 0 ? sz : 0);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -1;
+		}
+
+		if (!sz)
+			return 0;
+
+		total += sz;
+		if (total > ICMPD_BUILTIN_MAX_READ) {
+			errno = EFBIG;
+			return -1;
+		}
+
+		if (chunk < ICMPD_BUILTIN_READ_CHUNK)
+			chunk = ICMPD_BUILTIN_READ_CHUNK;
+	}
+}
+
+/* The components of /proc giving the magic links to anywhere */
+static const char *magic_components[] = {
+	"root", "cwd", "exe", "fd", "map_files", "ns",
+};
+
+static bool
+has_magic_component(const char *path)
+{
+	while (*path) {
+		unsigned long len = strcspn(path, "/");
+
+		for (unsigned int i = 0; i < sizeof(magic_components) /
+					     sizeof(magic_components[0]); ++i) {
+			if (strlen(magic_components[i]) == len &&
+			    !strncmp(path, magic_components[i], len))
+				return 1;
+		}
+
+		path += len;
+		path += strspn(path, "/");
+	}
+
+	return 0;
+}
+
+/* Open the path without leaving the directory */
+static int
+open_beneath(int dir_fd, const char *path, int flags)
+{
+	if (path[0] == '/' || strstr(path, "..") ||
+	    has_magic_component(path)) {
+		errno = EPERM;
+		return -1;
+	}
+
+#ifdef SYS_openat2
+	struct open_how how = {
+		.flags = flags,
+		.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+	};
+
+	int fd = syscall(SYS_openat2, dir_fd, path, &how, sizeof(how));
+	if (fd >= 0 || errno != ENOSYS)
+		return fd;
+#endif
+
+	return openat(dir_fd, path, flags);
+}
+
+/* Don't block the lane on a fifo or device */
+#define READ_FLAGS		(O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY)
+
+static int
+read_file(icmpd_output_t *out, int dir_fd, const char *path, bool beneath)
+{
+	int fd = beneath ? open_beneath(dir_fd, path, READ_FLAGS) :
+			   openat(dir_fd, path, READ_FLAGS);
+	if (fd < 0)
+		return -1;
+
+	int rc = read_fd(out, fd);
+	int error = errno;
+
+	close(fd);
+	errno = error;
+
+	return rc;
+}
+
+static int
+builtin_read(icmpd_output_t *out, const char *args, unsigned long args_len)
+{
+	const char *path = next_argument(&args, &args_len);
+	if (!path || args_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return read_file(out, AT_FDCWD, path, 0);
+}
+
+static int
+builtin_proc(icmpd_output_t *out, const char *args, unsigned long args_len)
+{
+	int proc_fd = open("/proc", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (proc_fd < 0)
+		return -1;
+
+	const char *path;
+
+	while ((path = next_argument(&args, &args_len))) {
+		unsigned long start = out->len;
+
+		if (!icmpd_output_reserve(out, sizeof(icmp_builtin_record_t))) {
+			close(proc_fd);
+			return -1;
+		}
+
+		icmp_builtin_record_t record = {
+			.error = 0,
+		};
+
+		if (read_file(out, proc_fd, path, 1)) {
+			record.error = errno;
+			out->len = start + sizeof(record);
+		}
+
+		record.length = out->len - start - sizeof(record);
+		eee_memcpy(out->msg + out->offset + start, &record,
+			   sizeof(record));
+	}
+
+	close(proc_fd);
+
+	return 0;
+}
+
+static int
+builtin_stat(icmpd_output_t *out, const char *args, unsigned long args_len)
+{
+	const char *path;
+
+	while ((path = next_argument(&args, &args_len))) {
+		icmp_builtin_stat_t *result;
+
+		result = icmpd_output_reserve(out, sizeof(*result));
+		if (!result)
+			return -1;
+
+		struct stat st;
+
+		/* Report the symbolic link itself like stat does */
+		if (fstatat(AT_FDCWD, path, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+			eee_memset(result, 0, sizeof(*result));
+			result->error = errno;
+			continue;
+		}
+
+		result->error = 0;
+		result->mode = st.st_mode;
+		result->uid = st.st_uid;
+		result->gid = st.st_gid;
+		result->size = st.st_size;
+		result->ino = st.st_ino;
+		result->nlink = st.st_nlink;
+		result->mtime = st.st_mtim.tv_sec * 1000000000ULL +
+				st.st_mtim.tv_nsec;
+	}
+
+	return 0;
+}
+
+static int
+builtin_list(icmpd_output_t *out, const char *args, unsigned long args_len)
+{
+	const char *path = next_argument(&args, &args_len);
+	if (!path || args_len) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	DIR *dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	struct dirent *ent;
+	int rc = 0;
+
+	while (1) {
+		errno = 0;
+		ent = readdir(dir);
+		if (!ent) {
+			if (errno)
+				rc = -1;
+			break;
+		}
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		unsigned long len = strlen(ent->d_name) + 1;
+		uint8_t *p = icmpd_output_reserve(out, 1 + len);
+		if (!p) {
+			rc = -1;
+			break;
+		}
+
+		*p = ent->d_type;
+		eee_memcpy(p + 1, ent->d_name, len);
+	}
+
+	int error = errno;
+	closedir(dir);
+	errno = error;
+
+	return rc;
+}
+
+static int
+builtin_statfs(icmpd_output_t *out, const char *args, unsigned long args_len)
+{
+	const char *path;
+
+	while ((path = next_argument(&args, &args_len))) {
+		icmp_builtin_statfs_t *result;
+
+		result = icmpd_output_reserve(out, sizeof(*result));
+		if (!result)
+			return -1;
+
+		struct statvfs st;
+
+		if (statvfs(path, &st) < 0) {
+			eee_memset(result, 0, sizeof(*result));
+			result->error = errno;
+			continue;
+		}
+
+		result->error = 0;
+		result->block_size = st.f_frsize;
+		result->blocks = st.f_blocks;
+		result->blocks_free = st.f_bfree;
+		result->blocks_avail = st.f_bavail;
+		result->files = st.f_files;
+		result->files_free = st.f_ffree;
+	}
+
+	return 0;
+}
+
+static int
+builtin_sysinfo(icmpd_output_t *out, const char *args,
+		unsigned long args_len)
+{
+	struct sysinfo si;
+
+	if (sysinfo(&si) < 0)
+		return -1;
+
+	icmp_builtin_sysinfo_t *result;
+
+	result = icmpd_output_reserve(out, sizeof(*result));
+	if (!result)
+		return -1;
+
+	uint64_t unit = si.mem_unit ? si.mem_unit : 1;
+
+	result->uptime = si.uptime;
+	for (int i = 0; i < 3; ++i)
+		result->loads[i] = si.loads[i];
+	result->total_ram = si.totalram * unit;
+	result->free_ram = si.freeram * unit;
+	result->shared_ram = si.sharedram * unit;
+	result->buffer_ram = si.bufferram * unit;
+	result->total_swap = si.totalswap * unit;
+	result->free_swap = si.freeswap * unit;
+	result->procs = si.procs;
+	result->nr_cpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return 0;
+}
+
+static int
+builtin_cache(icmpd_output_t *out, const char *args,
+	      unsigned long args_len)
+{
+	icmp_builtin_cache_t *result;
+
+	result = icmpd_output_reserve(out, sizeof(*result));
+	if (!result)
+		return -1;
+
+	icmpd_cache_stats(result);
+
+	return 0;
+}
+
+static builtin_op_t builtin_ops[ICMP_MAX_BUILTIN] = {
+	[ICMP_BUILTIN_READ] = { "cat", builtin_read },
+	[ICMP_BUILTIN_STAT] = { "stat", builtin_stat },
+	[ICMP_BUILTIN_LIST] = { "ls", builtin_list },
+	[ICMP_BUILTIN_PROC] = { "cat", builtin_proc },
+	[ICMP_BUILTIN_STATFS] = { "df", builtin_statfs },
+	[ICMP_BUILTIN_SYSINFO] = { "sysinfo", builtin_sysinfo },
+	[ICMP_BUILTIN_CACHE] = { "cache", builtin_cache },
+};
+
+/* Return the operation requested, or NULL if the request is malformed */
+static builtin_op_t *
+find_op(const void *payload, unsigned long payload_len)
+{
+	if (payload_len < sizeof(icmp_builtin_t))
+		return NULL;
+
+	icmp_builtin_t req;
+	eee_memcpy(&req, payload, sizeof(req));
+	if (req.op >= ICMP_MAX_BUILTIN)
+		return NULL;
+
+	/* The arguments must be terminated */
+	payload_len -= sizeof(req);
+	if (payload_len && ((const char *)payload)[sizeof(req) +
+						   payload_len - 1])
+		return NULL;
+
+	return builtin_ops + req.op;
+}
+
+/* Return the command replaced by the operation for the authorization,
+ * or NULL if the request is malformed.
+ */
+const char *
+icmpd_builtin_command(const void *payload, unsigned long payload_len)
+{
+	builtin_op_t *op = find_op(payload, payload_len);
+
+	return op ? op->command : NULL;
+}
+
+static int
+send_result(icmpd_request_t *req, icmpd_output_t *out)
+{
+	/* The whole message is sent so trim the room not used */
+	unsigned long msg_len = out->offset + out->len;
+	char *msg = ic_transport_realloc_data(out->tr, out->msg, msg_len);
+	if (!msg)
+		return -1;
+	out->msg = NULL;
+
+	int rc = icmp_marshal_in_place(msg, msg_len, ICMP_CC_BUILTIN,
+				       msg + out->offset, out->len, &msg_len);
+	ic_assert(!rc, "Unable to marshal ICMP message");
+
+	rc = ic_transport_send_msg(req->tr, msg, msg_len);
+	if (rc) {
+		err("Failed to send ICMP response message\n");
+		ic_transport_free_data(req->tr, msg);
+		return rc;
+	}
+
+	dbg("%ld-byte ICMP response message sent to %s\n", msg_len,
+	    ic_transport_name(req->tr));
+
+	return 0;
+}
+
+/* Answer the request with the error only */
+int
+icmpd_builtin_fail(icmpd_request_t *req, int error)
+{
+	icmp_builtin_result_t result = {
+		.error = error,
+	};
+
+	return icmpd_send_response(req, ICMP_CC_BUILTIN, &result,
+				   sizeof(result));
+}
+
+int
+icmpd_builtin_run(icmpd_request_t *req, const void *payload,
+		  unsigned long payload_len)
+{
+	builtin_op_t *op = find_op(payload, payload_len);
+	if (!op)
+		return icmpd_builtin_fail(req, EINVAL);
+
+	icmpd_output_t out;
+	int rc = icmpd_output_init(&out, req->tr,
+				   icmp_message_header_length(icmp_message_version()));
+	if (rc)
+		return icmpd_builtin_fail(req, ENOMEM);
+
+	icmp_builtin_result_t result = {
+		.error = 0,
+	};
+
+	out.len = sizeof(result);
+	if (op->run(&out, (const char *)payload + sizeof(icmp_builtin_t),
+		    payload_len - sizeof(icmp_builtin_t))) {
+		result.error = errno ? errno : EIO;
+		out.len = sizeof(result);
+	}
+
+	eee_memcpy(out.msg + out.offset, &result, sizeof(result));
+
+	rc = send_result(req, &out);
+	icmpd_output_destroy(&out);
+
+	return rc;
+}
@@ -0,0 +1,558 @@
+/*
+ * ICMPD result cache
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * Each monitored container is served by its own worker, so the facts of
+ * host polled by all containers would be computed by every worker. The
+ * output of the command configured with .commands.<command>.cache_ttl,
+ * in milliseconds, is kept for so long in the area mapped before the
+ * workers are forked, and the identical requests of any worker are
+ * answered from it without running the command.
+ *
+ * The area is a memfd holding the header, the hash buckets and the slab
+ * of fixed-size chunks. An entry takes a chain of chunks holding its
+ * header, the key, the stdout and the stderr. The chunks never used are
+ * taken in order so the pages are only touched once needed, and the
+ * chunks of entry dropped go back to the free list. The least recently
+ * used entries are evicted once the free chunks run short, so the cache
+ * never takes more than .cache_budget in bytes.
+ *
+ * The area is protected by a robust mutex shared by the workers. If a
+ * worker dies holding it, the cache is emptied since the entries may be
+ * inconsistent.
+ */
+
+#include "icmpd.h"
+
+#define CACHE_CHUNK_SIZE		1024
+/* The index of no chunk */
+#define CACHE_NIL			UINT32_MAX
+
+typedef struct {
+	/* The next chunk of entry, or the next free chunk */
+	uint32_t next;
+	uint32_t reserved;
+	uint8_t data[CACHE_CHUNK_SIZE - 2 * sizeof(uint32_t)];
+} cache_chunk_t;
+
+/* Placed at the start of the first chunk of entry, which is the index
+ * of entry.
+ */
+typedef struct {
+	/* The next entry in the bucket */
+	uint32_t hash_next;
+	/* The neighbours in the order of use */
+	uint32_t lru_prev;
+	uint32_t lru_next;
+	uint32_t nr_chunk;
+	uint64_t hash;
+	/* In ms of CLOCK_MONOTONIC shared by the workers */
+	uint64_t expire_time;
+	uint32_t key_len;
+	uint32_t out_len;
+	uint32_t err_len;
+	uint32_t reserved;
+	icmp_exec_result_t result;
+} cache_entry_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	uint32_t nr_bucket;
+	uint32_t nr_chunk;
+	/* The chunks taken from the slab so far */
+	uint32_t nr_used;
+	uint32_t nr_free;
+	uint32_t free_chunk;
+	/* The least recently used entry first */
+	uint32_t lru_head;
+	uint32_t lru_tail;
+	uint32_t nr_entry;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stores;
+	uint64_t evictions;
+	uint64_t expirations;
+} cache_header_t;
+
+/* The position in the chain of chunks */
+typedef struct {
+	uint32_t chunk;
+	unsigned long offset;
+} cursor_t;
+
+static cache_header_t *cache;
+static uint32_t *buckets;
+static cache_chunk_t *chunks;
+
+static uint64_t
+hash_key(const void *key, unsigned long key_len)
+{
+	const uint8_t *p = key;
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (key_len--) {
+		h ^= *p++;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static cache_entry_t *
+entry_of(uint32_t id)
+{
+	return (cache_entry_t *)chunks[id].data;
+}
+
+/* Drop all entries but keep the statistics */
+static void
+reset(void)
+{
+	for (uint32_t i = 0; i < cache->nr_bucket; ++i)
+		buckets[i] = CACHE_NIL;
+
+	cache->nr_used = 0;
+	cache->nr_free = cache->nr_chunk;
+	cache->free_chunk = CACHE_NIL;
+	cache->lru_head = CACHE_NIL;
+	cache->lru_tail = CACHE_NIL;
+	cache->nr_entry = 0;
+}
+
+static void
+lock_cache(void)
+{
+	if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+		warn("Emptying the result cache left by a dead worker\n");
+		reset();
+		pthread_mutex_consistent(&cache->lock);
+	}
+}
+
+static void
+unlock_cache(void)
+{
+	pthread_mutex_unlock(&cache->lock);
+}
+
+static uint32_t
+alloc_chunk(void)
+{
+	uint32_t i = cache->free_chunk;
+
+	if (i != CACHE_NIL)
+		cache->free_chunk = chunks[i].next;
+	else
+		i = cache->nr_used++;
+
+	--cache->nr_free;
+
+	return i;
+}
+
+static void
+cursor_init(cursor_t *cur, uint32_t id)
+{
+	cur->chunk = id;
+	cur->offset = sizeof(cache_entry_t);
+}
+
+/* Copy len bytes from (to if write) the chain of chunks */
+static void
+cursor_copy(cursor_t *cur, void *buf, unsigned long len, bool write)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		if (cur->offset == sizeof(chunks->data)) {
+			cur->chunk = chunks[cur->chunk].next;
+			cur->offset = 0;
+		}
+
+		unsigned long n = sizeof(chunks->data) - cur->offset;
+		if (n > len)
+			n = len;
+
+		if (write)
+			eee_memcpy(chunks[cur->chunk].data + cur->offset, p, n);
+		else
+			eee_memcpy(p, chunks[cur->chunk].data + cur->offset, n);
+
+		cur->offset += n;
+		p += n;
+		len -= n;
+	}
+}
+
+static void
+cursor_skip(cursor_t *cur, unsigned long len)
+{
+	cur->offset += len;
+
+	while (cur->offset > sizeof(chunks->data)) {
+		cur->offset -= sizeof(chunks->data);
+		cur->chunk = chunks[cur->chunk].next;
+	}
+}
+
+static bool
+cursor_equal(cursor_t *cur, const void *buf, unsigned long len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		if (cur->offset == sizeof(chunks->data)) {
+			cur->chunk = chunks[cur->chunk].next;
+			cur->offset = 0;
+		}
+
+		unsigned long n = sizeof(chunks->data) - cur->offset;
+		if (n > len)
+			n = len;
+
+		if (memcmp(chunks[cur->chunk].data + cur->offset, p, n))
+			return 0;
+
+		cur->offset += n;
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+static void
+lru_unlink(uint32_t id)
+{
+	cache_entry_t *entry = entry_of(id);
+
+	if (entry->lru_prev != CACHE_NIL)
+		entry_of(entry->lru_prev)->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+
+	if (entry->lru_next != CACHE_NIL)
+		entry_of(entry->lru_next)->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void
+lru_add_tail(uint32_t id)
+{
+	cache_entry_t *entry = entry_of(id);
+
+	entry->lru_prev = cache->lru_tail;
+	entry->lru_next = CACHE_NIL;
+
+	if (cache->lru_tail != CACHE_NIL)
+		entry_of(cache->lru_tail)->lru_next = id;
+	else
+		cache->lru_head = id;
+
+	cache->lru_tail = id;
+}
+
+static void
+remove_entry(uint32_t id)
+{
+	cache_entry_t *entry = entry_of(id);
+	uint32_t *link = buckets + (entry->hash & (cache->nr_bucket - 1));
+
+	while (*link != id)
+		link = &entry_of(*link)->hash_next;
+	*link = entry->hash_next;
+
+	lru_unlink(id);
+
+	for (uint32_t i = 0, next; i < entry->nr_chunk; ++i, id = next) {
+		next = chunks[id].next;
+		chunks[id].next = cache->free_chunk;
+		cache->free_chunk = id;
+	}
+
+	cache->nr_free += entry->nr_chunk;
+	--cache->nr_entry;
+}
+
+static uint32_t
+find_entry(uint64_t hash, const void *key, unsigned long key_len)
+{
+	uint32_t id = buckets[hash & (cache->nr_bucket - 1)];
+
+	for (; id != CACHE_NIL; id = entry_of(id)->hash_next) {
+		cache_entry_t *entry = entry_of(id);
+		cursor_t cur;
+
+		if (entry->hash != hash || entry->key_len != key_len)
+			continue;
+
+		cursor_init(&cur, id);
+		if (cursor_equal(&cur, key, key_len))
+			break;
+	}
+
+	return id;
+}
+
+/* Map the cache before the workers are forked. The cache is disabled if
+ * .cache_budget is 0.
+ */
+int
+icmpd_cache_init(void)
+{
+	unsigned long budget = ICMPD_CACHE_BUDGET;
+	char *s = ic_conf_file_query(".cache_budget");
+
+	if (s) {
+		budget = strtoul(s, NULL, 0);
+		eee_mfree(s);
+	}
+
+	unsigned long nr_chunk = budget / sizeof(cache_chunk_t);
+	if (!nr_chunk)
+		return 0;
+
+	if (nr_chunk >= CACHE_NIL)
+		nr_chunk = CACHE_NIL - 1;
+
+	unsigned long nr_bucket = 16;
+	while (nr_bucket < nr_chunk / 2)
+		nr_bucket <<= 1;
+
+	/* The slab is aligned to the chunk */
+	unsigned long slab_offset = sizeof(cache_header_t) +
+				    sizeof(uint32_t) * nr_bucket;
+	slab_offset = (slab_offset + CACHE_CHUNK_SIZE - 1) &
+		      ~(CACHE_CHUNK_SIZE - 1UL);
+
+	unsigned long size = slab_offset + sizeof(cache_chunk_t) * nr_chunk;
+	int fd = -1;
+
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "icmpd-cache", MFD_CLOEXEC);
+	if (fd >= 0 && ftruncate(fd, size) < 0) {
+		close(fd);
+		fd = -1;
+	}
+#endif
+
+	void *area = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			  fd >= 0 ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS,
+			  fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (area == MAP_FAILED) {
+		err("Unable to map the result cache of %ld bytes: %s\n",
+		    size, strerror(errno));
+		return -1;
+	}
+
+	cache = area;
+	buckets = (uint32_t *)(cache + 1);
+	chunks = (cache_chunk_t *)((char *)area + slab_offset);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&cache->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	cache->nr_bucket = nr_bucket;
+	cache->nr_chunk = nr_chunk;
+	reset();
+
+	info("Result cache of %ld bytes created\n", size);
+
+	return 0;
+}
+
+/* Return the time to keep the output of argv[] in ms, or 0 if it isn't
+ * kept. Every stage of pipeline has to be configured, and the shortest
+ * time applies.
+ */
+unsigned long
+icmpd_cache_ttl(char **argv)
+{
+	bool stage_start = 1;
+	unsigned long ttl = ULONG_MAX;
+
+	if (!cache || !argv[0])
+		return 0;
+
+	for (char **arg = argv; *arg && ttl; ++arg) {
+		if (*arg == ICMP_PIPE) {
+			stage_start = 1;
+			continue;
+		}
+
+		if (stage_start) {
+			char *s = ic_conf_file_query(".commands.%s.cache_ttl",
+						     *arg);
+			unsigned long ms = s ? strtoul(s, NULL, 0) : 0;
+
+			eee_mfree(s);
+			if (ms < ttl)
+				ttl = ms;
+		}
+
+		stage_start = 0;
+	}
+
+	return ttl;
+}
+
+/* Answer the output of request from the cache. Return 1 if the output
+ * and the result of command are filled, or 0 if the command has to run.
+ */
+int
+icmpd_cache_lookup(const void *key, unsigned long key_len,
+		   icmpd_output_t *out, icmpd_output_t *err,
+		   icmp_exec_result_t *result)
+{
+	if (!cache)
+		return 0;
+
+	uint64_t hash = hash_key(key, key_len);
+
+	lock_cache();
+
+	uint32_t id = find_entry(hash, key, key_len);
+	if (id != CACHE_NIL &&
+	    entry_of(id)->expire_time <= ic_util_time_ms()) {
+		remove_entry(id);
+		++cache->expirations;
+		id = CACHE_NIL;
+	}
+
+	if (id == CACHE_NIL) {
+		++cache->misses;
+		unlock_cache();
+		return 0;
+	}
+
+	cache_entry_t *entry = entry_of(id);
+	char *out_p = icmpd_output_reserve(out, entry->out_len);
+	char *err_p = out_p ? icmpd_output_reserve(err, entry->err_len) :
+		      NULL;
+	if (!err_p) {
+		if (out_p)
+			out->len -= entry->out_len;
+		++cache->misses;
+		unlock_cache();
+		return 0;
+	}
+
+	cursor_t cur;
+	cursor_init(&cur, id);
+	cursor_skip(&cur, entry->key_len);
+	cursor_copy(&cur, out_p, entry->out_len, 0);
+	cursor_copy(&cur, err_p, entry->err_len, 0);
+	eee_memcpy(result, &entry->result, sizeof(*result));
+
+	lru_unlink(id);
+	lru_add_tail(id);
+	++cache->hits;
+
+	unlock_cache();
+
+	return 1;
+}
+
+/* Keep the output of request for ttl ms. The output taking much of the
+ * cache isn't kept in order not to evict everything else.
+ */
+void
+icmpd_cache_store(const void *key, unsigned long key_len, unsigned long ttl,
+		  const void *out, unsigned long out_len, const void *err,
+		  unsigned long err_len, const icmp_exec_result_t *result)
+{
+	if (!cache)
+		return;
+
+	unsigned long len = sizeof(cache_entry_t) + key_len + out_len +
+			    err_len;
+	unsigned long nr_chunk = (len + sizeof(chunks->data) - 1) /
+				 sizeof(chunks->data);
+	if (nr_chunk > cache->nr_chunk / 8)
+		return;
+
+	uint64_t hash = hash_key(key, key_len);
+
+	lock_cache();
+
+	uint32_t id = find_entry(hash, key, key_len);
+	if (id != CACHE_NIL)
+		remove_entry(id);
+
+	while (cache->nr_free < nr_chunk) {
+		remove_entry(cache->lru_head);
+		++cache->evictions;
+	}
+
+	id = alloc_chunk();
+	for (uint32_t i = 1, prev = id; i < nr_chunk; ++i) {
+		uint32_t next = alloc_chunk();
+
+		chunks[prev].next = next;
+		prev = next;
+	}
+
+	cache_entry_t *entry = entry_of(id);
+	uint32_t *bucket = buckets + (hash & (cache->nr_bucket - 1));
+
+	entry->hash_next = *bucket;
+	*bucket = id;
+	entry->nr_chunk = nr_chunk;
+	entry->hash = hash;
+	entry->expire_time = ic_util_time_ms() + ttl;
+	entry->key_len = key_len;
+	entry->out_len = out_len;
+	entry->err_len = err_len;
+	eee_memcpy(&entry->result, result, sizeof(*result));
+
+	cursor_t cur;
+	cursor_init(&cur, id);
+	cursor_copy(&cur, (void *)key, key_len, 1);
+	cursor_copy(&cur, (void *)out, out_len, 1);
+	cursor_copy(&cur, (void *)err, err_len, 1);
+
+	lru_add_tail(id);
+	++cache->nr_entry;
+	++cache->stores;
+
+	unlock_cache();
+}
+
+void
+icmpd_cache_stats(icmp_builtin_cache_t *stats)
+{
+	eee_memset(stats, 0, sizeof(*stats));
+
+	if (!cache)
+		return;
+
+	lock_cache();
+
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->stores = cache->stores;
+	stats->evictions = cache->evictions;
+	stats->expirations = cache->expirations;
+	stats->used = (uint64_t)(cache->nr_chunk - cache->nr_free) *
+		      sizeof(cache_chunk_t);
+	stats->budget = (uint64_t)cache->nr_chunk * sizeof(cache_chunk_t);
+	stats->entries = cache->nr_entry;
+
+	unlock_cache();
+}
@@ -0,0 +1,949 @@
+/*
+ * ICMPD asynchronous command
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The command runs asynchronously in the event loop of lane. The output,
+ * the stdin stream and the exit of child are all watched with poll(),
+ * where the exit is signaled by the socket from zygote or the pidfd of
+ * child. The requestor is saved once the command is started, and the
+ * output is answered to it after the child exits and its output ends.
+ *
+ * The command is terminated with SIGTERM if it runs longer than the
+ * timeout configured with .commands.<command>.timeout, or the global
+ * .command_timeout, in milliseconds. It is killed with SIGKILL if it is
+ * still alive ICMPD_KILL_GRACE later. The signals are sent to the whole
+ * process group led by the child.
+ *
+ * The stdout and stderr are captured separately. Once the command
+ * completes, the stderr is appended to the stdout in the response, which
+ * ends with icmp_exec_result_t reporting the exit status and the resource
+ * usage of command.
+ *
+ * The command with the request id chosen by the client is registered so
+ * that ICMP_CC_CANCEL, served by the control lane, can find it. The lane
+ * is woken up to kill the command and free its output right away. The
+ * client may also lease the request. If the client is gone and the lease
+ * is not renewed by the heartbeat in time, the command is cancelled as
+ * well.
+ *
+ * The command started for a batch answers its output to the batch,
+ * which collects the outputs into a single response.
+ *
+ * The stdout may be spilled to be fetched later, or answered as the
+ * delta against the one kept by the client, as requested by the options.
+ *
+ * The command configured with .commands.<command>.idempotent: yes is
+ * shared with the identical requests running at the same time in any
+ * worker, all of which are granted already, so the thundering herd of
+ * pollers spawns it once. Its output is read after it exits. Giving up
+ * the command shared only detaches from it, while the timeout still
+ * terminates it for all.
+ *
+ * The output of command configured with .commands.<command>.cache_ttl
+ * is kept in the result cache shared by the workers once it exits
+ * normally, and answered to the identical requests until it expires.
+ */
+
+#include "icmpd.h"
+
+/* How often to check the exit of child if it can't be polled (ms) */
+#define ICMPD_REAP_INTERVAL		100
+
+/* The commands with request id in all lanes */
+static BCLL_DECLARE(registry);
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long
+icmpd_command_timeout(const char *cmd)
+{
+	char *timeout = NULL;
+
+	if (cmd)
+		timeout = ic_conf_file_query(".commands.%s.timeout", cmd);
+	if (!timeout)
+		timeout = ic_conf_file_query(".command_timeout");
+	if (!timeout)
+		return 0;
+
+	unsigned long ms = strtoul(timeout, NULL, 0);
+	eee_mfree(timeout);
+
+	return ms;
+}
+
+static void
+update_timeout(int *timeout, unsigned long deadline, unsigned long now)
+{
+	if (!deadline)
+		return;
+
+	int ms = deadline > now ? (int)(deadline - now) : 0;
+	if (*timeout < 0 || ms < *timeout)
+		*timeout = ms;
+}
+
+static void
+close_output(icmpd_command_t *cmd)
+{
+	/* Take the partial line and the last lines kept by the filter,
+	 * and spill the rest of output.
+	 */
+	if (!cmd->output_done && cmd->out.msg) {
+		if (cmd->out.filter)
+			icmpd_filter_run(cmd->out.filter, &cmd->out, 1);
+		if (cmd->out.spill)
+			icmpd_spill_write(cmd->out.spill, &cmd->out);
+	}
+
+	if (cmd->child.stdout_fd >= 0) {
+		close(cmd->child.stdout_fd);
+		cmd->child.stdout_fd = -1;
+	}
+
+	cmd->output_done = 1;
+}
+
+static void
+close_error(icmpd_command_t *cmd)
+{
+	if (cmd->child.stderr_fd >= 0) {
+		close(cmd->child.stderr_fd);
+		cmd->child.stderr_fd = -1;
+	}
+
+	cmd->error_done = 1;
+}
+
+static void
+set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags >= 0 && !(flags & O_NONBLOCK))
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Give up the command which can't be answered anymore */
+static void
+abandon(icmpd_command_t *cmd)
+{
+	/* No child is running for the output answered from the cache */
+	if (cmd->child.shared || cmd->cached) {
+		icmpd_detach(&cmd->child);
+		close_output(cmd);
+		close_error(cmd);
+		cmd->status = -1;
+		cmd->exited = 1;
+		cmd->abandoned = 1;
+		return;
+	}
+
+	icmpd_kill(&cmd->child, SIGKILL);
+	cmd->kill_signal = SIGKILL;
+	cmd->deadline = ic_util_time_ms() + ICMPD_KILL_GRACE;
+	cmd->abandoned = 1;
+}
+
+/* Kill the command and free its output right away */
+static void
+cancel(icmpd_command_t *cmd)
+{
+	abandon(cmd);
+	close_output(cmd);
+	close_error(cmd);
+	icmpd_output_destroy(&cmd->out);
+	icmpd_output_destroy(&cmd->err);
+	icmpd_spill_destroy(cmd->out.spill);
+	cmd->out.spill = NULL;
+
+	ic_transport_drop_reply(cmd->tr, icmpd_stdin_close(cmd));
+	if (cmd->child.stdin_fd >= 0) {
+		close(cmd->child.stdin_fd);
+		cmd->child.stdin_fd = -1;
+	}
+
+	ic_transport_drop_reply(cmd->tr, cmd->reply);
+	cmd->reply = 0;
+}
+
+/* Return the time the lease expires, or 0 if the client isn't waiting
+ * for the command.
+ */
+static unsigned long
+lease_deadline(icmpd_command_t *cmd)
+{
+	if (!cmd->lease || cmd->abandoned)
+		return 0;
+
+	/* The stdin stream has its own timeout while waiting for the
+	 * client.
+	 */
+	if (cmd->stdin_stream && icmpd_stdin_deadline(cmd))
+		return 0;
+
+	pthread_mutex_lock(&registry_lock);
+	unsigned long deadline = cmd->renew_time + cmd->lease;
+	pthread_mutex_unlock(&registry_lock);
+
+	return deadline;
+}
+
+/* Escalate the termination of command running out of time */
+static void
+expire(icmpd_command_t *cmd, unsigned long now)
+{
+	switch (cmd->kill_signal) {
+	case 0:
+		warn("Command %d timed out, terminating it\n", cmd->child.pid);
+		icmpd_kill(&cmd->child, SIGTERM);
+		cmd->kill_signal = SIGTERM;
+		cmd->timed_out = 1;
+		cmd->deadline = now + ICMPD_KILL_GRACE;
+		break;
+	case SIGTERM:
+		warn("Command %d ignores SIGTERM, killing it\n",
+		     cmd->child.pid);
+		icmpd_kill(&cmd->child, SIGKILL);
+		cmd->kill_signal = SIGKILL;
+		cmd->deadline = now + ICMPD_KILL_GRACE;
+		break;
+	default:
+		/* The output is held by a process escaping from the group */
+		warn("Giving up the output of command %d\n", cmd->child.pid);
+		close_output(cmd);
+		close_error(cmd);
+		cmd->deadline = 0;
+	}
+}
+
+static unsigned long
+timeval_us(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000000UL + tv->tv_usec;
+}
+
+static void
+timeval_from_us(struct timeval *tv, unsigned long us)
+{
+	tv->tv_sec = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+static void
+fill_result(icmpd_command_t *cmd, icmp_exec_result_t *result)
+{
+	int status = cmd->status;
+
+	result->stdout_length = cmd->out.len;
+	result->stderr_length = cmd->err.len;
+
+	if (status >= 0 && WIFEXITED(status)) {
+		result->exit_code = WEXITSTATUS(status);
+		result->signal = 0;
+	} else if (status >= 0 && WIFSIGNALED(status) &&
+		   WTERMSIG(status) == SIGPIPE && cmd->out.cut_off) {
+		/* Like the pipeline with head, the writer killed after
+		 * the rest of output is dropped isn't a failure.
+		 */
+		result->exit_code = 0;
+		result->signal = 0;
+	} else {
+		result->exit_code = -1;
+		result->signal = status >= 0 && WIFSIGNALED(status) ?
+				 WTERMSIG(status) : 0;
+	}
+
+	result->wall_time = cmd->exit_time - cmd->start_time;
+	result->user_time = timeval_us(&cmd->rusage.ru_utime);
+	result->sys_time = timeval_us(&cmd->rusage.ru_stime);
+	result->max_rss = cmd->rusage.ru_maxrss;
+	result->flags = cmd->timed_out ? ICMP_EXEC_TIMED_OUT : 0;
+	if (cmd->cached)
+		result->flags |= ICMP_EXEC_CACHED;
+	if (cmd->out.cut_off)
+		result->flags |= ICMP_EXEC_TRUNCATED;
+	result->magic = ICMP_EXEC_RESULT_MAGIC;
+}
+
+/* Send the output captured in the response message without copying the
+ * stdout. The stderr and the result trailer are appended to it, and so
+ * is the result of spill in front of the trailer if the stdout is
+ * spilled.
+ */
+static int
+send_output(icmpd_command_t *cmd)
+{
+	icmpd_output_t *out = &cmd->out;
+	icmp_exec_result_t result;
+	icmp_spill_result_t spill_result;
+	icmp_delta_result_t delta_result;
+	bool spilled = 0;
+
+	fill_result(cmd, &result);
+
+	/* The result spilled is owned by the spill area once published */
+	if (out->spill) {
+		spilled = icmpd_spill_publish(out->spill, &spill_result);
+		out->spill = NULL;
+		if (spilled)
+			result.flags |= ICMP_EXEC_SPILLED;
+	}
+
+	/* The preview of stdout spilled isn't worth the delta */
+	if (cmd->delta && !spilled) {
+		icmpd_delta_encode(cmd->delta, out, &delta_result);
+		result.stdout_length = out->len;
+		result.flags |= ICMP_EXEC_DELTA;
+	}
+
+	/* Add a NULL charactor behind the stderr in order to make the
+	 * result printable directly for the old icmpc. The whole message
+	 * is sent so trim the room not used.
+	 */
+	unsigned long payload_len = out->len + cmd->err.len + 1 +
+				    (spilled ? sizeof(spill_result) : 0) +
+				    (cmd->delta && !spilled ?
+				     sizeof(delta_result) : 0) +
+				    sizeof(result);
+	unsigned long msg_len = out->offset + payload_len;
+	char *msg = ic_transport_realloc_data(cmd->tr, out->msg, msg_len);
+	if (!msg)
+		return -1;
+	out->msg = NULL;
+
+	char *p = msg + out->offset + out->len;
+	if (cmd->err.len)
+		eee_memcpy(p, cmd->err.msg, cmd->err.len);
+	p += cmd->err.len;
+	*p++ = 0;
+	if (spilled) {
+		eee_memcpy(p, &spill_result, sizeof(spill_result));
+		p += sizeof(spill_result);
+	}
+	if (result.flags & ICMP_EXEC_DELTA) {
+		eee_memcpy(p, &delta_result, sizeof(delta_result));
+		p += sizeof(delta_result);
+	}
+	eee_memcpy(p, &result, sizeof(result));
+
+	int rc = icmp_marshal_in_place(msg, msg_len, ICMP_CC_COMMMANDLINE,
+				       msg + out->offset, payload_len,
+				       &msg_len);
+	ic_assert(!rc, "Unable to marshal ICMP message");
+
+	rc = ic_transport_send_msg(cmd->tr, msg, msg_len);
+	if (rc) {
+		err("Failed to send ICMP response message\n");
+		ic_transport_free_data(cmd->tr, msg);
+		return rc;
+	}
+
+	dbg("%ld-byte ICMP response message sent to %s\n", msg_len,
+	    ic_transport_name(cmd->tr));
+
+	return 0;
+}
+
+/* Keep the output of command exiting normally in the result cache. The
+ * stdout spilled is gone from the message.
+ */
+static void
+keep_output(icmpd_command_t *cmd)
+{
+	icmp_exec_result_t result;
+
+	if (!cmd->cache_key || cmd->cached || cmd->abandoned ||
+	    cmd->out.spill || !cmd->out.msg)
+		return;
+
+	fill_result(cmd, &result);
+	if (result.exit_code < 0 || cmd->timed_out)
+		return;
+
+	icmpd_cache_store(cmd->cache_key, cmd->cache_key_len,
+			  cmd->cache_ttl, cmd->out.msg + cmd->out.offset,
+			  cmd->out.len, cmd->err.msg, cmd->err.len, &result);
+}
+
+static void
+complete(icmpd_command_t *cmd)
+{
+	info("Command %d for %s completed with status 0x%x in %ld ms "
+	     "(user %ld ms, sys %ld ms, max rss %ld KB)\n", cmd->child.pid,
+	     ic_transport_name(cmd->tr), cmd->status,
+	     (cmd->exit_time - cmd->start_time) / 1000,
+	     timeval_us(&cmd->rusage.ru_utime) / 1000,
+	     timeval_us(&cmd->rusage.ru_stime) / 1000,
+	     cmd->rusage.ru_maxrss);
+
+	keep_output(cmd);
+
+	ic_transport_reply_t reply = cmd->reply;
+	cmd->reply = 0;
+
+	if (cmd->stdin_stream)
+		reply = icmpd_stdin_close(cmd);
+
+	if (cmd->batch) {
+		if (cmd->abandoned) {
+			icmpd_batch_add(cmd->batch, cmd->batch_index, EIO,
+					NULL, 0, NULL, 0, NULL);
+			return;
+		}
+
+		icmp_exec_result_t result;
+
+		fill_result(cmd, &result);
+		icmpd_batch_add(cmd->batch, cmd->batch_index, 0,
+				cmd->out.msg + cmd->out.offset, cmd->out.len,
+				cmd->err.msg, cmd->err.len, &result);
+		return;
+	}
+
+	if (cmd->abandoned) {
+		ic_transport_drop_reply(cmd->tr, reply);
+		reply = 0;
+	}
+
+	if (!reply) {
+		dbg("Discarding the output of command %d\n", cmd->child.pid);
+		return;
+	}
+
+	if (!ic_transport_restore_reply(cmd->tr, reply))
+		send_output(cmd);
+}
+
+/* The output is kept filtered in the result cache, so the key is argv[]
+ * followed by the filter.
+ */
+static void *
+cache_key(char **argv, const void *filter, uint16_t filter_len,
+	  unsigned long *ret_len)
+{
+	char *key = eee_malloc(icmp_argv_size(argv) + filter_len);
+	if (!key)
+		return NULL;
+
+	unsigned long len = icmp_put_argv(key, argv);
+
+	if (filter_len)
+		eee_memcpy(key + len, filter, filter_len);
+
+	*ret_len = len + filter_len;
+
+	return key;
+}
+
+/* Every stage of the commandline is configured to be idempotent */
+static bool
+idempotent(char **argv)
+{
+	bool stage_start = 1;
+	bool rc = !!argv[0];
+
+	for (char **arg = argv; *arg && rc; ++arg) {
+		if (*arg == ICMP_PIPE) {
+			stage_start = 1;
+			continue;
+		}
+
+		if (stage_start) {
+			char *val = ic_conf_file_query(".commands.%s.idempotent",
+						       *arg);
+
+			rc = val && (!strcmp(val, "yes") ||
+				     !strcmp(val, "true"));
+			eee_mfree(val);
+		}
+
+		stage_start = 0;
+	}
+
+	return rc;
+}
+
+/* Answer the commandline failing to run as the stderr of command exiting
+ * with 127 like the shell does.
+ */
+int
+icmpd_command_fail(icmpd_request_t *req, const char *program, int error,
+		   icmpd_batch_t *batch, unsigned int batch_index)
+{
+	char msg[PATH_MAX + 64 + sizeof(icmp_exec_result_t)];
+	icmp_exec_result_t result = {
+		.stdout_length = 0,
+		.exit_code = 127,
+		.magic = ICMP_EXEC_RESULT_MAGIC,
+	};
+
+	snprintf(msg, PATH_MAX + 64, "Error executing subprocess %s: %s\n",
+		 program ? program : "", strerror(error));
+	result.stderr_length = strlen(msg);
+	eee_memcpy(msg + result.stderr_length + 1, &result, sizeof(result));
+
+	if (batch) {
+		icmpd_batch_add(batch, batch_index, 0, NULL, 0, msg,
+				result.stderr_length, &result);
+		return 0;
+	}
+
+	return icmpd_send_response(req, ICMP_CC_COMMMANDLINE, msg,
+				   result.stderr_length + 1 + sizeof(result));
+}
+
+/* Launch argv[] and add the command to the running commands of lane. The
+ * command is killed after the timeout in ms unless it is 0. The options
+ * of request are looked up in the payload from opt_offset. The output is
+ * answered to the batch if given, or to the requestor.
+ */
+int
+icmpd_command_start_argv(icmpd_request_t *req, char **argv,
+			 unsigned long timeout,
+			 const void *payload, unsigned long payload_len,
+			 unsigned long opt_offset, icmpd_batch_t *batch,
+			 unsigned int batch_index)
+{
+	icmpd_command_t *cmd = eee_malloc(sizeof(*cmd));
+	if (!cmd) {
+		ic_set_errno(IC_ERRNO_OUT_OF_MEM);
+		return -1;
+	}
+
+	/* The malformed filter, spill or delta is refused before spawning
+	 * the command.
+	 */
+	icmpd_filter_t *filter = NULL;
+	icmpd_spill_t *spill = NULL;
+	icmpd_delta_t *delta = NULL;
+	uint16_t opt_len = 0;
+	const void *opt = icmp_find_option_at(payload, payload_len, opt_offset,
+					      ICMP_OPT_FILTER, &opt_len);
+	if (opt) {
+		filter = icmpd_filter_create(opt, opt_len);
+		if (!filter)
+			goto err_option;
+	}
+
+	opt = icmp_find_option_at(payload, payload_len, opt_offset,
+				  ICMP_OPT_SPILL, &opt_len);
+	if (opt) {
+		spill = icmpd_spill_create(opt, opt_len,
+					   ic_transport_name(req->tr));
+		if (!spill)
+			goto err_option;
+	}
+
+	/* The request up to the options tells what is polled */
+	opt = icmp_find_option_at(payload, payload_len, opt_offset,
+				  ICMP_OPT_DELTA, &opt_len);
+	if (opt) {
+		delta = icmpd_delta_create(opt, opt_len,
+					   ic_transport_name(req->tr), payload,
+					   opt_offset);
+		if (!delta)
+			goto err_option;
+	}
+
+	/* The command reading the stdin stream isn't identical to any */
+	bool stdin_stream = !!icmp_find_option_at(payload, payload_len,
+						  opt_offset,
+						  ICMP_OPT_STDIN_STREAM,
+						  &opt_len);
+	bool shared = !stdin_stream && idempotent(argv);
+	unsigned long ttl = stdin_stream ? 0 : icmpd_cache_ttl(argv);
+	unsigned long key_len = 0;
+	void *key = NULL;
+
+	if (ttl) {
+		opt = icmp_find_option_at(payload, payload_len, opt_offset,
+					  ICMP_OPT_FILTER, &opt_len);
+		key = cache_key(argv, opt, opt ? opt_len : 0, &key_len);
+	}
+
+	/* Redirect stdout to the response message directly */
+	int rc = icmpd_output_init(&cmd->out, req->tr,
+				   icmp_message_header_length(icmp_message_version()));
+	if (!rc) {
+		rc = icmpd_output_init(&cmd->err, req->tr, 0);
+		if (rc)
+			icmpd_output_destroy(&cmd->out);
+	}
+	if (rc) {
+		errno = ENOMEM;
+		goto err_output;
+	}
+
+	icmp_exec_result_t result;
+	bool cached = key && icmpd_cache_lookup(key, key_len, &cmd->out,
+						&cmd->err, &result);
+	unsigned long start_time = ic_util_time_us();
+
+	if (cached) {
+		/* No child runs for the output answered from the cache */
+		eee_memset(&cmd->child, 0, sizeof(cmd->child));
+		cmd->child.stdin_fd = -1;
+		cmd->child.stdout_fd = -1;
+		cmd->child.stderr_fd = -1;
+		cmd->child.zygote_fd = -1;
+		cmd->child.pidfd = -1;
+	} else {
+		rc = icmpd_launch(argv, &cmd->child, shared);
+		if (rc) {
+			icmpd_output_destroy(&cmd->out);
+			icmpd_output_destroy(&cmd->err);
+			goto err_output;
+		}
+	}
+
+	cmd->tr = req->tr;
+	cmd->reply = 0;
+	cmd->stdin_stream = NULL;
+	cmd->output_done = 0;
+	cmd->error_done = 0;
+	cmd->exited = 0;
+	cmd->status = 0;
+	eee_memset(&cmd->rusage, 0, sizeof(cmd->rusage));
+	cmd->start_time = start_time;
+	cmd->exit_time = start_time;
+	cmd->deadline = timeout ? ic_util_time_ms() + timeout : 0;
+	cmd->kill_signal = 0;
+	cmd->timed_out = 0;
+	cmd->abandoned = 0;
+	cmd->request_id = 0;
+	cmd->wake_fd = req->wake_fd;
+	cmd->lease = 0;
+	cmd->renew_time = ic_util_time_ms();
+	cmd->cancelled = 0;
+	cmd->batch = batch;
+	cmd->batch_index = batch_index;
+	cmd->delta = delta;
+	cmd->cache_key = key;
+	cmd->cache_key_len = key_len;
+	cmd->cache_ttl = ttl;
+	cmd->cached = cached;
+	bcll_add_tail(req->commands, &cmd->link);
+
+	opt = icmp_find_option_at(payload, payload_len, opt_offset,
+				  ICMP_OPT_REQUEST_ID, &opt_len);
+	if (opt && opt_len == sizeof(uint64_t))
+		eee_memcpy(&cmd->request_id, opt, sizeof(uint64_t));
+
+	if (cmd->request_id) {
+		opt = icmp_find_option_at(payload, payload_len, opt_offset,
+					  ICMP_OPT_LEASE, &opt_len);
+		if (opt && opt_len == sizeof(uint32_t)) {
+			uint32_t lease;
+
+			eee_memcpy(&lease, opt, sizeof(lease));
+			cmd->lease = lease;
+		}
+
+		pthread_mutex_lock(&registry_lock);
+		bcll_add_tail(&registry, &cmd->registry_link);
+		pthread_mutex_unlock(&registry_lock);
+	}
+
+	cmd->out.spill = spill;
+
+	if (cached) {
+		/* The output is kept filtered. It is only spilled. */
+		icmpd_filter_destroy(filter);
+		close_output(cmd);
+		close_error(cmd);
+
+		cmd->status = W_EXITCODE(result.exit_code, 0);
+		cmd->out.cut_off = !!(result.flags & ICMP_EXEC_TRUNCATED);
+		timeval_from_us(&cmd->rusage.ru_utime, result.user_time);
+		timeval_from_us(&cmd->rusage.ru_stime, result.sys_time);
+		cmd->rusage.ru_maxrss = result.max_rss;
+		cmd->exited = 1;
+		cmd->deadline = 0;
+	} else {
+		cmd->out.filter = filter;
+		set_nonblock(cmd->child.stdout_fd);
+		set_nonblock(cmd->child.stderr_fd);
+	}
+
+	opt = icmp_find_option_at(payload, payload_len, opt_offset,
+				  ICMP_OPT_STDIN_STREAM, &opt_len);
+	if (opt && opt_len == sizeof(uint64_t)) {
+		uint64_t stream_id;
+
+		eee_memcpy(&stream_id, opt, sizeof(stream_id));
+		if (icmpd_stdin_open(cmd, stream_id))
+			abandon(cmd);
+	} else {
+		/* The child shared has no stdin to close */
+		if (cmd->child.stdin_fd >= 0)
+			close(cmd->child.stdin_fd);
+		cmd->child.stdin_fd = -1;
+		if (!batch)
+			cmd->reply = ic_transport_save_reply(req->tr);
+	}
+
+	dbg("Command %d %s%s\n", cmd->child.pid,
+	    cached ? "answered from the cache" :
+	    cmd->child.shared ? "shared" : "started",
+	    timeout ? " with timeout" : "");
+
+	return 0;
+
+err_output:
+	rc = errno;
+	eee_mfree(key);
+	icmpd_delta_destroy(delta);
+	icmpd_spill_destroy(spill);
+	icmpd_filter_destroy(filter);
+	eee_mfree(cmd);
+
+	return icmpd_command_fail(req, argv[0], rc, batch, batch_index);
+
+err_option:
+	rc = errno;
+	icmpd_spill_destroy(spill);
+	icmpd_filter_destroy(filter);
+	eee_mfree(cmd);
+
+	return icmpd_command_fail(req, argv[0], rc, batch, batch_index);
+}
+
+/* Parse the commandline and start it. The commandline of batch is given
+ * without the options.
+ */
+int
+icmpd_command_start(icmpd_request_t *req, const char *cmdline,
+		    unsigned long cmdline_len, icmpd_batch_t *batch,
+		    unsigned int batch_index)
+{
+	dbg("Execute commandline: %s (%ld-byte)\n", (char *)cmdline,
+	    cmdline_len);
+
+	/* Parse the commandline prior to spawning the child */
+	char **argv;
+	char *args;
+	int rc = icmpd_build_argv(cmdline, 0, &argv, &args);
+	ic_assert(!rc, "Unable to build argv");
+
+	rc = icmpd_command_start_argv(req, argv, icmpd_command_timeout(argv[0]),
+				      cmdline, cmdline_len,
+				      strnlen(cmdline, cmdline_len) + 1,
+				      batch, batch_index);
+	eee_mfree(argv);
+	eee_mfree(args);
+
+	return rc;
+}
+
+/* Fill ICMPD_COMMAND_NR_FD pollfd for the command, and shorten the
+ * timeout of poll() to its nearest deadline.
+ */
+void
+icmpd_command_poll(icmpd_command_t *cmd, struct pollfd *fds, int *timeout)
+{
+	unsigned long now = ic_util_time_ms();
+
+	/* The output of child shared is complete once it exits */
+	bool waiting = cmd->child.shared && !cmd->exited;
+
+	fds[0].fd = cmd->output_done || waiting ? -1 : cmd->child.stdout_fd;
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	fds[1].fd = -1;
+	fds[1].events = POLLOUT;
+	fds[1].revents = 0;
+
+	fds[2].fd = cmd->exited ? -1 : icmpd_exit_fd(&cmd->child);
+	fds[2].events = POLLIN;
+	fds[2].revents = 0;
+
+	fds[3].fd = cmd->error_done || waiting ? -1 : cmd->child.stderr_fd;
+	fds[3].events = POLLIN;
+	fds[3].revents = 0;
+
+	if (cmd->stdin_stream) {
+		if (icmpd_stdin_events(cmd))
+			fds[1].fd = cmd->child.stdin_fd;
+
+		update_timeout(timeout, icmpd_stdin_deadline(cmd), now);
+	}
+
+	/* The output answered from the cache is sent right away */
+	if (cmd->cached)
+		update_timeout(timeout, now, now);
+
+	if (!cmd->exited && fds[2].fd < 0)
+		update_timeout(timeout, now + ICMPD_REAP_INTERVAL, now);
+
+	update_timeout(timeout, cmd->deadline, now);
+	update_timeout(timeout, lease_deadline(cmd), now);
+}
+
+/* Handle the events polled for the command. Return 1 if the command is
+ * completed, or 0 if it is still running.
+ */
+int
+icmpd_command_handle(icmpd_command_t *cmd, struct pollfd *fds)
+{
+	pthread_mutex_lock(&registry_lock);
+	bool cancelled = cmd->cancelled;
+	pthread_mutex_unlock(&registry_lock);
+
+	if (cancelled && !cmd->abandoned) {
+		info("Command %d cancelled by the client\n", cmd->child.pid);
+		cancel(cmd);
+	}
+
+	if (!cmd->output_done && fds[0].revents) {
+		int rc = icmpd_output_read(&cmd->out, cmd->child.stdout_fd);
+		if (rc) {
+			if (rc < 0)
+				abandon(cmd);
+
+			close_output(cmd);
+		}
+	}
+
+	if (!cmd->error_done && fds[3].revents) {
+		int rc = icmpd_output_read(&cmd->err, cmd->child.stderr_fd);
+		if (rc) {
+			if (rc < 0)
+				abandon(cmd);
+
+			close_error(cmd);
+		}
+	}
+
+	if (cmd->stdin_stream && fds[1].revents) {
+		if (icmpd_stdin_write(cmd)) {
+			err("Failed to stream stdin to command %d\n",
+			    cmd->child.pid);
+			abandon(cmd);
+		}
+	}
+
+	if (!cmd->exited && (fds[2].fd < 0 || fds[2].revents)) {
+		int rc = icmpd_try_wait(&cmd->child, &cmd->status,
+					&cmd->rusage);
+		if (rc) {
+			if (rc < 0) {
+				err("Unable to reap command %d\n",
+				    cmd->child.pid);
+				cmd->status = -1;
+			}
+
+			cmd->exit_time = ic_util_time_us();
+			cmd->exited = 1;
+		}
+	}
+
+	unsigned long now = ic_util_time_ms();
+
+	if (cmd->stdin_stream)
+		icmpd_stdin_expire(cmd, now);
+
+	unsigned long lease = lease_deadline(cmd);
+	if (lease && now >= lease) {
+		warn("The client of command %d is gone\n", cmd->child.pid);
+		cancel(cmd);
+	}
+
+	if (cmd->output_done && cmd->error_done && cmd->exited &&
+	    (!cmd->stdin_stream || icmpd_stdin_done(cmd))) {
+		complete(cmd);
+		return 1;
+	}
+
+	if (cmd->deadline && now >= cmd->deadline)
+		expire(cmd, now);
+
+	return 0;
+}
+
+void
+icmpd_command_destroy(icmpd_command_t *cmd)
+{
+	if (cmd->request_id) {
+		pthread_mutex_lock(&registry_lock);
+		bcll_del(&cmd->registry_link);
+		pthread_mutex_unlock(&registry_lock);
+	}
+
+	if (!cmd->exited && cmd->child.shared)
+		icmpd_detach(&cmd->child);
+	else if (!cmd->exited) {
+		icmpd_kill(&cmd->child, SIGKILL);
+		icmpd_wait(&cmd->child, NULL);
+	}
+
+	ic_transport_drop_reply(cmd->tr, icmpd_stdin_close(cmd));
+
+	if (cmd->child.stdin_fd >= 0)
+		close(cmd->child.stdin_fd);
+	close_output(cmd);
+	close_error(cmd);
+
+	ic_transport_drop_reply(cmd->tr, cmd->reply);
+	icmpd_output_destroy(&cmd->out);
+	icmpd_output_destroy(&cmd->err);
+	icmpd_filter_destroy(cmd->out.filter);
+	icmpd_spill_destroy(cmd->out.spill);
+	icmpd_delta_destroy(cmd->delta);
+	eee_mfree(cmd->cache_key);
+	eee_mfree(cmd);
+}
+
+/* Cancel the commands with the request id in any lane. Return 1 if any
+ * command is cancelled.
+ */
+int
+icmpd_command_cancel(uint64_t request_id)
+{
+	icmpd_command_t *cmd;
+	int cancelled = 0;
+
+	pthread_mutex_lock(&registry_lock);
+
+	bcll_for_each_link(cmd, &registry, registry_link) {
+		if (cmd->request_id != request_id || cmd->cancelled)
+			continue;
+
+		cmd->cancelled = 1;
+		cancelled = 1;
+
+		uint64_t one = 1;
+		if (write(cmd->wake_fd, &one, sizeof(one)) < 0)
+			dbg("Unable to wake up the lane: %s\n",
+			    strerror(errno));
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+
+	return cancelled;
+}
+
+/* Renew the lease of the commands with the request id */
+void
+icmpd_command_renew(uint64_t request_id)
+{
+	icmpd_command_t *cmd;
+	unsigned long now = ic_util_time_ms();
+
+	pthread_mutex_lock(&registry_lock);
+
+	bcll_for_each_link(cmd, &registry, registry_link) {
+		if (cmd->request_id == request_id)
+			cmd->renew_time = now;
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
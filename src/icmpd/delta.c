@@ -0,0 +1,516 @@
+/*
+ * ICMPD delta of polled output
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The pollers run the same requests over and over again, and the stdout
+ * barely changes between them. The stdout is tagged with its hash, and
+ * the client sends the tag of the last stdout it keeps. If the stdout
+ * is the same, nothing is answered in place of it. Otherwise, the last
+ * stdout of the request is kept by the worker for each container as the
+ * baseline, and if the client keeps the baseline, the stdout is answered
+ * as the delta against it once the delta is shorter.
+ *
+ * The delta works on lines since the output of the commands polled is
+ * mostly the lines of a table. Each line of the new stdout is looked up
+ * among the lines of baseline, preferring the line following the one
+ * copied last, so the lines unchanged are copied in runs, and the rest
+ * are inserted.
+ *
+ * The baselines are kept in the order of use, and the least recently
+ * used ones are dropped once they take more than .delta_budget in bytes.
+ */
+
+#include "icmpd.h"
+
+#define PRIME64_1			0x9e3779b185ebca87ULL
+#define PRIME64_2			0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3			0x165667b19e3779f9ULL
+#define PRIME64_4			0x85ebca77c2b2ae63ULL
+#define PRIME64_5			0x27d4eb2f165667c5ULL
+
+/* The longest varint of 64-bit value */
+#define VARINT_MAX			10
+
+typedef struct {
+	bcll_t link;
+	/* The container and the request polling */
+	char *container;
+	void *key;
+	unsigned long key_len;
+	uint64_t tag;
+	char *output;
+	unsigned long len;
+} icmpd_baseline_t;
+
+struct icmpd_delta {
+	char *container;
+	/* The request up to the options */
+	void *key;
+	unsigned long key_len;
+	/* The tag of stdout kept by the client */
+	uint64_t tag;
+};
+
+/* The line of baseline indexed */
+typedef struct {
+	uint32_t hash;
+	uint32_t offset;
+	uint32_t len;
+} line_t;
+
+/* The baselines in the order of use, the least recent first */
+static BCLL_DECLARE(baselines);
+/* The total length of baselines */
+static unsigned long baseline_usage;
+static pthread_mutex_t baseline_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t
+rotl64(uint64_t x, unsigned int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+/* Hash 8 bytes at a time in the way of xxHash64 with a single lane */
+static uint64_t
+hash64(const void *data, unsigned long len)
+{
+	const uint8_t *p = data;
+	uint64_t h = PRIME64_5 + len;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t w;
+
+		eee_memcpy(&w, p, sizeof(w));
+		w *= PRIME64_2;
+		w = rotl64(w, 31) * PRIME64_1;
+		h = rotl64(h ^ w, 27) * PRIME64_1 + PRIME64_4;
+	}
+
+	for (; len; ++p, --len)
+		h = rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static void
+destroy_baseline(icmpd_baseline_t *base)
+{
+	eee_mfree(base->output);
+	eee_mfree(base->key);
+	eee_mfree(base->container);
+	eee_mfree(base);
+}
+
+/* Take the baseline of request out of the list */
+static icmpd_baseline_t *
+take_baseline(icmpd_delta_t *delta)
+{
+	icmpd_baseline_t *base;
+
+	pthread_mutex_lock(&baseline_lock);
+
+	bcll_for_each_link(base, &baselines, link) {
+		if (base->key_len == delta->key_len &&
+		    !memcmp(base->key, delta->key, delta->key_len) &&
+		    !strcmp(base->container, delta->container)) {
+			bcll_del(&base->link);
+			baseline_usage -= base->len;
+			pthread_mutex_unlock(&baseline_lock);
+			return base;
+		}
+	}
+
+	pthread_mutex_unlock(&baseline_lock);
+
+	return NULL;
+}
+
+/* Keep the baseline as the most recently used one. The baseline added
+ * by the other lane meanwhile is replaced.
+ */
+static void
+put_baseline(icmpd_baseline_t *base, unsigned long budget)
+{
+	icmpd_baseline_t *old, *tmp;
+
+	/* The lines are indexed with 32-bit offset */
+	if (base->len > budget || base->len > UINT32_MAX) {
+		destroy_baseline(base);
+		return;
+	}
+
+	pthread_mutex_lock(&baseline_lock);
+
+	bcll_for_each_link_safe(old, tmp, &baselines, link) {
+		if (old->key_len == base->key_len &&
+		    !memcmp(old->key, base->key, base->key_len) &&
+		    !strcmp(old->container, base->container)) {
+			bcll_del(&old->link);
+			baseline_usage -= old->len;
+			destroy_baseline(old);
+			break;
+		}
+	}
+
+	bcll_for_each_link_safe(old, tmp, &baselines, link) {
+		if (baseline_usage + base->len <= budget)
+			break;
+
+		bcll_del(&old->link);
+		baseline_usage -= old->len;
+		destroy_baseline(old);
+	}
+
+	bcll_add_tail(&baselines, &base->link);
+	baseline_usage += base->len;
+
+	pthread_mutex_unlock(&baseline_lock);
+}
+
+static icmpd_baseline_t *
+create_baseline(icmpd_delta_t *delta, uint64_t tag, const char *output,
+		unsigned long len)
+{
+	icmpd_baseline_t *base = eee_malloc(sizeof(*base));
+	if (!base)
+		return NULL;
+
+	base->container = strdup(delta->container);
+	base->key = eee_malloc(delta->key_len);
+	base->output = eee_malloc(len ? len : 1);
+	if (!base->container || !base->key || !base->output) {
+		eee_mfree(base->output);
+		eee_mfree(base->key);
+		eee_mfree(base->container);
+		eee_mfree(base);
+		return NULL;
+	}
+
+	eee_memcpy(base->key, delta->key, delta->key_len);
+	base->key_len = delta->key_len;
+	base->tag = tag;
+	eee_memcpy(base->output, output, len);
+	base->len = len;
+
+	return base;
+}
+
+static unsigned long
+line_end(const char *s, unsigned long pos, unsigned long len)
+{
+	const char *nl = memchr(s + pos, '\n', len - pos);
+
+	return nl ? (unsigned long)(nl - s) + 1 : len;
+}
+
+/* Index the lines of baseline with open addressing. The first one of
+ * the same lines is indexed. Return the mask of table.
+ */
+static line_t *
+index_lines(const char *s, unsigned long len, unsigned long *ret_mask)
+{
+	unsigned long nr_line = 0;
+
+	for (unsigned long pos = 0; pos < len; pos = line_end(s, pos, len))
+		++nr_line;
+
+	unsigned long size = 16;
+	while (size < nr_line * 2)
+		size <<= 1;
+
+	line_t *table = eee_malloc(sizeof(*table) * size);
+	if (!table)
+		return NULL;
+
+	eee_memset(table, 0, sizeof(*table) * size);
+
+	for (unsigned long pos = 0, end; pos < len; pos = end) {
+		end = line_end(s, pos, len);
+
+		uint32_t hash = hash64(s + pos, end - pos) | 1;
+		unsigned long i = hash & (size - 1);
+
+		for (; table[i].hash; i = (i + 1) & (size - 1)) {
+			if (table[i].hash == hash && table[i].len == end - pos &&
+			    !memcmp(s + table[i].offset, s + pos, end - pos))
+				break;
+		}
+
+		if (!table[i].hash) {
+			table[i].hash = hash;
+			table[i].offset = pos;
+			table[i].len = end - pos;
+		}
+	}
+
+	*ret_mask = size - 1;
+
+	return table;
+}
+
+static uint8_t *
+put_varint(uint8_t *p, uint64_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	*p++ = val;
+
+	return p;
+}
+
+/* The delta being encoded, given up once it isn't shorter than the
+ * stdout.
+ */
+typedef struct {
+	uint8_t *buf;
+	uint8_t *p;
+	unsigned long size;
+	/* The run of lines to copy */
+	unsigned long copy_offset;
+	unsigned long copy_len;
+	/* The run of lines to insert */
+	const char *insert;
+	unsigned long insert_len;
+} encoder_t;
+
+static int
+flush_copy(encoder_t *enc)
+{
+	if (!enc->copy_len)
+		return 0;
+
+	if ((unsigned long)(enc->p - enc->buf) + VARINT_MAX * 2 > enc->size)
+		return -1;
+
+	enc->p = put_varint(enc->p, ((uint64_t)enc->copy_len << 1) | 1);
+	enc->p = put_varint(enc->p, enc->copy_offset);
+	enc->copy_len = 0;
+
+	return 0;
+}
+
+static int
+flush_insert(encoder_t *enc)
+{
+	if (!enc->insert_len)
+		return 0;
+
+	if ((unsigned long)(enc->p - enc->buf) + VARINT_MAX +
+	    enc->insert_len > enc->size)
+		return -1;
+
+	enc->p = put_varint(enc->p, (uint64_t)enc->insert_len << 1);
+	eee_memcpy(enc->p, enc->insert, enc->insert_len);
+	enc->p += enc->insert_len;
+	enc->insert_len = 0;
+
+	return 0;
+}
+
+/* Encode the delta from base to s into buf of size bytes. Return the
+ * length of delta, or -1 if it doesn't fit.
+ */
+static long
+encode(const char *base, unsigned long base_len, const char *s,
+       unsigned long len, uint8_t *buf, unsigned long size)
+{
+	unsigned long mask;
+	line_t *table = index_lines(base, base_len, &mask);
+	if (!table)
+		return -1;
+
+	encoder_t enc = {
+		.buf = buf,
+		.p = buf,
+		.size = size,
+		.copy_len = 0,
+		.insert_len = 0,
+	};
+	long rc = -1;
+
+	for (unsigned long pos = 0, end; pos < len; pos = end) {
+		end = line_end(s, pos, len);
+
+		unsigned long n = end - pos;
+		unsigned long next = enc.copy_offset + enc.copy_len;
+
+		/* Extend the run of lines copied */
+		if (enc.copy_len && next + n <= base_len &&
+		    !memcmp(base + next, s + pos, n) &&
+		    (next + n == base_len || base[next + n - 1] == '\n')) {
+			enc.copy_len += n;
+			continue;
+		}
+
+		uint32_t hash = hash64(s + pos, n) | 1;
+		unsigned long i = hash & mask;
+
+		for (; table[i].hash; i = (i + 1) & mask) {
+			if (table[i].hash == hash && table[i].len == n &&
+			    !memcmp(base + table[i].offset, s + pos, n))
+				break;
+		}
+
+		if (table[i].hash) {
+			if (flush_insert(&enc) || flush_copy(&enc))
+				goto out;
+
+			enc.copy_offset = table[i].offset;
+			enc.copy_len = n;
+			continue;
+		}
+
+		if (flush_copy(&enc))
+			goto out;
+
+		if (!enc.insert_len)
+			enc.insert = s + pos;
+		enc.insert_len += n;
+
+		/* Give up early if it can't be shorter */
+		if (enc.insert_len >= size)
+			goto out;
+	}
+
+	if (!flush_insert(&enc) && !flush_copy(&enc))
+		rc = enc.p - enc.buf;
+
+out:
+	eee_mfree(table);
+
+	return rc;
+}
+
+/* Create the delta from the value of ICMP_OPT_DELTA for the request up
+ * to the options. Return NULL with errno set if the value is malformed.
+ */
+icmpd_delta_t *
+icmpd_delta_create(const void *value, unsigned long value_len,
+		   const char *container, const void *key,
+		   unsigned long key_len)
+{
+	icmp_delta_t opt;
+
+	if (value_len < sizeof(opt)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	eee_memcpy(&opt, value, sizeof(opt));
+
+	icmpd_delta_t *delta = eee_malloc(sizeof(*delta));
+	if (!delta) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	delta->container = strdup(container);
+	delta->key = eee_malloc(key_len ? key_len : 1);
+	if (!delta->container || !delta->key) {
+		icmpd_delta_destroy(delta);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	eee_memcpy(delta->key, key, key_len);
+	delta->key_len = key_len;
+	delta->tag = opt.tag;
+
+	return delta;
+}
+
+/*
+ * Tag the stdout, and replace it with nothing if the client keeps it
+ * already, or with the delta if the client keeps the baseline and the
+ * delta is shorter. The stdout is kept as the new baseline.
+ */
+void
+icmpd_delta_encode(icmpd_delta_t *delta, icmpd_output_t *out,
+		   icmp_delta_result_t *result)
+{
+	char *s = out->msg + out->offset;
+	unsigned long len = out->len;
+	uint64_t tag = hash64(s, len);
+
+	/* 0 stands for no stdout kept by the client */
+	if (!tag)
+		tag = 1;
+
+	result->tag = tag;
+	result->length = len;
+	result->encoding = ICMP_DELTA_FULL;
+	result->reserved = 0;
+
+	char *budget_str = ic_conf_file_query(".delta_budget");
+	unsigned long budget = ICMPD_DELTA_BUDGET;
+	if (budget_str) {
+		budget = strtoul(budget_str, NULL, 0);
+		eee_mfree(budget_str);
+	}
+
+	icmpd_baseline_t *base = take_baseline(delta);
+	icmpd_baseline_t *new_base = NULL;
+
+	/* Keep the stdout as the new baseline before replacing it */
+	if (!base || base->tag != tag)
+		new_base = create_baseline(delta, tag, s, len);
+
+	if (delta->tag == tag) {
+		result->encoding = ICMP_DELTA_NOT_MODIFIED;
+		out->len = 0;
+	} else if (base && base->tag == delta->tag && len > 1) {
+		uint8_t *buf = eee_malloc(len - 1);
+		long delta_len = -1;
+
+		if (buf)
+			delta_len = encode(base->output, base->len, s, len,
+					   buf, len - 1);
+
+		if (delta_len >= 0) {
+			dbg("Delta of %ld bytes for %ld-byte stdout\n",
+			    delta_len, len);
+			eee_memcpy(s, buf, delta_len);
+			out->len = delta_len;
+			result->encoding = ICMP_DELTA_PATCH;
+		}
+
+		eee_mfree(buf);
+	}
+
+	if (new_base) {
+		if (base)
+			destroy_baseline(base);
+		base = new_base;
+	}
+
+	if (base)
+		put_baseline(base, budget);
+}
+
+void
+icmpd_delta_destroy(icmpd_delta_t *delta)
+{
+	if (!delta)
+		return;
+
+	eee_mfree(delta->key);
+	eee_mfree(delta->container);
+	eee_mfree(delta);
+}
@@ -0,0 +1,656 @@
+/*
+ * ICMPD command executor
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#include "icmpd.h"
+
+extern char **environ;
+
+/* Construct argv[] for execvp(). If asked, the standalone | separates
+ * the stages of pipeline.
+ */
+int
+icmpd_build_argv(const char *argument, bool pipeline, char ***ret_argv,
+		 char **ret_args)
+{
+	char *args = malloc(eee_strlen(argument) + 1);
+	ic_assert(args, "Unable to allocate argument");
+
+	eee_memcpy(args, argument, eee_strlen(argument) + 1);
+
+	char **argv = (char **)malloc(sizeof(char *));
+	ic_assert(argv, "Unable to allocate argv");
+
+	int argc = 0;
+	argv[0] = NULL;
+	char *curr_arg = args;
+	while (*curr_arg) {
+		char *prev_arg;
+
+		/* Skip preposed spaces */
+		while (*curr_arg && isspace(*curr_arg))
+			++curr_arg;
+
+		if (*curr_arg)
+			prev_arg = curr_arg++;
+		else
+			break;
+
+		/* Skip characters */
+		while (*curr_arg && !isspace(*curr_arg))
+			++curr_arg;
+
+		argv = eee_mrealloc(argv, 0, sizeof(char *) * (++argc + 1));
+		ic_assert(argv, "Failed to re-allocate argv");
+
+		argv[argc - 1] = prev_arg;
+		argv[argc] = NULL;
+
+		if (*curr_arg)
+			*(curr_arg++) = 0;
+
+		if (pipeline && !strcmp(prev_arg, ICMP_PIPE))
+			argv[argc - 1] = ICMP_PIPE;
+	}
+
+	*ret_argv = argv;
+	*ret_args = args;
+
+	return 0;
+}
+
+/* Join argv[] in the layout of icmp_argv_t, so the stages of pipeline
+ * are kept apart from the arguments. icmp_get_argv() recovers argv[].
+ */
+char *
+icmpd_join_argv(char **argv, unsigned long *ret_len)
+{
+	char *args = eee_malloc(icmp_argv_size(argv));
+	if (!args)
+		return NULL;
+
+	*ret_len = icmp_put_argv(args, argv);
+
+	return args;
+}
+
+/* Split argv[] at ICMP_PIPE into the argv[] of each stage.
+ * Return the number of stages, or -1 if any stage is empty.
+ */
+static int
+split_pipeline(char **argv, char **stages[ICMPD_MAX_STAGES])
+{
+	unsigned int nr_stage = 0;
+
+	stages[nr_stage++] = argv;
+
+	for (char **arg = argv; *arg; ++arg) {
+		if (*arg != ICMP_PIPE)
+			continue;
+
+		if (nr_stage == ICMPD_MAX_STAGES) {
+			errno = E2BIG;
+			return -1;
+		}
+
+		*arg = NULL;
+		stages[nr_stage++] = arg + 1;
+	}
+
+	for (unsigned int i = 0; i < nr_stage; ++i) {
+		if (!stages[i][0]) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	return nr_stage;
+}
+
+/* The programs resolved against PATH, the least recently used first */
+typedef struct {
+	bcll_t link;
+	char *program;
+	char *path;
+} icmpd_resolved_t;
+
+static BCLL_DECLARE(resolved);
+static unsigned int nr_resolved;
+static pthread_mutex_t resolved_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The inotify watching the directories of PATH, or -1 */
+static int path_watch_fd = -1;
+
+static const char *
+search_path(void)
+{
+	const char *dirs = getenv("PATH");
+
+	return dirs ? dirs : "/bin:/usr/bin";
+}
+
+/* Search PATH for the program like posix_spawnp() does */
+static int
+search_program(const char *program, char *path, unsigned long size)
+{
+	const char *dirs = search_path();
+
+	while (*dirs) {
+		unsigned long len = strcspn(dirs, ":");
+		struct stat st;
+
+		/* The empty entry stands for the current directory */
+		if (snprintf(path, size, "%.*s%s%s", (int)len, dirs,
+			     len ? "/" : "", program) < (int)size &&
+		    !stat(path, &st) && S_ISREG(st.st_mode) &&
+		    !access(path, X_OK))
+			return 0;
+
+		dirs += len;
+		if (*dirs)
+			++dirs;
+	}
+
+	return -1;
+}
+
+/* Watch the directories of PATH, so the programs resolved are dropped
+ * once anything is added, removed or changed in them.
+ */
+static int
+watch_path(void)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		dbg("Unable to watch PATH: %s\n", strerror(errno));
+		return -1;
+	}
+
+	const char *dirs = search_path();
+
+	while (*dirs) {
+		unsigned long len = strcspn(dirs, ":");
+		char dir[PATH_MAX];
+
+		snprintf(dir, sizeof(dir), "%.*s", (int)len, len ? dirs : ".");
+		if (inotify_add_watch(fd, dir, IN_CREATE | IN_DELETE |
+					       IN_MOVED_FROM | IN_MOVED_TO |
+					       IN_ATTRIB | IN_DELETE_SELF |
+					       IN_MOVE_SELF) < 0)
+			dbg("Unable to watch %s: %s\n", dir, strerror(errno));
+
+		dirs += len;
+		if (*dirs)
+			++dirs;
+	}
+
+	return fd;
+}
+
+static void
+drop_resolved(void)
+{
+	icmpd_resolved_t *res, *tmp;
+
+	bcll_for_each_link_safe(res, tmp, &resolved, link) {
+		bcll_del(&res->link);
+		eee_mfree(res);
+	}
+
+	nr_resolved = 0;
+}
+
+/* Drop the programs resolved if PATH changed. The watches are set up
+ * again, in case the directory watched is replaced.
+ */
+static void
+check_path(void)
+{
+	char buf[4096]
+		__attribute__ ((__aligned__(__alignof__(struct inotify_event))));
+	bool changed = 0;
+
+	if (path_watch_fd >= 0) {
+		while (read(path_watch_fd, buf, sizeof(buf)) > 0)
+			changed = 1;
+
+		if (!changed)
+			return;
+
+		dbg("PATH changed, dropping %u programs resolved\n",
+		    nr_resolved);
+		drop_resolved();
+		close(path_watch_fd);
+	}
+
+	path_watch_fd = watch_path();
+}
+
+static icmpd_resolved_t *
+find_resolved(const char *program)
+{
+	icmpd_resolved_t *res;
+
+	bcll_for_each_link(res, &resolved, link) {
+		if (!strcmp(res->program, program))
+			return res;
+	}
+
+	return NULL;
+}
+
+/*
+ * Resolve the program against PATH into path, so the spawn doesn't try
+ * each directory of PATH for every launch. The programs resolved are
+ * kept until anything changes in the directories of PATH. Return -1 if
+ * the program is not resolved, including the one with a "/".
+ */
+int
+icmpd_resolve_program(const char *program, char *path, unsigned long size)
+{
+	if (!*program || strchr(program, '/'))
+		return -1;
+
+	pthread_mutex_lock(&resolved_lock);
+	check_path();
+
+	icmpd_resolved_t *res = find_resolved(program);
+	if (res) {
+		/* Keep the recently used ones from eviction */
+		bcll_del(&res->link);
+		bcll_add_tail(&resolved, &res->link);
+		snprintf(path, size, "%s", res->path);
+	}
+	pthread_mutex_unlock(&resolved_lock);
+
+	if (res)
+		return 0;
+
+	if (search_program(program, path, size))
+		return -1;
+
+	/* PATH changed since then is noticed by the next resolution */
+	unsigned long program_len = strlen(program) + 1;
+	unsigned long path_len = strlen(path) + 1;
+
+	pthread_mutex_lock(&resolved_lock);
+	if (path_watch_fd >= 0 && !find_resolved(program)) {
+		res = eee_malloc(sizeof(*res) + program_len + path_len);
+		if (res) {
+			res->program = (char *)(res + 1);
+			res->path = res->program + program_len;
+			eee_memcpy(res->program, program, program_len);
+			eee_memcpy(res->path, path, path_len);
+
+			if (nr_resolved >= ICMPD_MAX_RESOLVED) {
+				icmpd_resolved_t *lru;
+
+				/* Evict the least recently used one */
+				bcll_for_each_link(lru, &resolved, link)
+					break;
+
+				bcll_del(&lru->link);
+				eee_mfree(lru);
+				--nr_resolved;
+			}
+
+			bcll_add_tail(&resolved, &res->link);
+			++nr_resolved;
+		}
+	}
+	pthread_mutex_unlock(&resolved_lock);
+
+	return 0;
+}
+
+/* Spawn a stage in the process group with its standard streams bound to
+ * the fds given.
+ */
+static int
+spawn_stage(char **argv, int in_fd, int out_fd, int err_fd, pid_t pgid,
+	    pid_t *pid)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+
+	posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+	/* SIGPIPE is ignored by the daemon. Restore the default for the
+	 * child, and start it in the process group of command.
+	 */
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+
+	sigset_t sigdefault;
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+
+	posix_spawnattr_setpgroup(&attr, pgid);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+					POSIX_SPAWN_SETSIGMASK |
+					POSIX_SPAWN_SETPGROUP);
+
+	/* argv[0] is kept as it is for the program */
+	char path[PATH_MAX];
+	int rc;
+
+	if (!icmpd_resolve_program(argv[0], path, sizeof(path)))
+		rc = posix_spawn(pid, path, &actions, &attr, argv, environ);
+	else
+		rc = posix_spawnp(pid, argv[0], &actions, &attr, argv,
+				  environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (rc) {
+		err("Error executing subprocess %s: %s\n", argv[0],
+		    strerror(rc));
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Launch the child with posix_spawn(). Unlike fork(), the cost doesn't
+ * grow with the size of daemon because the page tables are not copied.
+ * The pipes are created with O_CLOEXEC so the child only inherits the
+ * endpoints bound to its standard streams.
+ *
+ * If argv[] is a pipeline, i.e, the stages are separated by ICMP_PIPE,
+ * the stages are spawned in the same process group and connected with
+ * pipes without a shell in between. The stdin of child is bound to the
+ * first stage and the stdout to the last stage, while the stderr of all
+ * stages is captured. If any stage fails to spawn, the stages spawned
+ * already are killed and reaped.
+ *
+ * The stdout and stderr are bound to the files given instead of pipes
+ * unless they are -1.
+ */
+static int
+spawn(char **argv, icmpd_child_t *child, int out_file, int err_file)
+{
+	if (!argv[0]) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return -1;
+	}
+
+	char **stages[ICMPD_MAX_STAGES];
+	int nr_stage = split_pipeline(argv, stages);
+	if (nr_stage < 0)
+		return -1;
+
+	int input_fds[2];
+	if (pipe2(input_fds, O_CLOEXEC) < 0) {
+		err("Error creating the pipe for input: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+
+	int output_fds[2] = { -1, out_file };
+	if (out_file < 0 && pipe2(output_fds, O_CLOEXEC) < 0) {
+		err("Error creating the pipe for output: %s\n",
+		    strerror(errno));
+		goto err_output_pipe;
+	}
+
+	int error_fds[2] = { -1, err_file };
+	if (err_file < 0 && pipe2(error_fds, O_CLOEXEC) < 0) {
+		err("Error creating the pipe for error: %s\n",
+		    strerror(errno));
+		goto err_error_pipe;
+	}
+
+	/* Let the child write more before it is blocked by the reader. It
+	 * is fine to run with the default pipe size if it is not allowed.
+	 */
+	if (output_fds[0] >= 0 &&
+	    fcntl(output_fds[0], F_SETPIPE_SZ, ICMPD_OUTPUT_PIPE_SIZE) < 0)
+		dbg("Unable to enlarge the pipe for output: %s\n",
+		    strerror(errno));
+
+	/* The read end of the pipe from the previous stage */
+	int in_fd = input_fds[0];
+	int i;
+
+	for (i = 0; i < nr_stage; ++i) {
+		int stage_fds[2] = { -1, output_fds[1] };
+
+		if (i < nr_stage - 1 && pipe2(stage_fds, O_CLOEXEC) < 0) {
+			err("Error creating the pipe for pipeline: %s\n",
+			    strerror(errno));
+			break;
+		}
+
+		int rc = spawn_stage(stages[i], in_fd, stage_fds[1],
+				     error_fds[1], i ? child->pids[0] : 0,
+				     child->pids + i);
+		int error = errno;
+
+		if (in_fd != input_fds[0])
+			close(in_fd);
+		if (stage_fds[1] != output_fds[1])
+			close(stage_fds[1]);
+		in_fd = stage_fds[0];
+
+		if (rc) {
+			errno = error;
+			break;
+		}
+	}
+
+	close(input_fds[0]);
+	if (out_file < 0)
+		close(output_fds[1]);
+	if (err_file < 0)
+		close(error_fds[1]);
+
+	if (i < nr_stage) {
+		int error = errno;
+
+		if (in_fd >= 0 && in_fd != input_fds[0])
+			close(in_fd);
+
+		if (i) {
+			kill(-child->pids[0], SIGKILL);
+			while (i)
+				waitpid(child->pids[--i], NULL, 0);
+		}
+
+		close(input_fds[1]);
+		if (output_fds[0] >= 0)
+			close(output_fds[0]);
+		if (error_fds[0] >= 0)
+			close(error_fds[0]);
+		errno = error;
+		return -1;
+	}
+
+	child->pid = child->pids[0];
+	child->nr_stage = nr_stage;
+	child->status = 0;
+	eee_memset(&child->rusage, 0, sizeof(child->rusage));
+	child->stdin_fd = input_fds[1];
+	child->stdout_fd = output_fds[0];
+	child->stderr_fd = error_fds[0];
+	child->shared = 0;
+
+	return 0;
+
+err_error_pipe:
+	if (out_file < 0) {
+		close(output_fds[0]);
+		close(output_fds[1]);
+	}
+
+err_output_pipe:
+	close(input_fds[0]);
+	close(input_fds[1]);
+
+	return -1;
+}
+
+int
+icmpd_spawn(char **argv, icmpd_child_t *child)
+{
+	return spawn(argv, child, -1, -1);
+}
+
+/* Spawn the child writing its stdout and stderr to the files given. The
+ * fds of output in the child returned are -1.
+ */
+int
+icmpd_spawn_to_files(char **argv, icmpd_child_t *child, int out_fd,
+		     int err_fd)
+{
+	return spawn(argv, child, out_fd, err_fd);
+}
+
+int
+icmpd_output_init(icmpd_output_t *out, ic_transport_t tr,
+		  unsigned long offset)
+{
+	out->size = offset + ICMPD_OUTPUT_CHUNK;
+	out->msg = ic_transport_alloc_data(tr, out->size);
+	if (!out->msg) {
+		ic_set_errno(IC_ERRNO_OUT_OF_MEM);
+		return -1;
+	}
+
+	out->tr = tr;
+	out->offset = offset;
+	out->len = 0;
+	out->filter = NULL;
+	out->spill = NULL;
+	out->cut_off = 0;
+
+	return 0;
+}
+
+/* Reserve len bytes behind the output and return where to fill them */
+void *
+icmpd_output_reserve(icmpd_output_t *out, unsigned long len)
+{
+	unsigned long need = out->offset + out->len + len;
+
+	if (need > out->size) {
+		unsigned long new_size = out->size * 2;
+
+		while (new_size < need)
+			new_size *= 2;
+
+		char *new_msg = ic_transport_realloc_data(out->tr, out->msg,
+							  new_size);
+		if (!new_msg) {
+			errno = ENOMEM;
+			return NULL;
+		}
+
+		out->msg = new_msg;
+		out->size = new_size;
+	}
+
+	void *p = out->msg + out->offset + out->len;
+	out->len += len;
+
+	return p;
+}
+
+void
+icmpd_output_destroy(icmpd_output_t *out)
+{
+	if (out->msg) {
+		ic_transport_free_data(out->tr, out->msg);
+		out->msg = NULL;
+	}
+}
+
+/*
+ * Read the output of child available in the non-blocking fd into the
+ * message allocated by the transport. The output is placed right behind
+ * the offset reserved for the header so the message can be sent without
+ * copying it once more. The buffer grows geometrically so the total
+ * amount of copy is linear in the output size even if it is moved by
+ * the reallocation. At least one byte is left behind the output for the
+ * caller. The filter of output, if any, runs over each chunk read, and
+ * the owner of output runs it at the end of output. So does the spill
+ * of output, which runs at the end of output only if the output is
+ * filtered, because the filter keeps the last lines in place.
+ *
+ * Return 1 at the end of output or if the filter drops the rest of it,
+ * or 0 if no more output is available for now.
+ */
+int
+icmpd_output_read(icmpd_output_t *out, int fd)
+{
+	while (1) {
+		if (out->size - out->offset - out->len <=
+		    ICMPD_OUTPUT_CHUNK / 2) {
+			unsigned long new_size = out->size * 2;
+			char *new_msg = ic_transport_realloc_data(out->tr,
+								  out->msg,
+								  new_size);
+			if (!new_msg) {
+				ic_set_errno(IC_ERRNO_OUT_OF_MEM);
+				return -1;
+			}
+
+			out->msg = new_msg;
+			out->size = new_size;
+		}
+
+		/* Leave one byte for the caller */
+		ssize_t sz = read(fd, out->msg + out->offset + out->len,
+				  out->size - out->offset - out->len - 1);
+		if (sz > 0) {
+			out->len += sz;
+
+			/* Like the pipeline with head, the writer gets
+			 * SIGPIPE once the rest is dropped.
+			 */
+			if (out->filter &&
+			    icmpd_filter_run(out->filter, out, 0)) {
+				out->cut_off = 1;
+				return 1;
+			}
+
+			if (!out->filter && out->spill &&
+			    icmpd_spill_write(out->spill, out)) {
+				out->cut_off = 1;
+				return 1;
+			}
+
+			continue;
+		}
+
+		if (!sz)
+			return 1;
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN)
+			return 0;
+
+		err("Unable to read from stdout/stderr: %s\n",
+		    strerror(errno));
+
+		return -1;
+	}
+}
@@ -0,0 +1,393 @@
+/*
+ * ICMPD output filter
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The filter runs over the stdout of command each time a chunk is read,
+ * so only what is kept stays in the response message. The output is
+ * filtered in place: the lines kept are moved to the front, followed by
+ * the partial line waiting for the rest of it, and the chunk read next
+ * is placed right behind them.
+ *
+ * The byte range is taken out of the stdout first, then the lines are
+ * matched with the pattern, and finally the first or the last lines
+ * matched are kept, like dd, grep and head or tail in a pipeline. The
+ * offsets of the last lines are kept in a ring, and the lines before
+ * them are dropped once they take as much room as the ones kept.
+ */
+
+#include "icmpd.h"
+
+struct icmpd_filter {
+	uint64_t byte_offset;
+	uint64_t byte_length;
+	unsigned int head;
+	unsigned int tail;
+	uint32_t flags;
+	char *pattern;
+	unsigned long pattern_len;
+	regex_t regex;
+	/* The amount of stdout read */
+	uint64_t position;
+	/* The length of output kept at the front */
+	unsigned long kept;
+	/* The length of partial line behind the output kept */
+	unsigned long pending;
+	/* The number of lines matched */
+	unsigned long nr_line;
+	/* The offsets of the last lines kept */
+	unsigned long *ring;
+	unsigned int ring_start;
+	unsigned int ring_count;
+	/* The rest of stdout is dropped */
+	bool done;
+};
+
+/*
+ * Search the needle in the haystack. With SSE2, the first and the last
+ * byte of needle are compared at 16 positions at once, and only the
+ * positions matching both are compared entirely.
+ */
+static const char *
+find_substring(const char *s, unsigned long n, const char *needle,
+	       unsigned long m)
+{
+	if (m > n)
+		return NULL;
+
+	if (m == 1)
+		return memchr(s, needle[0], n);
+
+#ifdef __SSE2__
+	const __m128i first = _mm_set1_epi8(needle[0]);
+	const __m128i last = _mm_set1_epi8(needle[m - 1]);
+	unsigned long i = 0;
+
+	for (; i + m - 1 + 16 <= n; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+		unsigned int mask;
+
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+						       _mm_cmpeq_epi8(b, last)));
+		while (mask) {
+			unsigned int bit = __builtin_ctz(mask);
+
+			if (!memcmp(s + i + bit + 1, needle + 1, m - 2))
+				return s + i + bit;
+
+			mask &= mask - 1;
+		}
+	}
+
+	s += i;
+	n -= i;
+#endif
+
+	return memmem(s, n, needle, m);
+}
+
+/* The line excludes the newline. The byte behind the line is writable. */
+static bool
+match_line(icmpd_filter_t *filter, char *line, unsigned long len)
+{
+	bool matched;
+
+	if (!filter->pattern)
+		matched = 1;
+	else if (filter->flags & ICMP_FILTER_REGEX) {
+		char c = line[len];
+
+		line[len] = 0;
+		matched = !regexec(&filter->regex, line, 0, NULL, 0);
+		line[len] = c;
+	} else
+		matched = !!find_substring(line, len, filter->pattern,
+					   filter->pattern_len);
+
+	return filter->flags & ICMP_FILTER_INVERT ? !matched : matched;
+}
+
+/* Drop the lines before the last ones kept */
+static void
+compact(icmpd_filter_t *filter, char *base)
+{
+	unsigned long oldest = filter->ring[filter->ring_start];
+
+	if (!oldest)
+		return;
+
+	memmove(base, base + oldest, filter->kept - oldest);
+	filter->kept -= oldest;
+
+	for (unsigned int i = 0; i < filter->ring_count; ++i)
+		filter->ring[(filter->ring_start + i) % filter->tail] -= oldest;
+}
+
+/* Keep the line between start and end, including the newline */
+static void
+keep_line(icmpd_filter_t *filter, char *base, unsigned long start,
+	  unsigned long end)
+{
+	unsigned long len = end - start;
+
+	if (start != filter->kept)
+		memmove(base + filter->kept, base + start, len);
+
+	if (filter->tail) {
+		unsigned int i;
+
+		if (filter->ring_count < filter->tail)
+			i = (filter->ring_start + filter->ring_count++) %
+			    filter->tail;
+		else {
+			i = filter->ring_start;
+			filter->ring_start = (i + 1) % filter->tail;
+		}
+
+		filter->ring[i] = filter->kept;
+	}
+
+	filter->kept += len;
+
+	if (filter->head && ++filter->nr_line >= filter->head)
+		filter->done = 1;
+
+	if (filter->tail) {
+		unsigned long oldest = filter->ring[filter->ring_start];
+
+		if (oldest >= ICMPD_OUTPUT_CHUNK &&
+		    oldest >= filter->kept - oldest)
+			compact(filter, base);
+	}
+}
+
+/* Take the byte range out of the chunk read. Return 1 if the end of
+ * range is reached.
+ */
+static bool
+cut_range(icmpd_filter_t *filter, char *chunk, unsigned long *len)
+{
+	uint64_t pos = filter->position;
+	uint64_t n = *len;
+
+	filter->position += n;
+
+	if (!filter->byte_length && !filter->byte_offset)
+		return 0;
+
+	uint64_t lo = 0;
+	if (filter->byte_offset > pos)
+		lo = filter->byte_offset - pos < n ?
+		     filter->byte_offset - pos : n;
+
+	uint64_t hi = n;
+	bool end_reached = 0;
+	if (filter->byte_length) {
+		uint64_t end = filter->byte_offset + filter->byte_length;
+
+		hi = end > pos ? (end - pos < n ? end - pos : n) : 0;
+		if (hi < lo)
+			hi = lo;
+
+		end_reached = filter->position >= end;
+	}
+
+	if (lo)
+		memmove(chunk, chunk + lo, hi - lo);
+	*len = hi - lo;
+
+	return end_reached;
+}
+
+/*
+ * Filter the chunk just read behind the output kept. The partial line
+ * is taken as the last line at the end of output. Return 1 if the rest
+ * of output is dropped.
+ */
+bool
+icmpd_filter_run(icmpd_filter_t *filter, icmpd_output_t *out, bool eof)
+{
+	char *base = out->msg + out->offset;
+
+	if (filter->done) {
+		out->len = filter->kept;
+		return 1;
+	}
+
+	unsigned long start = filter->kept + filter->pending;
+	unsigned long len = out->len - start;
+
+	if (cut_range(filter, base + start, &len))
+		eof = 1;
+
+	unsigned long end = start + len;
+	unsigned long p = filter->kept;
+
+	if (!filter->pattern && !filter->head && !filter->tail) {
+		filter->kept = end;
+		p = end;
+	} else if (filter->pattern && !(filter->flags & (ICMP_FILTER_REGEX |
+						      ICMP_FILTER_INVERT))) {
+		/* Search the whole chunk rather than line by line */
+		while (p < end && !filter->done) {
+			const char *hit = find_substring(base + p, end - p,
+							 filter->pattern,
+							 filter->pattern_len);
+			if (!hit)
+				break;
+
+			unsigned long h = hit - base;
+			const char *nl = memchr(hit, '\n', end - h);
+			if (!nl && !eof)
+				break;
+
+			const char *prev = memrchr(base + p, '\n', h - p);
+			unsigned long line_start = prev ? prev + 1 - base : p;
+			unsigned long line_end = nl ? nl + 1 - base : end;
+
+			keep_line(filter, base, line_start, line_end);
+			p = line_end;
+		}
+
+		/* The complete lines not matched are dropped */
+		if (eof || filter->done)
+			p = end;
+		else if (p < end) {
+			const char *nl = memrchr(base + p, '\n', end - p);
+			if (nl)
+				p = nl + 1 - base;
+		}
+	} else {
+		while (p < end && !filter->done) {
+			char *nl = memchr(base + p, '\n', end - p);
+			if (!nl && !eof)
+				break;
+
+			unsigned long line_end = nl ? nl + 1 - base : end;
+			if (match_line(filter, base + p,
+				       (nl ? nl - base : end) - p))
+				keep_line(filter, base, p, line_end);
+
+			p = line_end;
+		}
+	}
+
+	if (eof || filter->done)
+		p = end;
+
+	/* Move the partial line behind the output kept */
+	filter->pending = end - p;
+	if (filter->pending && p != filter->kept)
+		memmove(base + filter->kept, base + p, filter->pending);
+
+	if (eof) {
+		filter->done = 1;
+		if (filter->tail && filter->ring_count)
+			compact(filter, base);
+	}
+
+	out->len = filter->kept + filter->pending;
+
+	return filter->done;
+}
+
+/* Create the filter from the value of ICMP_OPT_FILTER. Return NULL with
+ * errno set if the value is malformed.
+ */
+icmpd_filter_t *
+icmpd_filter_create(const void *value, unsigned long value_len)
+{
+	icmp_filter_t opt;
+
+	if (value_len < sizeof(opt)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	eee_memcpy(&opt, value, sizeof(opt));
+
+	const char *pattern = (const char *)value + sizeof(opt);
+	if (opt.pattern_length > value_len - sizeof(opt) ||
+	    opt.tail > ICMPD_FILTER_MAX_TAIL ||
+	    memchr(pattern, '\n', opt.pattern_length) ||
+	    memchr(pattern, 0, opt.pattern_length)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	icmpd_filter_t *filter = eee_malloc(sizeof(*filter));
+	if (!filter) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	eee_memset(filter, 0, sizeof(*filter));
+	filter->byte_offset = opt.byte_offset;
+	filter->byte_length = opt.byte_length;
+	filter->head = opt.head;
+	filter->tail = opt.tail;
+	filter->flags = opt.flags;
+
+	if (opt.pattern_length) {
+		filter->pattern = eee_malloc(opt.pattern_length + 1);
+		if (!filter->pattern)
+			goto err;
+
+		eee_memcpy(filter->pattern, pattern, opt.pattern_length);
+		filter->pattern[opt.pattern_length] = 0;
+		filter->pattern_len = opt.pattern_length;
+
+		if ((filter->flags & ICMP_FILTER_REGEX) &&
+		    regcomp(&filter->regex, filter->pattern,
+			    REG_EXTENDED | REG_NOSUB)) {
+			err("Invalid regular expression %s\n",
+			    filter->pattern);
+			eee_mfree(filter->pattern);
+			eee_mfree(filter);
+			errno = EINVAL;
+			return NULL;
+		}
+	} else
+		filter->flags &= ~ICMP_FILTER_REGEX;
+
+	if (filter->tail) {
+		filter->ring = eee_malloc(sizeof(*filter->ring) *
+					  filter->tail);
+		if (!filter->ring) {
+			icmpd_filter_destroy(filter);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	return filter;
+
+err:
+	eee_mfree(filter);
+	errno = ENOMEM;
+
+	return NULL;
+}
+
+void
+icmpd_filter_destroy(icmpd_filter_t *filter)
+{
+	if (!filter)
+		return;
+
+	if (filter->flags & ICMP_FILTER_REGEX)
+		regfree(&filter->regex);
+
+	eee_mfree(filter->ring);
+	eee_mfree(filter->pattern);
+	eee_mfree(filter);
+}
@@ -0,0 +1,527 @@
+/*
+ * ICMPD private definitions
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#ifndef ICMPD_H
+#define ICMPD_H
+
+#include <ic.h>
+
+/* The pipe size requested for the output of child */
+#define ICMPD_OUTPUT_PIPE_SIZE		(1024 * 1024)
+/* The minimum room to read the output of child */
+#define ICMPD_OUTPUT_CHUNK		(64 * 1024)
+/* The amount of stdin buffered before the chunk is acknowledged */
+#define ICMPD_STDIN_WINDOW		(256 * 1024)
+/* Give up the stdin stream if the client is silent for so long (ms) */
+#define ICMPD_STDIN_TIMEOUT		60000
+/* The time given to the command to exit after SIGTERM (ms) */
+#define ICMPD_KILL_GRACE		5000
+/* The maximum number of stages in a pipeline */
+#define ICMPD_MAX_STAGES		16
+/* The maximum number of commands running concurrently in a lane */
+#define ICMPD_MAX_COMMANDS		64
+/* The number of pollfd used by a running command */
+#define ICMPD_COMMAND_NR_FD		4
+/* The maximum number of sessions kept in a lane */
+#define ICMPD_MAX_SESSIONS		16
+/* The number of pollfd used by a session */
+#define ICMPD_SESSION_NR_FD		4
+/* Close the session idle for so long unless configured (ms) */
+#define ICMPD_SESSION_IDLE_TIMEOUT	300000
+/* The maximum number of commandlines in a batch */
+#define ICMPD_BATCH_MAX_COMMANDS	1024
+/* The commandlines of batch running in parallel unless configured */
+#define ICMPD_BATCH_PARALLEL		8
+/* The maximum number of prepared commands kept by a worker */
+#define ICMPD_MAX_PREPARED		256
+/* The maximum number of commandlines planned by a worker */
+#define ICMPD_MAX_PLANS			256
+/* The maximum number of programs resolved against PATH by a spawner */
+#define ICMPD_MAX_RESOLVED		256
+/* The maximum number of last lines kept by the output filter */
+#define ICMPD_FILTER_MAX_TAIL		(1024 * 1024)
+/* The total size of results spilled by the workers unless configured */
+#define ICMPD_SPILL_BUDGET		(1024UL * 1024 * 1024)
+/* Drop the result spilled if not fetched for so long unless configured
+ * (ms).
+ */
+#define ICMPD_SPILL_TTL			300000
+/* The maximum length of range answered by a fetch */
+#define ICMPD_FETCH_MAX_LENGTH		(16 * 1024 * 1024)
+/* The total size of baselines kept for the delta unless configured */
+#define ICMPD_DELTA_BUDGET		(64UL * 1024 * 1024)
+/* The size of result cache shared by the workers unless configured */
+#define ICMPD_CACHE_BUDGET		(64UL * 1024 * 1024)
+
+/* The request being handled */
+typedef struct {
+	ic_transport_t tr;
+	void *msg;
+	unsigned long msg_len;
+	/* The commands running in the lane */
+	bcll_t *commands;
+	/* The sessions kept in the lane */
+	bcll_t *sessions;
+	/* The batches running in the lane */
+	bcll_t *batches;
+	/* The eventfd to wake up the lane */
+	int wake_fd;
+} icmpd_request_t;
+
+typedef struct icmpd_filter icmpd_filter_t;
+typedef struct icmpd_spill icmpd_spill_t;
+
+/* The output of child captured into the response message */
+typedef struct {
+	ic_transport_t tr;
+	char *msg;
+	unsigned long size;
+	/* The room reserved for the header */
+	unsigned long offset;
+	unsigned long len;
+	/* Run over each chunk read, or NULL */
+	icmpd_filter_t *filter;
+	/* Take the output beyond the preview once it grows too large, or
+	 * NULL.
+	 */
+	icmpd_spill_t *spill;
+	/* The rest of output is dropped by the filter or the spill, so the
+	 * writer may get SIGPIPE.
+	 */
+	bool cut_off;
+} icmpd_output_t;
+
+/* The child launched for a commandline. If the commandline is a
+ * pipeline, the child stands for all its stages.
+ */
+typedef struct {
+	/* The first stage leading the process group */
+	pid_t pid;
+	/* The write end of the pipe bound to the stdin of child */
+	int stdin_fd;
+	/* The read end of the pipe bound to the stdout of child */
+	int stdout_fd;
+	/* The read end of the pipe bound to the stderr of child */
+	int stderr_fd;
+	/* The socket to receive the exit status from zygote, or -1 if the
+	 * child is spawned by the daemon itself.
+	 */
+	int zygote_fd;
+	/* The pidfd of the last stage spawned by the daemon itself, or -1
+	 * if it is not supported.
+	 */
+	int pidfd;
+	/* The stages spawned by the daemon itself. The pid is cleared once
+	 * the stage is reaped.
+	 */
+	pid_t pids[ICMPD_MAX_STAGES];
+	unsigned int nr_stage;
+	/* The exit status of the last stage, and the resource usage of
+	 * the stages reaped so far.
+	 */
+	int status;
+	struct rusage rusage;
+	/* The child is launched once for the identical requests coalesced
+	 * by zygote. Its stdout and stderr are the files read once it
+	 * exits, and it keeps running for the others if a request gives
+	 * it up.
+	 */
+	bool shared;
+} icmpd_child_t;
+
+typedef struct icmpd_stdin_stream icmpd_stdin_stream_t;
+typedef struct icmpd_batch icmpd_batch_t;
+typedef struct icmpd_delta icmpd_delta_t;
+
+/* The command running asynchronously in the lane */
+typedef struct {
+	bcll_t link;
+	ic_transport_t tr;
+	icmpd_child_t child;
+	/* The stdout captured into the response message */
+	icmpd_output_t out;
+	/* The stderr appended to the stdout once the command completes */
+	icmpd_output_t err;
+	/* The requestor answered with the output, or 0 if the output is
+	 * answered to the last chunk of stdin.
+	 */
+	ic_transport_reply_t reply;
+	/* The stdin streamed by the client, or NULL */
+	icmpd_stdin_stream_t *stdin_stream;
+	bool output_done;
+	bool error_done;
+	bool exited;
+	int status;
+	struct rusage rusage;
+	/* When the command is started and exits in microseconds */
+	unsigned long start_time;
+	unsigned long exit_time;
+	/* The wall-clock time to terminate the command, or 0 if unlimited */
+	unsigned long deadline;
+	/* The signal sent to the command due to the timeout */
+	int kill_signal;
+	bool timed_out;
+	/* The command is killed without answering the output */
+	bool abandoned;
+	/* The id chosen by the client, or 0 */
+	uint64_t request_id;
+	/* Linked in the registry of all lanes if the request id is given */
+	bcll_t registry_link;
+	/* The eventfd to wake up the lane */
+	int wake_fd;
+	/* The lease of request in ms, or 0 if not leased. The following
+	 * fields are protected by the registry lock.
+	 */
+	unsigned long lease;
+	unsigned long renew_time;
+	bool cancelled;
+	/* The batch answered with the output instead of requestor, or
+	 * NULL.
+	 */
+	icmpd_batch_t *batch;
+	/* The index of commandline in the batch */
+	unsigned int batch_index;
+	/* The stdout is answered as the delta, or NULL */
+	icmpd_delta_t *delta;
+	/* The key to keep the output in the result cache for cache_ttl
+	 * ms, or NULL.
+	 */
+	void *cache_key;
+	unsigned long cache_key_len;
+	unsigned long cache_ttl;
+	/* The output is answered from the result cache */
+	bool cached;
+} icmpd_command_t;
+
+/* The long-lived shell of client session */
+typedef struct {
+	bcll_t link;
+	ic_transport_t tr;
+	uint64_t session_id;
+	icmpd_child_t child;
+	/* Printed by the shell after the commandline to frame its output */
+	char marker[32];
+	/* The framed commandline not yet written to the shell */
+	char *input;
+	unsigned long input_len;
+	unsigned long input_offset;
+	/* The output of commandline running */
+	icmpd_output_t out;
+	icmpd_output_t err;
+	bool output_done;
+	bool error_done;
+	int exit_code;
+	/* The requestor of commandline running, or 0 if idle */
+	ic_transport_reply_t reply;
+	bool busy;
+	bool exited;
+	int status;
+	/* When the commandline is started in microseconds */
+	unsigned long start_time;
+	/* The wall-clock time to kill the shell running the commandline,
+	 * or to close the idle session.
+	 */
+	unsigned long deadline;
+	unsigned long idle_timeout;
+	bool timed_out;
+} icmpd_session_t;
+
+/* The commandlines of client run in parallel and answered at once */
+struct icmpd_batch {
+	bcll_t link;
+	ic_transport_t tr;
+	/* The commands running in the lane */
+	bcll_t *commands;
+	int wake_fd;
+	ic_transport_reply_t reply;
+	/* The copy of commandlines requested */
+	char *commandlines;
+	unsigned long *offsets;
+	unsigned int nr_command;
+	/* The index of commandlines to start */
+	unsigned int *pending;
+	unsigned int nr_pending;
+	unsigned int next_pending;
+	unsigned int nr_running;
+	unsigned int nr_done;
+	unsigned int parallel;
+	/* The records of commandlines completed */
+	icmpd_output_t out;
+	/* The errno answered instead of the records, or 0 */
+	int error;
+};
+
+extern int
+icmpd_build_argv(const char *argument, bool pipeline, char ***ret_argv,
+		 char **ret_args);
+
+extern char *
+icmpd_join_argv(char **argv, unsigned long *ret_len);
+
+extern int
+icmpd_resolve_program(const char *program, char *path, unsigned long size);
+
+extern int
+icmpd_spawn(char **argv, icmpd_child_t *child);
+
+extern int
+icmpd_spawn_to_files(char **argv, icmpd_child_t *child, int out_fd,
+		     int err_fd);
+
+extern int
+icmpd_output_init(icmpd_output_t *out, ic_transport_t tr,
+		  unsigned long offset);
+
+extern int
+icmpd_output_read(icmpd_output_t *out, int fd);
+
+extern void *
+icmpd_output_reserve(icmpd_output_t *out, unsigned long len);
+
+extern void
+icmpd_output_destroy(icmpd_output_t *out);
+
+extern icmpd_filter_t *
+icmpd_filter_create(const void *value, unsigned long value_len);
+
+extern bool
+icmpd_filter_run(icmpd_filter_t *filter, icmpd_output_t *out, bool eof);
+
+extern void
+icmpd_filter_destroy(icmpd_filter_t *filter);
+
+extern int
+icmpd_spill_init(unsigned int nr_worker);
+
+extern void
+icmpd_spill_attach(unsigned int worker);
+
+extern void
+icmpd_spill_reclaim(unsigned int worker);
+
+extern icmpd_spill_t *
+icmpd_spill_create(const void *value, unsigned long value_len,
+		   const char *container);
+
+extern int
+icmpd_spill_write(icmpd_spill_t *spill, icmpd_output_t *out);
+
+extern bool
+icmpd_spill_publish(icmpd_spill_t *spill, icmp_spill_result_t *result);
+
+extern void
+icmpd_spill_destroy(icmpd_spill_t *spill);
+
+extern void
+icmpd_spill_expire(int *timeout);
+
+extern int
+icmpd_spill_fetch(icmpd_request_t *req, const void *payload,
+		  unsigned long payload_len);
+
+extern icmpd_delta_t *
+icmpd_delta_create(const void *value, unsigned long value_len,
+		   const char *container, const void *key,
+		   unsigned long key_len);
+
+extern void
+icmpd_delta_encode(icmpd_delta_t *delta, icmpd_output_t *out,
+		   icmp_delta_result_t *result);
+
+extern void
+icmpd_delta_destroy(icmpd_delta_t *delta);
+
+extern int
+icmpd_policy_load(void);
+
+extern int
+icmpd_policy_check(const char *cmd, const char *target_container_name);
+
+extern unsigned long
+icmpd_policy_generation(void);
+
+extern int
+icmpd_cache_init(void);
+
+extern unsigned long
+icmpd_cache_ttl(char **argv);
+
+extern int
+icmpd_cache_lookup(const void *key, unsigned long key_len,
+		   icmpd_output_t *out, icmpd_output_t *err,
+		   icmp_exec_result_t *result);
+
+extern void
+icmpd_cache_store(const void *key, unsigned long key_len, unsigned long ttl,
+		  const void *out, unsigned long out_len, const void *err,
+		  unsigned long err_len, const icmp_exec_result_t *result);
+
+extern void
+icmpd_cache_stats(icmp_builtin_cache_t *stats);
+
+extern int
+icmpd_stdin_open(icmpd_command_t *cmd, uint64_t stream_id);
+
+extern icmpd_command_t *
+icmpd_stdin_find(bcll_t *commands, uint64_t stream_id);
+
+extern int
+icmpd_stdin_receive(icmpd_command_t *cmd, icmpd_request_t *req,
+		    const void *data, unsigned long data_len);
+
+extern int
+icmpd_stdin_write(icmpd_command_t *cmd);
+
+extern short
+icmpd_stdin_events(icmpd_command_t *cmd);
+
+extern unsigned long
+icmpd_stdin_deadline(icmpd_command_t *cmd);
+
+extern void
+icmpd_stdin_expire(icmpd_command_t *cmd, unsigned long now);
+
+extern bool
+icmpd_stdin_done(icmpd_command_t *cmd);
+
+extern ic_transport_reply_t
+icmpd_stdin_close(icmpd_command_t *cmd);
+
+extern int
+icmpd_command_fail(icmpd_request_t *req, const char *program, int error,
+		   icmpd_batch_t *batch, unsigned int batch_index);
+
+extern int
+icmpd_command_start_argv(icmpd_request_t *req, char **argv,
+			 unsigned long timeout, const void *payload, unsigned long payload_len,
+			 unsigned long opt_offset, icmpd_batch_t *batch,
+			 unsigned int batch_index);
+
+extern int
+icmpd_command_start(icmpd_request_t *req, const char *cmdline,
+		    unsigned long cmdline_len, icmpd_batch_t *batch,
+		    unsigned int batch_index);
+
+extern void
+icmpd_command_poll(icmpd_command_t *cmd, struct pollfd *fds, int *timeout);
+
+extern int
+icmpd_command_handle(icmpd_command_t *cmd, struct pollfd *fds);
+
+extern void
+icmpd_command_destroy(icmpd_command_t *cmd);
+
+extern int
+icmpd_command_cancel(uint64_t request_id);
+
+extern void
+icmpd_command_renew(uint64_t request_id);
+
+extern unsigned long
+icmpd_command_timeout(const char *cmd);
+
+extern char *
+icmpd_session_shell(void);
+
+extern int
+icmpd_session_open(icmpd_request_t *req, uint64_t session_id,
+		   const char *shell);
+
+extern int
+icmpd_session_exec(icmpd_request_t *req, uint64_t session_id,
+		   const char *cmdline);
+
+extern int
+icmpd_session_close(icmpd_request_t *req, uint64_t session_id);
+
+extern int
+icmpd_session_check(const char *cmdline);
+
+extern int
+icmpd_session_reply(icmpd_request_t *req, int error);
+
+extern void
+icmpd_session_poll(icmpd_session_t *ses, struct pollfd *fds, int *timeout);
+
+extern int
+icmpd_session_handle(icmpd_session_t *ses, struct pollfd *fds);
+
+extern void
+icmpd_session_destroy(icmpd_session_t *ses);
+
+extern int
+icmpd_batch_start(icmpd_request_t *req, const void *payload,
+		  unsigned long payload_len,
+		  int (*check)(icmpd_request_t *, const char *,
+			       unsigned long));
+
+extern void
+icmpd_batch_add(icmpd_batch_t *batch, unsigned int index, int error,
+		const void *out, unsigned long out_len, const void *err,
+		unsigned long err_len, const icmp_exec_result_t *result);
+
+extern int
+icmpd_batch_schedule(icmpd_batch_t *batch, unsigned int *nr_command);
+
+extern void
+icmpd_batch_destroy(icmpd_batch_t *batch);
+
+extern int
+icmpd_plan(icmpd_request_t *req, const char *cmdline, bool pipeline,
+	   int (*check)(icmpd_request_t *, char **), char ***ret_argv,
+	   char **ret_args, unsigned long *ret_timeout);
+
+extern int
+icmpd_prepare(icmpd_request_t *req, const void *payload,
+	      unsigned long payload_len,
+	      int (*check)(icmpd_request_t *, char **));
+
+extern int
+icmpd_prepared_execute(icmpd_request_t *req, const void *payload,
+		       unsigned long payload_len);
+
+extern const char *
+icmpd_builtin_command(const void *payload, unsigned long payload_len);
+
+extern int
+icmpd_builtin_run(icmpd_request_t *req, const void *payload,
+		  unsigned long payload_len);
+
+extern int
+icmpd_builtin_fail(icmpd_request_t *req, int error);
+
+extern int
+icmpd_send_response(icmpd_request_t *req, uint16_t cc, const void *payload,
+		    unsigned long payload_len);
+
+extern int
+icmpd_zygote_start(void);
+
+extern int
+icmpd_launch(char **argv, icmpd_child_t *child, bool shared);
+
+extern void
+icmpd_detach(icmpd_child_t *child);
+
+extern int
+icmpd_wait(icmpd_child_t *child, int *status);
+
+extern int
+icmpd_try_wait(icmpd_child_t *child, int *status, struct rusage *rusage);
+
+extern int
+icmpd_exit_fd(icmpd_child_t *child);
+
+extern int
+icmpd_kill(icmpd_child_t *child, int sig);
+
+#endif	/* ICMPD_H */
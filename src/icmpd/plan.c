@@ -0,0 +1,259 @@
+/*
+ * ICMPD commandline plans
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The pollers send the same commandlines at a high rate, and each of
+ * them used to be tokenized, authorized and looked up for the timeout
+ * again. The plan of commandline keeps the arguments tokenized, the
+ * verdict of authorization and the timeout, so the commandline planned
+ * already goes to the launch directly. The programs are resolved against
+ * PATH by the spawn.
+ *
+ * The plans are kept by the worker for the container served, and they
+ * are shared by the lanes. The least recently used one is evicted once
+ * there are too many, and they become stale once the policy compiled
+ * from the configuration reloaded is applied.
+ */
+
+#include "icmpd.h"
+
+typedef struct {
+	bcll_t link;
+	uint64_t hash;
+	/* The container requesting the commandline */
+	char *container;
+	/* The generation of policy the commandline is checked against */
+	unsigned long generation;
+	char *cmdline;
+	/* The standalone | of commandline separates the stages */
+	bool pipeline;
+	/* The arguments in the layout of icmp_argv_t */
+	char *args;
+	unsigned long args_len;
+	unsigned long timeout;
+	bool denied;
+} icmpd_plan_t;
+
+/* The plans in the order of use, the least recent first */
+static BCLL_DECLARE(plans);
+static unsigned int nr_plan;
+static pthread_mutex_t plan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t
+hash_plan(const char *cmdline, const char *container)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (const char *p = cmdline; *p; ++p) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	/* The NUL separates the commandline from the container */
+	hash *= 0x100000001b3ULL;
+
+	for (const char *p = container; *p; ++p) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static void
+destroy_plan(icmpd_plan_t *plan)
+{
+	bcll_del(&plan->link);
+	--nr_plan;
+
+	eee_mfree(plan->args);
+	eee_mfree(plan);
+}
+
+/* Look up the plan. The stale ones met are dropped. */
+static icmpd_plan_t *
+find_plan(uint64_t hash, const char *cmdline, bool pipeline,
+	  const char *container, unsigned long generation)
+{
+	icmpd_plan_t *plan, *tmp;
+
+	bcll_for_each_link_safe(plan, tmp, &plans, link) {
+		if (plan->generation != generation) {
+			destroy_plan(plan);
+			continue;
+		}
+
+		if (plan->hash != hash || plan->pipeline != pipeline ||
+		    strcmp(plan->cmdline, cmdline) ||
+		    strcmp(plan->container, container))
+			continue;
+
+		/* Keep the recently used ones from eviction */
+		bcll_del(&plan->link);
+		bcll_add_tail(&plans, &plan->link);
+
+		return plan;
+	}
+
+	return NULL;
+}
+
+static icmpd_plan_t *
+create_plan(uint64_t hash, const char *cmdline, bool pipeline,
+	    const char *container, unsigned long generation, char **argv,
+	    unsigned long timeout, bool denied)
+{
+	unsigned long cmdline_len = strlen(cmdline) + 1;
+	unsigned long container_len = strlen(container) + 1;
+	icmpd_plan_t *plan = eee_malloc(sizeof(*plan) + cmdline_len +
+					container_len);
+	if (!plan)
+		return NULL;
+
+	plan->args = icmpd_join_argv(argv, &plan->args_len);
+	if (!plan->args) {
+		eee_mfree(plan);
+		return NULL;
+	}
+
+	plan->cmdline = (char *)(plan + 1);
+	plan->container = plan->cmdline + cmdline_len;
+	eee_memcpy(plan->cmdline, cmdline, cmdline_len);
+	eee_memcpy(plan->container, container, container_len);
+
+	plan->hash = hash;
+	plan->pipeline = pipeline;
+	plan->generation = generation;
+	plan->timeout = timeout;
+	plan->denied = denied;
+
+	return plan;
+}
+
+/* Copy argv[] out of the plan since it may be evicted by the other lane
+ * once unlocked.
+ */
+static int
+copy_plan(icmpd_plan_t *plan, char ***ret_argv, char **ret_args)
+{
+	char *args = eee_malloc(plan->args_len);
+	if (!args)
+		return -1;
+
+	eee_memcpy(args, plan->args, plan->args_len);
+
+	char **argv;
+	if (icmp_get_argv(args, plan->args_len, &argv, NULL) < 0) {
+		eee_mfree(args);
+		return -1;
+	}
+
+	*ret_argv = argv;
+	*ret_args = args;
+
+	return 0;
+}
+
+/*
+ * Tokenize the commandline into argv[] and args, and authorize it with
+ * check(), as icmpd_build_argv() and check() would. The timeout of
+ * command is returned as well. The denied commandline fails with
+ * IC_ERRNO_COMMAND_DENIED.
+ */
+int
+icmpd_plan(icmpd_request_t *req, const char *cmdline, bool pipeline,
+	   int (*check)(icmpd_request_t *, char **), char ***ret_argv,
+	   char **ret_args, unsigned long *ret_timeout)
+{
+	const char *container = ic_transport_name(req->tr);
+	/* The commandline checked against the policy being replaced is
+	 * stale right away.
+	 */
+	unsigned long generation = icmpd_policy_generation();
+	uint64_t hash = hash_plan(cmdline, container);
+	int rc = 0;
+
+	pthread_mutex_lock(&plan_lock);
+	icmpd_plan_t *plan = find_plan(hash, cmdline, pipeline, container,
+				       generation);
+	if (plan) {
+		if (plan->denied) {
+			ic_set_errno(IC_ERRNO_COMMAND_DENIED);
+			rc = -1;
+		} else if (copy_plan(plan, ret_argv, ret_args)) {
+			ic_set_errno(IC_ERRNO_OUT_OF_MEM);
+			rc = -1;
+		} else
+			*ret_timeout = plan->timeout;
+	}
+	pthread_mutex_unlock(&plan_lock);
+
+	if (plan) {
+		if (rc && ic_get_errno() == IC_ERRNO_COMMAND_DENIED)
+			warn("%s is denied for %s\n", cmdline, container);
+		return rc;
+	}
+
+	char **argv;
+	char *args;
+	rc = icmpd_build_argv(cmdline, pipeline, &argv, &args);
+	if (rc)
+		return rc;
+
+	bool denied = 0;
+	rc = check(req, argv);
+	if (rc) {
+		if (ic_get_errno() != IC_ERRNO_COMMAND_DENIED)
+			goto err_check;
+
+		denied = 1;
+	}
+
+	unsigned long timeout = 0;
+	if (!denied)
+		timeout = icmpd_command_timeout(argv[0] ? argv[0] : "");
+
+	/* The empty commandline is refused by the spawn, not planned */
+	plan = argv[0] ? create_plan(hash, cmdline, pipeline, container,
+				     generation, argv, timeout, denied) : NULL;
+	if (plan) {
+		pthread_mutex_lock(&plan_lock);
+		if (nr_plan >= ICMPD_MAX_PLANS) {
+			icmpd_plan_t *lru;
+
+			/* Evict the least recently used one */
+			bcll_for_each_link(lru, &plans, link)
+				break;
+
+			destroy_plan(lru);
+		}
+		bcll_add_tail(&plans, &plan->link);
+		++nr_plan;
+		pthread_mutex_unlock(&plan_lock);
+	}
+
+	if (denied)
+		goto err_check;
+
+	*ret_argv = argv;
+	*ret_args = args;
+	*ret_timeout = timeout;
+
+	return 0;
+
+err_check:
+	eee_mfree(argv);
+	eee_mfree(args);
+
+	return -1;
+}
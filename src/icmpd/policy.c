@@ -0,0 +1,597 @@
+/*
+ * ICMPD command policy
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * Each stage of every request is checked against .<container>.commands
+ * of the local container and .commands.<command>.acl of the command.
+ * Querying and splitting the configuration per request is costly, so
+ * both are compiled when the configuration is loaded or reloaded.
+ *
+ * .<container>.commands is compiled into a prefix trie, whose edges are
+ * kept in a hash table keyed by the parent node and the character. A
+ * command is allowed if any prefix of it, including itself, ends at a
+ * node of an entry.
+ *
+ * The names of containers in .commands.<command>.acl are interned, and
+ * the pairs of command and container granted are kept in a hash set.
+ * So a decision takes the length of command and container name without
+ * allocating anything.
+ */
+
+#include "icmpd.h"
+
+/* The slot of hash tables not used */
+#define POLICY_NIL			0
+
+typedef struct {
+	/* POLICY_NIL if the slot is not used */
+	uint32_t child;
+	uint32_t parent;
+	unsigned char c;
+} policy_edge_t;
+
+typedef struct {
+	/* POLICY_NIL if the slot is not used */
+	uint32_t id;
+	uint32_t len;
+	uint64_t hash;
+	char *name;
+	/* The command with .commands.<command>.acl: '*' */
+	bool global;
+} policy_name_t;
+
+typedef struct {
+	/* The container of .<container>.commands applied */
+	char *container;
+	/* Unlimited if .<container>.commands is not configured or '*' */
+	bool limited;
+	uint32_t edge_mask;
+	policy_edge_t *edges;
+	/* The node ending an entry, indexed by node. The root is 0. */
+	uint8_t *terminal;
+	uint32_t container_mask;
+	policy_name_t *containers;
+	/* The commands with .commands.<command>.acl */
+	uint32_t command_mask;
+	policy_name_t *commands;
+	/* The command id in high 32 bits and the container id in low */
+	uint32_t grant_mask;
+	uint64_t *grants;
+} policy_t;
+
+/* The decisions run in parallel while the reload swaps the policy */
+static pthread_rwlock_t policy_lock = PTHREAD_RWLOCK_INITIALIZER;
+static policy_t *policy;
+/* Bumped along with each swap of the policy */
+static unsigned long generation;
+
+static uint64_t
+hash_name(const char *name, unsigned long len)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (unsigned long i = 0; i < len; ++i) {
+		hash ^= (unsigned char)name[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static uint32_t
+hash_edge(uint32_t parent, unsigned char c)
+{
+	return (uint32_t)((((uint64_t)parent << 8 | c) *
+			   0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static uint32_t
+hash_grant(uint64_t grant)
+{
+	return (uint32_t)((grant * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/* The mask of hash table holding nr items at most half full */
+static uint32_t
+table_mask(unsigned long nr)
+{
+	uint32_t size = 16;
+
+	while (size < nr * 2)
+		size <<= 1;
+
+	return size - 1;
+}
+
+static policy_name_t *
+find_name(policy_name_t *table, uint32_t mask, const char *name,
+	  unsigned long len, uint64_t hash)
+{
+	for (uint32_t i = hash & mask; ; i = (i + 1) & mask) {
+		policy_name_t *slot = table + i;
+
+		if (slot->id == POLICY_NIL)
+			return slot;
+
+		if (slot->hash == hash && slot->len == len &&
+		    !memcmp(slot->name, name, len))
+			return slot;
+	}
+}
+
+/* Return the slot of name, adding it if absent */
+static policy_name_t *
+intern(policy_name_t *table, uint32_t mask, uint32_t *nr,
+       const char *name)
+{
+	unsigned long len = strlen(name);
+	uint64_t hash = hash_name(name, len);
+	policy_name_t *slot = find_name(table, mask, name, len, hash);
+
+	if (slot->id != POLICY_NIL)
+		return slot;
+
+	slot->name = strdup(name);
+	if (!slot->name)
+		return NULL;
+
+	slot->id = ++*nr;
+	slot->len = len;
+	slot->hash = hash;
+
+	return slot;
+}
+
+static uint32_t
+lookup(policy_name_t *table, uint32_t mask, const char *name,
+       policy_name_t **found)
+{
+	unsigned long len = strlen(name);
+	policy_name_t *slot = find_name(table, mask, name, len,
+					hash_name(name, len));
+
+	if (found)
+		*found = slot;
+
+	return slot->id;
+}
+
+static policy_edge_t *
+find_edge(policy_t *pol, uint32_t parent, unsigned char c)
+{
+	uint32_t mask = pol->edge_mask;
+
+	for (uint32_t i = hash_edge(parent, c) & mask; ; i = (i + 1) & mask) {
+		policy_edge_t *edge = pol->edges + i;
+
+		if (edge->child == POLICY_NIL ||
+		    (edge->parent == parent && edge->c == c))
+			return edge;
+	}
+}
+
+static uint64_t *
+find_grant(policy_t *pol, uint64_t grant)
+{
+	uint32_t mask = pol->grant_mask;
+
+	for (uint32_t i = hash_grant(grant) & mask; ; i = (i + 1) & mask) {
+		if (pol->grants[i] == POLICY_NIL || pol->grants[i] == grant)
+			return pol->grants + i;
+	}
+}
+
+static void
+free_names(policy_name_t *table, uint32_t mask)
+{
+	if (!table)
+		return;
+
+	for (uint32_t i = 0; i <= mask; ++i)
+		free(table[i].name);
+
+	eee_mfree(table);
+}
+
+static void
+free_strings(char **strings, unsigned int nr)
+{
+	for (unsigned int i = 0; i < nr; ++i)
+		free(strings[i]);
+
+	free(strings);
+}
+
+static void
+destroy_policy(policy_t *pol)
+{
+	if (!pol)
+		return;
+
+	eee_mfree(pol->container);
+	eee_mfree(pol->edges);
+	eee_mfree(pol->terminal);
+	free_names(pol->containers, pol->container_mask);
+	free_names(pol->commands, pol->command_mask);
+	eee_mfree(pol->grants);
+	eee_mfree(pol);
+}
+
+static void *
+alloc_table(unsigned long size)
+{
+	void *table = eee_malloc(size);
+
+	if (table)
+		memset(table, 0, size);
+
+	return table;
+}
+
+/* Compile .<container>.commands into the prefix trie */
+static int
+compile_commands(policy_t *pol)
+{
+	char *limited_commands = ic_conf_file_query(".%s.commands",
+						    pol->container);
+	if (!limited_commands) {
+		if (strcmp(pol->container, "container-essential")) {
+			info("%s.commands is not configured\n",
+			     pol->container);
+			return 0;
+		}
+
+		/* In case of essential, check the setting for host */
+		limited_commands = ic_conf_file_query(".host.commands");
+		if (!limited_commands) {
+			info("host.commands is not configured\n");
+			return 0;
+		}
+
+		eee_mfree(pol->container);
+		pol->container = strdup("host");
+		if (!pol->container) {
+			eee_mfree(limited_commands);
+			return -1;
+		}
+	}
+
+	if (!strcmp(limited_commands, "*")) {
+		info("Commands are not limited by %s.commands\n",
+		     pol->container);
+		eee_mfree(limited_commands);
+		return 0;
+	}
+
+	unsigned int nr_cmd = 0;
+	char **splitted_cmds = ic_util_split_string(limited_commands, ":",
+						    &nr_cmd);
+	eee_mfree(limited_commands);
+	if (!splitted_cmds) {
+		err("Failed to retrieve the setting of %s.commands\n",
+		    pol->container);
+		return -1;
+	}
+
+	/* Each character of entries adds a node at most */
+	unsigned long nr_node = 1;
+	for (unsigned int i = 0; i < nr_cmd; ++i)
+		nr_node += strlen(splitted_cmds[i]);
+
+	pol->edge_mask = table_mask(nr_node);
+	pol->edges = alloc_table(sizeof(*pol->edges) *
+				 (pol->edge_mask + 1UL));
+	pol->terminal = alloc_table(nr_node);
+	if (!pol->edges || !pol->terminal) {
+		free_strings(splitted_cmds, nr_cmd);
+		return -1;
+	}
+
+	uint32_t nr = 1;
+	for (unsigned int i = 0; i < nr_cmd; ++i) {
+		uint32_t node = 0;
+
+		for (const char *p = splitted_cmds[i]; *p; ++p) {
+			policy_edge_t *edge = find_edge(pol, node,
+							(unsigned char)*p);
+
+			if (edge->child == POLICY_NIL) {
+				edge->parent = node;
+				edge->c = (unsigned char)*p;
+				edge->child = nr++;
+			}
+
+			node = edge->child;
+		}
+
+		pol->terminal[node] = 1;
+	}
+
+	free_strings(splitted_cmds, nr_cmd);
+	pol->limited = 1;
+
+	info("%u entries of %s.commands compiled into %u nodes\n", nr_cmd,
+	     pol->container, nr);
+
+	return 0;
+}
+
+typedef struct {
+	char *command;
+	/* NULL if .commands.<command>.acl: '*' */
+	char **acl;
+	unsigned int nr_acl;
+} policy_acl_t;
+
+typedef struct {
+	policy_acl_t *acls;
+	unsigned int nr_acl;
+	unsigned int max_acl;
+	unsigned long nr_grant;
+} policy_acls_t;
+
+/* Collect .commands.<command>.acl without querying the configuration,
+ * which is locked during the iteration.
+ */
+static int
+collect_acl(const char *command, const char *value, void *data)
+{
+	policy_acls_t *acls = data;
+
+	if (!value)
+		return 0;
+
+	if (acls->nr_acl == acls->max_acl) {
+		unsigned int max_acl = acls->max_acl ? acls->max_acl * 2 : 64;
+		policy_acl_t *p = realloc(acls->acls, sizeof(*p) * max_acl);
+		if (!p)
+			return -1;
+
+		acls->acls = p;
+		acls->max_acl = max_acl;
+	}
+
+	policy_acl_t *acl = acls->acls + acls->nr_acl;
+
+	acl->command = strdup(command);
+	acl->acl = NULL;
+	acl->nr_acl = 0;
+	if (!acl->command)
+		return -1;
+
+	++acls->nr_acl;
+
+	if (!strcmp(value, "*"))
+		return 0;
+
+	acl->acl = ic_util_split_string((char *)value, ":", &acl->nr_acl);
+	if (!acl->acl) {
+		err("Failed to retrieve the setting of commands.%s.acl\n",
+		    command);
+		return -1;
+	}
+
+	acls->nr_grant += acl->nr_acl;
+
+	return 0;
+}
+
+/* Compile .commands.<command>.acl into the grants */
+static int
+compile_acl(policy_t *pol)
+{
+	policy_acls_t acls = {
+		.acls = NULL,
+		.nr_acl = 0,
+		.max_acl = 0,
+		.nr_grant = 0,
+	};
+	int rc = ic_conf_file_foreach(".commands", "acl", collect_acl, &acls);
+	if (rc)
+		goto out;
+
+	rc = -1;
+
+	pol->command_mask = table_mask(acls.nr_acl);
+	pol->commands = alloc_table(sizeof(*pol->commands) *
+				    (pol->command_mask + 1UL));
+	pol->container_mask = table_mask(acls.nr_grant);
+	pol->containers = alloc_table(sizeof(*pol->containers) *
+				      (pol->container_mask + 1UL));
+	pol->grant_mask = table_mask(acls.nr_grant);
+	pol->grants = alloc_table(sizeof(*pol->grants) *
+				  (pol->grant_mask + 1UL));
+	if (!pol->commands || !pol->containers || !pol->grants)
+		goto out;
+
+	uint32_t nr_command_id = 0;
+	uint32_t nr_container_id = 0;
+	for (unsigned int i = 0; i < acls.nr_acl; ++i) {
+		policy_acl_t *acl = acls.acls + i;
+		policy_name_t *command = intern(pol->commands,
+						pol->command_mask,
+						&nr_command_id, acl->command);
+		if (!command)
+			goto out;
+
+		command->global = !acl->acl;
+
+		for (unsigned int j = 0; j < acl->nr_acl; ++j) {
+			policy_name_t *container = intern(pol->containers,
+							  pol->container_mask,
+							  &nr_container_id,
+							  acl->acl[j]);
+			if (!container)
+				goto out;
+
+			uint64_t grant = (uint64_t)command->id << 32 |
+					 container->id;
+
+			*find_grant(pol, grant) = grant;
+		}
+	}
+
+	info("%u acl of commands compiled for %u containers\n", acls.nr_acl,
+	     nr_container_id);
+
+	rc = 0;
+
+out:
+	for (unsigned int i = 0; i < acls.nr_acl; ++i) {
+		free(acls.acls[i].command);
+		free_strings(acls.acls[i].acl, acls.acls[i].nr_acl);
+	}
+
+	free(acls.acls);
+
+	return rc;
+}
+
+/* Compile the current configuration and replace the policy applied */
+int
+icmpd_policy_load(void)
+{
+	policy_t *old;
+	policy_t *pol = alloc_table(sizeof(*pol));
+	if (!pol)
+		return -1;
+
+	pol->container = ic_container_name();
+	if (!pol->container)
+		goto err_compile;
+
+	if (compile_commands(pol) || compile_acl(pol))
+		goto err_compile;
+
+	pthread_rwlock_wrlock(&policy_lock);
+	old = policy;
+	policy = pol;
+	++generation;
+	pthread_rwlock_unlock(&policy_lock);
+
+	destroy_policy(old);
+
+	return 0;
+
+err_compile:
+	destroy_policy(pol);
+
+	err("Failed to compile the policy of commands\n");
+
+	/* Deny everything rather than applying the stale policy */
+	pthread_rwlock_wrlock(&policy_lock);
+	old = policy;
+	policy = NULL;
+	++generation;
+	pthread_rwlock_unlock(&policy_lock);
+
+	destroy_policy(old);
+
+	return -1;
+}
+
+/*
+ * Return the generation of the policy applied. The verdicts kept are
+ * stale once it changes. It is read before the decision, so the verdict
+ * made by the policy replaced meanwhile is never taken as a current one.
+ */
+unsigned long
+icmpd_policy_generation(void)
+{
+	pthread_rwlock_rdlock(&policy_lock);
+	unsigned long gen = generation;
+	pthread_rwlock_unlock(&policy_lock);
+
+	return gen;
+}
+
+static bool
+allowed(policy_t *pol, const char *cmd)
+{
+	if (!pol->limited)
+		return 1;
+
+	uint32_t node = 0;
+
+	for (const char *p = cmd; !pol->terminal[node]; ++p) {
+		if (!*p)
+			return 0;
+
+		policy_edge_t *edge = find_edge(pol, node, (unsigned char)*p);
+		if (edge->child == POLICY_NIL)
+			return 0;
+
+		node = edge->child;
+	}
+
+	return 1;
+}
+
+static bool
+granted(policy_t *pol, const char *cmd, const char *target_container_name)
+{
+	policy_name_t *command;
+	uint32_t command_id = lookup(pol->commands, pol->command_mask, cmd,
+				     &command);
+
+	/* Not configured or '*' */
+	if (command_id == POLICY_NIL || command->global)
+		return 1;
+
+	uint32_t container_id = lookup(pol->containers, pol->container_mask,
+				       target_container_name, NULL);
+	if (container_id == POLICY_NIL)
+		return 0;
+
+	uint64_t grant = (uint64_t)command_id << 32 | container_id;
+
+	return *find_grant(pol, grant) == grant;
+}
+
+/* Check the program against .<container>.commands of local container
+ * and .commands.<program>.acl for the target container.
+ */
+int
+icmpd_policy_check(const char *cmd, const char *target_container_name)
+{
+	int rc = -1;
+
+	pthread_rwlock_rdlock(&policy_lock);
+
+	if (!policy) {
+		err("No policy of commands to check %s\n", cmd);
+		ic_set_errno(IC_ERRNO_COMMAND_DENIED);
+		goto out;
+	}
+
+	if (!allowed(policy, cmd)) {
+		warn("%s is prohibited by %s.commands\n", cmd,
+		     policy->container);
+		ic_set_errno(IC_ERRNO_COMMAND_DENIED);
+		goto out;
+	}
+
+	if (!granted(policy, cmd, target_container_name)) {
+		warn("%s is not granted by commands.%s.acl for %s\n", cmd,
+		     cmd, target_container_name);
+		ic_set_errno(IC_ERRNO_COMMAND_DENIED);
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	pthread_rwlock_unlock(&policy_lock);
+
+	return rc;
+}
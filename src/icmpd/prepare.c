@@ -0,0 +1,296 @@
+/*
+ * ICMPD prepared commands
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The pollers send the same few commandlines over and over again. The
+ * commandline prepared is tokenized and authorized once, and then run
+ * by its handle with the arguments appended, skipping both of them.
+ *
+ * The prepared commands are kept by the worker, so they are scoped to
+ * the container served by the worker, and they are shared by the lanes.
+ * They become stale once the policy compiled from the configuration
+ * reloaded is applied, because the authorization and the timeout may
+ * change.
+ */
+
+#include "icmpd.h"
+
+typedef struct {
+	bcll_t link;
+	uint64_t handle;
+	/* The container preparing the command */
+	char *container;
+	/* The generation of policy the command is checked against */
+	unsigned long generation;
+	/* The commandline to look up the command prepared already */
+	char *cmdline;
+	/* The standalone | of commandline separates the stages */
+	bool pipeline;
+	/* The arguments in the layout of icmp_argv_t */
+	char *args;
+	unsigned long args_len;
+	unsigned long timeout;
+} icmpd_prepared_t;
+
+/* The prepared commands in the order of use, the least recent first */
+static BCLL_DECLARE(prepared);
+static unsigned int nr_prepared;
+static pthread_mutex_t prepared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+destroy_prepared(icmpd_prepared_t *prep)
+{
+	bcll_del(&prep->link);
+	--nr_prepared;
+
+	eee_mfree(prep->args);
+	eee_mfree(prep->cmdline);
+	eee_mfree(prep->container);
+	eee_mfree(prep);
+}
+
+static int
+reply(icmpd_request_t *req, uint16_t cc, int error, uint64_t handle)
+{
+	icmp_prepare_result_t result = {
+		.error = error,
+		.reserved = 0,
+		.handle = handle,
+	};
+
+	return icmpd_send_response(req, cc, &result, sizeof(result));
+}
+
+/* Look up the prepared command. The stale ones met are dropped. */
+static icmpd_prepared_t *
+find_prepared(uint64_t handle, const char *cmdline, bool pipeline,
+	      const char *container, unsigned long generation)
+{
+	icmpd_prepared_t *prep, *tmp;
+
+	bcll_for_each_link_safe(prep, tmp, &prepared, link) {
+		if (prep->generation != generation) {
+			destroy_prepared(prep);
+			continue;
+		}
+
+		if (strcmp(prep->container, container))
+			continue;
+
+		if (cmdline ? prep->pipeline == pipeline &&
+			      !strcmp(prep->cmdline, cmdline) :
+			      prep->handle == handle) {
+			/* Keep the recently used ones from eviction */
+			bcll_del(&prep->link);
+			bcll_add_tail(&prepared, &prep->link);
+			return prep;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Prepare the commandline and answer the handle. The commandline is
+ * authorized with check(). The commandline prepared already is answered
+ * with its handle. The commandline is a pipeline only if the request
+ * carries ICMP_OPT_PIPELINE.
+ */
+int
+icmpd_prepare(icmpd_request_t *req, const void *payload,
+	      unsigned long payload_len,
+	      int (*check)(icmpd_request_t *, char **))
+{
+	const char *cmdline = payload;
+	const char *container = ic_transport_name(req->tr);
+
+	if (strnlen(cmdline, payload_len) == payload_len ||
+	    !cmdline[strspn(cmdline, " \f\n\r\t\v")])
+		return reply(req, ICMP_CC_PREPARE, EINVAL, 0);
+
+	bool pipeline = !!icmp_find_option(payload, payload_len,
+					   ICMP_OPT_PIPELINE, NULL);
+
+	/* The command checked against the policy being replaced is stale
+	 * right away.
+	 */
+	unsigned long generation = icmpd_policy_generation();
+
+	pthread_mutex_lock(&prepared_lock);
+	icmpd_prepared_t *prep = find_prepared(0, cmdline, pipeline,
+					       container, generation);
+	uint64_t handle = prep ? prep->handle : 0;
+	pthread_mutex_unlock(&prepared_lock);
+
+	if (handle)
+		return reply(req, ICMP_CC_PREPARE, 0, handle);
+
+	char **argv;
+	char *args;
+	int rc = icmpd_build_argv(cmdline, pipeline, &argv, &args);
+	if (rc)
+		return reply(req, ICMP_CC_PREPARE, ENOMEM, 0);
+
+	int error = 0;
+	if (check(req, argv))
+		error = ic_get_errno() == IC_ERRNO_COMMAND_DENIED ?
+			EACCES : EIO;
+
+	prep = NULL;
+	if (!error) {
+		prep = eee_malloc(sizeof(*prep));
+		if (prep) {
+			prep->container = strdup(container);
+			prep->cmdline = strdup(cmdline);
+			prep->pipeline = pipeline;
+			prep->args = icmpd_join_argv(argv, &prep->args_len);
+		}
+
+		if (!prep || !prep->container || !prep->cmdline ||
+		    !prep->args) {
+			if (prep) {
+				eee_mfree(prep->args);
+				eee_mfree(prep->cmdline);
+				eee_mfree(prep->container);
+				eee_mfree(prep);
+			}
+			error = ENOMEM;
+		}
+	}
+
+	if (error) {
+		eee_mfree(argv);
+		eee_mfree(args);
+		return reply(req, ICMP_CC_PREPARE, error, 0);
+	}
+
+	prep->timeout = icmpd_command_timeout(argv[0]);
+	prep->generation = generation;
+	prep->handle = ic_util_random();
+
+	eee_mfree(argv);
+	eee_mfree(args);
+
+	pthread_mutex_lock(&prepared_lock);
+	if (nr_prepared >= ICMPD_MAX_PREPARED) {
+		icmpd_prepared_t *lru;
+
+		/* Evict the least recently used one */
+		bcll_for_each_link(lru, &prepared, link)
+			break;
+
+		destroy_prepared(lru);
+	}
+	bcll_add_tail(&prepared, &prep->link);
+	++nr_prepared;
+	handle = prep->handle;
+	pthread_mutex_unlock(&prepared_lock);
+
+	dbg("Command 0x%llx prepared for %s: %s\n", (unsigned long long)handle,
+	    container, cmdline);
+
+	return reply(req, ICMP_CC_PREPARE, 0, handle);
+}
+
+/*
+ * Run the prepared command with the arguments in the request appended.
+ * The arguments are appended to the last stage and they are unable to
+ * add a stage, because the program of stage isn't authorized.
+ */
+int
+icmpd_prepared_execute(icmpd_request_t *req, const void *payload,
+		       unsigned long payload_len)
+{
+	icmp_execute_t hdr;
+
+	if (payload_len < sizeof(hdr))
+		return reply(req, ICMP_CC_EXECUTE, EINVAL, 0);
+
+	eee_memcpy(&hdr, payload, sizeof(hdr));
+
+	char **extra;
+	unsigned long extra_len;
+	int nr_extra = icmp_get_argv((const char *)payload + sizeof(hdr),
+				     payload_len - sizeof(hdr), &extra,
+				     &extra_len);
+	if (nr_extra < 0)
+		return reply(req, ICMP_CC_EXECUTE, EINVAL, hdr.handle);
+
+	for (char **arg = extra; *arg; ++arg) {
+		if (*arg == ICMP_PIPE) {
+			eee_mfree(extra);
+			return reply(req, ICMP_CC_EXECUTE, EINVAL, hdr.handle);
+		}
+	}
+
+	/* Copy the arguments because the command may be evicted by the
+	 * other lane once unlocked.
+	 */
+	char *args = NULL;
+	unsigned long args_len = 0;
+	unsigned long timeout = 0;
+	int error = ESTALE;
+
+	pthread_mutex_lock(&prepared_lock);
+	icmpd_prepared_t *prep = find_prepared(hdr.handle, NULL, 0,
+					       ic_transport_name(req->tr),
+					       icmpd_policy_generation());
+	if (prep) {
+		args = eee_malloc(prep->args_len);
+		if (args) {
+			eee_memcpy(args, prep->args, prep->args_len);
+			args_len = prep->args_len;
+			timeout = prep->timeout;
+			error = 0;
+		} else
+			error = ENOMEM;
+	}
+	pthread_mutex_unlock(&prepared_lock);
+
+	char **prep_argv = NULL;
+	int nr_prep = 0;
+	if (!error) {
+		nr_prep = icmp_get_argv(args, args_len, &prep_argv, NULL);
+		if (nr_prep < 0)
+			error = ENOMEM;
+	}
+
+	char **argv = NULL;
+	if (!error) {
+		argv = eee_malloc(sizeof(char *) * (nr_prep + nr_extra + 1));
+		if (!argv)
+			error = ENOMEM;
+	}
+
+	if (error) {
+		dbg("Unable to run the prepared command 0x%llx: %s\n",
+		    (unsigned long long)hdr.handle, strerror(error));
+		eee_mfree(prep_argv);
+		eee_mfree(args);
+		eee_mfree(extra);
+		return reply(req, ICMP_CC_EXECUTE, error, hdr.handle);
+	}
+
+	eee_memcpy(argv, prep_argv, sizeof(char *) * nr_prep);
+	eee_memcpy(argv + nr_prep, extra, sizeof(char *) * (nr_extra + 1));
+	eee_mfree(prep_argv);
+
+	int rc = icmpd_command_start_argv(req, argv, timeout, payload,
+					  payload_len,
+					  sizeof(hdr) + extra_len, NULL, 0);
+
+	eee_mfree(argv);
+	eee_mfree(args);
+	eee_mfree(extra);
+
+	return rc;
+}
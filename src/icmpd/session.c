@@ -0,0 +1,689 @@
+/*
+ * ICMPD session
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The session keeps a long-lived shell for the client, so a script
+ * running many commandlines pays for the process creation only once.
+ * The shell is configured with .session_shell, "sh" by default, and it
+ * must understand the POSIX shell syntax.
+ *
+ * Each commandline is written to the stdin of shell, followed by the
+ * printf commands writing the marker of session to the stdout along
+ * with the exit status, and to the stderr. The output is complete once
+ * both markers are read, and it is answered in the same layout as the
+ * output of ICMP_CC_COMMMANDLINE. The stdin of commandline is bound to
+ * /dev/null so it can't consume what follows.
+ *
+ * The shell is killed if the commandline runs out of the time given by
+ * .commands.<command>.timeout or .command_timeout, or by
+ * .session_idle_timeout if neither is configured, so a hung commandline
+ * or the framing broken by an unbalanced quote can't keep the shell
+ * forever. The session is closed if it stays idle longer than
+ * .session_idle_timeout.
+ *
+ * The commandline is run by the shell, so the program of each stage
+ * checked against the policy is only what runs if the shell can't be
+ * told to run anything else. The commandline is thus limited to the
+ * words and the pipes separated by the spaces. The separators, the
+ * substitutions, the redirections and the grouping are refused, and so
+ * are the escapes and the unbalanced quotes. The program of stage must
+ * be a plain word, and neither a reserved word of shell nor a builtin
+ * running whatever it is given, e.g, eval, or changing what the later
+ * commandlines run, e.g, export, whatever the policy allows.
+ *
+ * The sessions are kept by the lane of client and served in its event
+ * loop like the commands.
+ */
+
+#include "icmpd.h"
+
+/* How often to check the exit of shell if it can't be polled (ms) */
+#define ICMPD_REAP_INTERVAL		100
+
+static unsigned long
+idle_timeout(void)
+{
+	char *timeout = ic_conf_file_query(".session_idle_timeout");
+	if (!timeout)
+		return ICMPD_SESSION_IDLE_TIMEOUT;
+
+	unsigned long ms = strtoul(timeout, NULL, 0);
+	eee_mfree(timeout);
+
+	return ms ? ms : ICMPD_SESSION_IDLE_TIMEOUT;
+}
+
+static void
+set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags >= 0 && !(flags & O_NONBLOCK))
+		fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+close_fd(int *fd)
+{
+	if (*fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+static icmpd_session_t *
+find_session(bcll_t *sessions, uint64_t session_id)
+{
+	icmpd_session_t *ses;
+
+	bcll_for_each_link(ses, sessions, link) {
+		if (ses->session_id == session_id)
+			return ses;
+	}
+
+	return NULL;
+}
+
+/* Return the shell configured for the session */
+char *
+icmpd_session_shell(void)
+{
+	char *shell = ic_conf_file_query(".session_shell");
+	if (shell)
+		return shell;
+
+	return strdup("sh");
+}
+
+/* The words the shell takes as something else than the program */
+static const char *const shell_words[] = {
+	/* The reserved words */
+	"!", "case", "coproc", "do", "done", "elif", "else", "esac", "fi",
+	"for", "function", "if", "in", "select", "then", "time", "until",
+	"while",
+	/* The builtins running the words given or changing the lookup and
+	 * the environment of the later commands.
+	 */
+	".", "alias", "builtin", "cd", "command", "declare", "enable",
+	"eval", "exec", "export", "fc", "hash", "local", "readonly", "set",
+	"shopt", "source", "trap", "typeset", "unalias", "unset",
+};
+
+static bool
+shell_word(const char *word, unsigned long len)
+{
+	for (unsigned int i = 0; i < sizeof(shell_words) /
+				     sizeof(shell_words[0]); ++i) {
+		if (strlen(shell_words[i]) == len &&
+		    !memcmp(shell_words[i], word, len))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Refuse the commandline the shell may run more than the programs of
+ * stages in.
+ */
+int
+icmpd_session_check(const char *cmdline)
+{
+	const char *p;
+	char quote = 0;
+	bool in_word = 0;
+	/* In the program of stage, which must be the word checked */
+	bool program = 1;
+	const char *word = cmdline;
+
+	for (p = cmdline; *p; ++p) {
+		if (*p == '\n' || *p == '\r')
+			break;
+
+		/* Nothing is special in the single quotes */
+		if (quote == '\'') {
+			if (*p == '\'')
+				quote = 0;
+			continue;
+		}
+
+		if (*p == '$' || *p == '`' || *p == '\\')
+			break;
+
+		if (quote) {
+			if (*p == '"')
+				quote = 0;
+			continue;
+		}
+
+		if (isspace(*p)) {
+			if (in_word && program && shell_word(word, p - word))
+				break;
+			if (in_word)
+				program = 0;
+			in_word = 0;
+			continue;
+		}
+
+		/* Only the pipe taken as the separator of stages */
+		if (*p == '|') {
+			if (in_word || (p[1] && !isspace(p[1])))
+				break;
+			program = 1;
+			continue;
+		}
+
+		if (!in_word)
+			word = p;
+		in_word = 1;
+
+		/* The quotes, the expansions and the assignments make the
+		 * program different from what is checked.
+		 */
+		if (program && strchr("'\"*?[~=", *p))
+			break;
+
+		if (*p == '\'' || *p == '"') {
+			quote = *p;
+			continue;
+		}
+
+		if (strchr(";&<>(){}", *p))
+			break;
+	}
+
+	if (*p || quote ||
+	    (in_word && program && shell_word(word, p - word))) {
+		warn("Commandline refused by the session: %s\n", cmdline);
+		ic_set_errno(IC_ERRNO_COMMAND_DENIED);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Answer the request with the error only, or 0 on success */
+int
+icmpd_session_reply(icmpd_request_t *req, int error)
+{
+	icmp_session_result_t result = {
+		.error = error,
+	};
+
+	return icmpd_send_response(req, ICMP_CC_SESSION, &result,
+				   sizeof(result));
+}
+
+static void
+write_input(icmpd_session_t *ses)
+{
+	while (ses->input_offset < ses->input_len) {
+		ssize_t sz = write(ses->child.stdin_fd,
+				   ses->input + ses->input_offset,
+				   ses->input_len - ses->input_offset);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN)
+				return;
+
+			/* EPIPE: the exit of shell is handled later */
+			break;
+		}
+
+		ses->input_offset += sz;
+	}
+
+	eee_mfree(ses->input);
+	ses->input = NULL;
+}
+
+/* Look for the marker in the output read so far and cut it off */
+static const char *
+find_marker(icmpd_output_t *out, unsigned long prev_len, const char *marker,
+	    unsigned long marker_len)
+{
+	char *data = out->msg + out->offset;
+	unsigned long from = prev_len > marker_len ? prev_len - marker_len : 0;
+
+	if (out->len < from + marker_len)
+		return NULL;
+
+	return memmem(data + from, out->len - from, marker, marker_len);
+}
+
+static void
+read_output(icmpd_session_t *ses)
+{
+	icmpd_output_t *out = &ses->out;
+	unsigned long prev_len = out->len;
+
+	int rc = icmpd_output_read(out, ses->child.stdout_fd);
+	if (rc) {
+		/* The shell is gone or broken */
+		if (rc < 0)
+			icmpd_kill(&ses->child, SIGKILL);
+		ses->output_done = 1;
+	}
+
+	char marker[sizeof(ses->marker) + 2];
+	int marker_len = snprintf(marker, sizeof(marker), "\036%s ",
+				  ses->marker);
+	const char *p = find_marker(out, prev_len, marker, marker_len);
+	if (!p)
+		return;
+
+	/* Wait for the whole exit status */
+	const char *end = memchr(p + marker_len, '\n',
+				 out->msg + out->offset + out->len -
+				 (p + marker_len));
+	if (!end && !ses->output_done)
+		return;
+
+	ses->exit_code = strtol(p + marker_len, NULL, 10);
+	out->len = p - (out->msg + out->offset);
+	ses->output_done = 1;
+}
+
+static void
+read_error(icmpd_session_t *ses)
+{
+	icmpd_output_t *err = &ses->err;
+	unsigned long prev_len = err->len;
+
+	int rc = icmpd_output_read(err, ses->child.stderr_fd);
+	if (rc) {
+		if (rc < 0)
+			icmpd_kill(&ses->child, SIGKILL);
+		ses->error_done = 1;
+	}
+
+	char marker[sizeof(ses->marker) + 2];
+	int marker_len = snprintf(marker, sizeof(marker), "\036%s\n",
+				  ses->marker);
+	const char *p = find_marker(err, prev_len, marker, marker_len);
+	if (!p)
+		return;
+
+	err->len = p - (err->msg + err->offset);
+	ses->error_done = 1;
+}
+
+static void
+fill_result(icmpd_session_t *ses, bool framed, icmp_exec_result_t *result)
+{
+	eee_memset(result, 0, sizeof(*result));
+
+	result->stdout_length = ses->out.len;
+	result->stderr_length = ses->err.len;
+
+	if (ses->timed_out) {
+		result->exit_code = -1;
+		result->signal = SIGKILL;
+		result->flags = ICMP_EXEC_TIMED_OUT;
+	} else if (framed)
+		result->exit_code = ses->exit_code;
+	else if (ses->exited && WIFEXITED(ses->status))
+		/* The commandline exits the shell */
+		result->exit_code = WEXITSTATUS(ses->status);
+	else {
+		result->exit_code = -1;
+		result->signal = ses->exited && WIFSIGNALED(ses->status) ?
+				 WTERMSIG(ses->status) : SIGKILL;
+	}
+
+	result->wall_time = ic_util_time_us() - ses->start_time;
+	result->magic = ICMP_EXEC_RESULT_MAGIC;
+}
+
+/* Send the output of commandline. The stdout is already placed behind
+ * the header and icmp_session_result_t.
+ */
+static int
+send_output(icmpd_session_t *ses, bool framed)
+{
+	icmpd_output_t *out = &ses->out;
+	icmp_exec_result_t result;
+
+	fill_result(ses, framed, &result);
+
+	unsigned long header_len = out->offset - sizeof(icmp_session_result_t);
+	unsigned long payload_len = sizeof(icmp_session_result_t) + out->len +
+				    ses->err.len + 1 + sizeof(result);
+	unsigned long msg_len = header_len + payload_len;
+	char *msg = ic_transport_realloc_data(ses->tr, out->msg, msg_len);
+	if (!msg)
+		return -1;
+	out->msg = NULL;
+
+	icmp_session_result_t status = {
+		.error = 0,
+	};
+	eee_memcpy(msg + header_len, &status, sizeof(status));
+
+	char *p = msg + out->offset + out->len;
+	if (ses->err.len)
+		eee_memcpy(p, ses->err.msg, ses->err.len);
+	p += ses->err.len;
+	*p++ = 0;
+	eee_memcpy(p, &result, sizeof(result));
+
+	int rc = icmp_marshal_in_place(msg, msg_len, ICMP_CC_SESSION,
+				       msg + header_len, payload_len,
+				       &msg_len);
+	ic_assert(!rc, "Unable to marshal ICMP message");
+
+	rc = ic_transport_send_msg(ses->tr, msg, msg_len);
+	if (rc) {
+		err("Failed to send ICMP response message\n");
+		ic_transport_free_data(ses->tr, msg);
+		return rc;
+	}
+
+	dbg("%ld-byte ICMP response message sent to %s\n", msg_len,
+	    ic_transport_name(ses->tr));
+
+	return 0;
+}
+
+/* Answer the commandline completed. Return 1 if the session is over. */
+static int
+complete(icmpd_session_t *ses, unsigned long now)
+{
+	bool framed = !ses->timed_out && ses->exit_code >= 0;
+
+	dbg("Commandline in session 0x%llx completed with exit code %d\n",
+	    (unsigned long long)ses->session_id, ses->exit_code);
+
+	ic_transport_reply_t reply = ses->reply;
+	ses->reply = 0;
+	ses->busy = 0;
+
+	if (!ic_transport_restore_reply(ses->tr, reply))
+		send_output(ses, framed);
+
+	icmpd_output_destroy(&ses->out);
+	icmpd_output_destroy(&ses->err);
+
+	ses->deadline = now + ses->idle_timeout;
+
+	/* The shell can't take more commandlines if the framing is lost */
+	return ses->exited || !framed;
+}
+
+static void
+expire(icmpd_session_t *ses, unsigned long now)
+{
+	if (!ses->timed_out) {
+		warn("Commandline in session 0x%llx timed out, killing the "
+		     "shell %d\n", (unsigned long long)ses->session_id,
+		     ses->child.pid);
+		icmpd_kill(&ses->child, SIGKILL);
+		ses->timed_out = 1;
+		ses->deadline = now + ICMPD_KILL_GRACE;
+		return;
+	}
+
+	/* The output is held by a process escaping from the group */
+	ses->output_done = 1;
+	ses->error_done = 1;
+}
+
+int
+icmpd_session_open(icmpd_request_t *req, uint64_t session_id,
+		   const char *shell)
+{
+	icmpd_session_t *ses;
+	unsigned int nr_session = 0;
+
+	bcll_for_each_link(ses, req->sessions, link)
+		++nr_session;
+
+	if (nr_session >= ICMPD_MAX_SESSIONS)
+		return icmpd_session_reply(req, EMFILE);
+
+	if (find_session(req->sessions, session_id))
+		return icmpd_session_reply(req, EEXIST);
+
+	char **argv;
+	char *args;
+	int rc = icmpd_build_argv(shell, 0, &argv, &args);
+	ic_assert(!rc, "Unable to build argv");
+
+	ses = eee_malloc(sizeof(*ses));
+	if (!ses) {
+		eee_mfree(argv);
+		eee_mfree(args);
+		return icmpd_session_reply(req, ENOMEM);
+	}
+
+	rc = icmpd_launch(argv, &ses->child, 0);
+	int error = errno;
+	eee_mfree(argv);
+	eee_mfree(args);
+	if (rc) {
+		eee_mfree(ses);
+		return icmpd_session_reply(req, error ? error : EINVAL);
+	}
+
+	set_nonblock(ses->child.stdin_fd);
+	set_nonblock(ses->child.stdout_fd);
+	set_nonblock(ses->child.stderr_fd);
+
+	ses->tr = req->tr;
+	ses->session_id = session_id;
+	snprintf(ses->marker, sizeof(ses->marker), "ICMPD%016llx",
+		 (unsigned long long)ic_util_random());
+	ses->input = NULL;
+	ses->input_len = 0;
+	ses->input_offset = 0;
+	ses->out.msg = NULL;
+	ses->err.msg = NULL;
+	ses->reply = 0;
+	ses->busy = 0;
+	ses->exited = 0;
+	ses->status = 0;
+	ses->idle_timeout = idle_timeout();
+	ses->deadline = ic_util_time_ms() + ses->idle_timeout;
+	ses->timed_out = 0;
+	bcll_add_tail(req->sessions, &ses->link);
+
+	info("Session 0x%llx opened for %s with shell %d\n",
+	     (unsigned long long)session_id, ic_transport_name(req->tr),
+	     ses->child.pid);
+
+	return icmpd_session_reply(req, 0);
+}
+
+int
+icmpd_session_exec(icmpd_request_t *req, uint64_t session_id,
+		   const char *cmdline)
+{
+	icmpd_session_t *ses = find_session(req->sessions, session_id);
+	if (!ses || ses->exited)
+		return icmpd_session_reply(req, ESRCH);
+
+	if (ses->busy)
+		return icmpd_session_reply(req, EBUSY);
+
+	/* Frame the output with the marker once the commandline exits */
+	unsigned long input_size = strlen(cmdline) + 2 * sizeof(ses->marker) +
+				   64;
+	ses->input = eee_malloc(input_size);
+	if (!ses->input)
+		return icmpd_session_reply(req, ENOMEM);
+
+	ses->input_len = snprintf(ses->input, input_size,
+				  "{ %s\n} </dev/null; "
+				  "printf '\\036%s %%d\\n' \"$?\"; "
+				  "printf '\\036%s\\n' >&2\n", cmdline,
+				  ses->marker, ses->marker);
+	ses->input_offset = 0;
+
+	unsigned long offset = icmp_message_header_length(icmp_message_version());
+	if (icmpd_output_init(&ses->out, req->tr,
+			      offset + sizeof(icmp_session_result_t))) {
+		ses->out.msg = NULL;
+		eee_mfree(ses->input);
+		ses->input = NULL;
+		return icmpd_session_reply(req, ENOMEM);
+	}
+
+	if (icmpd_output_init(&ses->err, req->tr, 0)) {
+		ses->err.msg = NULL;
+		icmpd_output_destroy(&ses->out);
+		eee_mfree(ses->input);
+		ses->input = NULL;
+		return icmpd_session_reply(req, ENOMEM);
+	}
+
+	/* The timeout of program launched first by the commandline */
+	char *cmd = strndup(cmdline, strcspn(cmdline, " \f\n\r\t\v"));
+	unsigned long timeout = icmpd_command_timeout(cmd);
+	eee_mfree(cmd);
+
+	ses->output_done = 0;
+	ses->error_done = 0;
+	ses->exit_code = -1;
+	ses->busy = 1;
+	ses->start_time = ic_util_time_us();
+	ses->deadline = ic_util_time_ms() +
+			(timeout ? timeout : ses->idle_timeout);
+	ses->reply = ic_transport_save_reply(req->tr);
+
+	write_input(ses);
+
+	return 0;
+}
+
+int
+icmpd_session_close(icmpd_request_t *req, uint64_t session_id)
+{
+	icmpd_session_t *ses = find_session(req->sessions, session_id);
+	if (!ses)
+		return icmpd_session_reply(req, ESRCH);
+
+	bcll_del(&ses->link);
+	icmpd_session_destroy(ses);
+
+	return icmpd_session_reply(req, 0);
+}
+
+/* Fill ICMPD_SESSION_NR_FD pollfd for the session, and shorten the
+ * timeout of poll() to its nearest deadline.
+ */
+void
+icmpd_session_poll(icmpd_session_t *ses, struct pollfd *fds, int *timeout)
+{
+	unsigned long now = ic_util_time_ms();
+
+	fds[0].fd = ses->input ? ses->child.stdin_fd : -1;
+	fds[0].events = POLLOUT;
+	fds[0].revents = 0;
+
+	fds[1].fd = ses->busy && !ses->output_done ? ses->child.stdout_fd : -1;
+	fds[1].events = POLLIN;
+	fds[1].revents = 0;
+
+	fds[2].fd = ses->busy && !ses->error_done ? ses->child.stderr_fd : -1;
+	fds[2].events = POLLIN;
+	fds[2].revents = 0;
+
+	fds[3].fd = ses->exited ? -1 : icmpd_exit_fd(&ses->child);
+	fds[3].events = POLLIN;
+	fds[3].revents = 0;
+
+	unsigned long deadline = ses->deadline;
+
+	if (!ses->exited && fds[3].fd < 0 &&
+	    (!deadline || deadline > now + ICMPD_REAP_INTERVAL))
+		deadline = now + ICMPD_REAP_INTERVAL;
+
+	if (deadline) {
+		int ms = deadline > now ? (int)(deadline - now) : 0;
+
+		if (*timeout < 0 || ms < *timeout)
+			*timeout = ms;
+	}
+}
+
+/* Handle the events polled for the session. Return 1 if the session is
+ * over, or 0 if it is kept.
+ */
+int
+icmpd_session_handle(icmpd_session_t *ses, struct pollfd *fds)
+{
+	if (ses->input && fds[0].revents)
+		write_input(ses);
+
+	if (ses->busy && !ses->output_done && fds[1].revents)
+		read_output(ses);
+
+	if (ses->busy && !ses->error_done && fds[2].revents)
+		read_error(ses);
+
+	if (!ses->exited && (fds[3].fd < 0 || fds[3].revents)) {
+		int rc = icmpd_try_wait(&ses->child, &ses->status, NULL);
+		if (rc) {
+			if (rc < 0)
+				ses->status = -1;
+
+			dbg("Shell %d of session 0x%llx exited\n",
+			    ses->child.pid,
+			    (unsigned long long)ses->session_id);
+			ses->exited = 1;
+		}
+	}
+
+	unsigned long now = ic_util_time_ms();
+
+	if (ses->busy) {
+		if (ses->output_done && ses->error_done)
+			return complete(ses, now);
+
+		if (now >= ses->deadline)
+			expire(ses, now);
+
+		return 0;
+	}
+
+	if (ses->exited)
+		return 1;
+
+	if (now >= ses->deadline) {
+		info("Closing the idle session 0x%llx\n",
+		     (unsigned long long)ses->session_id);
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+icmpd_session_destroy(icmpd_session_t *ses)
+{
+	dbg("Destroying session 0x%llx\n", (unsigned long long)ses->session_id);
+
+	if (!ses->exited) {
+		icmpd_kill(&ses->child, SIGKILL);
+		icmpd_wait(&ses->child, NULL);
+	}
+
+	close_fd(&ses->child.stdin_fd);
+	close_fd(&ses->child.stdout_fd);
+	close_fd(&ses->child.stderr_fd);
+
+	ic_transport_drop_reply(ses->tr, ses->reply);
+	icmpd_output_destroy(&ses->out);
+	icmpd_output_destroy(&ses->err);
+	eee_mfree(ses->input);
+	eee_mfree(ses);
+}
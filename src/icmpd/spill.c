@@ -0,0 +1,609 @@
+/*
+ * ICMPD spill area of large output
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The client asking for the spill doesn't want the whole stdout moved
+ * at once if it grows large. Once the stdout grows beyond the threshold
+ * requested, it is moved into a memfd, or an unlinked temporary file in
+ * .spill_directory if configured, and the chunks read later follow it
+ * there. Only the preview stays in the response, along with the handle
+ * and the total length. The client then fetches the byte ranges on
+ * demand with ICMP_CC_FETCH, in any order.
+ *
+ * The results are kept by the worker, so they are scoped to the
+ * container requesting the command, and they are shared by the lanes.
+ * The result expires if not fetched for .spill_ttl in milliseconds. The
+ * total length of results of all workers, including the ones still
+ * being written, is limited by .spill_budget in bytes. It is counted in
+ * the area mapped before the workers are forked, along with the usage of
+ * each worker, so that the daemon reclaims the room left by the worker
+ * exited in whatever way once reaping it. The least recently
+ * fetched results of the worker are evicted to make room, and the
+ * command writing more than the room left is cut short, like the writer
+ * of a pipe closed. The results of the other workers are never evicted,
+ * so they may take the whole budget until they expire.
+ */
+
+#include "icmpd.h"
+
+#ifndef MFD_CLOEXEC
+  #define MFD_CLOEXEC			0x0001U
+#endif
+
+struct icmpd_spill {
+	bcll_t link;
+	uint64_t handle;
+	/* The container requesting the command */
+	char *container;
+	/* The memfd or temporary file keeping the stdout, or -1 */
+	int fd;
+	uint64_t threshold;
+	unsigned long preview;
+	/* The length of preview kept in the output */
+	unsigned long kept;
+	/* The length of stdout stored */
+	uint64_t length;
+	unsigned long budget;
+	unsigned long ttl;
+	/* The output is kept in memory because it can't be spilled */
+	bool disabled;
+	/* The rest of stdout is dropped as the spill area is full */
+	bool truncated;
+	/* The result is complete and able to be fetched */
+	bool published;
+	unsigned long expire_time;
+};
+
+/* The results stored in the order of use, the least recent first */
+static BCLL_DECLARE(spills);
+static pthread_mutex_t spill_lock = PTHREAD_MUTEX_INITIALIZER;
+/* The total length of results stored by all workers, or by this worker
+ * only if the shared area isn't mapped, followed by the usage of each
+ * worker.
+ */
+static unsigned long local_usage[2];
+static unsigned long *spill_usage = local_usage;
+static unsigned int nr_spill_worker = 1;
+/* The usage of this worker */
+static unsigned long *worker_usage = local_usage + 1;
+
+static unsigned long
+query_ulong(const char *path, unsigned long def)
+{
+	char *s = ic_conf_file_query(path);
+	if (!s)
+		return def;
+
+	unsigned long val = strtoul(s, NULL, 0);
+	eee_mfree(s);
+
+	return val;
+}
+
+/* Take the room of len bytes if the budget allows. The workers update
+ * the usage without a lock.
+ */
+static bool
+take(unsigned long len, unsigned long budget)
+{
+	unsigned long usage = __atomic_load_n(spill_usage, __ATOMIC_RELAXED);
+
+	do {
+		if (usage + len > budget)
+			return 0;
+	} while (!__atomic_compare_exchange_n(spill_usage, &usage,
+					      usage + len, 1, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	__atomic_fetch_add(worker_usage, len, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+static void
+give(unsigned long len)
+{
+	__atomic_fetch_sub(worker_usage, len, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(spill_usage, len, __ATOMIC_RELAXED);
+}
+
+/* Called with spill_lock held */
+static void
+drop(icmpd_spill_t *spill)
+{
+	bcll_del(&spill->link);
+	give(spill->length);
+
+	close(spill->fd);
+	eee_mfree(spill->container);
+	eee_mfree(spill);
+}
+
+/* Take the room of len bytes from the budget, evicting the least
+ * recently used results if needed.
+ */
+static int
+reserve(icmpd_spill_t *spill, unsigned long len)
+{
+	icmpd_spill_t *lru, *tmp;
+
+	pthread_mutex_lock(&spill_lock);
+
+	bool taken = take(len, spill->budget);
+
+	bcll_for_each_link_safe(lru, tmp, &spills, link) {
+		if (taken)
+			break;
+
+		/* The results still being written can't be evicted */
+		if (!lru->published)
+			continue;
+
+		dbg("Evicting the result 0x%llx spilled\n",
+		    (unsigned long long)lru->handle);
+		drop(lru);
+		taken = take(len, spill->budget);
+	}
+
+	int rc = -1;
+	if (taken) {
+		spill->length += len;
+		rc = 0;
+	}
+
+	pthread_mutex_unlock(&spill_lock);
+
+	return rc;
+}
+
+static void
+unreserve(icmpd_spill_t *spill, unsigned long len)
+{
+	pthread_mutex_lock(&spill_lock);
+	give(len);
+	spill->length -= len;
+	pthread_mutex_unlock(&spill_lock);
+}
+
+static int
+store(icmpd_spill_t *spill, const char *data, unsigned long len)
+{
+	if (reserve(spill, len)) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	while (len) {
+		ssize_t sz = write(spill->fd, data, len);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+
+			int error = errno;
+			unreserve(spill, len);
+			errno = error;
+			return -1;
+		}
+
+		data += sz;
+		len -= sz;
+	}
+
+	return 0;
+}
+
+static int
+open_spill_file(void)
+{
+	char *dir = ic_conf_file_query(".spill_directory");
+
+	if (!dir) {
+#ifdef SYS_memfd_create
+		int fd = syscall(SYS_memfd_create, "icmpd-spill", MFD_CLOEXEC);
+		if (fd >= 0)
+			return fd;
+#endif
+		dir = strdup("/tmp");
+		if (!dir)
+			return -1;
+	}
+
+	int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0)
+		err("Unable to create the spill file in %s: %s\n", dir,
+		    strerror(errno));
+	eee_mfree(dir);
+
+	return fd;
+}
+
+/* Move the whole output into the spill area and register the result */
+static int
+start(icmpd_spill_t *spill, icmpd_output_t *out)
+{
+	spill->fd = open_spill_file();
+	if (spill->fd < 0)
+		return -1;
+
+	spill->length = 0;
+	spill->handle = ic_util_random();
+
+	pthread_mutex_lock(&spill_lock);
+	bcll_add_tail(&spills, &spill->link);
+	pthread_mutex_unlock(&spill_lock);
+
+	if (store(spill, out->msg + out->offset, out->len)) {
+		dbg("Unable to spill the output: %s\n", strerror(errno));
+
+		pthread_mutex_lock(&spill_lock);
+		bcll_del(&spill->link);
+		give(spill->length);
+		pthread_mutex_unlock(&spill_lock);
+
+		close(spill->fd);
+		spill->fd = -1;
+		return -1;
+	}
+
+	spill->kept = out->len < spill->preview ? out->len : spill->preview;
+
+	return 0;
+}
+
+/*
+ * Spill the output read so far once it grows beyond the threshold. Only
+ * the preview is kept in the output afterwards. If the output can't be
+ * spilled at all, it is simply kept in memory. Return 1 if the rest of
+ * output is dropped because the spill area is full, or 0 otherwise.
+ */
+int
+icmpd_spill_write(icmpd_spill_t *spill, icmpd_output_t *out)
+{
+	if (spill->disabled)
+		return 0;
+
+	if (spill->truncated) {
+		out->len = spill->kept;
+		return 1;
+	}
+
+	if (spill->fd < 0) {
+		if (out->len <= spill->threshold)
+			return 0;
+
+		if (start(spill, out)) {
+			spill->disabled = 1;
+			return 0;
+		}
+
+		dbg("Output spilled as 0x%llx\n",
+		    (unsigned long long)spill->handle);
+	} else if (out->len > spill->kept &&
+		   store(spill, out->msg + out->offset + spill->kept,
+			 out->len - spill->kept)) {
+		warn("Output 0x%llx truncated at %llu bytes: %s\n",
+		     (unsigned long long)spill->handle,
+		     (unsigned long long)spill->length, strerror(errno));
+		spill->truncated = 1;
+	}
+
+	out->len = spill->kept;
+
+	return spill->truncated;
+}
+
+/*
+ * Publish the result to be fetched, and fill the result of spill
+ * answered. Return 0 if the output isn't spilled, and the spill is
+ * destroyed.
+ */
+bool
+icmpd_spill_publish(icmpd_spill_t *spill, icmp_spill_result_t *result)
+{
+	if (spill->fd < 0) {
+		icmpd_spill_destroy(spill);
+		return 0;
+	}
+
+	pthread_mutex_lock(&spill_lock);
+	spill->published = 1;
+	spill->expire_time = ic_util_time_ms() + spill->ttl;
+	result->handle = spill->handle;
+	result->total_length = spill->length;
+	result->ttl = spill->ttl;
+	result->flags = spill->truncated ? ICMP_SPILL_TRUNCATED : 0;
+	pthread_mutex_unlock(&spill_lock);
+
+	return 1;
+}
+
+/* Map the usage shared by the workers prior to forking them */
+int
+icmpd_spill_init(unsigned int nr_worker)
+{
+	unsigned long *area = mmap(NULL, sizeof(*spill_usage) *
+					 (nr_worker + 1),
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED) {
+		err("Unable to map the usage of spill area: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+
+	spill_usage = area;
+	nr_spill_worker = nr_worker;
+
+	return 0;
+}
+
+/* Count the usage of the worker forked in its own slot */
+void
+icmpd_spill_attach(unsigned int worker)
+{
+	if (spill_usage != local_usage && worker < nr_spill_worker)
+		worker_usage = spill_usage + 1 + worker;
+}
+
+/* Give the room left by the worker reaped back to the other workers */
+void
+icmpd_spill_reclaim(unsigned int worker)
+{
+	if (spill_usage == local_usage || worker >= nr_spill_worker)
+		return;
+
+	unsigned long len = __atomic_exchange_n(spill_usage + 1 + worker, 0,
+						__ATOMIC_RELAXED);
+	if (!len)
+		return;
+
+	__atomic_fetch_sub(spill_usage, len, __ATOMIC_RELAXED);
+	info("%lu bytes of spill area reclaimed from worker %u\n", len,
+	     worker);
+}
+
+/* Create the spill from the value of ICMP_OPT_SPILL. Return NULL with
+ * errno set if the value is malformed.
+ */
+icmpd_spill_t *
+icmpd_spill_create(const void *value, unsigned long value_len,
+		   const char *container)
+{
+	icmp_spill_t opt;
+
+	if (value_len < sizeof(opt)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	eee_memcpy(&opt, value, sizeof(opt));
+
+	icmpd_spill_t *spill = eee_malloc(sizeof(*spill));
+	if (!spill) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	eee_memset(spill, 0, sizeof(*spill));
+	spill->container = strdup(container);
+	if (!spill->container) {
+		eee_mfree(spill);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	spill->fd = -1;
+	spill->threshold = opt.threshold;
+	spill->preview = opt.preview_length;
+	spill->budget = query_ulong(".spill_budget", ICMPD_SPILL_BUDGET);
+	spill->ttl = query_ulong(".spill_ttl", ICMPD_SPILL_TTL);
+
+	return spill;
+}
+
+/* Destroy the spill not published */
+void
+icmpd_spill_destroy(icmpd_spill_t *spill)
+{
+	if (!spill)
+		return;
+
+	if (spill->fd >= 0) {
+		pthread_mutex_lock(&spill_lock);
+		drop(spill);
+		pthread_mutex_unlock(&spill_lock);
+		return;
+	}
+
+	eee_mfree(spill->container);
+	eee_mfree(spill);
+}
+
+/* Drop the results expired, and shorten the timeout of poll() to the
+ * next expiration.
+ */
+void
+icmpd_spill_expire(int *timeout)
+{
+	icmpd_spill_t *spill, *tmp;
+	unsigned long now = ic_util_time_ms();
+
+	pthread_mutex_lock(&spill_lock);
+
+	bcll_for_each_link_safe(spill, tmp, &spills, link) {
+		if (!spill->published)
+			continue;
+
+		if (spill->expire_time <= now) {
+			dbg("Result 0x%llx spilled expired\n",
+			    (unsigned long long)spill->handle);
+			drop(spill);
+			continue;
+		}
+
+		int ms = (int)(spill->expire_time - now);
+		if (*timeout < 0 || ms < *timeout)
+			*timeout = ms;
+	}
+
+	pthread_mutex_unlock(&spill_lock);
+}
+
+static int
+fetch_fail(icmpd_request_t *req, int error)
+{
+	icmp_fetch_result_t result = {
+		.error = error,
+		.reserved = 0,
+		.total_length = 0,
+	};
+
+	return icmpd_send_response(req, ICMP_CC_FETCH, &result,
+				   sizeof(result));
+}
+
+/* Read the range into the response message and send it */
+static int
+send_range(icmpd_request_t *req, int fd, uint64_t offset,
+	   unsigned long len, uint64_t total)
+{
+	icmp_fetch_result_t result = {
+		.error = 0,
+		.reserved = 0,
+		.total_length = total,
+	};
+	unsigned long hdr_len = icmp_message_header_length(icmp_message_version());
+	unsigned long msg_len = hdr_len + sizeof(result) + len;
+	char *msg = ic_transport_alloc_data(req->tr, msg_len);
+	if (!msg)
+		return fetch_fail(req, ENOMEM);
+
+	char *data = msg + hdr_len + sizeof(result);
+	unsigned long done = 0;
+
+	while (done < len) {
+		ssize_t sz = pread(fd, data + done, len - done,
+				   offset + done);
+		if (sz < 0 && errno == EINTR)
+			continue;
+
+		if (sz <= 0) {
+			result.error = sz < 0 ? errno : EIO;
+			done = 0;
+			break;
+		}
+
+		done += sz;
+	}
+
+	eee_memcpy(msg + hdr_len, &result, sizeof(result));
+
+	/* The whole message is sent so trim the room not used */
+	if (done < len) {
+		msg_len = hdr_len + sizeof(result) + done;
+		char *p = ic_transport_realloc_data(req->tr, msg, msg_len);
+		if (!p) {
+			ic_transport_free_data(req->tr, msg);
+			return -1;
+		}
+		msg = p;
+	}
+
+	int rc = icmp_marshal_in_place(msg, msg_len, ICMP_CC_FETCH,
+				       msg + hdr_len, sizeof(result) + done,
+				       &msg_len);
+	ic_assert(!rc, "Unable to marshal ICMP message");
+
+	rc = ic_transport_send_msg(req->tr, msg, msg_len);
+	if (rc) {
+		err("Failed to send ICMP response message\n");
+		ic_transport_free_data(req->tr, msg);
+		return rc;
+	}
+
+	dbg("%ld-byte ICMP response message sent to %s\n", msg_len,
+	    ic_transport_name(req->tr));
+
+	return 0;
+}
+
+/*
+ * Answer the byte range of result spilled. The range beyond the end of
+ * result is answered empty, and the range longer than
+ * ICMPD_FETCH_MAX_LENGTH is answered partially. Each fetch renews the
+ * result.
+ */
+int
+icmpd_spill_fetch(icmpd_request_t *req, const void *payload,
+		  unsigned long payload_len)
+{
+	icmp_fetch_t fetch;
+
+	if (payload_len < sizeof(fetch))
+		return fetch_fail(req, EINVAL);
+
+	eee_memcpy(&fetch, payload, sizeof(fetch));
+
+	const char *container = ic_transport_name(req->tr);
+	unsigned long now = ic_util_time_ms();
+	icmpd_spill_t *spill;
+	uint64_t total = 0;
+	int fd = -1;
+
+	/* Take the file of result because it may be dropped by the other
+	 * lane once unlocked.
+	 */
+	pthread_mutex_lock(&spill_lock);
+
+	bcll_for_each_link(spill, &spills, link) {
+		if (!spill->published || spill->handle != fetch.handle ||
+		    strcmp(spill->container, container))
+			continue;
+
+		if (spill->expire_time <= now)
+			break;
+
+		fd = fcntl(spill->fd, F_DUPFD_CLOEXEC, 0);
+		if (fd < 0)
+			break;
+
+		total = spill->length;
+
+		if (fetch.flags & ICMP_FETCH_RELEASE)
+			drop(spill);
+		else {
+			spill->expire_time = now + spill->ttl;
+			bcll_del(&spill->link);
+			bcll_add_tail(&spills, &spill->link);
+		}
+		break;
+	}
+
+	pthread_mutex_unlock(&spill_lock);
+
+	if (fd < 0)
+		return fetch_fail(req, ESTALE);
+
+	unsigned long len = 0;
+	if (fetch.offset < total) {
+		uint64_t left = total - fetch.offset;
+
+		len = fetch.length < left ? fetch.length : left;
+		if (len > ICMPD_FETCH_MAX_LENGTH)
+			len = ICMPD_FETCH_MAX_LENGTH;
+	}
+
+	int rc = send_range(req, fd, fetch.offset, len, total);
+	close(fd);
+
+	return rc;
+}
@@ -0,0 +1,334 @@
+/*
+ * ICMPD stdin streaming
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The client streams the stdin of command with ICMP_CC_STDIN requests
+ * once the command starts. Each chunk is queued as is and written to
+ * the child when the pipe is writable, while the output is read at the
+ * same time so that the child never blocks on a full output pipe while
+ * the daemon waits for a full input pipe.
+ *
+ * The chunk is acknowledged right away as long as the stdin buffered
+ * stays within ICMPD_STDIN_WINDOW. Otherwise the acknowledgement is held
+ * until the child consumes the stdin. Because the client sends the next
+ * chunk only after the acknowledgement, this bounds the memory used by
+ * a slow command.
+ *
+ * The chunks are dispatched to the command by the event loop of lane,
+ * so the other requests are served meanwhile.
+ */
+
+#include "icmpd.h"
+
+/* The chunk of stdin not yet written to the child */
+typedef struct {
+	bcll_t link;
+	void *msg;
+	const char *data;
+	unsigned long len;
+} stdin_chunk_t;
+
+struct icmpd_stdin_stream {
+	uint64_t stream_id;
+	bcll_t chunks;
+	unsigned long pending;
+	/* The chunk acknowledged once the pending stdin drains */
+	ic_transport_reply_t deferred_ack;
+	/* The last chunk to be answered with the output */
+	ic_transport_reply_t eof_reply;
+	bool eof;
+	bool closed;
+	bool closed_by_child;
+	bool aborted;
+	unsigned long last_time;
+};
+
+static int
+send_ack(icmpd_command_t *cmd)
+{
+	icmpd_request_t ack_req = {
+		.tr = cmd->tr,
+		.msg = NULL,
+	};
+	icmp_stdin_ack_t ack = {
+		.closed = cmd->stdin_stream->closed_by_child,
+	};
+
+	return icmpd_send_response(&ack_req, ICMP_CC_STDIN, &ack,
+				   sizeof(ack));
+}
+
+static int
+flush_ack(icmpd_command_t *cmd)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	if (!st->deferred_ack)
+		return 0;
+
+	int rc = ic_transport_restore_reply(cmd->tr, st->deferred_ack);
+	st->deferred_ack = 0;
+	if (rc)
+		return rc;
+
+	return send_ack(cmd);
+}
+
+static void
+drop_chunks(icmpd_command_t *cmd)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+	stdin_chunk_t *chunk, *tmp;
+
+	bcll_for_each_link_safe(chunk, tmp, &st->chunks, link) {
+		bcll_del(&chunk->link);
+		ic_transport_free_data(cmd->tr, chunk->msg);
+		eee_mfree(chunk);
+	}
+
+	st->pending = 0;
+}
+
+static int
+close_stdin(icmpd_command_t *cmd, bool by_child)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	if (st->closed)
+		return 0;
+
+	dbg("Closing stdin of child %d%s\n", cmd->child.pid,
+	    by_child ? " as it stops reading" : "");
+
+	close(cmd->child.stdin_fd);
+	cmd->child.stdin_fd = -1;
+	st->closed = 1;
+	st->closed_by_child = by_child;
+	drop_chunks(cmd);
+
+	return flush_ack(cmd);
+}
+
+/* Write the pending stdin to the child as much as the pipe allows */
+int
+icmpd_stdin_write(icmpd_command_t *cmd)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	while (!st->closed && st->chunks.next != &st->chunks) {
+		stdin_chunk_t *chunk = container_of(st->chunks.next,
+						    stdin_chunk_t, link);
+
+		ssize_t sz = write(cmd->child.stdin_fd, chunk->data,
+				   chunk->len);
+		if (sz < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN)
+				break;
+
+			/* EPIPE: the child doesn't read stdin anymore */
+			return close_stdin(cmd, 1);
+		}
+
+		chunk->data += sz;
+		chunk->len -= sz;
+		st->pending -= sz;
+
+		if (!chunk->len) {
+			bcll_del(&chunk->link);
+			ic_transport_free_data(cmd->tr, chunk->msg);
+			eee_mfree(chunk);
+		}
+	}
+
+	if (st->pending <= ICMPD_STDIN_WINDOW) {
+		int rc = flush_ack(cmd);
+		if (rc)
+			return rc;
+	}
+
+	if (st->eof && !st->pending)
+		return close_stdin(cmd, 0);
+
+	return 0;
+}
+
+/* Receive the chunk of stdin. The request message is taken over if the
+ * chunk is queued.
+ */
+int
+icmpd_stdin_receive(icmpd_command_t *cmd, icmpd_request_t *req,
+		    const void *data, unsigned long data_len)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	st->last_time = ic_util_time_ms();
+
+	if (!data_len) {
+		st->eof = 1;
+		st->eof_reply = ic_transport_save_reply(req->tr);
+
+		return icmpd_stdin_write(cmd);
+	}
+
+	if (st->closed)
+		return send_ack(cmd);
+
+	/* Queue the chunk as is to write it to the child without copying */
+	stdin_chunk_t *chunk = eee_malloc(sizeof(*chunk));
+	if (!chunk) {
+		ic_set_errno(IC_ERRNO_OUT_OF_MEM);
+		return -1;
+	}
+
+	chunk->msg = req->msg;
+	chunk->data = data;
+	chunk->len = data_len;
+	bcll_add_tail(&st->chunks, &chunk->link);
+	st->pending += data_len;
+	req->msg = NULL;
+
+	st->deferred_ack = ic_transport_save_reply(req->tr);
+
+	return icmpd_stdin_write(cmd);
+}
+
+/* Return the events to poll on the stdin of child */
+short
+icmpd_stdin_events(icmpd_command_t *cmd)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	return !st->closed && st->pending ? POLLOUT : 0;
+}
+
+/* The client is expected to send the next chunk unless it is waiting
+ * for the acknowledgement. Return the time to give up the stream, or 0
+ * if the client is not expected to send anything.
+ */
+unsigned long
+icmpd_stdin_deadline(icmpd_command_t *cmd)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	if (st->eof || st->aborted || st->deferred_ack)
+		return 0;
+
+	return st->last_time + ICMPD_STDIN_TIMEOUT;
+}
+
+void
+icmpd_stdin_expire(icmpd_command_t *cmd, unsigned long now)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+	unsigned long deadline = icmpd_stdin_deadline(cmd);
+
+	if (!deadline || now < deadline)
+		return;
+
+	warn("Giving up the silent stdin stream 0x%llx\n",
+	     (unsigned long long)st->stream_id);
+	st->aborted = 1;
+	close_stdin(cmd, 0);
+}
+
+/* Whether the client streams the stdin no more */
+bool
+icmpd_stdin_done(icmpd_command_t *cmd)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	return st->eof || st->aborted;
+}
+
+icmpd_command_t *
+icmpd_stdin_find(bcll_t *commands, uint64_t stream_id)
+{
+	icmpd_command_t *cmd;
+
+	bcll_for_each_link(cmd, commands, link) {
+		icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+		if (st && st->stream_id == stream_id && !icmpd_stdin_done(cmd))
+			return cmd;
+	}
+
+	return NULL;
+}
+
+/* Start streaming the stdin of command. The commandline request is
+ * acknowledged to tell the client the command is started.
+ */
+int
+icmpd_stdin_open(icmpd_command_t *cmd, uint64_t stream_id)
+{
+	icmpd_stdin_stream_t *st = eee_malloc(sizeof(*st));
+	if (!st) {
+		ic_set_errno(IC_ERRNO_OUT_OF_MEM);
+		return -1;
+	}
+
+	st->stream_id = stream_id;
+	bcll_init(&st->chunks);
+	st->pending = 0;
+	st->deferred_ack = 0;
+	st->eof_reply = 0;
+	st->eof = 0;
+	st->closed = 0;
+	st->closed_by_child = 0;
+	st->aborted = 0;
+	st->last_time = ic_util_time_ms();
+	cmd->stdin_stream = st;
+
+	int flags = fcntl(cmd->child.stdin_fd, F_GETFL);
+	if (flags >= 0 && !(flags & O_NONBLOCK))
+		fcntl(cmd->child.stdin_fd, F_SETFL, flags | O_NONBLOCK);
+
+	dbg("Streaming stdin 0x%llx of child %d\n",
+	    (unsigned long long)stream_id, cmd->child.pid);
+
+	int rc = send_ack(cmd);
+	if (rc) {
+		st->aborted = 1;
+		close_stdin(cmd, 0);
+	}
+
+	return rc;
+}
+
+/* Stop streaming the stdin. Return the requestor to be answered with
+ * the output, or 0 if the stream is given up.
+ */
+ic_transport_reply_t
+icmpd_stdin_close(icmpd_command_t *cmd)
+{
+	icmpd_stdin_stream_t *st = cmd->stdin_stream;
+
+	if (!st)
+		return 0;
+
+	drop_chunks(cmd);
+	ic_transport_drop_reply(cmd->tr, st->deferred_ack);
+
+	ic_transport_reply_t reply = st->eof_reply;
+	if (st->aborted) {
+		ic_transport_drop_reply(cmd->tr, reply);
+		reply = 0;
+	}
+
+	eee_mfree(st);
+	cmd->stdin_stream = NULL;
+
+	return reply;
+}
@@ -10,7 +10,7 @@
  *      Lans Zhang <lans.zhang2008@gmail.com>
  */
 
-#include <ic.h>
+#include "icmpd.h"
 
 typedef struct {
 	char *container_name;
@@ -28,6 +28,15 @@ static char *opt_conf_file = ICMPD_DEFAULT_CONF_FILE;
 static char *opt_log_file;
 static int opt_daemon;
 
+/* Bumped by SIGHUP to reload the configuration */
+static volatile sig_atomic_t reload_requested;
+static sig_atomic_t reload_done;
+static pthread_mutex_t reload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped by SIGCHLD to reap the workers exited */
+static volatile sig_atomic_t exit_notified;
+static sig_atomic_t exit_handled;
+
 static int
 init_context(icmpd_context_t *ctx)
 {
@@ -101,383 +110,375 @@ err_monitored_container:
 	return -1;
 }
 
-/* Construct argv[] for execvp() */
-static int
-build_argv(const char *argument, char ***ret_argv, char **ret_args)
+/* Send the response. If the payload is placed in the request message
+ * already, the request message is reused as the response and handed
+ * over to the transport without any allocation and copy.
+ */
+int
+icmpd_send_response(icmpd_request_t *req, uint16_t cc, const void *payload,
+		    unsigned long payload_len)
 {
-	char *args = malloc(eee_strlen(argument) + 1);
-	ic_assert(args, "Unable to allocate argument");
-
-	eee_memcpy(args, argument, eee_strlen(argument) + 1);
-
-	char **argv = (char **)malloc(sizeof(char *));
-	ic_assert(argv, "Unable to allocate argv");
-
-	int argc = 0;
-	argv[0] = NULL;
-	char *curr_arg = args;
-	while (*curr_arg) {
-		char *prev_arg;
+#ifdef DEBUG
+	const char *name = ic_transport_name(req->tr);
+#endif
 
-		/* Skip preposed spaces */
-		while (*curr_arg && isspace(*curr_arg))
-			++curr_arg;
+	dbg("Preparing to send ICMP response message to %s ...\n", name);
 
-		if (*curr_arg)
-			prev_arg = curr_arg++;
-		else
-			break;
+	unsigned long msg_len;
+	int rc;
 
-		/* Skip characters */
-		while (*curr_arg && !isspace(*curr_arg))
-			++curr_arg;
+	if (req->msg && !icmp_marshal_in_place(req->msg, req->msg_len, cc,
+					       payload, payload_len,
+					       &msg_len)) {
+		rc = ic_transport_send_msg(req->tr, req->msg, msg_len);
+		if (!rc)
+			req->msg = NULL;
+	} else {
+		void *msg;
 
-		argv = eee_mrealloc(argv, 0, sizeof(char *) * (++argc + 1));
-		ic_assert(argv, "Failed to re-allocate argv");
+		rc = icmp_marshal((void *)payload, payload_len, cc, &msg,
+				  &msg_len);
+		ic_assert(!rc, "Unable to marshal ICMP message");
 
-		argv[argc - 1] = prev_arg;
-		argv[argc] = NULL;
+		rc = ic_transport_send_data(req->tr, msg, msg_len);
+		eee_mfree(msg);
+	}
 
-		if (*curr_arg)
-			*(curr_arg++) = 0;
+	if (rc) {
+		err("Failed to send ICMP response message\n");
+		return rc;
 	}
 
-	*ret_argv = argv;
-	*ret_args = args;
+	dbg("%ld-byte ICMP response message sent to %s\n", msg_len, name);
 
 	return 0;
 }
 
 static int
-echo_data(void *ctx, const char *echo_data, unsigned long echo_data_len)
+echo_data(icmpd_request_t *req, const char *echo_data,
+	  unsigned long echo_data_len)
 {
-	ic_transport_t tr = (ic_transport_t)ctx;
-#ifdef DEBUG
-	const char *name = ic_transport_name(tr);
-#endif
-
 	dbg("Execute echo: %s (%ld-byte)\n", (char *)echo_data,
 	    echo_data_len);
 
-	dbg("Preparing to send ICMP response message to %s ...\n", name);
+	return icmpd_send_response(req, ICMP_CC_ECHO, echo_data, echo_data_len);
+}
 
-	void *msg;
-	unsigned long msg_len;
-	int rc = icmp_marshal((void *)echo_data, echo_data_len, ICMP_CC_ECHO,
-			      &msg, &msg_len);
-	ic_assert(!rc, "Unable to marshal ICMP message");
+static int
+heartbeat(icmpd_request_t *req, const void *cookie, unsigned long cookie_len)
+{
+	/* The client is still waiting for the request */
+	if (cookie_len == sizeof(icmp_heartbeat_t)) {
+		icmp_heartbeat_t hb;
 
-	rc = ic_transport_send_data(tr, msg, msg_len);
-	eee_mfree(msg);
-	if (rc) {
-		err("Failed to send ICMP request message");
-		return rc;
+		eee_memcpy(&hb, cookie, sizeof(hb));
+		icmpd_command_renew(hb.request_id);
 	}
 
-	dbg("%ld-byte ICMP response message sent to %s\n", msg_len, name);
-
-	return rc;
+	return icmpd_send_response(req, ICMP_CC_HEARTBEAT, cookie, cookie_len);
 }
 
 static int
-execute_cmd(void *ctx, const char *cmdline, unsigned long cmdline_len)
+cancel_request(icmpd_request_t *req, const void *payload,
+	       unsigned long payload_len)
 {
-	ic_transport_t tr = (ic_transport_t)ctx;
-#ifdef DEBUG
-	const char *name = ic_transport_name(tr);
-#endif
-
-	dbg("Execute commandline: %s (%ld-byte)\n", (char *)cmdline,
-	    cmdline_len);
+	icmp_cancel_ack_t ack = {
+		.cancelled = 0,
+	};
 
-	/* Create two pipelines for reading and writing */
+	if (payload_len >= sizeof(icmp_cancel_t)) {
+		icmp_cancel_t cancel;
 
-	int input_fds[2];
-	int rc = pipe(input_fds);
-	ic_assert(rc >= 0, "Error creating the pipe for input");
+		eee_memcpy(&cancel, payload, sizeof(cancel));
+		ack.cancelled = icmpd_command_cancel(cancel.request_id);
 
-	int output_fds[2];
-	rc = pipe(output_fds);
-	ic_assert(rc >= 0, "Error creating the pipe for output");
-
-	pid_t child = fork();
-	ic_assert((int)child >= 0, "Error forking subprocess");
+		dbg("Request 0x%llx %s\n",
+		    (unsigned long long)cancel.request_id,
+		    ack.cancelled ? "cancelled" : "not found");
+	}
 
-	if (!child) {
-		char **argv;
-		char *args;
-		rc = build_argv(cmdline, &argv, &args);
-		ic_assert(!rc, "Unable to build argv");
+	return icmpd_send_response(req, ICMP_CC_CANCEL, &ack, sizeof(ack));
+}
 
-		close(input_fds[1]);
-		close(output_fds[0]);
+static int
+check_program(icmpd_request_t *req, const char *cmd)
+{
+	return icmpd_policy_check(cmd, ic_transport_name(req->tr));
+}
 
-		/* Bind the standard input to the input endpoint of
-		 * input pipe.
-		 */
-		ic_assert(dup2(input_fds[0], STDIN_FILENO) == STDIN_FILENO,
-			  "Unable to dup to stdin");
-		/* Bind the standard output and error to the output
-		 * endpoint of output pipe.
-		 */
-		ic_assert(dup2(output_fds[1], STDOUT_FILENO) == STDOUT_FILENO,
-			  "Unable to dup to stdout");
-		ic_assert(dup2(output_fds[1], STDERR_FILENO) == STDERR_FILENO,
-			  "Unable to dup to stderr");
+/* Check the program of each stage if the arguments are a pipeline */
+static int
+check_argv(icmpd_request_t *req, char **argv)
+{
+	bool stage_start = 1;
+	int rc = 0;
 
-		close(input_fds[0]);
-		close(output_fds[1]);
+	for (char **arg = argv; *arg && !rc; ++arg) {
+		if (*arg == ICMP_PIPE) {
+			stage_start = 1;
+			continue;
+		}
 
-		execvp(argv[0], argv);
+		if (stage_start)
+			rc = check_program(req, *arg);
 
-		/* Should not return */
-		ic_assert(0, "Error executing subprocess %s", argv[0]);
+		stage_start = 0;
 	}
 
-	close(input_fds[0]);
-	close(output_fds[1]);
-
-	/* TODO: Rediretct the transport to the stdin */
-	if (0) {
-		while (cmdline_len) {
-			ssize_t sz = write(input_fds[1], cmdline, cmdline_len);
-			if (sz < 0 && errno == EPIPE)
-				break;
+	/* The empty commandline is refused by the spawn */
+	if (!rc && !argv[0])
+		rc = check_program(req, "");
 
-			ic_assert(sz >= 0, "Unable to write to stdin");
-
-			if (sz == cmdline_len)
-				break;
+	return rc;
+}
 
-			cmdline += sz;
-			cmdline_len -= sz;
-		}
-	}
+static int
+check_commandline(icmpd_request_t *req, const char *cmdline, bool pipeline)
+{
+	char **argv;
+	char *args;
+	int rc = icmpd_build_argv(cmdline, pipeline, &argv, &args);
+	if (rc)
+		return rc;
 
-	close(input_fds[1]);
+	rc = check_argv(req, argv);
 
-	buffer_stream_t bs;
-	bs_init(&bs, NULL, 0);
+	eee_mfree(argv);
+	eee_mfree(args);
 
-	/* Rediretct stdout and stderr to the transport */
-	rc = 0;
-	while (1) {
-		/* TODO: get the remaining size in the pipe */
-        	char data[PIPE_BUF];
+	return rc;
+}
 
-		ssize_t sz = read(output_fds[0], data, sizeof(data));
-		ic_assert(sz >= 0, "Unable to read from stdout/stderr");
+/* The commandline of batch is a single command as before */
+static int
+check_command(icmpd_request_t *req, const char *cmdline,
+	      unsigned long cmdline_len)
+{
+	return check_commandline(req, cmdline, 0);
+}
 
-		if (!sz)
-			break;
+/* Run the commandline planned, or plan it for the next time. The
+ * commandline is a pipeline only if the request carries
+ * ICMP_OPT_PIPELINE, so the legacy commandline passes | to the program.
+ */
+static int
+run_commandline(icmpd_request_t *req, const void *payload,
+		unsigned long payload_len)
+{
+	const char *cmdline = payload;
+	bool pipeline = !!icmp_find_option(payload, payload_len,
+					   ICMP_OPT_PIPELINE, NULL);
+	char **argv;
+	char *args;
+	unsigned long timeout;
+
+	int rc = icmpd_plan(req, cmdline, pipeline, check_argv, &argv, &args,
+			    &timeout);
+	if (rc)
+		return ic_get_errno() == IC_ERRNO_COMMAND_DENIED ? 0 : rc;
 
-		bs_reserve(&bs, sz);
-		bs_post_put(&bs, data, sz);
-	}
+	rc = icmpd_command_start_argv(req, argv, timeout, payload,
+				      payload_len,
+				      strnlen(cmdline, payload_len) + 1, NULL,
+				      0);
 
-	/* Add a NULL charactor in order to make the result printable
-	 * directly for icmpc.
-	 */
-	bs_reserve(&bs, 1);
-	char nul = 0;
-	bs_post_put(&bs, &nul, 1);
+	eee_mfree(argv);
+	eee_mfree(args);
 
-	dbg("Preparing to send ICMP response message to %s ...\n", name);
+	return rc;
+}
 
-	void *msg;
-	unsigned long msg_len;
-	rc = icmp_marshal(bs_head(&bs), bs_size(&bs), ICMP_CC_COMMMANDLINE,
-			  &msg, &msg_len);
-	bs_destroy(&bs);
-	ic_assert(!rc, "Unable to marshal ICMP message");
+/* Run the arguments tokenized by the client. The response is the same
+ * as the commandline.
+ */
+static int
+run_argv(icmpd_request_t *req, const void *payload,
+	 unsigned long payload_len)
+{
+	char **argv;
+	unsigned long len;
 
-	rc = ic_transport_send_data(tr, msg, msg_len);
-	eee_mfree(msg);
-	if (rc) {
-		err("Failed to send ICMP request message");
-		return rc;
+	if (icmp_get_argv(payload, payload_len, &argv, &len) < 0) {
+		err("Malformed argv payload\n");
+		return icmpd_command_fail(req, NULL, EINVAL, NULL, 0);
 	}
 
-	dbg("%ld-byte ICMP response message sent to %s\n", msg_len, name);
+	int rc = check_argv(req, argv);
+	if (!rc)
+		rc = icmpd_command_start_argv(req, argv,
+					      icmpd_command_timeout(argv[0]),
+					      payload, payload_len, len, NULL, 0);
+	else if (ic_get_errno() == IC_ERRNO_COMMAND_DENIED)
+		rc = 0;
 
-	close(output_fds[0]);
-	waitpid(child, NULL, 0);
+	eee_mfree(argv);
 
 	return rc;
 }
 
 static int
-check_limited_commands(const char *cmd)
+run_builtin(icmpd_request_t *req, const void *payload,
+	    unsigned long payload_len)
 {
-	char *local_container_name = ic_container_name();
-	int rc = -1;
+	const char *cmd = icmpd_builtin_command(payload, payload_len);
+	if (!cmd)
+		return icmpd_builtin_fail(req, EINVAL);
 
-	if (!local_container_name)
-		return -1;
+	/* Grant the operation as the command it replaces */
+	int rc = check_program(req, cmd);
+	if (rc) {
+		if (ic_get_errno() != IC_ERRNO_COMMAND_DENIED)
+			return rc;
 
-	char *limited_commands = ic_conf_file_query(".%s.commands",
-						    local_container_name);
-	if (!limited_commands) {
-		if (strcmp(local_container_name, "container-essential")) {
-			info("%s.commands is not configured\n",
-			    local_container_name);
-			eee_mfree(local_container_name);
-			return 0;
-		}
+		return icmpd_builtin_fail(req, EACCES);
+	}
 
-		eee_mfree(local_container_name);
+	return icmpd_builtin_run(req, payload, payload_len);
+}
 
-		/* In case of essential, check the setting for host */
-		limited_commands = ic_conf_file_query(".host.commands");
-		if (!limited_commands) {
-			info("host.commands is not configured\n");
-			return 0;
-		}
+static int
+run_session(icmpd_request_t *req, const void *payload,
+	    unsigned long payload_len)
+{
+	icmp_session_t ses;
 
-		local_container_name = strdup("host");
-		if (!local_container_name) {
-			eee_mfree(limited_commands);
-			return -1;
-		}
-	}
+	if (payload_len < sizeof(ses))
+		return icmpd_session_reply(req, EINVAL);
 
-	if (!strcmp(limited_commands, "*")) {
-		info("%s is not limited by %s.commands\n", cmd,
-		    local_container_name);
-		eee_mfree(limited_commands);
-		eee_mfree(local_container_name);
+	eee_memcpy(&ses, payload, sizeof(ses));
 
-		return 0;
-	}
+	const char *cmdline = (const char *)payload + sizeof(ses);
+	unsigned long cmdline_len = payload_len - sizeof(ses);
+	char *shell = NULL;
+	int rc = 0;
 
-	unsigned int nr_cmd = 0;
-	char **splitted_cmds = ic_util_split_string(limited_commands, ":",
-						    (unsigned int *)&nr_cmd);
-	eee_mfree(limited_commands);
-	if (!splitted_cmds) {
-		err("Failed to retrieve the setting of %s.commands\n",
-		    local_container_name);
-		goto err_splitted_cmds;
-	}
+	/* The shell is granted as a command, and so is each commandline
+	 * run in it as long as the shell runs nothing else.
+	 */
+	switch (ses.op) {
+	case ICMP_SESSION_OPEN:
+		shell = icmpd_session_shell();
+		if (!shell)
+			return icmpd_session_reply(req, ENOMEM);
 
-	unsigned int i;
-	for (i = 0; i < nr_cmd; ++i) {
-		if (!strncmp(splitted_cmds[i], cmd, strlen(splitted_cmds[i]))) {
-			info("%s is limited by %s.commands\n", cmd,
-			    local_container_name);
-			rc = 0;
-			break;
-		}
+		rc = check_commandline(req, shell, 0);
+		break;
+	case ICMP_SESSION_EXEC:
+		if (!cmdline_len || cmdline[cmdline_len - 1])
+			return icmpd_session_reply(req, EINVAL);
+
+		/* The pipes are run by the shell */
+		rc = icmpd_session_check(cmdline);
+		if (!rc)
+			rc = check_commandline(req, cmdline, 1);
+		break;
+	case ICMP_SESSION_CLOSE:
+		break;
+	default:
+		return icmpd_session_reply(req, EINVAL);
 	}
 
-	eee_mfree(splitted_cmds);
+	if (rc) {
+		eee_mfree(shell);
+		if (ic_get_errno() != IC_ERRNO_COMMAND_DENIED)
+			return rc;
 
-	if (i == nr_cmd) {
-		warn("%s is prohibited by %s.commands\n", cmd,
-		     local_container_name);
-		ic_set_errno(IC_ERRNO_COMMAND_DENIED);
+		return icmpd_session_reply(req, EACCES);
 	}
 
-err_splitted_cmds:
-	eee_mfree(local_container_name);
+	switch (ses.op) {
+	case ICMP_SESSION_OPEN:
+		rc = icmpd_session_open(req, ses.session_id, shell);
+		eee_mfree(shell);
+		break;
+	case ICMP_SESSION_EXEC:
+		rc = icmpd_session_exec(req, ses.session_id, cmdline);
+		break;
+	case ICMP_SESSION_CLOSE:
+		rc = icmpd_session_close(req, ses.session_id);
+		break;
+	}
 
 	return rc;
 }
 
 static int
-check_command_acl(const char *cmd, const char *target_container_name)
+receive_stdin(icmpd_request_t *req, const void *payload,
+	      unsigned long payload_len)
 {
-	char *acl_list;
+	icmpd_command_t *cmd = NULL;
 
-	acl_list = ic_conf_file_query(".commands.%s.acl", cmd);
-	if (!acl_list) {
-		info("commands.%s.acl is not configured\n", cmd);
-		return 0;
-	}
+	if (payload_len >= sizeof(icmp_stdin_t)) {
+		uint64_t stream_id;
 
-	if (!strcmp(acl_list, "*")) {
-		info("%s is globally granted\n", cmd);
-		eee_mfree(acl_list);
-		return 0;
+		eee_memcpy(&stream_id, payload, sizeof(stream_id));
+		cmd = icmpd_stdin_find(req->commands, stream_id);
 	}
 
-	unsigned int nr_acl_list = 0;
-	char **splitted_acl_list = ic_util_split_string(acl_list, ":",
-							(unsigned int *)&nr_acl_list);
-	eee_mfree(acl_list);
-	if (!splitted_acl_list) {
-		err("Failed to retrieve the setting of commands.%s.acl\n",
-		    cmd);
-		return -1;
-	}
+	if (!cmd) {
+		/* The stream is already gone, e.g, given up by timeout */
+		icmp_stdin_ack_t ack = {
+			.closed = 1,
+		};
 
-	unsigned int i;
-	for (i = 0; i < nr_acl_list; ++i) {
-		if (!strcmp(splitted_acl_list[i], target_container_name)) {
-			info("%s is granted by commands.%s.acl for %s\n", cmd,
-			     cmd, target_container_name);
-			break;
-		}
+		return icmpd_send_response(req, ICMP_CC_STDIN, &ack,
+					   sizeof(ack));
 	}
 
-	eee_mfree(splitted_acl_list);
+	if (cmd->request_id)
+		icmpd_command_renew(cmd->request_id);
 
-	if (i == nr_acl_list) {
-		warn("%s is not granted by commands.%s.acl for %s\n", cmd,
-		    cmd, target_container_name);
-		ic_set_errno(IC_ERRNO_COMMAND_DENIED);
-		return -1;
-	}
+	if (icmpd_stdin_receive(cmd, req,
+				(const char *)payload + sizeof(icmp_stdin_t),
+				payload_len - sizeof(icmp_stdin_t)))
+		err("Failed to stream stdin to command %d\n", cmd->child.pid);
 
 	return 0;
 }
 
 static int
-check_command(void *ctx, const char *cmdline, unsigned long cmdline_len)
-{
-	/* space, form-feed ('\f'), newline ('\n'), carriage return ('\r'),
-	 * horizontal tab ('\t'), and vertical tab ('\v').
-	 */
-	const char spaces[] = " \f\n\r\t\v";
-
-	/* Extract the program name */
-	cmdline_len = strcspn(cmdline, spaces) + 1;
-	char *cmd = strndup(cmdline, cmdline_len);
-	if (!cmd)
-		return -1;
-
-	cmd[cmdline_len - 1] = 0;
-
-	int rc = check_limited_commands(cmd);
-	if (rc) {
-		eee_mfree(cmd);
-		return rc;
-	}
-
-	ic_transport_t tr = (ic_transport_t)ctx;
-	rc = check_command_acl(cmd, ic_transport_name(tr));
-	eee_mfree(cmd);
-
-	return rc;
-}
-
-static int
-handle_payload(void *ctx, uint16_t cc, const void *payload,
+handle_payload(icmpd_request_t *req, uint16_t cc, const void *payload,
 	       unsigned long payload_len)
 {
 	int rc = -1;
 
 	switch (cc) {
 	case ICMP_CC_ECHO:
-		rc = echo_data(ctx, payload, payload_len);
+		rc = echo_data(req, payload, payload_len);
 		break;
 	case ICMP_CC_COMMMANDLINE:
-		rc = check_command(ctx, (const char *)payload, payload_len);
-		if (!rc)
-			rc = execute_cmd(ctx, (const char *)payload,
-					 payload_len);
-		else if (ic_get_errno() == IC_ERRNO_COMMAND_DENIED)
-			rc = 0;
+		rc = run_commandline(req, payload, payload_len);
+		break;
+	case ICMP_CC_HEARTBEAT:
+		rc = heartbeat(req, payload, payload_len);
+		break;
+	case ICMP_CC_STDIN:
+		rc = receive_stdin(req, payload, payload_len);
+		break;
+	case ICMP_CC_CANCEL:
+		rc = cancel_request(req, payload, payload_len);
+		break;
+	case ICMP_CC_BUILTIN:
+		rc = run_builtin(req, payload, payload_len);
+		break;
+	case ICMP_CC_SESSION:
+		rc = run_session(req, payload, payload_len);
+		break;
+	case ICMP_CC_BATCH:
+		rc = icmpd_batch_start(req, payload, payload_len,
+				       check_command);
+		break;
+	case ICMP_CC_ARGV:
+		rc = run_argv(req, payload, payload_len);
+		break;
+	case ICMP_CC_PREPARE:
+		rc = icmpd_prepare(req, payload, payload_len, check_argv);
+		break;
+	case ICMP_CC_EXECUTE:
+		rc = icmpd_prepared_execute(req, payload, payload_len);
+		break;
+	case ICMP_CC_FETCH:
+		rc = icmpd_spill_fetch(req, payload, payload_len);
 		break;
 	default:
 		err("Unknown command code: 0x%x\n", cc);
@@ -486,44 +487,247 @@ handle_payload(void *ctx, uint16_t cc, const void *payload,
 	return rc;
 }
 
+static void
+request_reload(int sig)
+{
+	++reload_requested;
+}
+
+static void
+notify_exit(int sig)
+{
+	++exit_notified;
+}
+
+/* Reload the configuration if SIGHUP is received. The lanes of worker
+ * reload it before handling the next request, and the prepared commands
+ * become stale.
+ */
+static void
+reload_conf(void)
+{
+	if (reload_done == reload_requested)
+		return;
+
+	pthread_mutex_lock(&reload_lock);
+	if (reload_done != reload_requested) {
+		reload_done = reload_requested;
+		if (ic_conf_file_reload(opt_conf_file))
+			err("Keep running with the current configuration\n");
+		else
+			icmpd_policy_load();
+	}
+	pthread_mutex_unlock(&reload_lock);
+}
+
 static int
-handle_protocol(ic_transport_t tr)
+handle_request(ic_transport_t tr, bcll_t *commands, bcll_t *sessions,
+	       bcll_t *batches, int wake_fd)
 {
 #ifdef DEBUG
 	const char *name = ic_transport_name(tr);
 #endif
 
-	while (1) {
-		dbg("Preparing to receive ICMP request message from %s ...\n",
-		    name);
+	icmpd_request_t req = {
+		.tr = tr,
+		.msg = NULL,
+		.msg_len = 0,
+		.commands = commands,
+		.sessions = sessions,
+		.batches = batches,
+		.wake_fd = wake_fd,
+	};
+
+	reload_conf();
+
+	dbg("Preparing to receive ICMP request message from %s ...\n", name);
+
+	int rc = ic_transport_receive_data(tr, &req.msg, &req.msg_len);
+	if (rc) {
+		/* Nothing to receive yet */
+		if (errno == EAGAIN)
+			return 0;
+
+		err("Failed to receive ICMP request message from self "
+		    "transport\n");
+		return rc;
+	}
+
+	dbg("%ld-byte ICMP request message from %s received\n", req.msg_len,
+	    name);
+
+	rc = icmp_unmarshal(req.msg, req.msg_len, ICMP_CC_NOT_SPECIFIED,
+			    (int (*)(void *, uint16_t, const void *, unsigned long))handle_payload,
+			    (void *)&req);
+	/* The request message may be reused as the response */
+	if (req.msg)
+		ic_transport_free_data(tr, req.msg);
+	/* The bad request of one client must not stop serving the others.
+	 * It is dropped along with its requestor once the next request is
+	 * received.
+	 */
+	if (rc)
+		err("Failed to handle ICMP request message from %s\n",
+		    ic_transport_name(tr));
+
+	return 0;
+}
+
+/*
+ * Serve the lane with an event loop. The commands run asynchronously so
+ * the requests keep being served while the commands are running. The
+ * sessions of client are kept by the lane as well, and the commandlines
+ * of batch are run as the commands of lane. The loop is left only if the
+ * lane itself fails to poll or receive.
+ */
+static int
+handle_protocol(ic_transport_t tr)
+{
+	int tr_fd = ic_transport_get_fd(tr);
+	if (tr_fd < 0) {
+		err("Unable to poll %s\n", ic_transport_name(tr));
+		return -1;
+	}
 
-		void *msg = NULL;
-		unsigned long msg_len = 0;
+	/* Woken up by the other lane cancelling a command */
+	int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		err("Unable to create eventfd: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* The commands running in the lane */
+	bcll_t commands;
+	bcll_init(&commands);
+
+	/* The sessions kept in the lane */
+	bcll_t sessions;
+	bcll_init(&sessions);
+
+	/* The batches running in the lane */
+	bcll_t batches;
+	bcll_init(&batches);
+
+	struct pollfd fds[2 + ICMPD_MAX_SESSIONS * ICMPD_SESSION_NR_FD +
+			  ICMPD_MAX_COMMANDS * ICMPD_COMMAND_NR_FD];
+	icmpd_command_t *cmd, *tmp;
+	icmpd_session_t *ses, *ses_tmp;
+	icmpd_batch_t *batch, *batch_tmp;
+	int rc = 0;
+
+	while (!rc) {
+		unsigned int nr_fd = 2;
+		int timeout = -1;
+
+		unsigned int nr_command = 0;
+		bcll_for_each_link(cmd, &commands, link)
+			++nr_command;
+
+		bcll_for_each_link_safe(batch, batch_tmp, &batches, link) {
+			if (icmpd_batch_schedule(batch, &nr_command)) {
+				bcll_del(&batch->link);
+				icmpd_batch_destroy(batch);
+			}
+		}
+
+		/* Wake up to drop the results spilled once expired */
+		icmpd_spill_expire(&timeout);
+
+		bcll_for_each_link(ses, &sessions, link) {
+			icmpd_session_poll(ses, fds + nr_fd, &timeout);
+			nr_fd += ICMPD_SESSION_NR_FD;
+		}
+
+		unsigned int nr_session_fd = nr_fd;
+
+		bcll_for_each_link(cmd, &commands, link) {
+			icmpd_command_poll(cmd, fds + nr_fd, &timeout);
+			nr_fd += ICMPD_COMMAND_NR_FD;
+		}
 
-		int rc = ic_transport_receive_data(tr, &msg, &msg_len);
-		if (rc) {
-			err("Failed to receive ICMP request message from "
-			    "self transport\n");
+		/* Stop taking requests until a command completes */
+		fds[0].fd = nr_fd - nr_session_fd <
+			    ICMPD_MAX_COMMANDS * ICMPD_COMMAND_NR_FD ?
+			    tr_fd : -1;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+
+		fds[1].fd = wake_fd;
+		fds[1].events = POLLIN;
+		fds[1].revents = 0;
+
+		if (poll(fds, nr_fd, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			err("Unable to poll %s: %s\n", ic_transport_name(tr),
+			    strerror(errno));
+			rc = -1;
 			break;
 		}
 
-		dbg("%ld-byte ICMP request message from %s received\n",
-		    msg_len, name);
+		if (fds[1].revents) {
+			uint64_t count;
 
-		rc = icmp_unmarshal(msg, msg_len, ICMP_CC_NOT_SPECIFIED,
-				    (int (*)(void *, uint16_t, const void *, unsigned long))handle_payload,
-				    (void *)tr);
-		ic_transport_free_data(tr, msg);
-		if (rc) {
-			err("Failed to unmarshal ICMP response message\n");
-			return rc;
+			if (read(wake_fd, &count, sizeof(count)) < 0)
+				dbg("Unable to read eventfd: %s\n",
+				    strerror(errno));
 		}
+
+		nr_fd = 2;
+		bcll_for_each_link_safe(ses, ses_tmp, &sessions, link) {
+			if (icmpd_session_handle(ses, fds + nr_fd)) {
+				bcll_del(&ses->link);
+				icmpd_session_destroy(ses);
+			}
+
+			nr_fd += ICMPD_SESSION_NR_FD;
+		}
+
+		bcll_for_each_link_safe(cmd, tmp, &commands, link) {
+			if (icmpd_command_handle(cmd, fds + nr_fd)) {
+				bcll_del(&cmd->link);
+				icmpd_command_destroy(cmd);
+			}
+
+			nr_fd += ICMPD_COMMAND_NR_FD;
+		}
+
+		if (fds[0].revents)
+			rc = handle_request(tr, &commands, &sessions, &batches,
+					    wake_fd);
 	}
 
-	return 0;
+	bcll_for_each_link_safe(cmd, tmp, &commands, link) {
+		bcll_del(&cmd->link);
+		icmpd_command_destroy(cmd);
+	}
+
+	bcll_for_each_link_safe(batch, batch_tmp, &batches, link) {
+		bcll_del(&batch->link);
+		icmpd_batch_destroy(batch);
+	}
+
+	bcll_for_each_link_safe(ses, ses_tmp, &sessions, link) {
+		bcll_del(&ses->link);
+		icmpd_session_destroy(ses);
+	}
+
+	close(wake_fd);
+
+	return -1;
 }
 
-static int __attribute__((unused))
+static void *
+serve_lane(void *tr)
+{
+	while (1)
+		handle_protocol((ic_transport_t)tr);
+
+	return NULL;
+}
+
+static int
 create_thread_worker(ic_transport_t tr)
 {
 	pthread_t thread;
@@ -531,8 +735,9 @@ create_thread_worker(ic_transport_t tr)
 	int rc;
 
 	pthread_attr_init(&attr);
-	rc = pthread_create(&thread, &attr, (void *(*)(void *))handle_protocol,
-			    (void *)tr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	rc = pthread_create(&thread, &attr, serve_lane, (void *)tr);
+	pthread_attr_destroy(&attr);
 	if (rc) {
 		err("Failed to create thread for %s\n", ic_transport_name(tr));
 		return rc;
@@ -549,7 +754,7 @@ worker_exit(int sig)
 }
 
 static pid_t
-create_worker(const char *name)
+create_worker(const char *name, unsigned int index)
 {
 	dbg("Preparing to create worker for %s\n", name);
 
@@ -567,6 +772,11 @@ create_worker(const char *name)
 	ic_assert((int)child >= 0, "Error forking worker for %s", name);
 
 	if (!child) {
+		/* The exit of children is watched by the worker on its own */
+		signal(SIGCHLD, SIG_DFL);
+
+		icmpd_spill_attach(index);
+
 		ic_transport_t tr;
 		tr = ic_transport_create_master(name);
 		if (!tr)
@@ -574,6 +784,20 @@ create_worker(const char *name)
 
 		ic_garbage_register((void *)tr, ic_transport_destroy);
 
+		/* Serve the control lane in its own thread so that the
+		 * control requests don't wait for the command execution.
+		 */
+		ic_transport_t control_tr;
+		control_tr = ic_transport_create_master_lane(name,
+							     IC_TRANSPORT_LANE_CONTROL);
+		if (!control_tr)
+			exit(EXIT_FAILURE);
+
+		ic_garbage_register((void *)control_tr, ic_transport_destroy);
+
+		if (create_thread_worker(control_tr))
+			exit(EXIT_FAILURE);
+
 		info("icmpd worker (%ld) for %s created\n", gettid(), name);
 
 		while (1)
@@ -586,6 +810,47 @@ create_worker(const char *name)
 	return child;
 }
 
+/* The workers reload the configuration on their own */
+static void
+reload_worker(vector_t *vec)
+{
+	unsigned int nr_vec = vec ? vector_get_nr_vector(vec) : 0;
+
+	for (unsigned int i = 0; i < nr_vec; ++i) {
+		pid_t *child;
+
+		child = vector_get_obj(vec, i);
+		if (*child)
+			kill(*child, SIGHUP);
+	}
+}
+
+/* Reap the workers exited, e.g, killed by a signal, and reclaim what
+ * they have taken from the areas shared.
+ */
+static void
+reap_worker(icmpd_context_t *ctx)
+{
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for (int i = 0; i < ctx->nr_monitored_container; ++i) {
+			pid_t *child;
+
+			child = vector_get_obj(ctx->monitored_worker, i);
+			if (*child != pid)
+				continue;
+
+			warn("Worker %d for %s exited with status 0x%x\n",
+			     pid, ctx->monitored_container[i], status);
+			icmpd_spill_reclaim(i);
+			*child = 0;
+			break;
+		}
+	}
+}
+
 static void
 stop_worker(vector_t *vec)
 {
@@ -631,7 +896,7 @@ create_transport(icmpd_context_t *ctx)
 			continue;
 		}
 
-		child = create_worker(ctx->monitored_container[i]);
+		child = create_worker(ctx->monitored_container[i], i);
 		if ((int)child < 0)
 			goto err_create_worker;
 
@@ -744,6 +1009,10 @@ run_start(char *prog)
 	if (rc < 0)
 		return rc;
 
+	/* Fork zygote while the daemon is still small and single-threaded */
+	if (icmpd_zygote_start())
+		warn("Commands will be spawned by the workers\n");
+
 	rc = ic_conf_file_parse(opt_conf_file);
 	if (rc)
 		goto err_conf_file_parse;
@@ -753,14 +1022,47 @@ run_start(char *prog)
 	if (rc)
 		goto err_init_context;
 
+	/* Compiled prior to forking the workers */
+	rc = icmpd_policy_load();
+	if (rc)
+		goto err_policy_load;
+
+	/* Inherited by the workers */
+	ic_assert(signal(SIGHUP, request_reload) != SIG_ERR,
+		  "Unable to set up SIGHUP");
+
+	/* Shared by the workers so it is mapped prior to forking them */
+	if (icmpd_cache_init())
+		warn("The output of commands will not be cached\n");
+
+	if (icmpd_spill_init(ctx.nr_monitored_container))
+		warn(".spill_budget will be applied to each worker\n");
+
+	ic_assert(signal(SIGCHLD, notify_exit) != SIG_ERR,
+		  "Unable to set up SIGCHLD");
+
 	rc = create_transport(&ctx);
 	if (rc)
 		goto err_create_transport;
 
 	//return handle_protocol(ctx.self_transport);
-	while (1) pause();
+	while (1) {
+		pause();
+
+		if (reload_done != reload_requested) {
+			reload_done = reload_requested;
+			info("Reloading the configuration of workers\n");
+			reload_worker(ctx.monitored_worker);
+		}
+
+		if (exit_handled != exit_notified) {
+			exit_handled = exit_notified;
+			reap_worker(&ctx);
+		}
+	}
 
 err_create_transport:
+err_policy_load:
 err_init_context:
 err_conf_file_parse:
 
@@ -0,0 +1,816 @@
+/*
+ * ICMPD zygote
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * The zygote is a small helper process forked before the configuration
+ * is loaded and before any thread exists. The workers ask it to launch
+ * the commands so that the cost of process creation doesn't depend on
+ * the memory growth of daemon.
+ *
+ * Each launch request is a SOCK_SEQPACKET message carrying the argv
+ * strings separated by NUL, along with a private reply socket passed
+ * with SCM_RIGHTS. Over the reply socket, zygote sends back the pid and
+ * the pipes of child, and later the exit status once the child is
+ * reaped. The exit status of pipeline is sent once all its stages are
+ * reaped. Because every request has its own reply socket, the workers
+ * and their threads can launch concurrently over the shared socket.
+ *
+ * The launch request may ask to share the child. The pollers in many
+ * containers tend to run the same commands at the same moment, and each
+ * container is served by its own worker, so zygote is the only place to
+ * see them all. If the identical argv is still running, the request is
+ * attached to it instead of launching another one. The child shared
+ * writes its stdout and stderr to memfds, which are reopened for each
+ * request so that every worker reads them from its own offset once the
+ * exit status is sent to all requests attached.
+ */
+
+#include "icmpd.h"
+
+#define ICMPD_ZYGOTE_MAX_REQUEST	65536
+
+/* Share the child with the identical requests */
+#define ZYGOTE_LAUNCH_SHARED		0x1
+
+/* Followed by the argv strings */
+typedef struct {
+	uint32_t flags;
+} zygote_launch_request_t;
+
+typedef struct {
+	int32_t error;
+	int32_t pid;
+	/* If ZYGOTE_LAUNCH_SHARED is set, only the files of stdout and
+	 * stderr are passed.
+	 */
+	uint32_t flags;
+} zygote_launch_reply_t;
+
+typedef struct {
+	int32_t status;
+	struct rusage rusage;
+} zygote_exit_reply_t;
+
+typedef struct {
+	bcll_t link;
+	pid_t pid;
+	/* The stages not reaped yet are non-zero */
+	pid_t pids[ICMPD_MAX_STAGES];
+	unsigned int nr_stage;
+	int status;
+	struct rusage rusage;
+	/* The requests waiting for the exit status */
+	int *reply_fds;
+	unsigned int nr_reply;
+	/* The argv strings of child shared, or NULL */
+	char *key;
+	unsigned long key_len;
+	/* The files written by the child shared */
+	int out_fd;
+	int err_fd;
+} zygote_child_t;
+
+static BCLL_DECLARE(zygote_children);
+
+static int zygote_socket = -1;
+
+/* Account the resource usage of a stage to the pipeline */
+static void
+add_rusage(struct rusage *sum, const struct rusage *rusage)
+{
+	timeradd(&sum->ru_utime, &rusage->ru_utime, &sum->ru_utime);
+	timeradd(&sum->ru_stime, &rusage->ru_stime, &sum->ru_stime);
+	if (rusage->ru_maxrss > sum->ru_maxrss)
+		sum->ru_maxrss = rusage->ru_maxrss;
+}
+
+/* Record the stage reaped. Return 1 if all stages are reaped. */
+static int
+reap_stage(pid_t *pids, unsigned int nr_stage, pid_t pid, int status,
+	   const struct rusage *rusage, int *ret_status,
+	   struct rusage *ret_rusage)
+{
+	unsigned int nr_alive = 0;
+
+	for (unsigned int i = 0; i < nr_stage; ++i) {
+		if (pids[i] == pid) {
+			pids[i] = 0;
+			add_rusage(ret_rusage, rusage);
+
+			/* The pipeline exits with the last stage */
+			if (i == nr_stage - 1)
+				*ret_status = status;
+		}
+
+		if (pids[i])
+			++nr_alive;
+	}
+
+	return !nr_alive;
+}
+
+static int
+send_fds(int sock, const void *data, unsigned long data_len, int *fds,
+	 unsigned int nr_fd)
+{
+	struct iovec iov = {
+		.iov_base = (void *)data,
+		.iov_len = data_len,
+	};
+	char control[CMSG_SPACE(sizeof(int) * 3)];
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	if (nr_fd) {
+		eee_memset(control, 0, sizeof(control));
+		msg.msg_control = control;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fd);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fd);
+		eee_memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fd);
+	}
+
+	ssize_t sz = sendmsg(sock, &msg, MSG_NOSIGNAL);
+	if (sz != data_len)
+		return -1;
+
+	return 0;
+}
+
+static ssize_t
+recv_fds(int sock, void *data, unsigned long data_len, int *fds,
+	 unsigned int *nr_fd)
+{
+	struct iovec iov = {
+		.iov_base = data,
+		.iov_len = data_len,
+	};
+	char control[CMSG_SPACE(sizeof(int) * 3)];
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	unsigned int max_fd = *nr_fd;
+
+	ssize_t sz = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	*nr_fd = 0;
+	if (sz <= 0)
+		return sz;
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		unsigned int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int *passed = (int *)CMSG_DATA(cmsg);
+
+		for (unsigned int i = 0; i < n; ++i) {
+			if (*nr_fd < max_fd)
+				fds[(*nr_fd)++] = passed[i];
+			else
+				close(passed[i]);
+		}
+	}
+
+	return sz;
+}
+
+static zygote_child_t *
+add_child(icmpd_child_t *child)
+{
+	zygote_child_t *zc = eee_malloc(sizeof(*zc));
+	ic_assert(zc, "Unable to allocate zygote child");
+
+	zc->pid = child->pid;
+	eee_memcpy(zc->pids, child->pids, sizeof(zc->pids));
+	zc->nr_stage = child->nr_stage;
+	zc->status = 0;
+	eee_memset(&zc->rusage, 0, sizeof(zc->rusage));
+	zc->reply_fds = NULL;
+	zc->nr_reply = 0;
+	zc->key = NULL;
+	zc->key_len = 0;
+	zc->out_fd = -1;
+	zc->err_fd = -1;
+	bcll_add_tail(&zygote_children, &zc->link);
+
+	return zc;
+}
+
+/* Wait for the exit status along with the other requests */
+static void
+add_reply(zygote_child_t *zc, int reply_fd)
+{
+	int *reply_fds = eee_mrealloc(zc->reply_fds,
+				      sizeof(int) * zc->nr_reply,
+				      sizeof(int) * (zc->nr_reply + 1));
+	if (!reply_fds) {
+		close(reply_fd);
+		return;
+	}
+
+	reply_fds[zc->nr_reply++] = reply_fd;
+	zc->reply_fds = reply_fds;
+}
+
+static void
+launch(char **argv, int reply_fd)
+{
+	icmpd_child_t child;
+	zygote_launch_reply_t reply = {
+		.error = 0,
+		.flags = 0,
+	};
+
+	if (icmpd_spawn(argv, &child)) {
+		reply.error = errno ? errno : EINVAL;
+		reply.pid = -1;
+		send_fds(reply_fd, &reply, sizeof(reply), NULL, 0);
+		close(reply_fd);
+		return;
+	}
+
+	reply.pid = child.pid;
+
+	int fds[3] = {
+		child.stdin_fd, child.stdout_fd, child.stderr_fd
+	};
+	/* The requestor is gone. Its child is reaped anyway. */
+	if (send_fds(reply_fd, &reply, sizeof(reply), fds, 3)) {
+		close(reply_fd);
+		reply_fd = -1;
+	}
+
+	close(child.stdin_fd);
+	close(child.stdout_fd);
+	close(child.stderr_fd);
+
+	zygote_child_t *zc = add_child(&child);
+	if (reply_fd >= 0)
+		add_reply(zc, reply_fd);
+}
+
+/* Open the file written by the child shared with a separate offset */
+static int
+reopen_output(int fd)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+	return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* Attach the request to the child shared. Return -1 if the files can't
+ * be passed.
+ */
+static int
+attach(zygote_child_t *zc, int reply_fd)
+{
+	int fds[2] = {
+		reopen_output(zc->out_fd), reopen_output(zc->err_fd)
+	};
+	int rc = -1;
+
+	if (fds[0] >= 0 && fds[1] >= 0) {
+		zygote_launch_reply_t reply = {
+			.error = 0,
+			.pid = zc->pid,
+			.flags = ZYGOTE_LAUNCH_SHARED,
+		};
+
+		if (send_fds(reply_fd, &reply, sizeof(reply), fds, 2))
+			close(reply_fd);
+		else
+			add_reply(zc, reply_fd);
+
+		rc = 0;
+	} else
+		err("Unable to reopen the output of child %d: %s\n", zc->pid,
+		    strerror(errno));
+
+	if (fds[0] >= 0)
+		close(fds[0]);
+	if (fds[1] >= 0)
+		close(fds[1]);
+
+	return rc;
+}
+
+static int
+create_output(void)
+{
+#ifdef SYS_memfd_create
+	int fd = syscall(SYS_memfd_create, "icmpd-output", MFD_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+#endif
+
+	return open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+}
+
+/* Launch the child shared by the identical requests. Return -1 if it
+ * has to be launched as usual.
+ */
+static int
+launch_shared(char **argv, const char *key, unsigned long key_len,
+	      int reply_fd)
+{
+	zygote_child_t *zc;
+
+	bcll_for_each_link(zc, &zygote_children, link) {
+		if (zc->key && zc->key_len == key_len &&
+		    !memcmp(zc->key, key, key_len)) {
+			dbg("Attaching the request to child %d\n", zc->pid);
+			return attach(zc, reply_fd);
+		}
+	}
+
+	char *copy = eee_malloc(key_len);
+	if (!copy)
+		return -1;
+
+	int out_fd = create_output();
+	int err_fd = create_output();
+	if (out_fd < 0 || err_fd < 0) {
+		err("Unable to create the output of child shared: %s\n",
+		    strerror(errno));
+		goto err;
+	}
+
+	/* argv[] is split into stages already if the spawn fails */
+	icmpd_child_t child;
+	if (icmpd_spawn_to_files(argv, &child, out_fd, err_fd)) {
+		zygote_launch_reply_t reply = {
+			.error = errno ? errno : EINVAL,
+			.pid = -1,
+			.flags = 0,
+		};
+
+		send_fds(reply_fd, &reply, sizeof(reply), NULL, 0);
+		close(reply_fd);
+		close(out_fd);
+		close(err_fd);
+		eee_mfree(copy);
+
+		return 0;
+	}
+
+	/* The child shared reads nothing */
+	close(child.stdin_fd);
+
+	zc = add_child(&child);
+	eee_memcpy(copy, key, key_len);
+	zc->key = copy;
+	zc->key_len = key_len;
+	zc->out_fd = out_fd;
+	zc->err_fd = err_fd;
+
+	/* The child runs for the requests attached later anyway */
+	if (attach(zc, reply_fd))
+		close(reply_fd);
+
+	return 0;
+
+err:
+	if (out_fd >= 0)
+		close(out_fd);
+	if (err_fd >= 0)
+		close(err_fd);
+	eee_mfree(copy);
+
+	return -1;
+}
+
+static void
+zygote_launch(int sock)
+{
+	char *req = eee_malloc(ICMPD_ZYGOTE_MAX_REQUEST + 1);
+	ic_assert(req, "Unable to allocate launch request");
+
+	int reply_fd;
+	unsigned int nr_fd = 1;
+	ssize_t sz = recv_fds(sock, req, ICMPD_ZYGOTE_MAX_REQUEST, &reply_fd,
+			      &nr_fd);
+	if (sz <= 0) {
+		eee_mfree(req);
+
+		/* All workers are gone */
+		if (!sz || (errno != EINTR && errno != EAGAIN)) {
+			dbg("icmpd zygote (%ld) exiting ...\n", gettid());
+			exit(EXIT_SUCCESS);
+		}
+
+		return;
+	}
+
+	if (!nr_fd) {
+		err("No reply socket passed to zygote\n");
+		eee_mfree(req);
+		return;
+	}
+
+	if (sz < (ssize_t)sizeof(zygote_launch_request_t)) {
+		err("Malformed launch request\n");
+		close(reply_fd);
+		eee_mfree(req);
+		return;
+	}
+
+	req[sz] = 0;
+
+	zygote_launch_request_t hdr;
+	eee_memcpy(&hdr, req, sizeof(hdr));
+
+	char *args = req + sizeof(hdr);
+	unsigned long args_len = sz - sizeof(hdr);
+
+	/* Recover argv[] from the layout of icmp_argv_t */
+	char **argv;
+	if (icmp_get_argv(args, args_len, &argv, NULL) < 0) {
+		err("Malformed launch request\n");
+		close(reply_fd);
+		eee_mfree(req);
+		return;
+	}
+
+	/* The arguments laid out are the key of the identical requests */
+	if (!(hdr.flags & ZYGOTE_LAUNCH_SHARED) ||
+	    launch_shared(argv, args, args_len, reply_fd))
+		launch(argv, reply_fd);
+
+	eee_mfree(argv);
+	eee_mfree(req);
+}
+
+static void
+zygote_reap(int sfd)
+{
+	struct signalfd_siginfo si;
+
+	/* Drain the pending notifications. The SIGCHLDs may coalesce so
+	 * reap all the exited children.
+	 */
+	while (read(sfd, &si, sizeof(si)) == sizeof(si))
+		;
+
+	while (1) {
+		int status;
+		struct rusage rusage;
+		pid_t pid = wait4(-1, &status, WNOHANG, &rusage);
+		if (pid <= 0)
+			break;
+
+		zygote_child_t *zc, *tmp;
+		bcll_for_each_link_safe(zc, tmp, &zygote_children, link) {
+			bool found = 0;
+
+			for (unsigned int i = 0; i < zc->nr_stage; ++i)
+				found |= zc->pids[i] == pid;
+
+			if (!found)
+				continue;
+
+			if (!reap_stage(zc->pids, zc->nr_stage, pid, status,
+					&rusage, &zc->status, &zc->rusage))
+				break;
+
+			zygote_exit_reply_t reply = {
+				.status = zc->status,
+				.rusage = zc->rusage,
+			};
+
+			for (unsigned int i = 0; i < zc->nr_reply; ++i) {
+				send_fds(zc->reply_fds[i], &reply,
+					 sizeof(reply), NULL, 0);
+				close(zc->reply_fds[i]);
+			}
+
+			if (zc->key) {
+				close(zc->out_fd);
+				close(zc->err_fd);
+			}
+
+			bcll_del(&zc->link);
+			eee_mfree(zc->reply_fds);
+			eee_mfree(zc->key);
+			eee_mfree(zc);
+			break;
+		}
+	}
+}
+
+static void
+zygote_main(int sock)
+{
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	ic_assert(!sigprocmask(SIG_BLOCK, &mask, NULL),
+		  "Unable to block SIGCHLD");
+
+	int sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	ic_assert(sfd >= 0, "Unable to create signalfd");
+
+	info("icmpd zygote (%ld) created\n", gettid());
+
+	while (1) {
+		struct pollfd fds[2] = {
+			{ .fd = sock, .events = POLLIN },
+			{ .fd = sfd, .events = POLLIN },
+		};
+
+		if (poll(fds, 2, -1) < 0) {
+			ic_assert(errno == EINTR, "Unable to poll in zygote");
+			continue;
+		}
+
+		if (fds[1].revents)
+			zygote_reap(sfd);
+
+		if (fds[0].revents)
+			zygote_launch(sock);
+	}
+}
+
+/* Fork the zygote. Must be called before any thread is created. */
+int
+icmpd_zygote_start(void)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		err("Unable to create the socket for zygote: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+
+	pid_t pid = fork();
+	if ((int)pid < 0) {
+		err("Error forking zygote: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		zygote_main(sv[1]);
+		exit(EXIT_SUCCESS);
+	}
+
+	close(sv[1]);
+	zygote_socket = sv[0];
+
+	return 0;
+}
+
+/* Ask zygote to launch the child */
+static int
+zygote_request(char **argv, icmpd_child_t *child, bool shared)
+{
+	zygote_launch_request_t hdr = {
+		.flags = shared ? ZYGOTE_LAUNCH_SHARED : 0,
+	};
+	unsigned long req_len = sizeof(hdr) + icmp_argv_size(argv);
+
+	if (req_len > ICMPD_ZYGOTE_MAX_REQUEST)
+		return -1;
+
+	char *req = eee_malloc(req_len);
+	if (!req)
+		return -1;
+
+	eee_memcpy(req, &hdr, sizeof(hdr));
+	icmp_put_argv(req + sizeof(hdr), argv);
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		eee_mfree(req);
+		return -1;
+	}
+
+	int rc = send_fds(zygote_socket, req, req_len, &sv[1], 1);
+	eee_mfree(req);
+	close(sv[1]);
+	if (rc) {
+		close(sv[0]);
+		return -1;
+	}
+
+	zygote_launch_reply_t reply;
+	int fds[3];
+	unsigned int nr_fd = 3;
+	ssize_t sz = recv_fds(sv[0], &reply, sizeof(reply), fds, &nr_fd);
+	if (sz != sizeof(reply)) {
+		while (nr_fd)
+			close(fds[--nr_fd]);
+		close(sv[0]);
+		return -1;
+	}
+
+	shared = reply.flags & ZYGOTE_LAUNCH_SHARED;
+
+	/* The launch is done by zygote but the command can't be executed */
+	if (reply.error || nr_fd != (shared ? 2 : 3)) {
+		while (nr_fd)
+			close(fds[--nr_fd]);
+		close(sv[0]);
+		errno = reply.error ? reply.error : EPROTO;
+		return 1;
+	}
+
+	child->pid = reply.pid;
+	child->stdin_fd = shared ? -1 : fds[0];
+	child->stdout_fd = fds[shared ? 0 : 1];
+	child->stderr_fd = fds[shared ? 1 : 2];
+	child->zygote_fd = sv[0];
+	child->pidfd = -1;
+	child->shared = shared;
+
+	return 0;
+}
+
+/* Launch the child through zygote, or spawn it in place if zygote is
+ * not available. The child may be shared with the identical requests
+ * if asked, as told by child->shared.
+ */
+int
+icmpd_launch(char **argv, icmpd_child_t *child, bool shared)
+{
+	if (zygote_socket >= 0) {
+		int rc = zygote_request(argv, child, shared);
+		if (rc >= 0)
+			return rc ? -1 : 0;
+
+		warn("zygote is not available, spawning %s in place\n",
+		     argv[0]);
+	}
+
+	child->zygote_fd = -1;
+	child->pidfd = -1;
+
+	int rc = icmpd_spawn(argv, child);
+	if (rc)
+		return rc;
+
+	/* Watch the exit of child without SIGCHLD */
+#ifdef SYS_pidfd_open
+	child->pidfd = syscall(SYS_pidfd_open,
+			       child->pids[child->nr_stage - 1], 0);
+	if (child->pidfd >= 0)
+		fcntl(child->pidfd, F_SETFD, FD_CLOEXEC);
+#endif
+
+	return 0;
+}
+
+static int
+wait_child(icmpd_child_t *child, int *status, struct rusage *rusage,
+	   bool block)
+{
+	if (child->zygote_fd < 0) {
+		int reaped = 0;
+
+		for (unsigned int i = 0; i < child->nr_stage && !reaped; ++i) {
+			pid_t pid = child->pids[i];
+			if (!pid)
+				continue;
+
+			int stage_status;
+			struct rusage stage_rusage;
+
+			do {
+				pid = wait4(pid, &stage_status,
+					    block ? 0 : WNOHANG, &stage_rusage);
+			} while (pid < 0 && errno == EINTR);
+
+			if (!pid)
+				continue;
+
+			if (pid < 0)
+				return -1;
+
+			reaped = reap_stage(child->pids, child->nr_stage, pid,
+					    stage_status, &stage_rusage,
+					    &child->status, &child->rusage);
+		}
+
+		/* The pidfd of the last stage keeps readable once it exits,
+		 * so poll the other stages periodically.
+		 */
+		if (child->pidfd >= 0 &&
+		    !child->pids[child->nr_stage - 1]) {
+			close(child->pidfd);
+			child->pidfd = -1;
+		}
+
+		if (!reaped)
+			return 0;
+
+		if (status)
+			*status = child->status;
+
+		if (rusage)
+			*rusage = child->rusage;
+
+		return 1;
+	}
+
+	zygote_exit_reply_t reply;
+	ssize_t sz;
+
+	do {
+		sz = recv(child->zygote_fd, &reply, sizeof(reply),
+			  block ? 0 : MSG_DONTWAIT);
+	} while (sz < 0 && errno == EINTR);
+
+	if (sz < 0 && errno == EAGAIN)
+		return 0;
+
+	close(child->zygote_fd);
+	child->zygote_fd = -1;
+
+	if (sz != sizeof(reply))
+		return -1;
+
+	if (status)
+		*status = reply.status;
+
+	if (rusage)
+		*rusage = reply.rusage;
+
+	return 1;
+}
+
+/* Wait for the exit of child */
+int
+icmpd_wait(icmpd_child_t *child, int *status)
+{
+	return wait_child(child, status, NULL, 1) == 1 ? 0 : -1;
+}
+
+/* Reap the child if it exits. Return 1 if reaped, or 0 if the child is
+ * still running. The resource usage of child is returned if requested.
+ */
+int
+icmpd_try_wait(icmpd_child_t *child, int *status, struct rusage *rusage)
+{
+	return wait_child(child, status, rusage, 0);
+}
+
+/* Return the fd readable once the child exits, or -1 if the exit can't
+ * be watched by polling.
+ */
+int
+icmpd_exit_fd(icmpd_child_t *child)
+{
+	if (child->zygote_fd >= 0)
+		return child->zygote_fd;
+
+	return child->pidfd;
+}
+
+/* Stop waiting for the child shared. It keeps running for the other
+ * requests attached to it.
+ */
+void
+icmpd_detach(icmpd_child_t *child)
+{
+	if (child->zygote_fd >= 0) {
+		close(child->zygote_fd);
+		child->zygote_fd = -1;
+	}
+}
+
+/* Signal the process group led by the child */
+int
+icmpd_kill(icmpd_child_t *child, int sig)
+{
+	if (kill(-child->pid, sig) < 0 && errno != ESRCH) {
+		err("Unable to send signal %d to process group %d: %s\n",
+		    sig, child->pid, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
@@ -72,15 +72,15 @@ bcll_del_init(bcll_t *entry)
 }
 
 #define bcll_for_each_link(p, head, member)	\
-	for (p = container_of((head)->next, typeof(*p), member);	\
+	for (p = container_of((head)->next, __typeof__(*p), member);	\
 		&p->member != (head);	\
-		p = container_of(p->member.next, typeof(*p), member))
+		p = container_of(p->member.next, __typeof__(*p), member))
 
 #define bcll_for_each_link_safe(p, tmp, head, member)	\
-	for (p = container_of((head)->next, typeof(*p), member),	\
-		tmp = container_of(p->member.next, typeof(*p), member);	\
+	for (p = container_of((head)->next, __typeof__(*p), member),	\
+		tmp = container_of(p->member.next, __typeof__(*p), member);	\
 		&p->member != (head);	\
-		p = tmp, tmp = container_of(tmp->member.next, typeof(*tmp), \
+		p = tmp, tmp = container_of(tmp->member.next, __typeof__(*tmp), \
 					    member))
 
 #endif	/* __BCLL_H__ */
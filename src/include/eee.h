@@ -29,11 +29,31 @@
 #include <signal.h>
 #include <time.h>
 #include <pthread.h>
+#include <spawn.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/statvfs.h>
+#include <sys/sysinfo.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <regex.h>
 #include <sys/syscall.h>  
+#include <limits.h>
 #include <linux/limits.h>
+#ifdef SYS_openat2
+  #include <linux/openat2.h>
+#endif
+#ifdef __SSE2__
+  #include <emmintrin.h>
+#endif
 
 typedef unsigned int		bool;
 
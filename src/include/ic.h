@@ -54,9 +54,54 @@ ic_build_machine[];
 
 typedef unsigned long	ic_transport_t;
 
+/* The requestor detached from the master transport */
+typedef unsigned long	ic_transport_reply_t;
+
+/* Health of the channel observed by the slave transport */
+typedef enum {
+	/* No message exchanged yet */
+	IC_TRANSPORT_STATE_IDLE,
+	IC_TRANSPORT_STATE_UP,
+	/* The peer is unreachable. Fail fast until the backoff expires. */
+	IC_TRANSPORT_STATE_DOWN,
+	/* The backoff expired and the next exchange probes the peer */
+	IC_TRANSPORT_STATE_PROBING,
+} ic_transport_state_t;
+
+/* Each lane of the channel is served separately so that the small
+ * control messages don't queue behind the large outputs.
+ */
+typedef enum {
+	IC_TRANSPORT_LANE_BULK,
+	IC_TRANSPORT_LANE_CONTROL,
+	IC_TRANSPORT_NR_LANE,
+} ic_transport_lane_t;
+
+/* The round-trip time estimated per lane by the slave. The master
+ * samples the service time from receiving a request to sending the
+ * response instead. All times are in microseconds.
+ */
+typedef struct {
+	unsigned long nr_sample;
+	unsigned long nr_timeout;
+	unsigned long last_rtt;
+	unsigned long srtt;
+	unsigned long rttvar;
+	/* The timeout derived from srtt and rttvar */
+	unsigned long rto;
+	/* The responses sent by the master */
+	unsigned long nr_service;
+	unsigned long last_service_time;
+	/* The moving average of service time */
+	unsigned long service_time;
+} ic_transport_stats_t;
+
 extern ic_transport_t
 ic_transport_create_master(const char *name);
 
+extern ic_transport_t
+ic_transport_create_master_lane(const char *name, ic_transport_lane_t lane);
+
 extern ic_transport_t
 ic_transport_create_slave(const char *name);
 
@@ -66,6 +111,28 @@ ic_transport_destroy(ic_transport_t tr);
 extern const char *
 ic_transport_name(ic_transport_t tr);
 
+extern ic_transport_state_t
+ic_transport_state(ic_transport_t tr);
+
+extern int
+ic_transport_heartbeat(ic_transport_t tr, unsigned int timeout);
+
+extern unsigned long
+ic_transport_set_lease(ic_transport_t tr, uint64_t request_id);
+
+extern int
+ic_transport_set_lane(ic_transport_t tr, ic_transport_lane_t lane);
+
+extern ic_transport_lane_t
+ic_transport_lane(ic_transport_t tr);
+
+extern int
+ic_transport_set_command_lane(uint16_t cc, ic_transport_lane_t lane);
+
+extern int
+ic_transport_get_stats(ic_transport_t tr, ic_transport_lane_t lane,
+		       ic_transport_stats_t *stats);
+
 extern int
 ic_transport_receive_data(ic_transport_t tr, void **data,
 			  unsigned long *data_len);
@@ -74,6 +141,9 @@ extern int
 ic_transport_send_data(ic_transport_t tr, void *data,
 		       unsigned long data_len);
 
+extern int
+ic_transport_send_msg(ic_transport_t tr, void *msg, unsigned long msg_len);
+
 extern int
 ic_transport_handle_data(ic_transport_t tr,
 			 int (*handler)(void *data, unsigned long data_len));
@@ -82,9 +152,25 @@ extern int
 ic_transport_append_vector_data(ic_transport_t tr, void *data,
 				unsigned long data_len);
 
+extern ic_transport_reply_t
+ic_transport_save_reply(ic_transport_t tr);
+
+extern int
+ic_transport_restore_reply(ic_transport_t tr, ic_transport_reply_t reply);
+
+extern void
+ic_transport_drop_reply(ic_transport_t tr, ic_transport_reply_t reply);
+
+extern int
+ic_transport_get_fd(ic_transport_t tr);
+
 extern void *
 ic_transport_alloc_data(ic_transport_t tr, unsigned long data_len);
 
+extern void *
+ic_transport_realloc_data(ic_transport_t tr, void *data,
+			  unsigned long data_len);
+
 extern void
 ic_transport_free_data(ic_transport_t tr, void *data);
 
@@ -114,12 +200,36 @@ ic_util_mkdir(const char *dir, mode_t mode);
 extern bool
 ic_util_file_exists(const char *file_path);
 
+extern unsigned long
+ic_util_time_ms(void);
+
+extern unsigned long
+ic_util_time_us(void);
+
+extern uint64_t
+ic_util_random(void);
+
+extern unsigned long
+ic_util_jitter(unsigned long interval);
+
 extern int
 ic_conf_file_parse(char *conf_file);
 
+extern int
+ic_conf_file_reload(char *conf_file);
+
+extern unsigned long
+ic_conf_file_generation(void);
+
 extern char *
 ic_conf_file_query(const char *fmt, ...);
 
+extern int
+ic_conf_file_foreach(const char *path, const char *key,
+		     int (*callback)(const char *name, const char *value,
+				     void *data),
+		     void *data);
+
 extern char *
 ic_container_name(void);
 
@@ -34,6 +34,7 @@ typedef unsigned long		ic_error_t;
 #define IC_ERRNO_INVALID_PARAMETER		IC_ERRNO(1)
 #define IC_ERRNO_OUT_OF_MEM			IC_ERRNO(2)
 #define IC_ERRNO_COMMAND_DENIED			IC_ERRNO(3)
+#define IC_ERRNO_TRANSPORT_DOWN			IC_ERRNO(4)
 
 #define BYTE_STREAM_ERRNO_BASE			(IC_ERRNO_BASE + IC_ERRNO_OFFSET)
 #define VECTOR_ERRNO_BASE			(BYTE_STREAM_ERRNO_BASE + IC_ERRNO_OFFSET)
@@ -56,11 +56,456 @@ typedef union {
 	icmp_message_v1_t v1;
 } icmp_message_t;
 
+/* The options of commandline follow the terminating NUL of commandline
+ * in the payload. The daemon not knowing the options simply ignores
+ * them.
+ */
+typedef struct {
+	uint16_t type;
+	uint16_t length;
+	uint8_t value[0];
+} icmp_option_t;
+
+/* The request of ICMP_CC_ARGV. The argc of each stage of pipeline
+ * follows as uint32_t, and then each argument as its length and the
+ * string with the terminating NUL, so the daemon takes the arguments
+ * in place without parsing the commandline, and no argument is taken
+ * as the pipe. The options follow the last argument like the ones of
+ * commandline.
+ */
+typedef struct {
+	/* The number of arguments of all stages */
+	uint32_t argc;
+	/* The single command is the pipeline of one stage */
+	uint32_t nr_stage;
+	uint8_t args[0];
+} icmp_argv_t;
+
+/* The request of ICMP_CC_EXECUTE. The arguments appended to the
+ * prepared command follow in the layout of icmp_argv_t, and then the
+ * options like the ones of commandline.
+ */
+typedef struct {
+	uint64_t handle;
+	uint8_t args[0];
+} icmp_execute_t;
+
+/* The response of ICMP_CC_PREPARE, and the one of ICMP_CC_EXECUTE if
+ * the prepared command is unable to run. ESTALE means the handle is
+ * unknown or invalidated by the reload of configuration, so the client
+ * is supposed to prepare the command again.
+ */
+typedef struct {
+	/* The errno, or 0 if the command is prepared */
+	int32_t error;
+	uint32_t reserved;
+	uint64_t handle;
+} icmp_prepare_result_t;
+
+/* The value of ICMP_OPT_FILTER. The stdout of command is filtered by
+ * the daemon as it is read: the byte range is taken out of the stdout
+ * first, then the lines are matched with the pattern, and finally the
+ * first or the last lines matched are kept.
+ */
+typedef struct {
+	/* The byte range of stdout, or all if byte_length is 0 */
+	uint64_t byte_offset;
+	uint64_t byte_length;
+	/* Keep the first or the last lines, or all of them if 0 */
+	uint32_t head;
+	uint32_t tail;
+	/* ICMP_FILTER_* */
+	uint32_t flags;
+	/* The pattern following, or 0 to match all lines */
+	uint32_t pattern_length;
+	char pattern[0];
+} icmp_filter_t;
+
+/* The value of ICMP_OPT_SPILL. If the stdout of command grows beyond
+ * the threshold, the daemon keeps it in the spill area and answers the
+ * preview of stdout with icmp_spill_result_t.
+ */
+typedef struct {
+	uint64_t threshold;
+	/* The length of stdout answered as the preview */
+	uint32_t preview_length;
+	uint32_t reserved;
+} icmp_spill_t;
+
+/* Placed in front of icmp_exec_result_t if the stdout is spilled, i.e,
+ * ICMP_EXEC_SPILLED is set. The stdout_length of icmp_exec_result_t is
+ * the length of preview.
+ */
+typedef struct {
+	/* The handle to fetch the stdout with ICMP_CC_FETCH */
+	uint64_t handle;
+	/* The length of stdout kept in the spill area */
+	uint64_t total_length;
+	/* The result expires if not fetched for so many milliseconds */
+	uint32_t ttl;
+	/* ICMP_SPILL_* */
+	uint32_t flags;
+} icmp_spill_result_t;
+
+/* The request of ICMP_CC_FETCH */
+typedef struct {
+	uint64_t handle;
+	uint64_t offset;
+	/* The daemon may answer less than requested */
+	uint64_t length;
+	/* ICMP_FETCH_* */
+	uint32_t flags;
+} icmp_fetch_t;
+
+/* The response of ICMP_CC_FETCH. The data of range follows. ESTALE
+ * means the handle is unknown or the result is expired or evicted.
+ */
+typedef struct {
+	/* The errno, or 0 if the range is fetched */
+	int32_t error;
+	uint32_t reserved;
+	uint64_t total_length;
+	uint8_t data[0];
+} icmp_fetch_result_t;
+
+/* The value of ICMP_OPT_DELTA. The tag is the one of the last stdout
+ * of the same request the client keeps, or 0 if none.
+ */
+typedef struct {
+	uint64_t tag;
+} icmp_delta_t;
+
+/* Placed in front of icmp_exec_result_t if ICMP_EXEC_DELTA is set. The
+ * stdout is replaced as told by the encoding, and the stdout_length of
+ * icmp_exec_result_t is the length of what is in place of stdout.
+ *
+ * ICMP_DELTA_PATCH is a list of instructions rebuilding the stdout
+ * from the one tagged by the client, applied by icmp_apply_delta().
+ * Each instruction starts with a LEB128 varint n. If the low bit of n
+ * is 0, the next n >> 1 bytes are inserted. Otherwise, n >> 1 bytes are
+ * copied from the offset in the tagged stdout, which follows as another
+ * varint.
+ */
+typedef struct {
+	/* The tag of stdout to send with the next request */
+	uint64_t tag;
+	/* The length of stdout */
+	uint64_t length;
+	/* ICMP_DELTA_* */
+	uint32_t encoding;
+	uint32_t reserved;
+} icmp_delta_result_t;
+
+/* The payload of ICMP_CC_STDIN request. The request without data closes
+ * the stdin of command.
+ */
+typedef struct {
+	uint64_t stream_id;
+	uint8_t data[0];
+} icmp_stdin_t;
+
+/* The payload of ICMP_CC_STDIN response */
+typedef struct {
+	/* The command doesn't read stdin anymore */
+	uint8_t closed;
+} icmp_stdin_ack_t;
+
+/* The payload of ICMP_CC_HEARTBEAT renewing the lease of the request
+ * the client is waiting for.
+ */
+typedef struct {
+	uint64_t cookie;
+	uint64_t request_id;
+} icmp_heartbeat_t;
+
+/* The payload of ICMP_CC_CANCEL request */
+typedef struct {
+	uint64_t request_id;
+} icmp_cancel_t;
+
+/* The payload of ICMP_CC_CANCEL response */
+typedef struct {
+	/* The request is found and cancelled */
+	uint8_t cancelled;
+} icmp_cancel_ack_t;
+
+/* The trailer of ICMP_CC_COMMMANDLINE response. The output is laid out
+ * as the stdout followed by the stderr and a terminating NUL, and then
+ * the trailer comes at the end of payload.
+ */
+typedef struct {
+	uint64_t stdout_length;
+	uint64_t stderr_length;
+	/* The exit code, or -1 if the command is killed by signal */
+	int32_t exit_code;
+	/* The signal killing the command, or 0 */
+	int32_t signal;
+	/* In microseconds */
+	uint64_t wall_time;
+	uint64_t user_time;
+	uint64_t sys_time;
+	/* The maximum resident set size in kilobytes */
+	uint64_t max_rss;
+	uint32_t flags;
+	uint32_t magic;
+} icmp_exec_result_t;
+
+/* The request of ICMP_CC_BUILTIN. The arguments of operation follow,
+ * separated by NUL.
+ */
+typedef struct {
+	uint16_t op;
+	char arguments[0];
+} icmp_builtin_t;
+
+/* The response of ICMP_CC_BUILTIN. The result of operation follows. */
+typedef struct {
+	/* The errno, or 0 if the operation succeeds */
+	int32_t error;
+	uint8_t data[0];
+} icmp_builtin_result_t;
+
+/* The result of ICMP_BUILTIN_PROC for each file */
+typedef struct {
+	int32_t error;
+	uint32_t length;
+	uint8_t data[0];
+} icmp_builtin_record_t;
+
+/* The result of ICMP_BUILTIN_STAT for each path */
+typedef struct {
+	int32_t error;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint64_t size;
+	uint64_t ino;
+	uint64_t nlink;
+	/* In nanoseconds since the epoch */
+	uint64_t mtime;
+} icmp_builtin_stat_t;
+
+/* The result of ICMP_BUILTIN_STATFS for each path */
+typedef struct {
+	int32_t error;
+	uint32_t block_size;
+	uint64_t blocks;
+	uint64_t blocks_free;
+	uint64_t blocks_avail;
+	uint64_t files;
+	uint64_t files_free;
+} icmp_builtin_statfs_t;
+
+/* The result of ICMP_BUILTIN_SYSINFO */
+typedef struct {
+	/* In seconds */
+	uint64_t uptime;
+	/* The load averages scaled by 65536 */
+	uint64_t loads[3];
+	/* In bytes */
+	uint64_t total_ram;
+	uint64_t free_ram;
+	uint64_t shared_ram;
+	uint64_t buffer_ram;
+	uint64_t total_swap;
+	uint64_t free_swap;
+	uint32_t procs;
+	uint32_t nr_cpu;
+} icmp_builtin_sysinfo_t;
+
+/* The result of ICMP_BUILTIN_CACHE, counted since the daemon starts */
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t stores;
+	/* The entries dropped to make room */
+	uint64_t evictions;
+	uint64_t expirations;
+	/* In bytes */
+	uint64_t used;
+	uint64_t budget;
+	uint32_t entries;
+	uint32_t reserved;
+} icmp_builtin_cache_t;
+
+/* The request of ICMP_CC_SESSION. The commandline follows for
+ * ICMP_SESSION_EXEC.
+ */
+typedef struct {
+	/* The id chosen by the client to refer to the session */
+	uint64_t session_id;
+	uint8_t op;
+	char data[0];
+} icmp_session_t;
+
+/* The response of ICMP_CC_SESSION. For ICMP_SESSION_EXEC, the output
+ * follows in the same layout as the response of ICMP_CC_COMMMANDLINE,
+ * ending with icmp_exec_result_t.
+ */
+typedef struct {
+	/* The errno, or 0 if the operation succeeds */
+	int32_t error;
+	uint8_t data[0];
+} icmp_session_result_t;
+
+/* The request of ICMP_CC_BATCH. The commandlines follow, separated by
+ * NUL.
+ */
+typedef struct {
+	/* The maximum number of commandlines running in parallel, or 0
+	 * for the limit of daemon.
+	 */
+	uint32_t parallel;
+	char commandlines[0];
+} icmp_batch_t;
+
+/* The response of ICMP_CC_BATCH. A record follows for each commandline
+ * in the order of completion.
+ */
+typedef struct {
+	/* The errno, or 0 if the batch is accepted */
+	int32_t error;
+	uint32_t nr_command;
+	uint8_t data[0];
+} icmp_batch_result_t;
+
+/* The result of each commandline in ICMP_CC_BATCH. If the commandline
+ * is run, the output follows in the same layout as the response of
+ * ICMP_CC_COMMMANDLINE, ending with icmp_exec_result_t.
+ */
+typedef struct {
+	/* The index of commandline in the request */
+	uint32_t index;
+	/* The errno, e.g, EACCES if the commandline is denied, or 0 */
+	int32_t error;
+	uint32_t length;
+	uint8_t data[0];
+} icmp_batch_record_t;
+
 #pragma pack (0)
 
+#define ICMP_EXEC_RESULT_MAGIC		0x52584549U
+/* The command is terminated due to the timeout */
+#define ICMP_EXEC_TIMED_OUT		0x1
+/* The stdout is spilled and icmp_spill_result_t is placed in front */
+#define ICMP_EXEC_SPILLED		0x2
+/* The stdout is tagged and icmp_delta_result_t is placed in front, and
+ * behind icmp_spill_result_t if any.
+ */
+#define ICMP_EXEC_DELTA			0x4
+/* The output is answered from the result cache. The resource usage is
+ * the one of the command run for the cache.
+ */
+#define ICMP_EXEC_CACHED		0x8
+/* The rest of stdout is dropped by the filter or the spill. The command
+ * killed by SIGPIPE for writing it is taken as exited normally.
+ */
+#define ICMP_EXEC_TRUNCATED		0x10
+
 #define ICMP_CC_ECHO			0
 #define ICMP_CC_COMMMANDLINE		1
-#define ICMP_MAX_CC			(ICMP_CC_COMMMANDLINE + 1)
+/* The payload of heartbeat is an opaque cookie echoed back by the peer */
+#define ICMP_CC_HEARTBEAT		2
+/* Stream a chunk of stdin to the command */
+#define ICMP_CC_STDIN			3
+/* Cancel the request identified by ICMP_OPT_REQUEST_ID */
+#define ICMP_CC_CANCEL			4
+/* Run the operation built in the daemon without spawning a process */
+#define ICMP_CC_BUILTIN			5
+/* Run the commandlines in a long-lived shell of the client session */
+#define ICMP_CC_SESSION			6
+/* Run a list of commandlines in parallel and answer them at once */
+#define ICMP_CC_BATCH			7
+/* Run the arguments tokenized by the client, answered in the same way
+ * as ICMP_CC_COMMMANDLINE.
+ */
+#define ICMP_CC_ARGV			8
+/* Validate a commandline once and return the handle to run it */
+#define ICMP_CC_PREPARE			9
+/* Run the prepared command with the arguments appended, answered in
+ * the same way as ICMP_CC_COMMMANDLINE.
+ */
+#define ICMP_CC_EXECUTE			10
+/* Fetch a byte range of the stdout spilled */
+#define ICMP_CC_FETCH			11
+#define ICMP_MAX_CC			(ICMP_CC_FETCH + 1)
+
+/* Read a regular file, like cat. The content of file is returned. */
+#define ICMP_BUILTIN_READ		0
+/* Stat the paths. icmp_builtin_stat_t is returned for each path. */
+#define ICMP_BUILTIN_STAT		1
+/* List a directory, like ls. Each entry is returned as the d_type byte
+ * followed by the name terminated by NUL.
+ */
+#define ICMP_BUILTIN_LIST		2
+/* Read the files relative to /proc. icmp_builtin_record_t is returned
+ * for each file. The path leaving /proc, or through the magic links such
+ * as <pid>/root and <pid>/fd, fails with EPERM or ELOOP.
+ */
+#define ICMP_BUILTIN_PROC		3
+/* Query the file systems of paths, like df. icmp_builtin_statfs_t is
+ * returned for each path.
+ */
+#define ICMP_BUILTIN_STATFS		4
+/* Take a snapshot of icmp_builtin_sysinfo_t */
+#define ICMP_BUILTIN_SYSINFO		5
+/* Take a snapshot of icmp_builtin_cache_t */
+#define ICMP_BUILTIN_CACHE		6
+#define ICMP_MAX_BUILTIN		(ICMP_BUILTIN_CACHE + 1)
+
+/* Start the shell of session */
+#define ICMP_SESSION_OPEN		0
+/* Run the commandline in the shell and return its output */
+#define ICMP_SESSION_EXEC		1
+/* Terminate the shell of session */
+#define ICMP_SESSION_CLOSE		2
+
+/* uint64_t: the stdin of command is streamed with ICMP_CC_STDIN. The
+ * commandline is answered with ICMP_CC_STDIN once the command starts,
+ * and the output is returned as the response of the last chunk.
+ */
+#define ICMP_OPT_STDIN_STREAM		1
+/* uint64_t: the id chosen by the client to refer to the request */
+#define ICMP_OPT_REQUEST_ID		2
+/* uint32_t: the client renews the lease of request with heartbeat at
+ * least once within so many milliseconds while waiting for the response.
+ * The request is cancelled once the lease expires.
+ */
+#define ICMP_OPT_LEASE			3
+/* icmp_filter_t: filter the stdout of command in the daemon */
+#define ICMP_OPT_FILTER			4
+
+/* icmp_spill_t: keep the large stdout in the daemon to be fetched */
+#define ICMP_OPT_SPILL			5
+
+/* The rest of stdout is dropped since the spill area is full */
+#define ICMP_SPILL_TRUNCATED		0x1
+
+/* icmp_delta_t: answer the delta against the stdout tagged */
+#define ICMP_OPT_DELTA			6
+
+/* No value: a standalone | in the commandline of ICMP_CC_COMMMANDLINE or
+ * ICMP_CC_PREPARE separates the stages of pipeline. Otherwise it is an
+ * argument as it is.
+ */
+#define ICMP_OPT_PIPELINE		7
+
+/* The stdout is in place as it is */
+#define ICMP_DELTA_FULL			0
+/* The stdout is the one tagged, so nothing is in place */
+#define ICMP_DELTA_NOT_MODIFIED		1
+/* The instructions rebuilding the stdout are in place */
+#define ICMP_DELTA_PATCH		2
+
+/* Release the result once the range is fetched */
+#define ICMP_FETCH_RELEASE		0x1
+
+/* The pattern is a POSIX extended regular expression */
+#define ICMP_FILTER_REGEX		0x1
+/* Keep the lines not matching the pattern */
+#define ICMP_FILTER_INVERT		0x2
+
+#define icmp_option_size(len)		(sizeof(icmp_option_t) + (len))
 #define ICMP_CC_NOT_SPECIFIED		0xffffU
 
 static inline uint8_t
@@ -86,6 +531,49 @@ extern int
 icmp_marshal(void *data, unsigned long data_len, uint32_t cc,
 	     void **ret_msg, unsigned long *ret_msg_len);
 
+extern int
+icmp_marshal_in_place(void *msg, unsigned long msg_len, uint16_t cc,
+		      const void *payload, unsigned long payload_len,
+		      unsigned long *ret_msg_len);
+
+extern unsigned long
+icmp_put_option(void *buf, uint16_t type, const void *value,
+		uint16_t value_len);
+
+extern int
+icmp_find_exec_result(const void *payload, unsigned long payload_len,
+		      icmp_exec_result_t *ret_result);
+
+extern const void *
+icmp_find_option(const void *payload, unsigned long payload_len,
+		 uint16_t type, uint16_t *value_len);
+
+extern const void *
+icmp_find_option_at(const void *payload, unsigned long payload_len,
+		    unsigned long offset, uint16_t type, uint16_t *value_len);
+
+/* The element of argv[] separating the stages of pipeline. It is told
+ * from the arguments by the address, so the argument "|" is the string
+ * as it is.
+ */
+extern char icmp_pipe[];
+#define ICMP_PIPE			icmp_pipe
+
+extern unsigned long
+icmp_argv_size(char **argv);
+
+extern unsigned long
+icmp_put_argv(void *buf, char **argv);
+
+extern int
+icmp_get_argv(const void *payload, unsigned long payload_len,
+	      char ***ret_argv, unsigned long *ret_len);
+
+extern int
+icmp_apply_delta(const void *base, unsigned long base_len,
+		 const void *delta, unsigned long delta_len, void *out,
+		 unsigned long out_len);
+
 extern int
 icmp_unmarshal(void *msg, unsigned long msg_len, uint16_t cc,
 	       int (*handler)(void *ctx, uint16_t cc, const void *payload,
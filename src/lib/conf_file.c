@@ -14,6 +14,12 @@
 #include "conf_file.h"
 #include "string_tree.h"
 
+/* The queries run in parallel while the reload swaps the tree */
+static pthread_rwlock_t conf_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Bumped each time the configuration is parsed */
+static unsigned long conf_generation;
+
 int
 ic_conf_file_parse(char *conf_file)
 {
@@ -23,12 +29,73 @@ ic_conf_file_parse(char *conf_file)
 	if (rc)
 		return rc;
 
+	++conf_generation;
+
 	if (ic_util_verbose())
 		string_tree_dump_tree(&string_tree_root);
 
 	return 0;
 }
 
+/*
+ * Parse the configuration file again and replace the current one. The
+ * current one is kept if the file is unable to be read.
+ */
+int
+ic_conf_file_reload(char *conf_file)
+{
+	if (access(conf_file, R_OK)) {
+		err("Unable to access %s: %s\n", conf_file, strerror(errno));
+		return -1;
+	}
+
+	string_tree_node_t root = {
+		.string = string_tree_root.string,
+	};
+
+	int rc = ic_yaml_conf_parse(&root, conf_file);
+	if (rc) {
+		string_tree_destroy_children(&root);
+		return rc;
+	}
+
+	pthread_rwlock_wrlock(&conf_lock);
+
+	unsigned int nr_child = string_tree_root.nr_child;
+	string_tree_node_t *child = string_tree_root.child;
+
+	string_tree_root.nr_child = root.nr_child;
+	string_tree_root.child = root.child;
+	root.nr_child = nr_child;
+	root.child = child;
+
+	++conf_generation;
+
+	pthread_rwlock_unlock(&conf_lock);
+
+	string_tree_destroy_children(&root);
+
+	info("%s reloaded\n", conf_file);
+
+	if (ic_util_verbose())
+		string_tree_dump_tree(&string_tree_root);
+
+	return 0;
+}
+
+/* Return the generation of configuration. Anything derived from the
+ * configuration is stale once the generation changes.
+ */
+unsigned long
+ic_conf_file_generation(void)
+{
+	pthread_rwlock_rdlock(&conf_lock);
+	unsigned long generation = conf_generation;
+	pthread_rwlock_unlock(&conf_lock);
+
+	return generation;
+}
+
 char *
 ic_conf_file_query(const char *fmt, ...)
 {
@@ -39,7 +106,9 @@ ic_conf_file_query(const char *fmt, ...)
 	vsnprintf(query, sizeof(query) - 1, fmt, ap);
 	va_end(ap);
 
+	pthread_rwlock_rdlock(&conf_lock);
 	char *result = string_tree_query(query);
+	pthread_rwlock_unlock(&conf_lock);
 	if (!result)
 		dbg("Unable to retrieve the result for the query %s\n", query);
 	else
@@ -47,3 +116,20 @@ ic_conf_file_query(const char *fmt, ...)
 
 	return result;
 }
+
+/* Call back with the name of each child of path, e.g, ".commands", and
+ * the setting of key under it. The callback must not query the
+ * configuration.
+ */
+int
+ic_conf_file_foreach(const char *path, const char *key,
+		     int (*callback)(const char *name, const char *value,
+				     void *data),
+		     void *data)
+{
+	pthread_rwlock_rdlock(&conf_lock);
+	int rc = string_tree_foreach(path, key, callback, data);
+	pthread_rwlock_unlock(&conf_lock);
+
+	return rc;
+}
@@ -12,7 +12,8 @@
 
 #include <ic.h>
 
-static ic_error_t ic_errno = IC_ERRNO_BASE;
+/* Each thread serving a lane has its own errno */
+static __thread ic_error_t ic_errno = IC_ERRNO_BASE;
 
 void
 ic_set_errno(ic_error_t e)
@@ -88,6 +88,23 @@ icmp_marshal(void *payload, unsigned long payload_len, uint32_t cc,
 		bs_put_at(&msg, payload, payload_len, header_len);
 		break;
 	}
+	case ICMP_CC_HEARTBEAT:
+	case ICMP_CC_STDIN:
+	case ICMP_CC_CANCEL:
+	case ICMP_CC_BUILTIN:
+	case ICMP_CC_SESSION:
+	case ICMP_CC_BATCH:
+	case ICMP_CC_ARGV:
+	case ICMP_CC_PREPARE:
+	case ICMP_CC_EXECUTE:
+	case ICMP_CC_FETCH:
+		if (!payload && payload_len)
+			return -1;
+
+		bs_reserve(&msg, header_len + payload_len);
+		if (payload_len)
+			bs_put_at(&msg, payload, payload_len, header_len);
+		break;
 	default:
 		err("Unknown commmand code: 0x%x\n", cc);
 		return -1;
@@ -130,6 +147,360 @@ icmp_marshal(void *payload, unsigned long payload_len, uint32_t cc,
 	return rc;
 }
 
+/* Rewrite the header of the received message for the response whose
+ * payload is already placed right behind the header, e.g, echo. This
+ * is not possible if the request has a longer header than ours.
+ */
+int
+icmp_marshal_in_place(void *msg, unsigned long msg_len, uint16_t cc,
+		      const void *payload, unsigned long payload_len,
+		      unsigned long *ret_msg_len)
+{
+	if (!msg || cc >= ICMP_MAX_CC)
+		return -1;
+
+	uint8_t ver = icmp_message_version();
+	unsigned long header_len = icmp_message_header_length(ver);
+
+	if (payload_len && payload != msg + header_len)
+		return -1;
+
+	if (header_len + payload_len > msg_len)
+		return -1;
+
+	icmp_message_v1_header_t *v1 = msg;
+
+	v1->version = ver;
+	v1->header_length = header_len;
+	v1->command_code = cc;
+	v1->payload_length = payload_len;
+	v1->authorization_length = 0;
+	eee_memset(v1->reserved, 0, sizeof(v1->reserved));
+
+	buffer_stream_t bs;
+	bs_init(&bs, msg, header_len + payload_len);
+	int rc = generate_authorization_area(&bs);
+	if (rc)
+		return rc;
+
+	if (ret_msg_len)
+		*ret_msg_len = header_len + payload_len;
+
+	if (ic_util_verbose())
+		dump_header(msg);
+
+	return 0;
+}
+
+/* Put the option at buf and return the size of option */
+unsigned long
+icmp_put_option(void *buf, uint16_t type, const void *value,
+		uint16_t value_len)
+{
+	icmp_option_t opt = {
+		.type = type,
+		.length = value_len,
+	};
+
+	eee_memcpy(buf, &opt, sizeof(opt));
+	if (value_len)
+		eee_memcpy((char *)buf + sizeof(opt), value, value_len);
+
+	return icmp_option_size(value_len);
+}
+
+/* Look up the option in the payload from the offset where the options
+ * start.
+ */
+const void *
+icmp_find_option_at(const void *payload, unsigned long payload_len,
+		    unsigned long offset, uint16_t type, uint16_t *value_len)
+{
+	const char *p = payload;
+
+	for (unsigned long off = offset;
+	     off + sizeof(icmp_option_t) <= payload_len;) {
+		icmp_option_t opt;
+
+		eee_memcpy(&opt, p + off, sizeof(opt));
+		off += sizeof(opt);
+		if (off + opt.length > payload_len)
+			break;
+
+		if (opt.type == type) {
+			if (value_len)
+				*value_len = opt.length;
+
+			return p + off;
+		}
+
+		off += opt.length;
+	}
+
+	return NULL;
+}
+
+/* Look up the option following the commandline in the payload */
+const void *
+icmp_find_option(const void *payload, unsigned long payload_len,
+		 uint16_t type, uint16_t *value_len)
+{
+	unsigned long len = strnlen(payload, payload_len);
+
+	/* Skip the commandline and its terminating NUL */
+	if (len == payload_len)
+		return NULL;
+
+	return icmp_find_option_at(payload, payload_len, len + 1, type,
+				   value_len);
+}
+
+char icmp_pipe[] = "|";
+
+/* Return the size of ICMP_CC_ARGV payload carrying argv[]. The stages
+ * of pipeline are separated by ICMP_PIPE.
+ */
+unsigned long
+icmp_argv_size(char **argv)
+{
+	unsigned long size = sizeof(icmp_argv_t) + sizeof(uint32_t);
+
+	for (char **arg = argv; *arg; ++arg) {
+		if (*arg == ICMP_PIPE)
+			size += sizeof(uint32_t);
+		else
+			size += sizeof(uint32_t) + strlen(*arg) + 1;
+	}
+
+	return size;
+}
+
+/* Put argv[] at buf as ICMP_CC_ARGV payload and return its size. The
+ * buffer must hold icmp_argv_size() bytes.
+ */
+unsigned long
+icmp_put_argv(void *buf, char **argv)
+{
+	icmp_argv_t hdr = {
+		.argc = 0,
+		.nr_stage = 1,
+	};
+
+	for (char **arg = argv; *arg; ++arg) {
+		if (*arg == ICMP_PIPE)
+			++hdr.nr_stage;
+	}
+
+	char *stage = (char *)buf + sizeof(hdr);
+	char *p = stage + sizeof(uint32_t) * hdr.nr_stage;
+	uint32_t stage_argc = 0;
+
+	for (char **arg = argv; *arg; ++arg) {
+		if (*arg == ICMP_PIPE) {
+			eee_memcpy(stage, &stage_argc, sizeof(stage_argc));
+			stage += sizeof(stage_argc);
+			stage_argc = 0;
+			continue;
+		}
+
+		uint32_t len = strlen(*arg);
+
+		eee_memcpy(p, &len, sizeof(len));
+		p += sizeof(len);
+		eee_memcpy(p, *arg, len + 1);
+		p += len + 1;
+		++stage_argc;
+		++hdr.argc;
+	}
+
+	eee_memcpy(stage, &stage_argc, sizeof(stage_argc));
+	eee_memcpy(buf, &hdr, sizeof(hdr));
+
+	return p - (char *)buf;
+}
+
+/* Point argv[] at the arguments in ICMP_CC_ARGV payload, with ICMP_PIPE
+ * between the stages. The array of pointers is allocated and must be
+ * freed by the caller. The size of the arguments is returned to look up
+ * the options following them. Return the number of elements of argv[],
+ * or -1 if the payload is malformed.
+ */
+int
+icmp_get_argv(const void *payload, unsigned long payload_len,
+	      char ***ret_argv, unsigned long *ret_len)
+{
+	icmp_argv_t hdr;
+
+	if (payload_len < sizeof(hdr))
+		return -1;
+
+	eee_memcpy(&hdr, payload, sizeof(hdr));
+
+	unsigned long off = sizeof(hdr);
+
+	if (!hdr.nr_stage ||
+	    hdr.nr_stage > (payload_len - off) / sizeof(uint32_t))
+		return -1;
+
+	const char *stage = (const char *)payload + off;
+	off += sizeof(uint32_t) * hdr.nr_stage;
+
+	/* Each argument takes the length and the NUL at least */
+	if (hdr.argc > (payload_len - off) / (sizeof(uint32_t) + 1))
+		return -1;
+
+	unsigned int nr = hdr.argc + hdr.nr_stage - 1;
+	char **argv = eee_malloc(sizeof(char *) * (nr + 1));
+	if (!argv)
+		return -1;
+
+	const char *p = payload;
+	unsigned int n = 0;
+	uint32_t argc = 0;
+
+	for (uint32_t i = 0; i < hdr.nr_stage; ++i) {
+		uint32_t stage_argc;
+
+		eee_memcpy(&stage_argc, stage + sizeof(stage_argc) * i,
+			   sizeof(stage_argc));
+		if (stage_argc > hdr.argc - argc)
+			goto err;
+
+		argc += stage_argc;
+
+		if (i)
+			argv[n++] = ICMP_PIPE;
+
+		for (; stage_argc; --stage_argc) {
+			uint32_t len;
+
+			if (off + sizeof(len) > payload_len)
+				goto err;
+
+			eee_memcpy(&len, p + off, sizeof(len));
+			off += sizeof(len);
+			if (len >= payload_len - off || p[off + len] ||
+			    strnlen(p + off, len) != len)
+				goto err;
+
+			argv[n++] = (char *)p + off;
+			off += len + 1;
+		}
+	}
+
+	if (argc != hdr.argc)
+		goto err;
+
+	argv[n] = NULL;
+
+	*ret_argv = argv;
+	if (ret_len)
+		*ret_len = off;
+
+	return n;
+
+err:
+	eee_mfree(argv);
+
+	return -1;
+}
+
+/* Copy out the trailer at the end of commandline response, which is not
+ * aligned in the payload. Return -1 if the response comes from the
+ * daemon not supporting the trailer.
+ */
+int
+icmp_find_exec_result(const void *payload, unsigned long payload_len,
+		      icmp_exec_result_t *ret_result)
+{
+	icmp_exec_result_t result;
+
+	if (payload_len < sizeof(result) + 1)
+		return -1;
+
+	eee_memcpy(&result, (const char *)payload + payload_len -
+			    sizeof(result), sizeof(result));
+	if (result.magic != ICMP_EXEC_RESULT_MAGIC)
+		return -1;
+
+	/* The output and its terminating NUL take the rest, as well as
+	 * the result of spill if any.
+	 */
+	unsigned long len = result.stdout_length + result.stderr_length + 1;
+	if (result.flags & ICMP_EXEC_SPILLED)
+		len += sizeof(icmp_spill_result_t);
+	if (result.flags & ICMP_EXEC_DELTA)
+		len += sizeof(icmp_delta_result_t);
+	if (len != payload_len - sizeof(result))
+		return -1;
+
+	*ret_result = result;
+
+	return 0;
+}
+
+static int
+get_varint(const uint8_t **p, const uint8_t *end, uint64_t *ret)
+{
+	uint64_t val = 0;
+
+	for (unsigned int shift = 0; *p < end && shift < 64; shift += 7) {
+		uint8_t c = *(*p)++;
+
+		val |= (uint64_t)(c & 0x7f) << shift;
+		if (!(c & 0x80)) {
+			*ret = val;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* Rebuild the stdout of out_len bytes from the base tagged and the
+ * delta of ICMP_DELTA_PATCH. Return -1 if the delta is malformed.
+ */
+int
+icmp_apply_delta(const void *base, unsigned long base_len,
+		 const void *delta, unsigned long delta_len, void *out,
+		 unsigned long out_len)
+{
+	const uint8_t *p = delta;
+	const uint8_t *end = p + delta_len;
+	uint8_t *o = out;
+	unsigned long left = out_len;
+
+	while (p < end) {
+		uint64_t n, len, off;
+
+		if (get_varint(&p, end, &n))
+			return -1;
+
+		len = n >> 1;
+		if (len > left)
+			return -1;
+
+		if (n & 1) {
+			if (get_varint(&p, end, &off) || off > base_len ||
+			    len > base_len - off)
+				return -1;
+
+			eee_memcpy(o, (const uint8_t *)base + off, len);
+		} else {
+			if (len > (unsigned long)(end - p))
+				return -1;
+
+			eee_memcpy(o, p, len);
+			p += len;
+		}
+
+		o += len;
+		left -= len;
+	}
+
+	return left ? -1 : 0;
+}
+
 static int
 sanity_check_header(buffer_stream_t *bs, uint16_t cc)
 {
@@ -239,6 +610,16 @@ icmp_unmarshal(void *msg, unsigned long msg_len, uint16_t cc,
 	switch (cc) {
 	case ICMP_CC_ECHO:
 	case ICMP_CC_COMMMANDLINE:
+	case ICMP_CC_HEARTBEAT:
+	case ICMP_CC_STDIN:
+	case ICMP_CC_CANCEL:
+	case ICMP_CC_BUILTIN:
+	case ICMP_CC_SESSION:
+	case ICMP_CC_BATCH:
+	case ICMP_CC_ARGV:
+	case ICMP_CC_PREPARE:
+	case ICMP_CC_EXECUTE:
+	case ICMP_CC_FETCH:
 		bs_get_at(&bs, (void **)&payload, payload_len,
 			  v0->header_length);
 		rc = handler(handler_ctx, cc, payload, payload_len);
@@ -199,7 +199,10 @@ nanomsg_create_master_socket(unsigned int send_timeout)
 {
 	int sock;
 
-	sock = nn_socket(AF_SP, NN_REP);
+	/* The raw socket allows to reply the requests out of order by
+	 * sending the response with the header of the request.
+	 */
+	sock = nn_socket(AF_SP_RAW, NN_REP);
 	if (sock < 0) {
 		nn_print_error("Unable to create the master socket");
 		assert(sock >= 0);
@@ -239,6 +242,40 @@ nanomsg_destroy_socket(int sock)
 	assert(!rc);
 }
 
+/* A negative timeout means infinite */
+int
+nanomsg_set_timeout(int sock, int send_timeout, int recv_timeout)
+{
+	int rc = nn_setsockopt(sock, NN_SOL_SOCKET, NN_SNDTIMEO,
+			       &send_timeout, sizeof(send_timeout));
+	if (rc) {
+		nn_print_error("Unable to set NN_SNDTIMEO");
+		return -1;
+	}
+
+	rc = nn_setsockopt(sock, NN_SOL_SOCKET, NN_RCVTIMEO, &recv_timeout,
+			   sizeof(recv_timeout));
+	if (rc) {
+		nn_print_error("Unable to set NN_RCVTIMEO");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Set a generic socket-level option */
+int
+nanomsg_set_option(int sock, int option, int val)
+{
+	int rc = nn_setsockopt(sock, NN_SOL_SOCKET, option, &val, sizeof(val));
+	if (rc) {
+		nn_print_error("Unable to set the socket option");
+		return -1;
+	}
+
+	return 0;
+}
+
 int
 nanomsg_add_slave_endpoint(int sock, char *url)
 {
@@ -258,6 +295,21 @@ nanomsg_add_master_endpoint(int sock, char *url)
 {
 	int ep;
 
+	/* Prevent the clients of a restarting daemon from reconnecting in
+	 * lockstep.
+	 */
+	int ivl = ic_util_jitter(NANOMSG_RECONNECT_IVL);
+	int rc = nn_setsockopt(sock, NN_SOL_SOCKET, NN_RECONNECT_IVL, &ivl,
+			       sizeof(ivl));
+	if (rc)
+		nn_print_error("Unable to set NN_RECONNECT_IVL");
+
+	ivl = NANOMSG_RECONNECT_IVL_MAX;
+	rc = nn_setsockopt(sock, NN_SOL_SOCKET, NN_RECONNECT_IVL_MAX, &ivl,
+			   sizeof(ivl));
+	if (rc)
+		nn_print_error("Unable to set NN_RECONNECT_IVL_MAX");
+
 	ep = nn_connect(sock, url);
 	if (ep >= 0) {
 		/* ECONNREFUSED is returned if the master endpoint currently
@@ -287,9 +339,17 @@ nanomsg_send_data(int sock, void *data, unsigned long data_len)
 again:
 	len = nn_send(sock, data, data_len, 0);
 	if (len != data_len) {
-		if (errno == EINTR)
+		int err = nn_errno();
+
+		if (err == EINTR)
 			goto again;
 
+		if (err == ETIMEDOUT) {
+			dbg("Tx timeout\n");
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
 		nn_print_error("Unable to send the expected amount of data");
 		return -1;
 	}
@@ -347,9 +407,17 @@ again:
 		rc = nn_recv(sock, *data, *data_len, 0);
 
 	if (rc < 0) {
-		if (errno == EINTR)
+		int err = nn_errno();
+
+		if (err == EINTR)
 			goto again;
 
+		if (err == ETIMEDOUT) {
+			dbg("Rx timeout\n");
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
 		nn_print_error("Failed to receive data");
 		return -1;
 	}
@@ -408,6 +476,113 @@ nanomsg_receive_iov_data(int sock, struct nn_iovec *iov,
 	return -1;
 }
 
+/* Receive the request with its header on the raw socket. The header
+ * routes the response back to the requestor.
+ */
+int
+nanomsg_receive_header_data(int sock, void **data, unsigned long *data_len,
+			    void **header)
+{
+	if (!data || !header)
+		return -1;
+
+	void *buf = NULL;
+	struct nn_iovec iov = {
+		.iov_base = &buf,
+		.iov_len = NN_MSG,
+	};
+	struct nn_msghdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = header;
+	hdr.msg_controllen = NN_MSG;
+
+	int len;
+
+	/* The master polls the socket prior to receiving so never block
+	 * in case the readiness is spurious.
+	 */
+	do {
+		len = nn_recvmsg(sock, &hdr, NN_DONTWAIT);
+	} while (len < 0 && nn_errno() == EINTR);
+
+	if (len < 0) {
+		if (nn_errno() == EAGAIN) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		if (nn_errno() == ETIMEDOUT) {
+			dbg("Rx timeout\n");
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		nn_print_error("Failed to receive data with header");
+		return -1;
+	}
+
+	*data = buf;
+	if (data_len)
+		*data_len = len;
+
+	return 0;
+}
+
+/* Send the response with the header of the request on the raw socket.
+ * The header is consumed on success.
+ */
+int
+nanomsg_send_header_iov_data(int sock, struct nn_iovec *iov,
+			     unsigned int nr_iov, void *header)
+{
+	struct nn_msghdr hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = nr_iov;
+	hdr.msg_control = &header;
+	hdr.msg_controllen = NN_MSG;
+
+	int err;
+
+	do {
+		int len = nn_sendmsg(sock, &hdr, 0);
+		if (len >= 0)
+			return len;
+
+		err = nn_errno();
+	} while (err == EINTR);
+
+	if (err == ETIMEDOUT) {
+		dbg("Tx timeout\n");
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	nn_print_error("Failed to send data with header");
+
+	return -1;
+}
+
+/* The file descriptor becomes readable once a message can be received */
+int
+nanomsg_get_fd(int sock)
+{
+	int fd;
+	size_t fd_len = sizeof(fd);
+
+	int rc = nn_getsockopt(sock, NN_SOL_SOCKET, NN_RCVFD, &fd, &fd_len);
+	if (rc) {
+		nn_print_error("Unable to get NN_RCVFD");
+		return -1;
+	}
+
+	return fd;
+}
+
 int
 nanomsg_pollin(int *sock, unsigned int nr_sock)
 {
@@ -449,6 +624,12 @@ nanomsg_alloc_data(unsigned long data_len)
 	return nn_allocmsg(data_len, 0);
 }
 
+void *
+nanomsg_realloc_data(void *data, unsigned long data_len)
+{
+	return nn_reallocmsg(data, data_len);
+}
+
 void
 nanomsg_free_data(void *data)
 {
@@ -27,6 +27,17 @@
 #include <nanomsg/pubsub.h>
 #include <nanomsg/survey.h>
 
+/* The interval in milliseconds between the attempts to reconnect the
+ * master endpoint. The actual interval is jittered.
+ */
+#ifndef NANOMSG_RECONNECT_IVL
+  #define NANOMSG_RECONNECT_IVL		100
+#endif
+
+#ifndef NANOMSG_RECONNECT_IVL_MAX
+  #define NANOMSG_RECONNECT_IVL_MAX	5000
+#endif
+
 extern int
 nanomsg_create_slave_socket(unsigned int timeout);
 
@@ -36,6 +47,12 @@ nanomsg_create_master_socket(unsigned int timeout);
 extern void
 nanomsg_destroy_socket(int sock);
 
+extern int
+nanomsg_set_timeout(int sock, int send_timeout, int recv_timeout);
+
+extern int
+nanomsg_set_option(int sock, int option, int val);
+
 extern int
 nanomsg_add_master_endpoint(int sock, char *url);
 
@@ -62,9 +79,23 @@ extern int
 nanomsg_receive_iov_data(int sock, struct nn_iovec *iov,
 			 unsigned int nr_iov);
 
+extern int
+nanomsg_receive_header_data(int sock, void **data, unsigned long *data_len,
+			    void **header);
+
+extern int
+nanomsg_send_header_iov_data(int sock, struct nn_iovec *iov,
+			     unsigned int nr_iov, void *header);
+
+extern int
+nanomsg_get_fd(int sock);
+
 extern void *
 nanomsg_alloc_data(unsigned long data_len);
 
+extern void *
+nanomsg_realloc_data(void *data, unsigned long data_len);
+
 extern void
 nanomsg_free_data(void *data);
 
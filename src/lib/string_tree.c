@@ -63,6 +63,22 @@ string_tree_set_node_string(string_tree_node_t *node,
 	return 0;
 }
 
+/* Free the children of node. The string of node itself is kept. */
+void
+string_tree_destroy_children(string_tree_node_t *node)
+{
+	for (unsigned int i = 0; i < node->nr_child; ++i) {
+		string_tree_node_t *child = node->child + i;
+
+		string_tree_destroy_children(child);
+		free(child->string);
+	}
+
+	free(node->child);
+	node->child = NULL;
+	node->nr_child = 0;
+}
+
 static void
 print_level(unsigned int level)
 {
@@ -87,6 +103,39 @@ string_tree_dump_tree(string_tree_node_t *this_node)
 	dump_string_tree(this_node, 0);
 }
 
+/* Join the strings of children with ":" if they are all leaves */
+static char *
+join_children(string_tree_node_t *this_node)
+{
+	if (!this_node->nr_child)
+		return NULL;
+
+	char *result = NULL;
+	unsigned int result_len = 0;
+	for (int i = 0; i < this_node->nr_child; ++i) {
+		string_tree_node_t *child_node;
+
+		child_node = string_tree_get_child_node(this_node, i);
+		if (child_node->nr_child) {
+			free(result);
+			return NULL;
+		}
+
+		/* TODO: escape ":" */
+
+		result = realloc(result, result_len + strlen(child_node->string) + 1);
+		if (!result)
+			return NULL;
+
+		strcpy(result + result_len, child_node->string);
+		if (result_len > 0)
+			result[result_len - 1] = ':';
+		result_len += strlen(child_node->string) + 1;
+	}
+
+	return result;
+}
+
 static char *
 query_string_tree(string_tree_node_t *this_node, const char *path,
 		  int *associated)
@@ -111,33 +160,7 @@ query_string_tree(string_tree_node_t *this_node, const char *path,
 		++path;
 	else {
 		/* Short of search */
-		if (!this_node->nr_child)
-			return NULL;
-
-		char *result = NULL;
-		unsigned int result_len = 0;
-		for (int i = 0; i < this_node->nr_child; ++i) {
-			string_tree_node_t *child_node;
-
-			child_node = string_tree_get_child_node(this_node, i);
-			if (child_node->nr_child) {
-				free(result);
-				return NULL;
-			}
-
-			/* TODO: escape ":" */
-
-			result = realloc(result, result_len + strlen(child_node->string) + 1);
-			if (!result)
-				return NULL;
-
-			strcpy(result + result_len, child_node->string);
-			if (result_len > 0)
-				result[result_len - 1] = ':';
-			result_len += strlen(child_node->string) + 1;
-		}
-
-		return result;
+		return join_children(this_node);
 	}
 
 	for (int i = 0; i < this_node->nr_child; ++i) {
@@ -184,3 +207,84 @@ string_tree_query(const char *path)
 
 	return NULL;
 }
+
+/* Find the node of path, e.g, ".commands.ls" */
+static string_tree_node_t *
+find_node(const char *path)
+{
+	string_tree_node_t *this_node = &string_tree_root;
+
+	int len = strlen(this_node->string);
+	if (strncmp(this_node->string, path, len))
+		return NULL;
+
+	path += len;
+
+	while (*path) {
+		char *p = strchr(path, '.');
+		if (p)
+			len = p - path;
+		else
+			len = strlen(path);
+
+		unsigned int i;
+		for (i = 0; i < this_node->nr_child; ++i) {
+			string_tree_node_t *child_node;
+
+			child_node = __string_tree_get_child_node(this_node, i);
+			if (!strncmp(child_node->string, path, len) &&
+			    strlen(child_node->string) == len)
+				break;
+		}
+
+		if (i == this_node->nr_child)
+			return NULL;
+
+		this_node = __string_tree_get_child_node(this_node, i);
+		path += len;
+		if (*path)
+			/* Skip "." */
+			++path;
+	}
+
+	return this_node;
+}
+
+
+/* Call back with the string of each child of path and the result of
+ * querying the key under the child, or NULL if it is not configured.
+ * The iteration stops once the callback fails.
+ */
+int
+string_tree_foreach(const char *path, const char *key,
+		    int (*callback)(const char *string, const char *value,
+				    void *data),
+		    void *data)
+{
+	string_tree_node_t *this_node = find_node(path);
+	if (!this_node)
+		return 0;
+
+	for (unsigned int i = 0; i < this_node->nr_child; ++i) {
+		string_tree_node_t *child_node;
+		char *value = NULL;
+
+		child_node = __string_tree_get_child_node(this_node, i);
+		for (unsigned int j = 0; j < child_node->nr_child; ++j) {
+			string_tree_node_t *key_node;
+
+			key_node = __string_tree_get_child_node(child_node, j);
+			if (!strcmp(key_node->string, key)) {
+				value = join_children(key_node);
+				break;
+			}
+		}
+
+		int rc = callback(child_node->string, value, data);
+		free(value);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
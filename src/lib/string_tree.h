@@ -55,12 +55,21 @@ int
 string_tree_set_node_string(string_tree_node_t *node,
 			    const char *str, unsigned int str_len);
 
+void
+string_tree_destroy_children(string_tree_node_t *node);
+
 void
 string_tree_dump_tree(string_tree_node_t *this_node);
 
 char *
 string_tree_query(const char *path);
 
+int
+string_tree_foreach(const char *path, const char *key,
+		    int (*callback)(const char *string, const char *value,
+				    void *data),
+		    void *data);
+
 extern string_tree_node_t
 string_tree_root;
 
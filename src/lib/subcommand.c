@@ -87,6 +87,19 @@ subcommand_parse(char *prog, char *subcmd, int argc, char *argv[])
 		}
 	}
 
+	/* The arguments following "--" are delivered in order as well if
+	 * the subcommand takes the non-option arguments.
+	 */
+	if (cmd->optstring[0] == '-') {
+		for (; optind < argc; ++optind) {
+			subcmd_arg_parsed = 1;
+			if (cmd->parse_arg(1, argv[optind])) {
+				cmd->show_usage(prog);
+				return -1;
+			}
+		}
+	}
+
 	if (!subcmd_arg_parsed) {
 		err("Nothing specified\n");
 		if (eee_strcmp(cmd->name, "help"))
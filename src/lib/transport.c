@@ -13,9 +13,90 @@
 #include <ic.h>
 #include "nanomsg.h"
 
+/* Reconnection backoff in milliseconds */
+#ifndef IC_TRANSPORT_BACKOFF_MIN
+  #define IC_TRANSPORT_BACKOFF_MIN	100
+#endif
+
+#ifndef IC_TRANSPORT_BACKOFF_MAX
+  #define IC_TRANSPORT_BACKOFF_MAX	30000
+#endif
+
+/* The bounds of timeouts in milliseconds derived from the estimated
+ * round-trip time. They are overridable with .transport.timeout_min,
+ * .transport.timeout_max and .transport.timeout_initial.
+ */
+#define IC_TRANSPORT_TIMEOUT_MIN	200
+#define IC_TRANSPORT_TIMEOUT_MAX	60000
+#define IC_TRANSPORT_TIMEOUT_INITIAL	1000
+
+/* The time in milliseconds the master waits for the response to be sent
+ * to a slow reader, overridable with .transport.send_timeout. The
+ * service time says nothing about the reader, so it isn't estimated.
+ */
+#define IC_TRANSPORT_SEND_TIMEOUT	10000
+
+/* Clock granularity in microseconds as G in RFC 6298 */
+#define IC_TRANSPORT_CLOCK_GRANULARITY	1000
+
+/* Auto-tuning resizes the socket buffers every period of messages */
+#define IC_TRANSPORT_AUTOTUNE_PERIOD	64
+#define IC_TRANSPORT_BUFFER_MIN		(16 * 1024)
+#define IC_TRANSPORT_BUFFER_MAX		(64 * 1024 * 1024)
+/* Message size histogram in power-of-2 classes */
+#define IC_TRANSPORT_NR_SIZE_CLASS	32
+
+/* Per-lane endpoint. Each lane has its own socket served by its own
+ * thread of the master, which keeps the control messages from queuing
+ * behind the bulk ones. The bulk lane keeps the original endpoint name
+ * for compatibility.
+ */
+static const struct {
+	const char *name;
+	const char *endpoint;
+} lane_setting[IC_TRANSPORT_NR_LANE] = {
+	[IC_TRANSPORT_LANE_BULK] = { "bulk", "ocp-channel" },
+	[IC_TRANSPORT_LANE_CONTROL] = { "control", "ocp-channel-control" },
+};
+
+/* The socket options configurable in .profiles.<profile> */
+static const struct {
+	const char *key;
+	int option;
+} profile_option[] = {
+	{ "sndbuf", NN_SNDBUF },
+	{ "rcvbuf", NN_RCVBUF },
+	{ "rcvmaxsize", NN_RCVMAXSIZE },
+	{ "linger", NN_LINGER },
+};
+
+/* The default lane for each command code */
+static ic_transport_lane_t command_lane[ICMP_MAX_CC] = {
+	[ICMP_CC_ECHO] = IC_TRANSPORT_LANE_CONTROL,
+	[ICMP_CC_COMMMANDLINE] = IC_TRANSPORT_LANE_BULK,
+	[ICMP_CC_HEARTBEAT] = IC_TRANSPORT_LANE_CONTROL,
+	/* The stdin is served along with its commandline */
+	[ICMP_CC_STDIN] = IC_TRANSPORT_LANE_BULK,
+	/* Don't wait for the bulk lane occupied by the request */
+	[ICMP_CC_CANCEL] = IC_TRANSPORT_LANE_CONTROL,
+	/* The file read may be as large as the output of command */
+	[ICMP_CC_BUILTIN] = IC_TRANSPORT_LANE_BULK,
+	/* The shell of session is kept by the lane */
+	[ICMP_CC_SESSION] = IC_TRANSPORT_LANE_BULK,
+	/* The commands of batch are run by the lane */
+	[ICMP_CC_BATCH] = IC_TRANSPORT_LANE_BULK,
+	[ICMP_CC_ARGV] = IC_TRANSPORT_LANE_BULK,
+	/* The prepared commands are shared by the lanes */
+	[ICMP_CC_PREPARE] = IC_TRANSPORT_LANE_CONTROL,
+	[ICMP_CC_EXECUTE] = IC_TRANSPORT_LANE_BULK,
+	[ICMP_CC_FETCH] = IC_TRANSPORT_LANE_BULK,
+};
+
 typedef struct {
 	int (*create)(unsigned int timeout);
 	void (*destroy)(int sock);
+	int (*set_timeout)(int sock, int send_timeout, int recv_timeout);
+	int (*set_option)(int sock, int option, int val);
 	int (*add_endpoint)(int sock, char *url);
 	void (*delete_endpoint)(int sock, int ep);
 	int (*send_data)(int sock, void *data, unsigned long data_len);
@@ -23,42 +104,106 @@ typedef struct {
 	int (*send_iov_data)(int sock, struct nn_iovec *iov,
 			     unsigned int nr_iov);
 	int (*pollin)(int *sock, unsigned int nr_sock);
+	int (*receive_header_data)(int sock, void **data,
+				   unsigned long *data_len, void **header);
+	int (*send_header_iov_data)(int sock, struct nn_iovec *iov,
+				    unsigned int nr_iov, void *header);
+	int (*get_fd)(int sock);
 	void *(*alloc_data)(unsigned long data_len);
+	void *(*realloc_data)(void *data, unsigned long data_len);
 	void (*free_data)(void *data);
 } ic_transport_ops_t;
 
 typedef struct {
-	char *name;
 	int socket;
 	int endpoint;
+	/* The timeout in milliseconds currently applied to the socket */
+	int timeout;
+	/* When the request was sent by the slave or received by the master */
+	unsigned long start_time;
+	/* Karn's algorithm: an exchange with timeout is not sampled */
+	bool timed_out;
+	ic_transport_stats_t stats;
+	bool autotune;
+	unsigned long buffer_size;
+	unsigned long nr_message;
+	unsigned long histogram[IC_TRANSPORT_NR_SIZE_CLASS];
+	/* The header of the request to be replied by the master */
+	void *reply_header;
+} ic_transport_lane_context_t;
+
+/* The timeouts in milliseconds loaded from the configuration */
+typedef struct {
+	unsigned long min;
+	unsigned long max;
+	unsigned long initial;
+	unsigned long send;
+	/* The generation of configuration loaded */
+	unsigned long generation;
+} ic_transport_timeouts_t;
+
+typedef struct {
+	char *name;
+	/* Loaded by the thread using the transport, so never shared */
+	ic_transport_timeouts_t timeouts;
+	/* The master serves a single lane and the slave owns all lanes */
+	ic_transport_lane_context_t lanes[IC_TRANSPORT_NR_LANE];
+	/* The lane of the current exchange */
+	ic_transport_lane_t lane;
+	/* The lane explicitly selected for the next message, or -1 */
+	int next_lane;
 	ic_transport_ops_t *ops;
 	bcll_t link;
 	vector_t *tx_vec;
+	bool master;
+	ic_transport_state_t state;
+	unsigned int nr_failure;
+	unsigned long retry_time;
+	/* The request renewed by heartbeat, or 0 */
+	uint64_t lease_id;
 } ic_transport_context_t;
 
+/* The requestor detached by the master along with the time the request
+ * was received, so the service time is sampled for the request replied.
+ */
+typedef struct {
+	void *header;
+	unsigned long start_time;
+} ic_transport_saved_reply_t;
+
 static ic_transport_ops_t master_transport_ops = {
 	.create = nanomsg_create_master_socket,
 	.destroy = nanomsg_destroy_socket,
+	.set_timeout = nanomsg_set_timeout,
+	.set_option = nanomsg_set_option,
 	.add_endpoint = nanomsg_add_slave_endpoint,
 	.delete_endpoint = nanomsg_delete_endpoint,
 	.send_data = nanomsg_send_data,
 	.receive_data = nanomsg_receive_data,
 	.send_iov_data = nanomsg_send_iov_data,
 	.pollin = nanomsg_pollin,
+	.receive_header_data = nanomsg_receive_header_data,
+	.send_header_iov_data = nanomsg_send_header_iov_data,
+	.get_fd = nanomsg_get_fd,
 	.alloc_data = nanomsg_alloc_data,
+	.realloc_data = nanomsg_realloc_data,
 	.free_data = nanomsg_free_data,
 };
 
 static ic_transport_ops_t slave_transport_ops = {
 	.create = nanomsg_create_slave_socket,
 	.destroy = nanomsg_destroy_socket,
+	.set_timeout = nanomsg_set_timeout,
+	.set_option = nanomsg_set_option,
 	.add_endpoint = nanomsg_add_master_endpoint,
 	.delete_endpoint = nanomsg_delete_endpoint,
 	.send_data = nanomsg_send_data,
 	.receive_data = nanomsg_receive_data,
 	.send_iov_data = nanomsg_send_iov_data,
 	.pollin = nanomsg_pollin,
+	.get_fd = nanomsg_get_fd,
 	.alloc_data = nanomsg_alloc_data,
+	.realloc_data = nanomsg_realloc_data,
 	.free_data = nanomsg_free_data,
 };
 
@@ -76,8 +221,352 @@ to_ic_transport_t(ic_transport_context_t *ctx)
 	return (ic_transport_t)ctx;
 }
 
+static void
+transport_up(ic_transport_context_t *ctx)
+{
+	if (ctx->state != IC_TRANSPORT_STATE_UP)
+		dbg("Transport %s is up\n", ctx->name);
+
+	ctx->state = IC_TRANSPORT_STATE_UP;
+	ctx->nr_failure = 0;
+	ctx->retry_time = 0;
+}
+
+static void
+transport_down(ic_transport_context_t *ctx)
+{
+	unsigned long backoff = IC_TRANSPORT_BACKOFF_MIN;
+
+	for (unsigned int i = 0; i < ctx->nr_failure &&
+	     backoff < IC_TRANSPORT_BACKOFF_MAX; ++i)
+		backoff <<= 1;
+
+	if (backoff > IC_TRANSPORT_BACKOFF_MAX)
+		backoff = IC_TRANSPORT_BACKOFF_MAX;
+
+	backoff = ic_util_jitter(backoff);
+	ctx->retry_time = ic_util_time_ms() + backoff;
+	++ctx->nr_failure;
+	ctx->state = IC_TRANSPORT_STATE_DOWN;
+
+	warn("Transport %s is down (%d failures), next attempt in %ld ms\n",
+	     ctx->name, ctx->nr_failure, backoff);
+}
+
+/* Fail fast while the peer is known to be unreachable */
+static int
+transport_check(ic_transport_context_t *ctx)
+{
+	if (ctx->master || ctx->state != IC_TRANSPORT_STATE_DOWN)
+		return 0;
+
+	if (ic_util_time_ms() < ctx->retry_time) {
+		ic_set_errno(IC_ERRNO_TRANSPORT_DOWN);
+		return -1;
+	}
+
+	ctx->state = IC_TRANSPORT_STATE_PROBING;
+
+	return 0;
+}
+
+/* The master serves many peers so that a failure with one of them says
+ * nothing about the health of the channel.
+ */
+static int
+transport_account(ic_transport_context_t *ctx, int rc, int exchanged)
+{
+	if (ctx->master)
+		return rc;
+
+	if (rc < 0)
+		transport_down(ctx);
+	else if (exchanged)
+		transport_up(ctx);
+
+	return rc;
+}
+
+static unsigned long
+query_timeout(const char *key, unsigned long def)
+{
+	char *val = ic_conf_file_query(".transport.%s", key);
+	if (!val)
+		return def;
+
+	unsigned long timeout = strtoul(val, NULL, 0);
+	eee_mfree(val);
+
+	return timeout ? timeout : def;
+}
+
+static void
+load_timeouts(ic_transport_timeouts_t *timeouts)
+{
+	timeouts->generation = ic_conf_file_generation();
+	timeouts->min = query_timeout("timeout_min", IC_TRANSPORT_TIMEOUT_MIN);
+	timeouts->max = query_timeout("timeout_max", IC_TRANSPORT_TIMEOUT_MAX);
+	if (timeouts->max < timeouts->min)
+		timeouts->max = timeouts->min;
+
+	timeouts->initial = query_timeout("timeout_initial",
+					  IC_TRANSPORT_TIMEOUT_INITIAL);
+	timeouts->send = query_timeout("send_timeout",
+				       IC_TRANSPORT_SEND_TIMEOUT);
+}
+
+static unsigned long
+clamp_rto(ic_transport_context_t *ctx, unsigned long rto)
+{
+	if (rto < ctx->timeouts.min * 1000)
+		return ctx->timeouts.min * 1000;
+
+	if (rto > ctx->timeouts.max * 1000)
+		return ctx->timeouts.max * 1000;
+
+	return rto;
+}
+
+/* Take the timeouts of the configuration reloaded before the exchange */
+static void
+reload_timeouts(ic_transport_context_t *ctx)
+{
+	if (ctx->timeouts.generation == ic_conf_file_generation())
+		return;
+
+	load_timeouts(&ctx->timeouts);
+
+	for (int i = 0; i < IC_TRANSPORT_NR_LANE; ++i) {
+		ic_transport_stats_t *stats = &ctx->lanes[i].stats;
+
+		stats->rto = clamp_rto(ctx, stats->nr_sample ? stats->rto :
+					    ctx->timeouts.initial * 1000);
+	}
+}
+
+/* Estimate RTO from the sample in microseconds as RFC 6298 */
+static void
+update_stats(ic_transport_context_t *ctx, ic_transport_stats_t *stats,
+	     unsigned long sample)
+{
+	if (!stats->nr_sample) {
+		stats->srtt = sample;
+		stats->rttvar = sample / 2;
+	} else {
+		unsigned long delta;
+
+		if (stats->srtt > sample)
+			delta = stats->srtt - sample;
+		else
+			delta = sample - stats->srtt;
+
+		stats->rttvar = (3 * stats->rttvar + delta) / 4;
+		stats->srtt = (7 * stats->srtt + sample) / 8;
+	}
+
+	unsigned long var = 4 * stats->rttvar;
+	if (var < IC_TRANSPORT_CLOCK_GRANULARITY)
+		var = IC_TRANSPORT_CLOCK_GRANULARITY;
+
+	stats->rto = clamp_rto(ctx, stats->srtt + var);
+	stats->last_rtt = sample;
+	++stats->nr_sample;
+}
+
+/* Back off the timer as RFC 6298 once the timer expires */
+static void
+backoff_stats(ic_transport_context_t *ctx, ic_transport_stats_t *stats)
+{
+	stats->rto = clamp_rto(ctx, stats->rto * 2);
+	++stats->nr_timeout;
+}
+
+/* Sample the service time of the response sent by the master */
+static void
+update_service_time(ic_transport_stats_t *stats, unsigned long sample)
+{
+	if (!stats->nr_service)
+		stats->service_time = sample;
+	else
+		stats->service_time = (7 * stats->service_time + sample) / 8;
+
+	stats->last_service_time = sample;
+	++stats->nr_service;
+}
+
+/* The master blocks on receiving requests and bounds the time to send
+ * the response with the send timeout configured. The slave bounds both
+ * with the estimated round-trip time.
+ */
+static int
+apply_timeout(ic_transport_context_t *ctx, ic_transport_lane_context_t *lane_ctx)
+{
+	int timeout = ctx->master ? (int)ctx->timeouts.send :
+				    (int)((lane_ctx->stats.rto + 999) / 1000);
+	if (timeout == lane_ctx->timeout)
+		return 0;
+
+	int rc = ctx->ops->set_timeout(lane_ctx->socket, timeout,
+				       ctx->master ? -1 : timeout);
+	if (!rc)
+		lane_ctx->timeout = timeout;
+
+	return rc;
+}
+
+/* Select the lane for the outgoing message of the slave */
+static void
+select_lane(ic_transport_context_t *ctx, void *data, unsigned long data_len)
+{
+	if (ctx->master)
+		return;
+
+	if (ctx->next_lane >= 0) {
+		ctx->lane = ctx->next_lane;
+		ctx->next_lane = -1;
+		return;
+	}
+
+	icmp_message_v0_header_t *v0 = data;
+	if (data_len >= sizeof(*v0) && v0->command_code < ICMP_MAX_CC)
+		ctx->lane = command_lane[v0->command_code];
+	else
+		ctx->lane = IC_TRANSPORT_LANE_BULK;
+}
+
+/* Look up the profile for the lane of the channel in this order:
+ * .channels.<channel>.<lane>.profile
+ * .channels.<channel>.profile
+ * default
+ */
+static char *
+query_profile(const char *channel, ic_transport_lane_t lane)
+{
+	char *profile = ic_conf_file_query(".channels.%s.%s.profile", channel,
+					   lane_setting[lane].name);
+	if (profile)
+		return profile;
+
+	profile = ic_conf_file_query(".channels.%s.profile", channel);
+	if (profile)
+		return profile;
+
+	return strdup("default");
+}
+
+static void
+apply_profile(ic_transport_context_t *ctx, ic_transport_lane_t lane)
+{
+	ic_transport_lane_context_t *lane_ctx = ctx->lanes + lane;
+	char *profile = query_profile(ctx->name, lane);
+	if (!profile)
+		return;
+
+	for (unsigned int i = 0; i < sizeof(profile_option) /
+	     sizeof(profile_option[0]); ++i) {
+		char *val = ic_conf_file_query(".profiles.%s.%s", profile,
+					       profile_option[i].key);
+		if (!val)
+			continue;
+
+		dbg("Setting %s to %s for the %s lane of %s\n",
+		    profile_option[i].key, val, lane_setting[lane].name,
+		    ctx->name);
+		ctx->ops->set_option(lane_ctx->socket, profile_option[i].option,
+				     strtol(val, NULL, 0));
+		eee_mfree(val);
+	}
+
+	char *val = ic_conf_file_query(".profiles.%s.autotune", profile);
+	if (val) {
+		lane_ctx->autotune = !strcmp(val, "true") ||
+				     !strcmp(val, "yes") || !strcmp(val, "1");
+		eee_mfree(val);
+	}
+
+	eee_mfree(profile);
+}
+
+/* Size the socket buffers to hold the 95th percentile of the observed
+ * messages. Note that the new buffer size takes effect on the
+ * connections established afterwards.
+ */
+static void
+autotune(ic_transport_context_t *ctx, ic_transport_lane_context_t *lane_ctx,
+	 unsigned long len)
+{
+	if (!lane_ctx->autotune)
+		return;
+
+	unsigned int class = 0;
+	while (class < IC_TRANSPORT_NR_SIZE_CLASS - 1 && (1UL << class) < len)
+		++class;
+
+	++lane_ctx->histogram[class];
+	if (++lane_ctx->nr_message % IC_TRANSPORT_AUTOTUNE_PERIOD)
+		return;
+
+	unsigned long threshold = lane_ctx->nr_message * 95 / 100;
+	unsigned long sum = 0;
+	for (class = 0; class < IC_TRANSPORT_NR_SIZE_CLASS - 1; ++class) {
+		sum += lane_ctx->histogram[class];
+		if (sum >= threshold)
+			break;
+	}
+
+	unsigned long size = 1UL << class;
+	if (size < IC_TRANSPORT_BUFFER_MIN)
+		size = IC_TRANSPORT_BUFFER_MIN;
+	else if (size > IC_TRANSPORT_BUFFER_MAX)
+		size = IC_TRANSPORT_BUFFER_MAX;
+
+	if (size != lane_ctx->buffer_size) {
+		dbg("Auto-tuning the buffer size of %s to %ld-byte\n",
+		    ctx->name, size);
+		ctx->ops->set_option(lane_ctx->socket, NN_SNDBUF, size);
+		ctx->ops->set_option(lane_ctx->socket, NN_RCVBUF, size);
+		lane_ctx->buffer_size = size;
+	}
+
+	/* Decay the history so that the buffers follow the traffic */
+	if (lane_ctx->nr_message >= 16 * IC_TRANSPORT_AUTOTUNE_PERIOD) {
+		lane_ctx->nr_message = 0;
+		for (class = 0; class < IC_TRANSPORT_NR_SIZE_CLASS; ++class) {
+			lane_ctx->histogram[class] /= 2;
+			lane_ctx->nr_message += lane_ctx->histogram[class];
+		}
+	}
+}
+
+static void
+create_lane(ic_transport_context_t *ctx, ic_transport_lane_t lane)
+{
+	ic_transport_lane_context_t *lane_ctx = ctx->lanes + lane;
+	char path[PATH_MAX];
+
+	eee_memset(&lane_ctx->stats, 0, sizeof(lane_ctx->stats));
+	lane_ctx->stats.rto = clamp_rto(ctx, ctx->timeouts.initial * 1000);
+	lane_ctx->timeout = -1;
+	lane_ctx->start_time = 0;
+	lane_ctx->timed_out = 0;
+	lane_ctx->autotune = 0;
+	lane_ctx->buffer_size = 0;
+	lane_ctx->nr_message = 0;
+	eee_memset(lane_ctx->histogram, 0, sizeof(lane_ctx->histogram));
+	lane_ctx->reply_header = NULL;
+
+	lane_ctx->socket = ctx->ops->create(0);
+	apply_timeout(ctx, lane_ctx);
+	apply_profile(ctx, lane);
+
+	snprintf(path, sizeof(path), "ipc://" ICMP_CHANNEL_PREFIX "%s/%s",
+		 ctx->name, lane_setting[lane].endpoint);
+	dbg("Adding the endpoint %s ...\n", path);
+	lane_ctx->endpoint = ctx->ops->add_endpoint(lane_ctx->socket, path);
+}
+
 static ic_transport_context_t *
-ic_transport_create(const char *name, int master)
+ic_transport_create(const char *name, int master, ic_transport_lane_t lane)
 {
 	if (!name)
 		return NULL;
@@ -116,45 +605,59 @@ ic_transport_create(const char *name, int master)
 	else
 		ctx->ops = &slave_transport_ops;
 
-	unsigned int timeout;
-	/* Set the send timeout for the master socket */
-	if (master)
-		timeout = 100;	/* 100ms */
-	else
-		timeout = 0;
-
-	ctx->socket = ctx->ops->create(timeout);
-	snprintf(path, sizeof(path), "ipc://" ICMP_CHANNEL_PREFIX
-		 "%s/ocp-channel", name);
-	dbg("Adding the endpoint %s ...\n", path);
-	ctx->endpoint = ctx->ops->add_endpoint(ctx->socket, path);
-
-	bcll_add(&transport_list, &ctx->link);
+	load_timeouts(&ctx->timeouts);
 
+	ctx->master = master;
+	ctx->state = IC_TRANSPORT_STATE_IDLE;
+	ctx->nr_failure = 0;
+	ctx->retry_time = 0;
+	ctx->lease_id = 0;
+	ctx->tx_vec = NULL;
 	ctx->name = (char *)(ctx + 1);
 	eee_strcpy(ctx->name, name);
 
+	ctx->lane = lane;
+	ctx->next_lane = -1;
+	for (int i = 0; i < IC_TRANSPORT_NR_LANE; ++i) {
+		ctx->lanes[i].socket = -1;
+		ctx->lanes[i].endpoint = -1;
+
+		if (!master || i == lane)
+			create_lane(ctx, i);
+	}
+
+	bcll_add(&transport_list, &ctx->link);
+
 	return ctx;
 }
 
 ic_transport_t
-ic_transport_create_master(const char *name)
+ic_transport_create_master_lane(const char *name, ic_transport_lane_t lane)
 {
 	ic_transport_context_t *ctx;
 
-	ctx = ic_transport_create(name, 1);
+	if (lane >= IC_TRANSPORT_NR_LANE)
+		return 0;
+
+	ctx = ic_transport_create(name, 1, lane);
 	if (ctx)
 		return to_ic_transport_t(ctx);
 
 	return 0;
 }
 
+ic_transport_t
+ic_transport_create_master(const char *name)
+{
+	return ic_transport_create_master_lane(name, IC_TRANSPORT_LANE_BULK);
+}
+
 ic_transport_t
 ic_transport_create_slave(const char *name)
 {
 	ic_transport_context_t *ctx;
 
-	ctx = ic_transport_create(name, 0);
+	ctx = ic_transport_create(name, 0, IC_TRANSPORT_LANE_BULK);
 	if (ctx)
 		return to_ic_transport_t(ctx);
 
@@ -169,8 +672,18 @@ ic_transport_destroy(ic_transport_t tr)
 {
 	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
 
-	ctx->ops->delete_endpoint(ctx->socket, ctx->endpoint);
-	ctx->ops->destroy(ctx->socket);
+	for (int i = 0; i < IC_TRANSPORT_NR_LANE; ++i) {
+		ic_transport_lane_context_t *lane_ctx = ctx->lanes + i;
+
+		if (lane_ctx->socket < 0)
+			continue;
+
+		if (lane_ctx->reply_header)
+			ctx->ops->free_data(lane_ctx->reply_header);
+
+		ctx->ops->delete_endpoint(lane_ctx->socket, lane_ctx->endpoint);
+		ctx->ops->destroy(lane_ctx->socket);
+	}
 
 	bcll_del(&ctx->link);
 
@@ -185,13 +698,322 @@ ic_transport_name(ic_transport_t tr)
 	return ctx->name;
 }
 
+ic_transport_state_t
+ic_transport_state(ic_transport_t tr)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	/* Report the expiration of backoff even without any exchange */
+	if (ctx->state == IC_TRANSPORT_STATE_DOWN &&
+	    ic_util_time_ms() >= ctx->retry_time)
+		ctx->state = IC_TRANSPORT_STATE_PROBING;
+
+	return ctx->state;
+}
+
+/* Select the lane for the next message sent by the slave */
+int
+ic_transport_set_lane(ic_transport_t tr, ic_transport_lane_t lane)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	if (ctx->master || lane >= IC_TRANSPORT_NR_LANE) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return -1;
+	}
+
+	ctx->next_lane = lane;
+
+	return 0;
+}
+
+ic_transport_lane_t
+ic_transport_lane(ic_transport_t tr)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	return ctx->lane;
+}
+
+/* Change the default lane of the command code for all slave transports */
+int
+ic_transport_set_command_lane(uint16_t cc, ic_transport_lane_t lane)
+{
+	if (cc >= ICMP_MAX_CC || lane >= IC_TRANSPORT_NR_LANE) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return -1;
+	}
+
+	command_lane[cc] = lane;
+
+	return 0;
+}
+
+static int
+check_heartbeat(void *heartbeat, uint16_t cc, const void *payload,
+		unsigned long payload_len)
+{
+	icmp_heartbeat_t *hb = heartbeat;
+	unsigned long hb_len = hb->request_id ? sizeof(*hb) :
+						sizeof(hb->cookie);
+
+	if (payload_len != hb_len || eee_memcmp(hb, payload, payload_len)) {
+		err("Mismatched heartbeat cookie\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+transport_heartbeat(ic_transport_context_t *ctx, unsigned int timeout)
+{
+	/* Don't disturb the outstanding exchange on the other lane */
+	ic_transport_lane_context_t *lane_ctx;
+	lane_ctx = ctx->lanes + command_lane[ICMP_CC_HEARTBEAT];
+
+	if (!timeout)
+		timeout = (lane_ctx->stats.rto + 999) / 1000;
+
+	/* The lease is renewed along with the probe */
+	icmp_heartbeat_t hb = {
+		.cookie = ic_util_time_us(),
+		.request_id = ctx->lease_id,
+	};
+	void *msg;
+	unsigned long msg_len;
+	int rc = icmp_marshal(&hb, hb.request_id ? sizeof(hb) :
+						   sizeof(hb.cookie),
+			      ICMP_CC_HEARTBEAT, &msg, &msg_len);
+	if (rc)
+		return rc;
+
+	rc = ctx->ops->set_timeout(lane_ctx->socket, timeout, timeout);
+	/* Restore the estimated timeout next time */
+	lane_ctx->timeout = -1;
+	if (rc) {
+		eee_mfree(msg);
+		return rc;
+	}
+
+	rc = ctx->ops->send_data(lane_ctx->socket, msg, msg_len);
+	eee_mfree(msg);
+	if (!rc) {
+		void *reply = NULL;
+		unsigned long reply_len = 0;
+
+		rc = ctx->ops->receive_data(lane_ctx->socket, &reply,
+					    &reply_len);
+		if (!rc) {
+			rc = icmp_unmarshal(reply, reply_len, ICMP_CC_HEARTBEAT,
+					    check_heartbeat, &hb);
+			ctx->ops->free_data(reply);
+		}
+	}
+
+	if (!rc)
+		update_stats(ctx, &lane_ctx->stats,
+			     ic_util_time_us() - hb.cookie);
+	else
+		backoff_stats(ctx, &lane_ctx->stats);
+
+	apply_timeout(ctx, lane_ctx);
+
+	return rc;
+}
+
+/* Renew the lease of the request with the probes sent while waiting for
+ * its response, or stop renewing if the request id is 0. Return the
+ * lease in milliseconds, within which the next probe is always sent.
+ */
+unsigned long
+ic_transport_set_lease(ic_transport_t tr, uint64_t request_id)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	ctx->lease_id = request_id;
+
+	/* The response is waited for at most timeout_max before probing,
+	 * and so is the probe.
+	 */
+	return ctx->timeouts.max * 2;
+}
+
+/* Probe the liveness of the peer within the timeout in milliseconds. If
+ * the timeout is 0, it is estimated from the round-trip time.
+ */
+int
+ic_transport_heartbeat(ic_transport_t tr, unsigned int timeout)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	if (ctx->master) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return -1;
+	}
+
+	if (transport_check(ctx))
+		return -1;
+
+	reload_timeouts(ctx);
+
+	int rc = transport_heartbeat(ctx, timeout);
+
+	return transport_account(ctx, rc, 1);
+}
+
+int
+ic_transport_get_stats(ic_transport_t tr, ic_transport_lane_t lane,
+		       ic_transport_stats_t *stats)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	if (lane >= IC_TRANSPORT_NR_LANE || ctx->lanes[lane].socket < 0 ||
+	    !stats) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return -1;
+	}
+
+	*stats = ctx->lanes[lane].stats;
+
+	return 0;
+}
+
+static int
+receive_data(ic_transport_context_t *ctx, void **data,
+	     unsigned long *data_len)
+{
+	ic_transport_lane_context_t *lane_ctx = ctx->lanes + ctx->lane;
+
+	reload_timeouts(ctx);
+
+	if (ctx->master) {
+		/* Drop the request not replied as the cooked REP socket */
+		if (lane_ctx->reply_header) {
+			ctx->ops->free_data(lane_ctx->reply_header);
+			lane_ctx->reply_header = NULL;
+		}
+
+		int rc = ctx->ops->receive_header_data(lane_ctx->socket, data,
+						       data_len,
+						       &lane_ctx->reply_header);
+		if (!rc) {
+			lane_ctx->start_time = ic_util_time_us();
+			autotune(ctx, lane_ctx, data_len ? *data_len : 0);
+		}
+
+		return rc;
+	}
+
+	while (1) {
+		apply_timeout(ctx, lane_ctx);
+
+		int rc = ctx->ops->receive_data(lane_ctx->socket, data,
+						data_len);
+		if (!rc) {
+			if (!lane_ctx->timed_out)
+				update_stats(ctx, &lane_ctx->stats,
+					     ic_util_time_us() -
+					     lane_ctx->start_time);
+			autotune(ctx, lane_ctx, data_len ? *data_len : 0);
+			return 0;
+		}
+
+		if (errno != ETIMEDOUT)
+			return rc;
+
+		lane_ctx->timed_out = 1;
+		backoff_stats(ctx, &lane_ctx->stats);
+
+		/* The response on the bulk lane may take as long as the
+		 * command runs. Keep waiting as long as the peer is alive.
+		 */
+		if (ctx->lane == command_lane[ICMP_CC_HEARTBEAT])
+			return rc;
+
+		dbg("Probing %s after %d ms without response\n", ctx->name,
+		    lane_ctx->timeout);
+
+		if (transport_heartbeat(ctx, 0))
+			return rc;
+	}
+}
+
+static int
+send_data(ic_transport_context_t *ctx, void *data, unsigned long data_len,
+	  struct nn_iovec *iov, unsigned int nr_iov)
+{
+	ic_transport_lane_context_t *lane_ctx = ctx->lanes + ctx->lane;
+	struct nn_iovec data_iov;
+
+	reload_timeouts(ctx);
+
+	if (ctx->master) {
+		if (!lane_ctx->reply_header) {
+			err("No request to be replied on %s\n", ctx->name);
+			ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+			return -1;
+		}
+
+		/* The response is always sent along with the header */
+		if (!iov) {
+			data_iov.iov_base = data;
+			data_iov.iov_len = data_len;
+			iov = &data_iov;
+			nr_iov = 1;
+			data_len = 0;
+		}
+	}
+
+	apply_timeout(ctx, lane_ctx);
+
+	int rc;
+	if (iov) {
+		for (unsigned int i = 0; i < nr_iov; ++i) {
+			if (iov[i].iov_len != NN_MSG)
+				data_len += iov[i].iov_len;
+		}
+
+		if (ctx->master) {
+			rc = ctx->ops->send_header_iov_data(lane_ctx->socket,
+							    iov, nr_iov,
+							    lane_ctx->reply_header);
+			if (rc >= 0) {
+				lane_ctx->reply_header = NULL;
+				update_service_time(&lane_ctx->stats,
+						    ic_util_time_us() -
+						    lane_ctx->start_time);
+			}
+		} else
+			rc = ctx->ops->send_iov_data(lane_ctx->socket, iov,
+						     nr_iov);
+	} else
+		rc = ctx->ops->send_data(lane_ctx->socket, data, data_len);
+
+	if (rc >= 0)
+		autotune(ctx, lane_ctx, data_len);
+
+	if (!ctx->master) {
+		lane_ctx->start_time = ic_util_time_us();
+		lane_ctx->timed_out = 0;
+	}
+
+	/* The length is returned by sending iov */
+	return rc < 0 ? rc : 0;
+}
+
 int
 ic_transport_receive_data(ic_transport_t tr, void **data,
 			  unsigned long *data_len)
 {
 	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
 
-	return ctx->ops->receive_data(ctx->socket, data, data_len);
+	if (transport_check(ctx))
+		return -1;
+
+	int rc = receive_data(ctx, data, data_len);
+
+	return transport_account(ctx, rc, 1);
 }
 
 int
@@ -200,10 +1022,13 @@ ic_transport_handle_data(ic_transport_t tr,
 {
 	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
 
+	if (transport_check(ctx))
+		return -1;
+
 	void *data = NULL;
 	unsigned long data_len = 0;
-	int rc = ctx->ops->receive_data(ctx->socket, &data, &data_len);
-	if (rc < 0)
+	int rc = receive_data(ctx, &data, &data_len);
+	if (transport_account(ctx, rc, 1) < 0)
 		return rc;
 
 	if (handler) {
@@ -220,7 +1045,14 @@ ic_transport_send_data(ic_transport_t tr, void *data,
 {
 	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
 
-	return ctx->ops->send_data(ctx->socket, data, data_len);
+	if (transport_check(ctx))
+		return -1;
+
+	select_lane(ctx, data, data_len);
+
+	int rc = send_data(ctx, data, data_len, NULL, 0);
+
+	return transport_account(ctx, rc, 0);
 }
 
 int
@@ -250,6 +1082,34 @@ ic_transport_append_vector_data(ic_transport_t tr, void *data,
 	return 0;
 }
 
+/* Send the message allocated by the transport without copying it. The
+ * ownership of the message is transferred to the transport on success.
+ * The whole allocation is sent so msg_len must be the allocated size.
+ */
+int
+ic_transport_send_msg(ic_transport_t tr, void *msg, unsigned long msg_len)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	if (!msg) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return -1;
+	}
+
+	if (transport_check(ctx))
+		return -1;
+
+	select_lane(ctx, msg, msg_len);
+
+	struct nn_iovec iov = {
+		.iov_base = &msg,
+		.iov_len = NN_MSG,
+	};
+	int rc = send_data(ctx, NULL, msg_len, &iov, 1);
+
+	return transport_account(ctx, rc < 0 ? rc : 0, 0);
+}
+
 int
 ic_transport_send_vector_data(ic_transport_t tr, vector_t *vec)
 {
@@ -260,6 +1120,9 @@ ic_transport_send_vector_data(ic_transport_t tr, vector_t *vec)
 
 	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
 
+	if (transport_check(ctx))
+		return -1;
+
 	unsigned int nr_vec = vector_get_nr_vector(vec);
 	struct nn_iovec *iov = eee_malloc(nr_vec * sizeof(struct nn_iovec));
 	if (!iov) {
@@ -280,10 +1143,87 @@ ic_transport_send_vector_data(ic_transport_t tr, vector_t *vec)
 		}
 	}
 
-	int rc = ctx->ops->send_iov_data(ctx->socket, iov, nr_vec);
+	select_lane(ctx, nr_vec ? vector_get_obj(vec, 0) : NULL,
+		    nr_vec ? vector_get_obj_len(vec, 0) : 0);
+
+	int rc = send_data(ctx, NULL, 0, iov, nr_vec);
 	eee_mfree(iov);
 
-	return rc;
+	return transport_account(ctx, rc, 0);
+}
+
+/* Detach the requestor of the request just received by the master, so
+ * that other requests can be received before it is replied.
+ */
+ic_transport_reply_t
+ic_transport_save_reply(ic_transport_t tr)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+	ic_transport_lane_context_t *lane_ctx = ctx->lanes + ctx->lane;
+
+	if (!ctx->master || !lane_ctx->reply_header) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return 0;
+	}
+
+	ic_transport_saved_reply_t *saved = eee_malloc(sizeof(*saved));
+	if (!saved) {
+		ic_set_errno(IC_ERRNO_OUT_OF_MEM);
+		return 0;
+	}
+
+	saved->header = lane_ctx->reply_header;
+	saved->start_time = lane_ctx->start_time;
+	lane_ctx->reply_header = NULL;
+
+	return (ic_transport_reply_t)saved;
+}
+
+/* Direct the next response to the saved requestor */
+int
+ic_transport_restore_reply(ic_transport_t tr, ic_transport_reply_t reply)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+	ic_transport_lane_context_t *lane_ctx = ctx->lanes + ctx->lane;
+
+	if (!ctx->master || !reply || lane_ctx->reply_header) {
+		ic_set_errno(IC_ERRNO_INVALID_PARAMETER);
+		return -1;
+	}
+
+	ic_transport_saved_reply_t *saved = (ic_transport_saved_reply_t *)reply;
+
+	lane_ctx->reply_header = saved->header;
+	lane_ctx->start_time = saved->start_time;
+	eee_mfree(saved);
+
+	return 0;
+}
+
+/* Give up replying the saved requestor */
+void
+ic_transport_drop_reply(ic_transport_t tr, ic_transport_reply_t reply)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	ic_transport_saved_reply_t *saved = (ic_transport_saved_reply_t *)reply;
+
+	if (saved) {
+		ctx->ops->free_data(saved->header);
+		eee_mfree(saved);
+	}
+}
+
+/* Return the file descriptor for poll(). It becomes readable once a
+ * message can be received. The master never blocks in receiving, and
+ * fails with EAGAIN if no message is available yet.
+ */
+int
+ic_transport_get_fd(ic_transport_t tr)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	return ctx->ops->get_fd(ctx->lanes[ctx->lane].socket);
 }
 
 void *
@@ -294,6 +1234,18 @@ ic_transport_alloc_data(ic_transport_t tr, unsigned long data_len)
 	return ctx->ops->alloc_data(data_len);
 }
 
+/* Resize the message allocated by the transport. On failure, the
+ * original message is left untouched.
+ */
+void *
+ic_transport_realloc_data(ic_transport_t tr, void *data,
+			  unsigned long data_len)
+{
+	ic_transport_context_t *ctx = to_ic_transport_context_t(tr);
+
+	return ctx->ops->realloc_data(data, data_len);
+}
+
 void
 ic_transport_free_data(ic_transport_t tr, void *data)
 {
@@ -96,3 +96,56 @@ ic_util_file_exists(const char *file_path)
 
 	return !stat(file_path, &statbuf);
 }
+
+unsigned long
+ic_util_time_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+unsigned long
+ic_util_time_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* Return the random bits from the kernel, so the seed of random() is
+ * left to the application.
+ */
+uint64_t
+ic_util_random(void)
+{
+	static uint64_t counter;
+	uint64_t val;
+
+	if (getrandom(&val, sizeof(val), GRND_NONBLOCK) == sizeof(val))
+		return val;
+
+	/* The entropy pool is not ready early in boot. The identifiers
+	 * only need to be unique then.
+	 */
+	val = __atomic_add_fetch(&counter, 1, __ATOMIC_RELAXED);
+
+	return ((uint64_t)getpid() << 32) ^ ic_util_time_us() ^
+	       (val * 0x9e3779b97f4a7c15ULL);
+}
+
+/* Randomize the interval within [interval / 2, interval] so that the
+ * peers retrying at the same time don't stay in lockstep.
+ */
+unsigned long
+ic_util_jitter(unsigned long interval)
+{
+	if (interval < 2)
+		return interval;
+
+	return interval / 2 + ic_util_random() % (interval / 2 + 1);
+}
@@ -126,18 +126,27 @@ ic_yaml_conf_parse(string_tree_node_t *root_node,
 
 	yaml_parser_set_input_file(&parser, fp);
 
+	/* The configuration reloaded may be broken, so the error is
+	 * returned instead of exiting.
+	 */
 	yaml_document_t document;
-	if (!yaml_parser_load(&parser, &document))
-		die("YAML parser error %d\n", parser.error);
+	if (!yaml_parser_load(&parser, &document)) {
+		err("YAML parser error %d in %s\n", parser.error, conf_file);
+		yaml_parser_delete(&parser);
+		fclose(fp);
+		return -1;
+	}
 
+	rc = 0;
 	yaml_node_t *root = yaml_document_get_root_node(&document);
-	rc = walk_through_yaml(&document, root, root_node);
-	if (rc)
-		die("YAML walk error\n");
+	if (!root || walk_through_yaml(&document, root, root_node)) {
+		err("YAML walk error in %s\n", conf_file);
+		rc = -1;
+	}
 
 	yaml_document_delete(&document);
 	yaml_parser_delete(&parser);
 	fclose(fp);
 
-	return 0;
+	return rc;
 }
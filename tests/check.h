@@ -0,0 +1,48 @@
+/*
+ * Unit checks
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "icmpd.h"
+
+static unsigned int nr_check;
+static unsigned int nr_failure;
+
+/* Count the failure and go on with the rest of checks */
+#define check(cond)	\
+	do {	\
+		++nr_check;	\
+		if (!(cond)) {	\
+			printf("%s:%d: %s failed\n", __FILE__, __LINE__,	\
+			       #cond);	\
+			++nr_failure;	\
+		}	\
+	} while (0)
+
+/* The logging of code checked is not what is checked */
+static inline void
+check_begin(void)
+{
+	if (!freopen("/dev/null", "w", stderr))
+		exit(EXIT_FAILURE);
+}
+
+static inline int
+check_end(const char *name)
+{
+	printf("%s: %u checks, %u failed\n", name, nr_check, nr_failure);
+
+	return nr_failure ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+#endif	/* CHECK_H */
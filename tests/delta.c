@@ -0,0 +1,167 @@
+/*
+ * Unit checks of the delta of polled output
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * Poll the stdout changing between the polls, as the client does with
+ * the tag of the stdout it keeps, and rebuild each stdout answered with
+ * icmp_apply_delta().
+ */
+
+#include "check.h"
+
+#define NR_ROW		200
+
+static const char container[] = "c1";
+static const char request[] = "seq 200";
+
+/* The stdout polled of the table, with the row changed if not -1 */
+static unsigned long
+make_table(char *buf, unsigned int nr_row, int changed, unsigned int value)
+{
+	unsigned long len = 0;
+
+	for (unsigned int i = 0; i < nr_row; ++i)
+		len += sprintf(buf + len, "row %u value %u\n", i,
+			       (int)i == changed ? value : i * 7);
+
+	return len;
+}
+
+/* Answer the stdout to the client keeping the tag, and return what is in
+ * place of stdout.
+ */
+static unsigned long
+poll_stdout(uint64_t tag, const char *key, const char *s, unsigned long len,
+	    char *answer, icmp_delta_result_t *result)
+{
+	icmp_delta_t opt = {
+		.tag = tag,
+	};
+	icmpd_delta_t *delta = icmpd_delta_create(&opt, sizeof(opt),
+						  container, key,
+						  strlen(key));
+	if (!delta)
+		return 0;
+
+	icmpd_output_t out = {
+		.msg = answer,
+		.size = len + 1,
+		.offset = 0,
+		.len = len,
+	};
+
+	eee_memcpy(answer, s, len);
+	icmpd_delta_encode(delta, &out, result);
+	icmpd_delta_destroy(delta);
+
+	return out.len;
+}
+
+/* Return 1 if the delta answered rebuilds the stdout from the base */
+static bool
+rebuilds(const char *base, unsigned long base_len, const char *answer,
+	 unsigned long answer_len, const char *s, unsigned long len)
+{
+	char *out = eee_malloc(len + 1);
+	if (!out)
+		return 0;
+
+	bool rc = !icmp_apply_delta(base, base_len, answer, answer_len, out,
+				    len) && !memcmp(out, s, len);
+
+	eee_mfree(out);
+
+	return rc;
+}
+
+int
+main(void)
+{
+	static char base[NR_ROW * 32];
+	static char s[NR_ROW * 32];
+	static char answer[NR_ROW * 32];
+	icmp_delta_result_t result;
+
+	check_begin();
+
+	/* The first poll takes the full stdout and its tag */
+	unsigned long base_len = make_table(base, NR_ROW, -1, 0);
+	unsigned long len = poll_stdout(0, request, base, base_len, answer,
+					&result);
+	uint64_t base_tag = result.tag;
+
+	check(result.encoding == ICMP_DELTA_FULL);
+	check(result.length == base_len);
+	check(len == base_len && !memcmp(answer, base, len));
+	check(base_tag);
+
+	/* The same stdout is not modified */
+	len = poll_stdout(base_tag, request, base, base_len, answer,
+			  &result);
+	check(result.encoding == ICMP_DELTA_NOT_MODIFIED);
+	check(result.tag == base_tag);
+	check(!len);
+
+	/* A row changed is answered as the delta against the baseline */
+	unsigned long s_len = make_table(s, NR_ROW, 100, 12345);
+	len = poll_stdout(base_tag, request, s, s_len, answer, &result);
+	check(result.encoding == ICMP_DELTA_PATCH);
+	check(result.length == s_len);
+	check(result.tag && result.tag != base_tag);
+	check(len < s_len / 4);
+	check(rebuilds(base, base_len, answer, len, s, s_len));
+
+	/* So is the stdout growing and shrinking against the new one */
+	eee_memcpy(base, s, s_len);
+	base_len = s_len;
+	base_tag = result.tag;
+
+	s_len = make_table(s, NR_ROW + 10, 0, 1);
+	len = poll_stdout(base_tag, request, s, s_len, answer, &result);
+	check(result.encoding == ICMP_DELTA_PATCH);
+	check(rebuilds(base, base_len, answer, len, s, s_len));
+
+	eee_memcpy(base, s, s_len);
+	base_len = s_len;
+	base_tag = result.tag;
+
+	s_len = make_table(s, NR_ROW / 2, -1, 0);
+	len = poll_stdout(base_tag, request, s, s_len, answer, &result);
+	check(result.encoding == ICMP_DELTA_PATCH);
+	check(rebuilds(base, base_len, answer, len, s, s_len));
+
+	/* The stdout not alike isn't answered as the longer delta */
+	base_tag = result.tag;
+	s_len = 0;
+	for (unsigned int i = 0; i < NR_ROW; ++i)
+		s_len += sprintf(s + s_len, "%08x\n", i * 2654435761U);
+	len = poll_stdout(base_tag, request, s, s_len, answer, &result);
+	check(result.encoding == ICMP_DELTA_FULL);
+	check(len == s_len && !memcmp(answer, s, len));
+
+	/* The stdout of the other request has no baseline to patch */
+	len = poll_stdout(result.tag, "seq 100", base, base_len, answer,
+			  &result);
+	check(result.encoding == ICMP_DELTA_FULL);
+	check(len == base_len);
+
+	/* The malformed delta is refused */
+	char out[16];
+	uint8_t bad_copy[] = { 2 * 8 + 1, 100 };
+	uint8_t bad_insert[] = { 2 * 4, 'a' };
+	check(icmp_apply_delta("0123456789", 10, bad_copy, sizeof(bad_copy),
+			       out, 8));
+	check(icmp_apply_delta("", 0, bad_insert, sizeof(bad_insert), out, 4));
+	check(icmp_apply_delta("", 0, "", 0, out, 1));
+
+	return check_end("delta");
+}
@@ -0,0 +1,255 @@
+/*
+ * Unit checks of the output filter
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * Feed the input to the filter in chunks of several sizes, as the lane
+ * reads the stdout of command, and compare what is kept with the output
+ * of the pipeline the filter stands for.
+ */
+
+#include "check.h"
+
+#define LINES		"alpha\nbeta\ngamma\ndelta\nepsilon\n"
+
+static const unsigned long chunk_sizes[] = { 1, 3, 7, 4096 };
+
+typedef struct {
+	uint64_t byte_offset;
+	uint64_t byte_length;
+	unsigned int head;
+	unsigned int tail;
+	uint32_t flags;
+	const char *pattern;
+} filter_opt_t;
+
+static icmpd_filter_t *
+create_filter(const filter_opt_t *fo)
+{
+	unsigned long pattern_len = fo->pattern ? strlen(fo->pattern) : 0;
+	icmp_filter_t *opt = eee_malloc(sizeof(*opt) + pattern_len);
+	if (!opt)
+		return NULL;
+
+	opt->byte_offset = fo->byte_offset;
+	opt->byte_length = fo->byte_length;
+	opt->head = fo->head;
+	opt->tail = fo->tail;
+	opt->flags = fo->flags;
+	opt->pattern_length = pattern_len;
+	eee_memcpy(opt->pattern, fo->pattern, pattern_len);
+
+	icmpd_filter_t *filter = icmpd_filter_create(opt, sizeof(*opt) +
+						     pattern_len);
+	eee_mfree(opt);
+
+	return filter;
+}
+
+/* Return 1 if the filter keeps the expected output with each size of
+ * chunk.
+ */
+static bool
+filter_keeps(const filter_opt_t *fo, const char *in, unsigned long in_len,
+	     const char *expected)
+{
+	char *msg = eee_malloc(in_len + 1);
+	if (!msg)
+		return 0;
+
+	for (unsigned int i = 0; i < sizeof(chunk_sizes) /
+				     sizeof(chunk_sizes[0]); ++i) {
+		icmpd_output_t out = {
+			.msg = msg,
+			.size = in_len + 1,
+			.offset = 0,
+			.len = 0,
+		};
+
+		out.filter = create_filter(fo);
+		if (!out.filter) {
+			eee_mfree(msg);
+			return 0;
+		}
+
+		/* Stop reading once the rest is dropped, as the lane does */
+		for (unsigned long pos = 0; pos < in_len;) {
+			unsigned long n = in_len - pos < chunk_sizes[i] ?
+					  in_len - pos : chunk_sizes[i];
+
+			eee_memcpy(out.msg + out.len, in + pos, n);
+			out.len += n;
+			pos += n;
+
+			if (icmpd_filter_run(out.filter, &out, 0))
+				break;
+		}
+
+		icmpd_filter_run(out.filter, &out, 1);
+		icmpd_filter_destroy(out.filter);
+
+		if (out.len != strlen(expected) ||
+		    memcmp(out.msg, expected, out.len)) {
+			printf("chunk %lu: kept \"%.*s\"\n", chunk_sizes[i],
+			       (int)out.len, out.msg);
+			eee_mfree(msg);
+			return 0;
+		}
+	}
+
+	eee_mfree(msg);
+
+	return 1;
+}
+
+static bool
+filter_lines_keeps(const filter_opt_t *fo, const char *expected)
+{
+	return filter_keeps(fo, LINES, strlen(LINES), expected);
+}
+
+static void
+check_head_tail(void)
+{
+	check(filter_lines_keeps(&(filter_opt_t){ .head = 2 },
+				 "alpha\nbeta\n"));
+	check(filter_lines_keeps(&(filter_opt_t){ .tail = 2 },
+				 "delta\nepsilon\n"));
+	check(filter_lines_keeps(&(filter_opt_t){ .head = 9 }, LINES));
+	check(filter_lines_keeps(&(filter_opt_t){ .tail = 9 }, LINES));
+	check(filter_lines_keeps(&(filter_opt_t){ 0 }, LINES));
+
+	/* The partial line at the end of output is the last line */
+	check(filter_keeps(&(filter_opt_t){ .tail = 1 }, "x\ny", 3, "y"));
+	check(filter_keeps(&(filter_opt_t){ .head = 1 }, "x", 1, "x"));
+	check(filter_keeps(&(filter_opt_t){ .tail = 1 }, "", 0, ""));
+}
+
+static void
+check_grep(void)
+{
+	check(filter_lines_keeps(&(filter_opt_t){ .pattern = "ta" },
+				 "beta\ndelta\n"));
+	check(filter_lines_keeps(&(filter_opt_t){
+					.pattern = "ta",
+					.flags = ICMP_FILTER_INVERT,
+				 }, "alpha\ngamma\nepsilon\n"));
+	check(filter_lines_keeps(&(filter_opt_t){
+					.pattern = "^(al|ga)",
+					.flags = ICMP_FILTER_REGEX,
+				 }, "alpha\ngamma\n"));
+	check(filter_lines_keeps(&(filter_opt_t){
+					.pattern = "a$",
+					.flags = ICMP_FILTER_REGEX |
+						 ICMP_FILTER_INVERT,
+				 }, "epsilon\n"));
+	check(filter_lines_keeps(&(filter_opt_t){ .pattern = "zeta" }, ""));
+
+	/* The pattern is matched before the first or the last lines */
+	check(filter_lines_keeps(&(filter_opt_t){
+					.pattern = "a",
+					.head = 2,
+				 }, "alpha\nbeta\n"));
+	check(filter_lines_keeps(&(filter_opt_t){
+					.pattern = "ta",
+					.tail = 1,
+				 }, "delta\n"));
+
+	/* The pattern longer than 16 bytes and the hit at the end */
+	static const char long_in[] = "x\n--0123456789abcdefg\ny\n"
+				      "0123456789abcdefg";
+
+	check(filter_keeps(&(filter_opt_t){ .pattern = "0123456789abcdefg" },
+			   long_in, sizeof(long_in) - 1,
+			   "--0123456789abcdefg\n0123456789abcdefg"));
+}
+
+static void
+check_bytes(void)
+{
+	check(filter_lines_keeps(&(filter_opt_t){
+					.byte_offset = 6,
+					.byte_length = 10,
+				 }, "beta\ngamma"));
+	check(filter_lines_keeps(&(filter_opt_t){
+					.byte_offset = 6,
+					.byte_length = 11,
+					.head = 1,
+				 }, "beta\n"));
+	check(filter_lines_keeps(&(filter_opt_t){ .byte_offset = 23 },
+				 "epsilon\n"));
+	check(filter_lines_keeps(&(filter_opt_t){ .byte_offset = 100 }, ""));
+
+	/* The range is taken before matching the lines */
+	check(filter_lines_keeps(&(filter_opt_t){
+					.byte_offset = 1,
+					.byte_length = 16,
+					.pattern = "a",
+				 }, "lpha\nbeta\ngamma\n"));
+}
+
+/* Many lines, so the lines before the last ones are compacted */
+static void
+check_many_lines(void)
+{
+	unsigned int nr_line = 100000;
+	char *in = eee_malloc(nr_line * 16);
+	if (!in) {
+		check(in);
+		return;
+	}
+
+	unsigned long len = 0;
+	for (unsigned int i = 0; i < nr_line; ++i)
+		len += sprintf(in + len, "line %u\n", i);
+
+	check(filter_keeps(&(filter_opt_t){ .tail = 3 }, in, len,
+			   "line 99997\nline 99998\nline 99999\n"));
+	check(filter_keeps(&(filter_opt_t){ .head = 2 }, in, len,
+			   "line 0\nline 1\n"));
+	check(filter_keeps(&(filter_opt_t){ .pattern = "99", .tail = 2 },
+			   in, len, "line 99998\nline 99999\n"));
+
+	eee_mfree(in);
+}
+
+static void
+check_malformed(void)
+{
+	icmp_filter_t opt = { .tail = ICMPD_FILTER_MAX_TAIL + 1 };
+
+	check(!icmpd_filter_create(&opt, sizeof(opt)) && errno == EINVAL);
+	check(!icmpd_filter_create(&opt, sizeof(opt) - 1) && errno == EINVAL);
+
+	opt.tail = 0;
+	opt.pattern_length = 1;
+	check(!icmpd_filter_create(&opt, sizeof(opt)) && errno == EINVAL);
+
+	check(!create_filter(&(filter_opt_t){ .pattern = "a\nb" }));
+	check(!create_filter(&(filter_opt_t){
+				.pattern = "(",
+				.flags = ICMP_FILTER_REGEX,
+			      }));
+}
+
+int
+main(void)
+{
+	check_begin();
+
+	check_head_tail();
+	check_grep();
+	check_bytes();
+	check_many_lines();
+	check_malformed();
+
+	return check_end("filter");
+}
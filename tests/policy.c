@@ -0,0 +1,147 @@
+/*
+ * Unit checks of the policy of commands
+ *
+ * Copyright (c) 2016, Lans Zhang
+ * All rights reserved.
+ *
+ * See "LICENSE" for license terms.
+ *
+ * Author:
+ *      Lans Zhang <lans.zhang2008@gmail.com>
+ */
+
+/*
+ * Compile the configurations and check the decisions: an entry of
+ * .<container>.commands allows the commands it prefixes, and
+ * .commands.<command>.acl grants the command to the containers listed.
+ */
+
+#include "check.h"
+
+static const char limited_conf[] =
+	"container_name: host\n"
+	"host:\n"
+	"  monitor: local\n"
+	"  commands: 'cat:/usr/bin/:seq'\n"
+	"commands:\n"
+	"  seq:\n"
+	"    acl: 'c1:c2'\n"
+	"  cat:\n"
+	"    acl: '*'\n";
+
+static const char unlimited_conf[] =
+	"container_name: host\n"
+	"host:\n"
+	"  monitor: local\n"
+	"  commands: '*'\n"
+	"commands:\n"
+	"  ls:\n"
+	"    acl: 'c3'\n";
+
+static const char unconfigured_conf[] =
+	"container_name: host\n"
+	"host:\n"
+	"  monitor: local\n";
+
+/* Parse the configuration the first time, and reload it later on */
+static int
+load_conf(const char *conf)
+{
+	static bool parsed;
+	char path[] = "/tmp/icmpd-check-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+
+	int rc = -1;
+	if (write(fd, conf, strlen(conf)) == (ssize_t)strlen(conf))
+		rc = parsed ? ic_conf_file_reload(path) :
+			      ic_conf_file_parse(path);
+	close(fd);
+	unlink(path);
+
+	if (rc)
+		return rc;
+
+	parsed = 1;
+
+	return icmpd_policy_load();
+}
+
+static bool
+granted(const char *cmd, const char *container)
+{
+	return !icmpd_policy_check(cmd, container);
+}
+
+static bool
+denied(const char *cmd, const char *container)
+{
+	ic_set_errno(IC_ERRNO_NONE);
+
+	return icmpd_policy_check(cmd, container) &&
+	       ic_get_errno() == IC_ERRNO_COMMAND_DENIED;
+}
+
+static void
+check_limited(void)
+{
+	/* The entry allows the commands it prefixes */
+	check(granted("cat", "c1"));
+	check(granted("catalog", "c1"));
+	check(granted("/usr/bin/id", "c1"));
+	check(denied("ca", "c1"));
+	check(denied("/usr/bin", "c1"));
+	check(denied("/usr/sbin/id", "c1"));
+	check(denied("ls", "c1"));
+	check(denied("", "c1"));
+
+	/* The acl applies to the command named only */
+	check(granted("seq", "c1"));
+	check(granted("seq", "c2"));
+	check(denied("seq", "c3"));
+	check(denied("seq", "c"));
+	check(denied("seq", "c10"));
+	check(granted("seqx", "c3"));
+	check(granted("cat", "c3"));
+}
+
+static void
+check_unlimited(void)
+{
+	check(granted("rm", "c1"));
+	check(granted("", "c1"));
+	check(granted("ls", "c3"));
+	check(denied("ls", "c1"));
+	check(granted("lsof", "c1"));
+}
+
+int
+main(void)
+{
+	check_begin();
+
+	/* Deny everything before any policy is compiled */
+	check(denied("cat", "c1"));
+
+	unsigned long generation = icmpd_policy_generation();
+
+	check(!load_conf(limited_conf));
+	check(icmpd_policy_generation() != generation);
+	check_limited();
+
+	generation = icmpd_policy_generation();
+	check(!load_conf(unlimited_conf));
+	check(icmpd_policy_generation() != generation);
+	check_unlimited();
+
+	check(!load_conf(unconfigured_conf));
+	check(granted("rm", "c1"));
+	check(granted("ls", "c1"));
+
+	/* The policy reloaded replaces the one applied entirely */
+	check(!load_conf(limited_conf));
+	check_limited();
+
+	return check_end("policy");
+}